@@ -0,0 +1,677 @@
+/*
+
+Copyright (c) 2023 Eugenio Arteaga A.
+
+Permission is hereby granted, free of charge, to any
+person obtaining a copy of this software and associated
+documentation files (the "Software"), to deal in the
+Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice
+shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+/******************
+***** spxbench ****
+*******************
+
+Throughput benchmark for spximg.h. It generates synthetic images
+of different sizes, channel counts and content types, and times
+every loader, every saver and every spxImageReshapeFunctions entry.
+Each case runs in its own forked process so that allocation counts
+and peak resident memory are reported per case. Results are printed
+as a table and optionally written as JSON.
+
+****************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stddef.h>
+
+static void* benchMalloc(size_t size);
+static void* benchRealloc(void* ptr, size_t size);
+static void benchFree(void* ptr);
+
+#define SPXI_MALLOC(size) benchMalloc(size)
+#define SPXI_REALLOC(ptr, size) benchRealloc(ptr, size)
+#define SPXI_FREE(ptr) benchFree(ptr)
+
+#define SPXI_APPLICATION
+#include <spximg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#define BENCH_NAME_SIZE 16
+#define BENCH_PATH_SIZE 512
+#define BENCH_MAX_RESULTS 4096
+
+/* Counting Allocator */
+
+typedef union BenchAllocHeader {
+    size_t size;
+    double align;
+} BenchAllocHeader;
+
+static unsigned long benchAllocCount = 0;
+static size_t benchAllocLive = 0, benchAllocPeak = 0;
+
+/* with SPXI_THREADS pool workers allocate too */
+#ifdef SPXI_THREADS
+#include <pthread.h>
+static pthread_mutex_t benchAllocLock = PTHREAD_MUTEX_INITIALIZER;
+#define benchAllocLockAcquire() pthread_mutex_lock(&benchAllocLock)
+#define benchAllocLockRelease() pthread_mutex_unlock(&benchAllocLock)
+#else
+#define benchAllocLockAcquire()
+#define benchAllocLockRelease()
+#endif /* SPXI_THREADS */
+
+static void* benchMalloc(size_t size)
+{
+    BenchAllocHeader* header = malloc(sizeof(BenchAllocHeader) + size);
+    if (!header) {
+        return NULL;
+    }
+
+    header->size = size;
+    benchAllocLockAcquire();
+    benchAllocLive += size;
+    if (benchAllocLive > benchAllocPeak) {
+        benchAllocPeak = benchAllocLive;
+    }
+
+    ++benchAllocCount;
+    benchAllocLockRelease();
+    return header + 1;
+}
+
+static void* benchRealloc(void* ptr, size_t size)
+{
+    BenchAllocHeader* header;
+    if (!ptr) {
+        return benchMalloc(size);
+    }
+
+    header = realloc((BenchAllocHeader*)ptr - 1, sizeof(BenchAllocHeader) + size);
+    if (!header) {
+        return NULL;
+    }
+
+    benchAllocLockAcquire();
+    benchAllocLive -= header->size;
+    header->size = size;
+    benchAllocLive += size;
+    if (benchAllocLive > benchAllocPeak) {
+        benchAllocPeak = benchAllocLive;
+    }
+
+    ++benchAllocCount;
+    benchAllocLockRelease();
+    return header + 1;
+}
+
+static void benchFree(void* ptr)
+{
+    if (ptr) {
+        BenchAllocHeader* header = (BenchAllocHeader*)ptr - 1;
+        benchAllocLockAcquire();
+        benchAllocLive -= header->size;
+        benchAllocLockRelease();
+        free(header);
+    }
+}
+
+/* Benchmark Cases and Results */
+
+typedef struct BenchSize {
+    const char* name;
+    int width;
+    int height;
+} BenchSize;
+
+typedef struct BenchResult {
+    char op[BENCH_NAME_SIZE];
+    char codec[BENCH_NAME_SIZE];
+    char storage[BENCH_NAME_SIZE];
+    char size[BENCH_NAME_SIZE];
+    char content[BENCH_NAME_SIZE];
+    int width;
+    int height;
+    int channels;
+    int iterations;
+    int ok;
+    double seconds;
+    double mps;
+    double mbs;
+    double allocs;
+    double heapPeak;
+    long rssPeak;
+    long fileSize;
+} BenchResult;
+
+typedef struct BenchConfig {
+    const char* sizes;
+    const char* channels;
+    const char* contents;
+    const char* ops;
+    const char* storages;
+    const char* diskdir;
+    const char* json;
+    double mintime;
+} BenchConfig;
+
+static const BenchSize benchSizes[] = {
+    {"tiny", 64, 64},
+    {"1mp", 1024, 1024},
+    {"50mp", 8192, 6144}
+};
+
+static const char* benchContents[] = {"flat", "noise", "photo"};
+static const char* benchCodecs[] = {"png", "jpeg", "pnm", "bmp"};
+static const char* benchExtensions[] = {"png", "jpg", "ppm", "bmp"};
+
+static BenchResult benchResults[BENCH_MAX_RESULTS];
+static int benchResultCount = 0;
+
+static double benchTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int benchListHas(const char* list, const char* name)
+{
+    size_t len = strlen(name);
+    while (list && *list) {
+        const char* end = strchr(list, ',');
+        size_t n = end ? (size_t)(end - list) : strlen(list);
+        if (n == len && !strncmp(list, name, n)) {
+            return 1;
+        }
+        list = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+static long benchFileSize(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) ? -1 : (long)st.st_size;
+}
+
+/* Synthetic Image Generation */
+
+static uint32_t benchRandom(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static Img2D benchImageGenerate(const BenchSize* size, int channels,
+    const char* content)
+{
+    int x, y, c;
+    uint32_t seed = 0x9E3779B9;
+    Img2D img = spxImageCreate(size->width, size->height, channels);
+    uint8_t* p = img.pixbuf;
+
+    if (!strcmp(content, "flat")) {
+        for (y = 0; y < img.height; ++y) {
+            for (x = 0; x < img.width; ++x) {
+                for (c = 0; c < channels; ++c) {
+                    *p++ = (uint8_t)(0x60 + c * 0x20);
+                }
+            }
+        }
+    } else if (!strcmp(content, "noise")) {
+        for (y = 0; y < img.height; ++y) {
+            for (x = 0; x < img.width * channels; ++x) {
+                *p++ = (uint8_t)(benchRandom(&seed) >> 24);
+            }
+        }
+    } else {
+        /* smooth gradients, a few hard edged shapes and mild grain */
+        for (y = 0; y < img.height; ++y) {
+            int fy = (y << 8) / img.height;
+            for (x = 0; x < img.width; ++x) {
+                int fx = (x << 8) / img.width;
+                int dx = fx - 160, dy = fy - 96;
+                int inside = dx * dx + dy * dy < 48 * 48;
+                int band = ((fx >> 5) + (fy >> 6)) & 1;
+                int grain = (int)(benchRandom(&seed) >> 29) - 4;
+                for (c = 0; c < channels; ++c) {
+                    int v;
+                    if (c == 3 || (c == 1 && channels == 2)) {
+                        v = fx < 224 ? 0xFF : 0xFF - ((fx - 224) << 3);
+                    } else {
+                        v = (fx * (c + 1) + fy * (3 - c)) >> 2;
+                        v += inside ? 64 : band * 16;
+                        v += grain;
+                    }
+                    *p++ = (uint8_t)(v < 0 ? 0 : v > 0xFF ? 0xFF : v);
+                }
+            }
+        }
+    }
+
+    return img;
+}
+
+static void benchWriteLE(FILE* file, uint32_t n, int bytes)
+{
+    while (bytes--) {
+        fputc((int)(n & 0xFF), file);
+        n >>= 8;
+    }
+}
+
+/* spximg has no BMP saver, so BMP sources for the loader are written here:
+ * 8bpp gray palette, 16bpp 555, 24bpp BGR and 32bpp BGRA by channel count */
+static int benchWriteBmp(const Img2D img, const char* path)
+{
+    static const int bppTable[] = {8, 16, 24, 32};
+    int x, y, i, bpp = bppTable[img.channels - 1];
+    int stride = ((img.width * bpp + 31) >> 5) << 2;
+    int palette = bpp == 8 ? 256 * 4 : 0;
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return EXIT_FAILURE;
+    }
+
+    fputc('B', file);
+    fputc('M', file);
+    benchWriteLE(file, 54 + palette + stride * img.height, 4);
+    benchWriteLE(file, 0, 4);
+    benchWriteLE(file, 54 + palette, 4);
+    benchWriteLE(file, 40, 4);
+    benchWriteLE(file, img.width, 4);
+    benchWriteLE(file, img.height, 4);
+    benchWriteLE(file, 1, 2);
+    benchWriteLE(file, bpp, 2);
+    benchWriteLE(file, 0, 4);
+    benchWriteLE(file, stride * img.height, 4);
+    benchWriteLE(file, 2835, 4);
+    benchWriteLE(file, 2835, 4);
+    benchWriteLE(file, palette ? 256 : 0, 4);
+    benchWriteLE(file, 0, 4);
+
+    for (i = 0; i < palette >> 2; ++i) {
+        benchWriteLE(file, 0xFF000000 | (i << 16) | (i << 8) | i, 4);
+    }
+
+    for (y = img.height - 1; y >= 0; --y) {
+        const uint8_t* src = img.pixbuf + y * img.width * img.channels;
+        for (x = 0; x < img.width; ++x, src += img.channels) {
+            switch (bpp) {
+                case 8:
+                    fputc(src[0], file);
+                    break;
+                case 16:
+                    i = src[0] >> 3;
+                    benchWriteLE(file, (i << 10) | (i << 5) | i, 2);
+                    break;
+                case 24:
+                    fputc(src[2], file);
+                    fputc(src[1], file);
+                    fputc(src[0], file);
+                    break;
+                case 32:
+                    fputc(src[2], file);
+                    fputc(src[1], file);
+                    fputc(src[0], file);
+                    fputc(src[3], file);
+                    break;
+            }
+        }
+        for (x = (img.width * bpp + 7) >> 3; x < stride; ++x) {
+            fputc(0, file);
+        }
+    }
+
+    return fclose(file);
+}
+
+static int benchSave(const Img2D img, int codec, const char* path)
+{
+    switch (codec) {
+        case 0: return spxImageSavePng(img, path);
+        case 1: return spxImageSaveJpeg(img, path, SPXI_JPEG_QUALITY);
+        case 2: return spxImageSavePnm(img, path);
+    }
+    return benchWriteBmp(img, path);
+}
+
+static Img2D benchLoad(int codec, const char* path)
+{
+    switch (codec) {
+        case 0: return spxImageLoadPng(path);
+        case 1: return spxImageLoadJpeg(path);
+        case 2: return spxImageLoadPnm(path);
+    }
+    return spxImageLoadBmp(path);
+}
+
+/* Case Execution */
+
+#define BENCH_OP_SAVE       0
+#define BENCH_OP_LOAD       1
+#define BENCH_OP_RESHAPE    2
+
+static void benchRunCase(BenchResult* res, const Img2D img, int op, int arg,
+    const char* path, double mintime)
+{
+    double start, elapsed;
+    size_t rawsize = (size_t)img.width * img.height * img.channels;
+    struct rusage usage;
+
+    benchAllocCount = 0;
+    benchAllocPeak = benchAllocLive;
+    res->iterations = 0;
+    res->ok = 1;
+    start = benchTime();
+
+    do {
+        Img2D out;
+        switch (op) {
+            case BENCH_OP_SAVE:
+                res->ok &= !benchSave(img, arg, path);
+                break;
+            case BENCH_OP_LOAD:
+                out = benchLoad(arg, path);
+                res->ok &= out.pixbuf != NULL;
+                rawsize = (size_t)out.width * out.height * out.channels;
+                spxImageFree(&out);
+                break;
+            default:
+                out = spxImageReshapeFunctions[img.channels - 1][arg - 1](img);
+                res->ok &= out.pixbuf != NULL;
+                spxImageFree(&out);
+        }
+        ++res->iterations;
+        elapsed = benchTime() - start;
+    } while (elapsed < mintime && res->ok);
+
+    res->seconds = elapsed / res->iterations;
+    res->mps = (double)img.width * img.height / res->seconds * 1e-6;
+    res->mbs = (double)rawsize / res->seconds * 1e-6;
+    res->allocs = (double)benchAllocCount / res->iterations;
+    res->heapPeak = (double)(benchAllocPeak - benchAllocLive);
+    res->fileSize = op == BENCH_OP_RESHAPE ? 0 : benchFileSize(path);
+
+    getrusage(RUSAGE_SELF, &usage);
+    res->rssPeak = usage.ru_maxrss;
+}
+
+static void benchFork(BenchResult* res, const Img2D img, int op, int arg,
+    const char* path, double mintime)
+{
+    int fds[2], status;
+    pid_t pid;
+
+    res->ok = 0;
+    if (pipe(fds)) {
+        perror("spxbench: pipe");
+        return;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        perror("spxbench: fork");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+
+    if (!pid) {
+        close(fds[0]);
+        benchRunCase(res, img, op, arg, path, mintime);
+        if (write(fds[1], res, sizeof(BenchResult)) != sizeof(BenchResult)) {
+            _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], res, sizeof(BenchResult)) != sizeof(BenchResult)) {
+        res->ok = 0;
+    }
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+}
+
+/* Reporting */
+
+static void benchPrintHeader(void)
+{
+    fprintf(stdout, "%-8s %-6s %-6s %-5s %-6s %2s %10s %9s %9s %8s %10s %10s %10s\n",
+        "op", "codec", "store", "size", "image", "ch", "ms", "MP/s", "MB/s",
+        "allocs", "heap KB", "rss KB", "file KB"
+    );
+}
+
+static void benchPrintResult(const BenchResult* r)
+{
+    if (!r->ok) {
+        fprintf(stdout, "%-8s %-6s %-6s %-5s %-6s %2d %10s\n", r->op, r->codec,
+            r->storage, r->size, r->content, r->channels, "FAILED"
+        );
+        return;
+    }
+
+    fprintf(stdout,
+        "%-8s %-6s %-6s %-5s %-6s %2d %10.3f %9.1f %9.1f %8.1f %10.0f %10ld %10.1f\n",
+        r->op, r->codec, r->storage, r->size, r->content, r->channels,
+        r->seconds * 1e3, r->mps, r->mbs, r->allocs, r->heapPeak / 1024.0,
+        r->rssPeak, (double)r->fileSize / 1024.0
+    );
+    fflush(stdout);
+}
+
+static int benchWriteJson(const char* path)
+{
+    int i;
+    FILE* file = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (!file) {
+        fprintf(stderr, "spxbench could not write file: '%s'\n", path);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(file, "[\n");
+    for (i = 0; i < benchResultCount; ++i) {
+        const BenchResult* r = benchResults + i;
+        fprintf(file,
+            "  {\"op\": \"%s\", \"codec\": \"%s\", \"storage\": \"%s\", "
+            "\"size\": \"%s\", \"content\": \"%s\", \"width\": %d, \"height\": %d, "
+            "\"channels\": %d, \"ok\": %s, \"iterations\": %d, \"seconds\": %.9f, "
+            "\"mps\": %.3f, \"mbs\": %.3f, \"allocs\": %.2f, \"heap_peak_bytes\": %.0f, "
+            "\"rss_peak_kb\": %ld, \"file_bytes\": %ld}%s\n",
+            r->op, r->codec, r->storage, r->size, r->content, r->width, r->height,
+            r->channels, r->ok ? "true" : "false", r->iterations, r->seconds,
+            r->mps, r->mbs, r->allocs, r->heapPeak, r->rssPeak, r->fileSize,
+            i + 1 < benchResultCount ? "," : ""
+        );
+    }
+    fprintf(file, "]\n");
+
+    return file == stdout ? fflush(file) : fclose(file);
+}
+
+static void benchRecord(const BenchResult* res)
+{
+    benchPrintResult(res);
+    if (benchResultCount < BENCH_MAX_RESULTS) {
+        benchResults[benchResultCount++] = *res;
+    }
+}
+
+static void benchRunImage(const BenchConfig* cfg, const BenchSize* size,
+    int channels, const char* content)
+{
+    static const char* storageNames[] = {"disk", "shm"};
+
+    int codec, target, storage;
+    char path[BENCH_PATH_SIZE];
+    BenchResult res;
+    Img2D img = benchImageGenerate(size, channels, content);
+
+    memset(&res, 0, sizeof(res));
+    strcpy(res.size, size->name);
+    strcpy(res.content, content);
+    res.width = img.width;
+    res.height = img.height;
+    res.channels = channels;
+
+    for (storage = 0; storage < 2; ++storage) {
+        const char* dir = storage ? "/dev/shm" : cfg->diskdir;
+        if (!benchListHas(cfg->storages, storageNames[storage]) || access(dir, W_OK)) {
+            continue;
+        }
+
+        strcpy(res.storage, storageNames[storage]);
+        for (codec = 0; codec < 4; ++codec) {
+            if (!benchListHas(cfg->ops, "save") && !benchListHas(cfg->ops, "load")) {
+                break;
+            }
+
+            sprintf(path, "%.400s/spxbench_%d.%s", dir, (int)getpid(),
+                benchExtensions[codec]
+            );
+            strcpy(res.codec, benchCodecs[codec]);
+
+            if (benchListHas(cfg->ops, "save") && codec != 3) {
+                strcpy(res.op, "save");
+                benchFork(&res, img, BENCH_OP_SAVE, codec, path, cfg->mintime);
+                benchRecord(&res);
+            }
+
+            if (benchListHas(cfg->ops, "load")) {
+                if (benchSave(img, codec, path)) {
+                    fprintf(stderr, "spxbench could not write file: '%s'\n", path);
+                    continue;
+                }
+                strcpy(res.op, "load");
+                benchFork(&res, img, BENCH_OP_LOAD, codec, path, cfg->mintime);
+                benchRecord(&res);
+            }
+            remove(path);
+        }
+    }
+
+    if (benchListHas(cfg->ops, "reshape")) {
+        strcpy(res.op, "reshape");
+        strcpy(res.storage, "-");
+        for (target = 1; target <= 4; ++target) {
+            sprintf(res.codec, "%dto%d", channels, target);
+            benchFork(&res, img, BENCH_OP_RESHAPE, target, NULL, cfg->mintime);
+            benchRecord(&res);
+        }
+    }
+
+    spxImageFree(&img);
+}
+
+static int benchUsage(const char* exe)
+{
+    fprintf(stdout, "%s usage:\n", exe);
+    fprintf(stdout, "-s <list>\t: Image sizes (tiny,1mp,50mp)\n");
+    fprintf(stdout, "-c <list>\t: Channel counts (1,2,3,4)\n");
+    fprintf(stdout, "-k <list>\t: Content types (flat,noise,photo)\n");
+    fprintf(stdout, "-o <list>\t: Operations (save,load,reshape)\n");
+    fprintf(stdout, "-m <list>\t: Storage for files (disk,shm)\n");
+    fprintf(stdout, "-d <dir>\t: Directory used for disk storage (default .)\n");
+    fprintf(stdout, "-t <sec>\t: Minimum time spent repeating each case\n");
+    fprintf(stdout, "-j <file>\t: Write results as JSON to <file> ('-' for stdout)\n");
+    fprintf(stdout, "-h\t\t: Display usage and available commands\n");
+    return EXIT_SUCCESS;
+}
+
+int main(const int argc, const char** argv)
+{
+    int i, s, c, k;
+    char name[BENCH_NAME_SIZE];
+    BenchConfig cfg;
+
+    cfg.sizes = "tiny,1mp,50mp";
+    cfg.channels = "1,2,3,4";
+    cfg.contents = "flat,noise,photo";
+    cfg.ops = "save,load,reshape";
+    cfg.storages = "disk,shm";
+    cfg.diskdir = ".";
+    cfg.json = NULL;
+    cfg.mintime = 0.25;
+
+    for (i = 1; i < argc; ++i) {
+        const char* arg = i + 1 < argc ? argv[i + 1] : NULL;
+        if (argv[i][0] != '-' || !argv[i][1] || argv[i][2]) {
+            fprintf(stderr, "%s: unknown option %s\n", argv[0], argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        if (argv[i][1] == 'h') {
+            return benchUsage(argv[0]);
+        } else if (!arg) {
+            fprintf(stderr, "%s: missing argument for option %s\n", argv[0], argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        switch (argv[i++][1]) {
+            case 's': cfg.sizes = arg; break;
+            case 'c': cfg.channels = arg; break;
+            case 'k': cfg.contents = arg; break;
+            case 'o': cfg.ops = arg; break;
+            case 'm': cfg.storages = arg; break;
+            case 'd': cfg.diskdir = arg; break;
+            case 'j': cfg.json = arg; break;
+            case 't': cfg.mintime = atof(arg); break;
+            default:
+                fprintf(stderr, "%s: unknown option %s\n", argv[0], argv[i - 1]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    benchPrintHeader();
+    for (s = 0; s < (int)(sizeof(benchSizes) / sizeof(benchSizes[0])); ++s) {
+        if (!benchListHas(cfg.sizes, benchSizes[s].name)) {
+            continue;
+        }
+        for (k = 0; k < 3; ++k) {
+            if (!benchListHas(cfg.contents, benchContents[k])) {
+                continue;
+            }
+            for (c = 1; c <= 4; ++c) {
+                sprintf(name, "%d", c);
+                if (benchListHas(cfg.channels, name)) {
+                    benchRunImage(&cfg, benchSizes + s, c, benchContents[k]);
+                }
+            }
+        }
+    }
+
+    return cfg.json ? benchWriteJson(cfg.json) : EXIT_SUCCESS;
+}
@@ -26,6 +26,9 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 */
 
+#define _POSIX_C_SOURCE 200809L
+#define SPXI_STATS
+#define SPXI_SHARED
 #define SPXI_APPLICATION
 #include <spximg.h>
 #include <stdlib.h>
@@ -60,10 +63,26 @@ static int spximgHelp(const char* exestr)
 {
     fprintf(stdout, "%s usage:\n", exestr);
     fprintf(stdout, "<image.*>\t: Load <image.*> file (.png, .jpeg or .ppm)\n");
+    fprintf(stdout, "-\t\t: Load image from standard input while it arrives\n");
     fprintf(stdout, "-o <image.*>\t: Save <image.*> file (.png, .jpeg or .ppm)\n");
-    fprintf(stdout, "-d\t\t: Display image information\n");
+    fprintf(stdout, "-d\t\t: Display image information and channel statistics\n");
     fprintf(stdout, "-i\t\t: Save output image file to same path as input file\n");
     fprintf(stdout, "-n <int>\t: Reshape image to have <int> number of channels\n");
+    fprintf(stdout, "-r <W>x<H>\t: Resize image to <W> by <H> pixels (Lanczos-3)\n");
+    fprintf(stdout, "-f <op>\t\t: Flip or rotate image (fx, fy, r90, r180, r270, tp, tv)\n");
+    fprintf(stdout, "-c <W>x<H>+<X>+<Y>: Crop image to <W> by <H> pixels at <X>, <Y>\n");
+    fprintf(stdout, "-e\t\t: Apply EXIF orientation to JPEG files loaded after it\n");
+    fprintf(stdout, "-k\t\t: Keep palette indices of PNG and BMP files loaded after it\n");
+    fprintf(stdout, "-w\t\t: Keep 16-bit samples of PNG and PNM files loaded after it\n");
+    fprintf(stdout, "-s\t\t: Split channels of files loaded after it into planes\n");
+    fprintf(stdout, "-m\t\t: Strip metadata of unchanged files copied by -o and -i\n");
+    fprintf(stdout, "-b <bytes>\t: Save JPEG files at the highest quality that fits <bytes>\n");
+    fprintf(stdout, "-p <int>\t: Reduce image to a palette of <int> colors\n");
+    fprintf(stdout, "-l <ops> <file>\t: Losslessly transform loaded JPEG file into file\n");
+    fprintf(stdout, "\t\t  ops: fx, fy, r90, r180, r270, tp, tv, gray, strip, WxH+X+Y\n");
+    fprintf(stdout, "-x <a> <b>\t: Compare image files <a> and <b> (MSE, PSNR, SSIM, MS-SSIM)\n");
+    fprintf(stdout, "-t\t\t: Display per stage timing of each processed image\n");
+    fprintf(stdout, "-z <pixels>\t: Load images of up to <pixels> pixels, 0 for no limit\n");
     fprintf(stdout, "-h, --help:\t: Display usage and available commands\n");
     fprintf(stdout, "-v, --version:\t: Display version information\n");
     return EXIT_SUCCESS;
@@ -74,12 +93,232 @@ static int spximgImageInfo(const Img2D image, const char* path, int format)
     static const char* sep = "-----------------------------------------------------\n";
     return fprintf(
         stdout, "%sfile: '%s'\nformat: %s\nwidth: %d\nheight: %d\n"
-        "channels: %d - '%s'\n",
+        "channels: %d - '%s'\ndepth: %d\nlayout: %s\n",
         sep, path, spxImageFormatName(format), image.width, image.height, 
-        image.channels, spxImageColorName(image.channels)
+        image.channels, image.palette ? "Indexed" : spxImageColorName(image.channels),
+        image.depth ? image.depth : 8,
+        image.layout == SPXI_LAYOUT_PLANAR ? "Planar" : "Interleaved"
     );
 }
 
+/* channel statistics and whether fewer channels would hold the image */
+static int spximgImageStats(const Img2D image)
+{
+    SpxImageAnalysis st;
+    int c;
+
+    if (spxImageAnalyze(image, &st)) {
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stdout, "%-8s %6s %6s %10s %10s\n", "channel", "min", "max", "mean", "stddev");
+    for (c = 0; c < st.channels; ++c) {
+        fprintf(stdout, "%-8d %6d %6d %10.3f %10.3f\n",
+            c, st.min[c], st.max[c], st.mean[c], st.stddev[c]
+        );
+    }
+
+    fprintf(stdout, "opaque: %s\ngray: %s\nchannels needed: %d\n",
+        st.opaque ? "yes" : "no", st.gray ? "yes" : "no", st.channelsNeeded
+    );
+    return EXIT_SUCCESS;
+}
+
+static void spximgTimingInfo(const char* path)
+{
+    static const char* sep = "-----------------------------------------------------\n";
+    int format;
+    SpxImageStats st;
+
+    fprintf(stdout, "%stiming: '%s'\n", sep, path);
+    fprintf(stdout, "%-8s %5s %10s %10s %9s %9s %9s %9s %6s %10s\n",
+        "format", "calls", "read KB", "write KB", "io ms", "codec ms",
+        "conv ms", "alloc ms", "allocs", "peak KB"
+    );
+
+    for (format = 0; format < SPXI_FORMAT_COUNT; ++format) {
+        if (spxImageStatsGet(format, NULL, &st) || !st.calls) {
+            continue;
+        }
+
+        fprintf(stdout, "%-8s %5lu %10.1f %10.1f %9.3f %9.3f %9.3f %9.3f %6lu %10.1f\n",
+            format ? spxImageFormatName(format) : "Convert", st.calls,
+            st.bytesRead / 1024.0, st.bytesWritten / 1024.0, st.timeIO * 1e3,
+            st.timeCodec * 1e3, st.timeConvert * 1e3, st.timeAlloc * 1e3,
+            st.allocs, st.peakBuffer / 1024.0
+        );
+    }
+
+    spxImageStatsReset();
+}
+
+/* per channel errors of two image files, one line each and one for all */
+static int spximgCompare(const char* apath, const char* bpath)
+{
+    static const char* sep = "-----------------------------------------------------\n";
+    SpxImageCompare cmp;
+    int c;
+
+    if (spxImageCompareFiles(apath, bpath, &cmp)) {
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stdout, "%scompare: '%s' '%s'\n", sep, apath, bpath);
+    fprintf(stdout, "%-8s %10s %9s %9s %9s %8s\n",
+        "channel", "mse", "psnr", "ssim", "ms-ssim", "maxdiff"
+    );
+
+    for (c = 0; c <= cmp.channels; ++c) {
+        const int i = c < cmp.channels ? c : SPXI_COMPARE_ALL;
+        char name[16] = "all";
+        if (i != SPXI_COMPARE_ALL) {
+            sprintf(name, "%d", c);
+        }
+        fprintf(stdout, "%-8s %10.4f %9.3f %9.6f %9.6f %8d\n",
+            name, cmp.mse[i], cmp.psnr[i], cmp.ssim[i], cmp.msssim[i], cmp.maxdiff[i]
+        );
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int spximgParseTransform(const char* str)
+{
+    static const char* names[] = {"none", "fx", "fy", "r180", "tp", "r90", "r270", "tv"};
+    int i;
+    for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); ++i) {
+        if (!strcmp(str, names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* apply a comma separated list of lossless JPEG operations, a crop is
+ * given as WxH+X+Y */
+static int spximgTransformJpeg(const char* inpath, const char* outpath, const char* ops)
+{
+    char buf[256], *op;
+    int transform = SPXI_TRANSFORM_NONE, flags = 0, cropped = 0, crop[4] = {0, 0, 0, 0};
+    
+    strncpy(buf, ops, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    for (op = strtok(buf, ","); op; op = strtok(NULL, ",")) {
+        int t = spximgParseTransform(op);
+        if (t >= 0) {
+            transform = t;
+        } else if (!strcmp(op, "gray")) {
+            flags |= SPXI_JPEG_GRAYSCALE;
+        } else if (!strcmp(op, "strip")) {
+            flags |= SPXI_JPEG_STRIP;
+        } else if (sscanf(op, "%dx%d+%d+%d", crop + 2, crop + 3, crop, crop + 1) == 4) {
+            cropped = 1;
+        } else {
+            fprintf(stderr, "spximg: invalid lossless JPEG operation %s\n", op);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return spxImageTransformJpeg(inpath, outpath, transform, cropped ? crop : NULL, flags);
+}
+
+/* number of arguments that follow an option, to know which are paths */
+static int spximgOptionArgs(const char* arg)
+{
+    if (arg[0] != '-' || !arg[1] || arg[2]) {
+        return 0;
+    }
+
+    switch (arg[1]) {
+        case 'o': case 'n': case 'r': case 'f': case 'p': case 'c': case 'b': case 'z':
+            return 1;
+        case 'l': case 'x': return 2;
+    }
+
+    return 0;
+}
+
+/* nonzero when an argument before end writes path, as the output of -o
+ * or -l, or by saving a load of path in place with -i */
+static int spximgWritten(const char** argv, const int end, const char* path)
+{
+    int i;
+    const char* current = NULL;
+    for (i = 1; i < end; ++i) {
+        if (argv[i][0] != '-' || !argv[i][1]) {
+            current = argv[i];
+        } else if ((!strcmp(argv[i], "-o") && i + 1 < end && !strcmp(argv[i + 1], path)) ||
+            (!strcmp(argv[i], "-l") && i + 2 < end && !strcmp(argv[i + 2], path)) ||
+            (!strcmp(argv[i], "-i") && current && !strcmp(current, path))) {
+            return 1;
+        } else {
+            i += spximgOptionArgs(argv[i]);
+        }
+    }
+    return 0;
+}
+
+/* decode standard input through the push decoder as it arrives */
+static Img2D spximgLoadStdin(const int flags, int* format)
+{
+    static uint8_t buf[1 << 16];
+    SpxImageDecoder* decoder = spxImageDecoderOpen(flags);
+    Img2D image;
+    size_t size;
+
+    *format = SPXI_FORMAT_UNKNOWN;
+    while (decoder && (size = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+        if (*format == SPXI_FORMAT_UNKNOWN && size >= SPXI_HEADER_SIZE) {
+            *format = spxParseHeader(buf);
+        }
+        if (spxImageDecoderPush(decoder, buf, size) < 0) {
+            break;
+        }
+    }
+
+    image = spxImageDecoderFinish(decoder);
+    spxImageDecoderClose(decoder);
+    *format = image.pixbuf ? *format : SPXI_FORMAT_NULL;
+    return image;
+}
+
+/* an image saved to its own format with nothing applied since it was
+ * loaded keeps its compressed bytes, only metadata may be stripped.
+ * JPEG files given a size in bytes are encoded again to fit in it */
+static int spximgSave(const Img2D image, const char* path, const int format,
+    const char* outpath, const int pristine, const int copyflags, const size_t bytes)
+{
+    if (bytes && spxParseExtension(outpath) == SPXI_FORMAT_JPEG) {
+        int quality = spxImageSaveJpegTarget(image, outpath, bytes);
+        if (quality) {
+            fprintf(stdout, "%s: saved at quality %d\n", outpath, quality);
+        }
+        return quality ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (pristine && spxParseExtension(outpath) == format) {
+        return spxImageCopyFile(path, outpath, copyflags);
+    }
+    return spxImageSave(image, outpath);
+}
+
+/* reshapes, transforms, crops and resizes are only recorded, they run
+ * fused in one pass when the image is next saved, shown or quantized */
+static void spximgEvaluate(Img2D* image, const SpxImageOp* ops, int* count)
+{
+    Img2D tmp;
+    if (!*count) {
+        return;
+    }
+
+    tmp = spxImageApply(*image, ops, *count);
+    *count = 0;
+    if (tmp.pixbuf) {
+        spxImageFree(image);
+        *image = tmp;
+    }
+}
+
 static int spximgCheckImage(
     const uint8_t* pixbuf, const char* path, const char* arg0, const char* argi)
 {
@@ -106,52 +345,183 @@ static int spximgCheckArgs(
 
 int main(const int argc, const char** argv)
 {
-    int i, format = 0, status = EXIT_FAILURE;
+    int i, format = 0, timing = 0, flags = 0, status = EXIT_FAILURE;
+    int pathcount = 0, next = 0, opcount = 0, pristine = 0, copyflags = 0;
+    size_t bytes = 0;
     const char* path = NULL;
-    Img2D image = {NULL, 0, 0, 0};
+    const char** paths = malloc(argc * sizeof(const char*));
+    SpxImageOp* ops = malloc(argc * sizeof(SpxImageOp));
+    SpxImageBatch* batch;
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
 
-    for (i = 1; i < argc; ++i) {
+    /* read image files ahead while earlier ones are decoded, the pixel
+     * limit applies to all of them so it is set before. Files written
+     * earlier on the command line are loaded in turn, after the write */
+    for (i = 1; paths && i < argc; ++i) {
+        if (!strcmp(argv[i], "-z") && i + 1 < argc) {
+            SpxImageLimits limits = {0, 0, 0, 0};
+            limits.pixels = (size_t)strtoul(argv[i + 1], NULL, 10);
+            spxImageSetLimits(&limits);
+        }
         if (argv[i][0] == '-') {
+            i += spximgOptionArgs(argv[i]);
+        } else if (!spximgWritten(argv, i, argv[i])) {
+            paths[pathcount++] = argv[i];
+        }
+    }
+    batch = paths ? spxImageBatchOpen(paths, pathcount, 0) : NULL;
+
+    for (i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-' && argv[i][1]) {
             const char* cmd = argv[i] + 1;
             if ((cmd[0] == 'h' && !cmd[1]) || !strcmp(cmd, "-help")) {
-                return spximgHelp(argv[0]);
+                status = spximgHelp(argv[0]);
+                goto spximgEnd;
             } else if ((cmd[0] == 'v' && !cmd[1]) || !strcmp(cmd, "-version")) {
-                return spximgVersion(argv[0]);
+                status = spximgVersion(argv[0]);
+                goto spximgEnd;
             } else if (cmd[0] == 'd' && !cmd[1]) { 
                 if (!spximgCheckImage(image.pixbuf, path, argv[0], argv[i])) {
+                    spximgEvaluate(&image, ops, &opcount);
                     spximgImageInfo(image, path, format);
+                    spximgImageStats(image);
+                }
+            } else if (cmd[0] == 't' && !cmd[1]) {
+                timing = 1;
+            } else if (cmd[0] == 'z' && !cmd[1]) {
+                i += !spximgCheckArgs(argc, i, argv[0], argv[i]);
+            } else if (cmd[0] == 'e' && !cmd[1]) {
+                flags |= SPXI_LOAD_ORIENT;
+            } else if (cmd[0] == 'k' && !cmd[1]) {
+                flags |= SPXI_LOAD_INDEXED;
+            } else if (cmd[0] == 'w' && !cmd[1]) {
+                flags |= SPXI_LOAD_16BIT;
+            } else if (cmd[0] == 's' && !cmd[1]) {
+                flags |= SPXI_LOAD_PLANAR;
+            } else if (cmd[0] == 'm' && !cmd[1]) {
+                copyflags |= SPXI_COPY_STRIP;
+            } else if (cmd[0] == 'b' && !cmd[1]) {
+                if (!spximgCheckArgs(argc, i, argv[0], argv[i])) {
+                    bytes = (size_t)strtoul(argv[++i], NULL, 10);
+                }
+            } else if (cmd[0] == 'f' && !cmd[1]) {
+                if (!spximgCheckImage(image.pixbuf, path, argv[0], argv[i]) &&
+                    !spximgCheckArgs(argc, i, argv[0], argv[i])) {
+                    int transform = spximgParseTransform(argv[++i]);
+                    if (transform >= 0 && ops) {
+                        pristine = 0;
+                        ops[opcount].type = SPXI_OP_TRANSFORM;
+                        ops[opcount++].args[0] = transform;
+                    } else {
+                        fprintf(stderr, "%s: invalid transform %s\n", argv[0], argv[i]);
+                    }
+                }
+            } else if (cmd[0] == 'c' && !cmd[1]) {
+                if (!spximgCheckImage(image.pixbuf, path, argv[0], argv[i]) &&
+                    !spximgCheckArgs(argc, i, argv[0], argv[i])) {
+                    int* crop = ops ? ops[opcount].args : NULL;
+                    if (crop && sscanf(argv[i + 1], "%dx%d+%d+%d",
+                            crop + 2, crop + 3, crop, crop + 1) == 4) {
+                        pristine = 0;
+                        ops[opcount++].type = SPXI_OP_CROP;
+                    } else {
+                        fprintf(stderr, "%s: invalid crop %s\n", argv[0], argv[i + 1]);
+                    }
+                    ++i;
+                }
+            } else if (cmd[0] == 'l' && !cmd[1]) {
+                if (!spximgCheckImage(image.pixbuf, path, argv[0], argv[i]) &&
+                    !spximgCheckArgs(argc, i + 1, argv[0], argv[i])) {
+                    if (format != SPXI_FORMAT_JPEG) {
+                        fprintf(stderr, "%s: %s needs a JPEG file\n", argv[0], argv[i]);
+                    } else {
+                        spximgTransformJpeg(path, argv[i + 2], argv[i + 1]);
+                    }
+                    i += 2;
+                }
+            } else if (cmd[0] == 'x' && !cmd[1]) {
+                if (!spximgCheckArgs(argc, i + 1, argv[0], argv[i])) {
+                    status = spximgCompare(argv[i + 1], argv[i + 2]);
+                    i += 2;
                 }
             } else if (cmd[0] == 'i' && !cmd[1]) {
                 if (!spximgCheckImage(image.pixbuf, path, argv[0], argv[i])) {
-                    spxImageSave(image, path);
+                    spximgEvaluate(&image, ops, &opcount);
+                    spximgSave(image, path, format, path, pristine, copyflags, bytes);
                 }
             } else if (cmd[0] == 'o' && !cmd[1]) {
                 if (!spximgCheckImage(image.pixbuf, path, argv[0], argv[i++]) &&
                     !spximgCheckArgs(argc, i - 1, argv[0], argv[i - 1])) {
-                    spxImageSave(image, argv[i]);
+                    spximgEvaluate(&image, ops, &opcount);
+                    spximgSave(image, path, format, argv[i], pristine, copyflags, bytes);
                 }
             } else if (cmd[0] == 'n' && !cmd[1]) {
                 if (!spximgCheckImage(image.pixbuf, path, argv[0], argv[i]) &&
                     !spximgCheckArgs(argc, i, argv[0], argv[i])) {
-                    Img2D tmp = spxImageReshape(image, atoi(argv[++i]));
+                    int channels = atoi(argv[++i]);
+                    if (channels >= 1 && channels <= 4 && ops) {
+                        pristine = 0;
+                        ops[opcount].type = SPXI_OP_RESHAPE;
+                        ops[opcount++].args[0] = channels;
+                    } else {
+                        fprintf(stderr, "%s: invalid channels %s\n", argv[0], argv[i]);
+                    }
+                }
+            } else if (cmd[0] == 'p' && !cmd[1]) {
+                if (!spximgCheckImage(image.pixbuf, path, argv[0], argv[i]) &&
+                    !spximgCheckArgs(argc, i, argv[0], argv[i])) {
+                    Img2D tmp;
+                    spximgEvaluate(&image, ops, &opcount);
+                    tmp = spxImageQuantize(image, atoi(argv[++i]));
                     if (tmp.pixbuf) {
                         spxImageFree(&image);
                         image = tmp;
+                        pristine = 0;
+                    }
+                }
+            } else if (cmd[0] == 'r' && !cmd[1]) {
+                if (!spximgCheckImage(image.pixbuf, path, argv[0], argv[i]) &&
+                    !spximgCheckArgs(argc, i, argv[0], argv[i])) {
+                    int* size = ops ? ops[opcount].args : NULL;
+                    if (size && sscanf(argv[i + 1], "%dx%d", size, size + 1) == 2) {
+                        pristine = 0;
+                        size[2] = SPXI_FILTER_LANCZOS3;
+                        ops[opcount++].type = SPXI_OP_RESIZE;
+                    } else {
+                        fprintf(stderr, "%s: invalid size %s\n", argv[0], argv[i + 1]);
                     }
+                    ++i;
                 }
             } else {
                 fprintf(stderr, "%s: unknown option %s\n", argv[0], argv[i]);
             }
         } else {
+            if (timing && image.pixbuf) {
+                spximgTimingInfo(path);
+            }
+
             path = argv[i];
+            opcount = 0;
             spxImageFree(&image);
-            format = spxParseFormat(path);
-            if (format == SPXI_FORMAT_NULL) {
-                fprintf(stderr, "%s: could not open file %s\n", argv[0], argv[i]);
-                continue;
+            spxImageStatsReset();
+            if (!strcmp(path, "-")) {
+                image = spximgLoadStdin(flags, &format);
+            } else if (batch && next < pathcount && paths[next] == path) {
+                ++next;
+                spxImageBatchNext(batch, &image, flags);
+                format = image.pixbuf ? spxParseFormat(path) : SPXI_FORMAT_NULL;
+            } else {
+                format = spxParseFormat(path);
+                if (format == SPXI_FORMAT_NULL) {
+                    fprintf(stderr, "%s: could not open file %s\n", argv[0], argv[i]);
+                    continue;
+                }
+                image = spxImageLoadEx(path, flags);
             }
 
-            image = spxImageLoad(path);
+            /* stdin is not kept and EXIF orientation may move pixels */
+            pristine = image.pixbuf && strcmp(path, "-") &&
+                !(format == SPXI_FORMAT_JPEG && (flags & SPXI_LOAD_ORIENT));
             if (status) {
                 status = !image.pixbuf;
             }
@@ -160,9 +530,16 @@ int main(const int argc, const char** argv)
 
     if (i == 1) {
         fprintf(stderr, "%s: missing arguments. See -h for more info\n", argv[0]);
-        return EXIT_FAILURE;
     }
    
+    if (timing && image.pixbuf) {
+        spximgTimingInfo(path);
+    }
+
+spximgEnd:
     spxImageFree(&image);
+    spxImageBatchClose(batch);
+    free(paths);
+    free(ops);
     return status;
 }
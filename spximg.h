@@ -47,6 +47,7 @@ bytes against each format specification.
 ****************************************************/
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef IMG2D_TYPE_DEFINED
 #define IMG2D_TYPE_DEFINED
@@ -56,16 +57,200 @@ typedef struct Img2D {
     int width;
     int height;
     int channels;
+    uint8_t* palette;
+    int depth;
+    int layout;
+    /* bytes from one row to the next, 0 when rows are packed */
+    size_t stride;
 } Img2D;
 
 #endif /* IMG2D_TYPE_DEFINED */
 
+#ifdef SPXI_STATS
+
+typedef struct SpxImageStats {
+    unsigned long calls;
+    unsigned long allocs;
+    size_t bytesRead;
+    size_t bytesWritten;
+    size_t peakBuffer;
+    double timeIO;
+    double timeCodec;
+    double timeConvert;
+    double timeAlloc;
+} SpxImageStats;
+
+int spxImageStatsGet(int format, SpxImageStats* last, SpxImageStats* total);
+void spxImageStatsReset(void);
+
+#endif /* SPXI_STATS */
+
+#ifdef SPXI_CACHE
+
+typedef struct SpxImageCacheStats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+    size_t bytes;
+    size_t budget;
+} SpxImageCacheStats;
+
+Img2D spxImageCacheLoad(const char* path, int channels);
+void spxImageCacheRelease(Img2D* image);
+void spxImageCacheBudget(size_t bytes);
+void spxImageCacheStatsGet(SpxImageCacheStats* stats);
+
+#endif /* SPXI_CACHE */
+
+#define SPXI_FILTER_BOX         0
+#define SPXI_FILTER_BILINEAR    1
+#define SPXI_FILTER_BICUBIC     2
+#define SPXI_FILTER_LANCZOS3    3
+
+#define SPXI_TRANSFORM_NONE         0
+#define SPXI_TRANSFORM_FLIP_X       1
+#define SPXI_TRANSFORM_FLIP_Y       2
+#define SPXI_TRANSFORM_ROTATE_180   3
+#define SPXI_TRANSFORM_TRANSPOSE    4
+#define SPXI_TRANSFORM_ROTATE_90    5
+#define SPXI_TRANSFORM_ROTATE_270   6
+#define SPXI_TRANSFORM_TRANSVERSE   7
+
+#define SPXI_LOAD_ORIENT        0x01
+#define SPXI_LOAD_INDEXED       0x02
+#define SPXI_LOAD_16BIT         0x04
+#define SPXI_LOAD_PLANAR        0x08
+
+#define SPXI_COPY_STRIP         0x01
+
+#define SPXI_LAYOUT_INTERLEAVED 0
+#define SPXI_LAYOUT_PLANAR      1
+
+#define SPXI_ERROR_NONE         0
+#define SPXI_ERROR_DECODE       1
+#define SPXI_ERROR_LIMIT        2
+#define SPXI_ERROR_CANCEL       3
+
+#define SPXI_OP_RESHAPE         0
+#define SPXI_OP_TRANSFORM       1
+#define SPXI_OP_CROP            2
+#define SPXI_OP_RESIZE          3
+
+#define SPXI_PALETTE_COLORS     256
+
+#define SPXI_COMPARE_ALL        4
+
+typedef struct SpxImageBatch SpxImageBatch;
+typedef struct SpxImageDecoder SpxImageDecoder;
+typedef struct SpxImageScans SpxImageScans;
+
+/* args are channels, transform, x y width height or width height filter */
+typedef struct SpxImageOp {
+    int type;
+    int args[4];
+} SpxImageOp;
+
+typedef struct SpxImageYCbCr {
+    uint8_t* planes[3];
+    int strides[3];
+    int widths[3];
+    int heights[3];
+    int components;
+    int width;
+    int height;
+} SpxImageYCbCr;
+
+/* called as codecs go through the rows of an image, rows out of total,
+ * a nonzero return cancels the load or save */
+typedef int (*SpxImageProgress)(void* user, int rows, int total);
+
+/* zero in any field leaves it unlimited, bytes counts the pixel buffer */
+typedef struct SpxImageLimits {
+    int width;
+    int height;
+    size_t pixels;
+    size_t bytes;
+} SpxImageLimits;
+
+/* errors of each channel and, at SPXI_COMPARE_ALL, of all of them,
+ * psnr is HUGE_VAL where nothing differs */
+typedef struct SpxImageCompare {
+    int channels;
+    int maxdiff[5];
+    double mse[5];
+    double psnr[5];
+    double ssim[5];
+    double msssim[5];
+} SpxImageCompare;
+
+/* per channel statistics, 16 bit samples are binned by their high byte
+ * and palette images counted as RGBA. channelsNeeded is how many of
+ * them hold the whole image: 1 when gray or 3, plus 1 unless opaque */
+typedef struct SpxImageAnalysis {
+    int channels;
+    int depth;
+    int min[4];
+    int max[4];
+    double mean[4];
+    double stddev[4];
+    size_t histogram[4][256];
+    int opaque;
+    int gray;
+    int channelsNeeded;
+} SpxImageAnalysis;
+
 Img2D spxImageCreate(int width, int height, int channels);
 Img2D spxImageLoad(const char* path);
+Img2D spxImageLoadEx(const char* path, int flags);
+Img2D spxImageLoadMemory(const void* data, size_t size, int flags);
+Img2D spxImageLoadLimited(const char* path, int flags, const SpxImageLimits* limits);
+Img2D spxImageLoadMemoryLimited(const void* data, size_t size, int flags,
+    const SpxImageLimits* limits);
+void spxImageSetLimits(const SpxImageLimits* limits);
+void spxImageSetProgress(SpxImageProgress func, void* user);
+int spxImageLastError(void);
 Img2D spxImageCopy(const Img2D img);
 Img2D spxImageReshape(const Img2D img, int channels);
+Img2D spxImageResize(const Img2D img, int width, int height, int filter);
+Img2D spxImageTransform(const Img2D img, int transform);
+Img2D spxImageThumbnail(const char* path, int width, int height, int filter);
+Img2D spxImageQuantize(const Img2D img, int colors);
+Img2D spxImageDepth(const Img2D img, int depth);
+Img2D spxImageLayout(const Img2D img, int layout);
+Img2D spxImageCrop(const Img2D img, int x, int y, int width, int height);
+Img2D spxImageApply(const Img2D img, const SpxImageOp* ops, int count);
 int spxImageSave(const Img2D image, const char* path);
+int spxImageCopyFile(const char* inpath, const char* outpath, int flags);
 void spxImageFree(Img2D* image);
+uint8_t* spxImageWritable(Img2D* image);
+void spxImageSetThreads(int count);
+
+SpxImageBatch* spxImageBatchOpen(const char** paths, int count, int depth);
+int spxImageBatchNext(SpxImageBatch* batch, Img2D* image, int flags);
+void spxImageBatchClose(SpxImageBatch* batch);
+
+SpxImageDecoder* spxImageDecoderOpen(int flags);
+int spxImageDecoderPush(SpxImageDecoder* decoder, const void* data, size_t size);
+Img2D spxImageDecoderPeek(const SpxImageDecoder* decoder, int* rows);
+Img2D spxImageDecoderFinish(SpxImageDecoder* decoder);
+void spxImageDecoderClose(SpxImageDecoder* decoder);
+
+SpxImageYCbCr spxImageCreateYCbCr(int width, int height, int components, int hsub, int vsub);
+SpxImageYCbCr spxImageLoadYCbCr(const char* path);
+int spxImageSaveYCbCr(const SpxImageYCbCr image, const char* path, int quality);
+void spxImageFreeYCbCr(SpxImageYCbCr* image);
+
+SpxImageScans* spxImageScansOpen(const char* path, int width, int height);
+int spxImageScansNext(SpxImageScans* scans, Img2D* image);
+void spxImageScansClose(SpxImageScans* scans);
+Img2D spxImageLoadJpegPreview(const char* path, int width, int height, int scans, int msec);
+
+int spxImageCompare(const Img2D a, const Img2D b, SpxImageCompare* result);
+int spxImageCompareFiles(const char* apath, const char* bpath, SpxImageCompare* result);
+Img2D spxImageDiffMask(const Img2D a, const Img2D b, int threshold);
+int spxImageAnalyze(const Img2D img, SpxImageAnalysis* analysis);
+int spxImageAnalyzeFile(const char* path, SpxImageAnalysis* analysis);
 
 #ifdef SPXI_APPLICATION
 
@@ -80,6 +265,7 @@ void spxImageFree(Img2D* image);
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <assert.h>
 
 /* Core Simple Pixel Image Functions */
@@ -91,6 +277,7 @@ void spxImageFree(Img2D* image);
 #define SPXI_FORMAT_GIF         3
 #define SPXI_FORMAT_PNM         4
 #define SPXI_FORMAT_BMP         5
+#define SPXI_FORMAT_COUNT       6
 
 #define SPXI_COLOR_UNKNOWN      0
 #define SPXI_COLOR_GRAY         1
@@ -106,6 +293,17 @@ void spxImageFree(Img2D* image);
 #define SPXI_PADDING            0xFF
 #endif /* SPXI_PADDING */
 
+/* an allocator replaced with SPXI_MALLOC and SPXI_FREE must replace
+ * SPXI_REALLOC as well when its blocks can not be given to realloc */
+#ifndef SPXI_MALLOC
+#define SPXI_MALLOC(size)       malloc(size)
+#define SPXI_FREE(ptr)          free(ptr)
+#endif /* SPXI_MALLOC */
+
+#ifndef SPXI_REALLOC
+#define SPXI_REALLOC(ptr, size) realloc(ptr, size)
+#endif /* SPXI_REALLOC */
+
 #if defined SPXI_ONLY_PNG
     #define SPXI_NO_JPEG
     #define SPXI_NO_GIF
@@ -133,1206 +331,9795 @@ void spxImageFree(Img2D* image);
     #define SPXI_NO_PNM
 #endif /* SPXI_ONLY_FORMAT */
 
-/* Parsing Name Extensions and File Headers */
+#if defined SPXI_THREADS && (defined __GNUC__ || defined __clang__)
+#define SPXI_THREAD_LOCAL __thread
+#else
+#define SPXI_THREAD_LOCAL
+#endif /* SPXI_THREADS */
+
+#if defined SPXI_STATS || !defined SPXI_NO_JPEG
+#include <time.h>
+
+/* wall clock time where CLOCK_MONOTONIC is visible, which needs
+ * _POSIX_C_SOURCE >= 199309L under a strict -std=c89 build. clock() is
+ * process CPU time instead, it does not count time spent waiting on I/O
+ * and adds up the time of every thread, so the split of stage times is
+ * only meaningful with the former */
+static double spxTime(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif /* CLOCK_MONOTONIC */
+}
 
-#define spxParseHeaderPng(h) (!memcmp(h, "\211PNG\r\n\032\n", 8))
-#define spxParseHeaderJpeg(h) (h[0] == 0xFF && h[1] == 0xD8 && h[2] == 0xFF)
-#define spxParseHeaderGif(h) (!memcmp(h, "GIF87a", 6) || !memcmp(h, "GIF89a", 6))
-#define spxParseHeaderPnm(h) ((h[0] == 0x50 && (h[1] > 0x30 || h[1] < 0x37) &&\
-                                isspace(h[2])))
-#define spxParseHeaderBmp(h) (h[0] == 0x42 && h[1] == 0x4D)
+#endif /* SPXI_STATS || SPXI_NO_JPEG */
 
-static int spxStrcmpLower(const char* s1, const char* s2)
+/* Optional Per-Stage Statistics */
+
+#ifdef SPXI_STATS
+
+#define SPXI_STAGE_IO           0
+#define SPXI_STAGE_CODEC        1
+#define SPXI_STAGE_CONVERT      2
+#define SPXI_STAGE_ALLOC        3
+
+#define SPXI_STATS_DEPTH        8
+
+#if defined SPXI_THREADS && !defined __GNUC__ && !defined __clang__
+#error "SPXI_STATS needs thread local storage to be used with SPXI_THREADS"
+#endif /* SPXI_THREADS */
+
+/* the call in progress is tracked per thread, calls that run on pool
+ * workers or on other threads only meet in the tables of each format */
+static SPXI_THREAD_LOCAL struct SpxStatsState {
+    SpxImageStats call;
+    int format;
+    int depth;
+    int stage;
+    int stack[SPXI_STATS_DEPTH];
+    int top;
+    double mark;
+} spxStats;
+
+static struct SpxStatsTables {
+    SpxImageStats last[SPXI_FORMAT_COUNT];
+    SpxImageStats total[SPXI_FORMAT_COUNT];
+} spxStatsTables;
+
+#ifdef SPXI_THREADS
+#include <pthread.h>
+static pthread_mutex_t spxStatsLock = PTHREAD_MUTEX_INITIALIZER;
+#define spxStatsLockTables() pthread_mutex_lock(&spxStatsLock)
+#define spxStatsUnlockTables() pthread_mutex_unlock(&spxStatsLock)
+#else
+#define spxStatsLockTables()
+#define spxStatsUnlockTables()
+#endif /* SPXI_THREADS */
+
+static void spxStatsAccumulate(void)
 {
-    while (*s1 && *s2) {
-        if (tolower(*s1++) != *s2++) {
-            return 0;
-        }
+    double now = spxTime(), dt = now - spxStats.mark;
+    switch (spxStats.stage) {
+        case SPXI_STAGE_IO: spxStats.call.timeIO += dt; break;
+        case SPXI_STAGE_CODEC: spxStats.call.timeCodec += dt; break;
+        case SPXI_STAGE_CONVERT: spxStats.call.timeConvert += dt; break;
+        case SPXI_STAGE_ALLOC: spxStats.call.timeAlloc += dt; break;
     }
-    return 1;
+    spxStats.mark = now;
 }
 
-static int spxParseExtension(const char* path)
+static void spxStatsBegin(const int format)
 {
-    size_t i, dotpos = 0;
-    for (i = 0; path[i]; ++i) {
-        if (path[i] == '.') {
-            dotpos = i;
-        }
+    if (spxStats.depth++) {
+        return;
     }
 
-    if (dotpos) {
-        const char* ext = path + dotpos + 1;
-        if (spxStrcmpLower(ext, "png")) {
-            return SPXI_FORMAT_PNG;
-        } else if (spxStrcmpLower(ext, "jpeg") || spxStrcmpLower(ext, "jpg")) {
-            return SPXI_FORMAT_JPEG;
-        } else if (spxStrcmpLower(ext, "gif")) {
-            return SPXI_FORMAT_GIF;
-        } else if (spxStrcmpLower(ext, "pnm") || spxStrcmpLower(ext, "ppm") ||
-                    spxStrcmpLower(ext, "pgm") || spxStrcmpLower(ext, "pbm")) {
-            return SPXI_FORMAT_PNM;
-        } else if (spxStrcmpLower(ext, "bmp")) {
-            return SPXI_FORMAT_BMP;
-        }
-    }
+    memset(&spxStats.call, 0, sizeof(SpxImageStats));
+    spxStats.call.calls = 1;
+    spxStats.format = format;
+    spxStats.stage = SPXI_STAGE_IO;
+    spxStats.top = 0;
+    spxStats.mark = spxTime();
+}
 
-    return SPXI_FORMAT_UNKNOWN;
+static void spxStatsStage(const int stage)
+{
+    if (spxStats.depth) {
+        spxStatsAccumulate();
+        spxStats.stage = stage;
+    }
 }
 
-static int spxParseHeader(const uint8_t* header)
+static void spxStatsPush(const int stage)
 {
-    if (spxParseHeaderPng(header)) {
-        return SPXI_FORMAT_PNG;
-    } else if (spxParseHeaderJpeg(header)) {
-        return SPXI_FORMAT_JPEG;
-    } else if (spxParseHeaderGif(header)) {
-        return SPXI_FORMAT_GIF;
-    } else if (spxParseHeaderPnm(header)) {
-        return SPXI_FORMAT_PNM;
-    } else if (spxParseHeaderBmp(header)) {
-        return SPXI_FORMAT_BMP;
+    if (spxStats.depth && spxStats.top < SPXI_STATS_DEPTH) {
+        spxStatsAccumulate();
+        spxStats.stack[spxStats.top++] = spxStats.stage;
+        spxStats.stage = stage;
     }
+}
 
-    return SPXI_FORMAT_UNKNOWN;
+static void spxStatsPop(void)
+{
+    if (spxStats.depth && spxStats.top > 0) {
+        spxStatsAccumulate();
+        spxStats.stage = spxStats.stack[--spxStats.top];
+    }
 }
 
-static int spxParseFormat(const char* path)
+static void spxStatsBytes(const size_t read, const size_t written)
 {
-    int format;
-    uint8_t header[SPXI_HEADER_SIZE];
-    FILE* file = fopen(path, "rb");
+    spxStats.call.bytesRead += read;
+    spxStats.call.bytesWritten += written;
+}
 
-    if (!file) {
-        fprintf(stderr, "spximg could not open file: '%s'\n", path);
-        return SPXI_FORMAT_NULL;
+static void spxStatsEnd(void)
+{
+    SpxImageStats* total;
+    if (!spxStats.depth || --spxStats.depth) {
+        return;
     }
 
-    fread(header, SPXI_HEADER_SIZE, sizeof(uint8_t), file);
-    fclose(file);
+    spxStatsAccumulate();
+    spxStatsLockTables();
+    spxStatsTables.last[spxStats.format] = spxStats.call;
+    total = spxStatsTables.total + spxStats.format;
+    total->calls += spxStats.call.calls;
+    total->allocs += spxStats.call.allocs;
+    total->bytesRead += spxStats.call.bytesRead;
+    total->bytesWritten += spxStats.call.bytesWritten;
+    total->timeIO += spxStats.call.timeIO;
+    total->timeCodec += spxStats.call.timeCodec;
+    total->timeConvert += spxStats.call.timeConvert;
+    total->timeAlloc += spxStats.call.timeAlloc;
+    if (spxStats.call.peakBuffer > total->peakBuffer) {
+        total->peakBuffer = spxStats.call.peakBuffer;
+    }
+    spxStatsUnlockTables();
+}
 
-    format = spxParseExtension(path);
-    if ((format == SPXI_FORMAT_PNG && spxParseHeaderPng(header)) ||
-        (format == SPXI_FORMAT_JPEG && spxParseHeaderJpeg(header)) ||
-        (format == SPXI_FORMAT_GIF && spxParseHeaderGif(header)) ||
-        (format == SPXI_FORMAT_PNM && spxParseHeaderPnm(header)) ||
-        (format == SPXI_FORMAT_BMP && spxParseHeaderBmp(header))) {
-        return format;
+static void* spxStatsAlloc(void* ptr, const size_t size)
+{
+    spxStatsPush(SPXI_STAGE_ALLOC);
+    ptr = ptr ? SPXI_REALLOC(ptr, size) : SPXI_MALLOC(size);
+    spxStatsPop();
+    if (!spxStats.depth) {
+        return ptr;
     }
 
-    return spxParseHeader(header);
+    ++spxStats.call.allocs;
+    if (size > spxStats.call.peakBuffer) {
+        spxStats.call.peakBuffer = size;
+    }
+    return ptr;
 }
 
-/* Image Reshape Implementation */
-
-static Img2D spxImageReshape1to4(const Img2D img)
+int spxImageStatsGet(int format, SpxImageStats* last, SpxImageStats* total)
 {
-	Img2D ret;
-	int i, size = img.width * img.height;
-    assert(img.channels == 1);
+    if (format < 0 || format >= SPXI_FORMAT_COUNT) {
+        return EXIT_FAILURE;
+    }
 
-	ret.channels = 4;
-	ret.width = img.width;
-	ret.height = img.height;
-	ret.pixbuf = (uint8_t*)malloc(size << 2);
+    spxStatsLockTables();
+    if (last) {
+        *last = spxStatsTables.last[format];
+    }
 
-    for (i = 0; i < size; ++i) {
-        uint8_t* dst = ret.pixbuf + (i << 2);
-        dst[1] = img.pixbuf[i];
-        dst[2] = img.pixbuf[i];
-        dst[3] = img.pixbuf[i];
-        dst[3] = SPXI_PADDING;
-	}
+    if (total) {
+        *total = spxStatsTables.total[format];
+    }
+    spxStatsUnlockTables();
 
-	return ret;
+    return EXIT_SUCCESS;
 }
 
-static Img2D spxImageReshape2to4(const Img2D img)
-{ 
-	Img2D ret;
-	int i, size = img.width * img.height;
-    assert(img.channels == 2);
+void spxImageStatsReset(void)
+{
+    spxStatsLockTables();
+    memset(&spxStatsTables, 0, sizeof(spxStatsTables));
+    spxStatsUnlockTables();
+}
 
-	ret.channels = 4;
-	ret.width = img.width;
-	ret.height = img.height;
-	ret.pixbuf = (uint8_t*)malloc(size << 2);
+#define spxMalloc(size) spxStatsAlloc(NULL, size)
+#define spxRealloc(ptr, size) spxStatsAlloc(ptr, size)
 
-    for (i = 0; i < size; ++i) {
-        uint8_t* src = img.pixbuf + (i << 1);
-        uint8_t* dst = ret.pixbuf + (i << 2);
-        dst[0] = src[0];
-        dst[1] = src[0];
-        dst[2] = src[0];
-        dst[3] = src[1];
-	}
+#else
+
+#define spxStatsBegin(format)
+#define spxStatsStage(stage)
+#define spxStatsPush(stage)
+#define spxStatsPop()
+#define spxStatsBytes(read, written)
+#define spxStatsEnd()
+
+#define spxMalloc(size) SPXI_MALLOC(size)
+#define spxRealloc(ptr, size) SPXI_REALLOC(ptr, size)
+
+#endif /* SPXI_STATS */
 
+/* with SPXI_SHARED pixel buffers carry a reference count in front of
+ * them, copies share the buffer until one asks for it to write into.
+ * Only buffers spximg allocated have one, which is told by their stride
+ * of 0, so images filled in by hand or made of rows inside another
+ * buffer must set a stride, their row size if they are packed */
+#ifdef SPXI_SHARED
+
+typedef struct SpxBuffer {
+    long refs;
+    long reserved;
+} SpxBuffer;
+
+#if defined __GNUC__ || defined __clang__
+#define spxAtomicAdd(ptr, n) __sync_add_and_fetch(ptr, n)
+#elif defined SPXI_THREADS
+#include <pthread.h>
+#define SPXI_ATOMIC_LOCK
+static pthread_mutex_t spxAtomicLock = PTHREAD_MUTEX_INITIALIZER;
+
+static long spxAtomicAdd(long* ptr, const long n)
+{
+    long ret;
+    pthread_mutex_lock(&spxAtomicLock);
+    ret = *ptr += n;
+    pthread_mutex_unlock(&spxAtomicLock);
     return ret;
 }
+#else
+#define spxAtomicAdd(ptr, n) (*(ptr) += (n))
+#endif /* __GNUC__ */
 
-static Img2D spxImageReshape3to4(const Img2D img)
+#define spxPixbufBuffer(pixbuf) ((SpxBuffer*)(pixbuf) - 1)
+#define spxPixbufOwned(img) ((img).pixbuf && !(img).stride)
+
+static uint8_t* spxPixbufAlloc(const size_t size)
 {
-	Img2D ret;
-	int i, size = img.width * img.height;
-    assert(img.channels == 3);
+    SpxBuffer* buffer = (SpxBuffer*)spxMalloc(sizeof(SpxBuffer) + size);
+    if (!buffer) {
+        return NULL;
+    }
 
-	ret.channels = 4;
-	ret.width = img.width;
-	ret.height = img.height;
-	ret.pixbuf = (uint8_t*)malloc(size << 2);
+    buffer->refs = 1;
+    return (uint8_t*)(buffer + 1);
+}
 
-    for (i = 0; i < size; ++i) {
-        uint8_t* src = img.pixbuf + i * 3;
-        uint8_t* dst = ret.pixbuf + (i << 2);
-        dst[0] = src[0];
-        dst[1] = src[1];
-        dst[2] = src[2];
-        dst[3] = SPXI_PADDING;
-	}
+#else
+
+#define spxPixbufAlloc(size) (uint8_t*)spxMalloc(size)
 
-	return ret;
+#endif /* SPXI_SHARED */
+
+/* 16 bit images keep two bytes per sample in host byte order, a depth
+ * of 0 counts as 8 bits so images filled in by hand keep working */
+#define spxSampleSize(img) ((img).depth > SPXI_BIT_DEPTH ? 2 : 1)
+
+/* stride is the distance in bytes from one row to the next, or from one
+ * row of a plane to the next in planar images, a stride of 0 means rows
+ * are packed. With SPXI_SHARED it also marks the buffers spximg
+ * allocated, so images filled in by hand must set it even when packed */
+#define spxImageRowSize(img) ((size_t)(img).width * spxSampleSize(img) * \
+    ((img).layout == SPXI_LAYOUT_PLANAR ? 1 : (img).channels))
+#define spxImageStride(img) ((img).stride ? (img).stride : spxImageRowSize(img))
+#define spxImagePacked(img) (!(img).stride || (img).stride == spxImageRowSize(img))
+#define spxImageRows(img) \
+    ((size_t)(img).height * ((img).layout == SPXI_LAYOUT_PLANAR ? (img).channels : 1))
+
+static int spxLittleEndian(void)
+{
+    const uint16_t one = 1;
+    return *(const uint8_t*)&one;
 }
 
-static Img2D spxImageReshape4to3(const Img2D img)
+#define SPXI_PALETTE_SIZE       (SPXI_PALETTE_COLORS * 4)
+
+/* indexed images keep one byte per pixel and their RGBA palette right
+ * after the pixels, in the same buffer, so it is copied and freed along */
+static Img2D spxIndexedCreate(const int width, const int height)
 {
-    Img2D ret;
-	int i, size = img.width * img.height;
-    assert(img.channels == 4);
+    Img2D img = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    size_t size = (size_t)width * height;
+    img.pixbuf = spxPixbufAlloc(size + SPXI_PALETTE_SIZE);
+    if (img.pixbuf) {
+        img.width = width;
+        img.height = height;
+        img.channels = 1;
+        img.palette = img.pixbuf + size;
+        memset(img.palette, 0, SPXI_PALETTE_SIZE);
+    }
+    return img;
+}
 
-    ret.channels = 3;
-    ret.width = img.width;
-    ret.height = img.height;
-    ret.pixbuf = (uint8_t*)malloc(size * 3);
+/* copy an image into a buffer of its own with packed rows, the form
+ * every operation works on */
+static Img2D spxImagePack(const Img2D img)
+{
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    const size_t size = spxImageRowSize(img), stride = spxImageStride(img);
+    const size_t rows = spxImageRows(img);
+    size_t y;
 
-    for (i = 0; i < size; ++i) {
-        uint8_t* src = img.pixbuf + (i << 2);
-        uint8_t* dst = ret.pixbuf + i * 3;
-        dst[0] = src[0];
-        dst[1] = src[1];
-        dst[2] = src[2];
+    if (!img.pixbuf) {
+        return ret;
+    } else if (img.palette) {
+        ret = spxIndexedCreate(img.width, img.height);
+        if (ret.palette) {
+            memcpy(ret.palette, img.palette, SPXI_PALETTE_SIZE);
+        }
+    } else {
+        ret.width = img.width;
+        ret.height = img.height;
+        ret.channels = img.channels;
+        ret.depth = img.depth;
+        ret.layout = img.layout;
+        ret.pixbuf = spxPixbufAlloc(size * rows);
     }
 
+    if (ret.pixbuf && stride == size) {
+        memcpy(ret.pixbuf, img.pixbuf, size * rows);
+    } else if (ret.pixbuf) {
+        for (y = 0; y < rows; ++y) {
+            memcpy(ret.pixbuf + y * size, img.pixbuf + y * stride, size);
+        }
+    }
     return ret;
 }
 
-static Img2D spxImageReshape2to3(const Img2D img)
-{ 
-    Img2D ret;
-    int i, size = img.width * img.height;
-    assert(img.channels == 2);
+/* Decoding Limits */
 
-    ret.channels = 3;
-    ret.width = img.width;
-    ret.height = img.height;
-    ret.pixbuf = (uint8_t*)malloc(size * 3);
+#ifndef SPXI_LIMIT_WIDTH
+#define SPXI_LIMIT_WIDTH        0
+#endif /* SPXI_LIMIT_WIDTH */
 
-    for (i = 0; i < size; ++i) {
-        uint8_t p = img.pixbuf[i << 1];
-        uint8_t* dst = img.pixbuf + i * 3;
-        dst[0] = p;
-        dst[1] = p;
-        dst[2] = p;
-    }
+#ifndef SPXI_LIMIT_HEIGHT
+#define SPXI_LIMIT_HEIGHT       0
+#endif /* SPXI_LIMIT_HEIGHT */
 
-    return ret;  
-}
+#ifndef SPXI_LIMIT_PIXELS
+#define SPXI_LIMIT_PIXELS       0
+#endif /* SPXI_LIMIT_PIXELS */
 
-static Img2D spxImageReshape1to3(const Img2D img)
-{
-    Img2D ret;
-    int i, size = img.width * img.height;
-    assert(img.channels == 1);
+#ifndef SPXI_LIMIT_BYTES
+#define SPXI_LIMIT_BYTES        0
+#endif /* SPXI_LIMIT_BYTES */
 
-    ret.channels = 3;
-    ret.width = img.width;
-    ret.height = img.height;
-    ret.pixbuf = (uint8_t*)malloc(size * 3);
+static SpxImageLimits spxLimits = {
+    SPXI_LIMIT_WIDTH, SPXI_LIMIT_HEIGHT, SPXI_LIMIT_PIXELS, SPXI_LIMIT_BYTES
+};
 
-    for (i = 0; i < size; ++i) {
-        uint8_t* dst = ret.pixbuf + i * 3;
-        dst[0] = img.pixbuf[i];
-        dst[1] = img.pixbuf[i];
-        dst[2] = img.pixbuf[i];
+/* limits given to the load in progress and why the last one failed,
+ * both kept per calling thread */
+static SPXI_THREAD_LOCAL const SpxImageLimits* spxLimitsCall;
+static SPXI_THREAD_LOCAL int spxLimitsError;
+
+#ifndef SPXI_PROGRESS_ROWS
+#define SPXI_PROGRESS_ROWS      64
+#endif /* SPXI_PROGRESS_ROWS */
+
+/* rows a codec went through and whether its callback asked to stop,
+ * shared with the workers it hands bands of rows to */
+typedef struct SpxProgress {
+    SpxImageProgress func;
+    void* user;
+    int total;
+    int pass;
+    int rows;
+    int next;
+    int cancel;
+} SpxProgress;
+
+static SPXI_THREAD_LOCAL SpxImageProgress spxProgressFunc;
+static SPXI_THREAD_LOCAL void* spxProgressUser;
+static SPXI_THREAD_LOCAL SpxProgress* spxProgressCall;
+
+/* bytes of an image, or 0 when a dimension is not positive, the whole
+ * buffer could overflow a size_t or a row takes more than an eighth of
+ * an int, which keeps stored rows of every format, often wider than the
+ * decoded ones, in an int */
+static size_t spxImageBytes(const int width, const int height, const int channels,
+    const int samplesize)
+{
+    size_t row;
+    if (width <= 0 || height <= 0 || channels <= 0 || samplesize <= 0 ||
+        (size_t)width > (size_t)(INT_MAX >> 3) / channels / samplesize) {
+        return 0;
     }
 
-    return ret;
+    row = (size_t)width * channels * samplesize;
+    return (size_t)height > ((size_t)-1 >> 1) / row ? 0 : row * height;
 }
 
-static Img2D spxImageReshape4to2(const Img2D img)
+/* called by every loader once the header gives the decoded size and
+ * before anything that large is allocated */
+static int spxImageAdmit(const int width, const int height, const int channels,
+    const int samplesize, const char* path)
 {
-    Img2D ret;
-    int i, size = img.width * img.height;
-    assert(img.channels == 4);
-
-    ret.channels = 2;
-    ret.width = img.width;
-    ret.height = img.height;
-    ret.pixbuf = (uint8_t*)malloc(size << 1);
+    const SpxImageLimits* limits = spxLimitsCall ? spxLimitsCall : &spxLimits;
+    const size_t bytes = spxImageBytes(width, height, channels, samplesize);
+    if (!bytes || (limits->width > 0 && width > limits->width) ||
+        (limits->height > 0 && height > limits->height) ||
+        (limits->pixels && (size_t)width * height > limits->pixels) ||
+        (limits->bytes && bytes > limits->bytes)) {
+        fprintf(stderr, "spximg image of %dx%d exceeds decoding limits: %s\n",
+            width, height, path
+        );
+        spxLimitsError = SPXI_ERROR_LIMIT;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
-    for (i = 0; i < size; ++i) {
-        uint8_t* src = img.pixbuf + (i << 2);
-        uint8_t* dst = ret.pixbuf + (i << 1);
-        dst[0] = (uint8_t)(((int)src[0] + (int)src[1] + (int)src[2]) / 3);
-        dst[1] = src[4];
+/* a failed load that was not stopped by the limits failed to decode */
+static Img2D spxImageChecked(const Img2D image)
+{
+    if (!image.pixbuf && spxLimitsError == SPXI_ERROR_NONE) {
+        spxLimitsError = SPXI_ERROR_DECODE;
     }
+    return image;
+}
 
-    return ret;
+void spxImageSetLimits(const SpxImageLimits* limits)
+{
+    const SpxImageLimits defaults = {
+        SPXI_LIMIT_WIDTH, SPXI_LIMIT_HEIGHT, SPXI_LIMIT_PIXELS, SPXI_LIMIT_BYTES
+    };
+    spxLimits = limits ? *limits : defaults;
 }
 
-static Img2D spxImageReshape3to2(const Img2D img)
+int spxImageLastError(void)
 {
-    Img2D ret;
-    int i, size = img.width * img.height;
-    assert(img.channels == 3);
+    return spxLimitsError;
+}
 
-    ret.channels = 2;
-    ret.width = img.width;
-    ret.height = img.height;
-    ret.pixbuf = (uint8_t*)malloc(size << 1);
+static size_t spxFileRead(void* dst, size_t size, size_t count, FILE* file)
+{
+    spxStatsPush(SPXI_STAGE_IO);
+    count = fread(dst, size, count, file);
+    spxStatsPop();
+    return count;
+}
 
-    for (i = 0; i < size; ++i) {
-        uint8_t* src = img.pixbuf + i * 3;
-        uint8_t* dst = ret.pixbuf + (i << 1);
-        dst[0] = (uint8_t)(((int)src[0] + (int)src[1] + (int)src[2]) / 3);
-        dst[1] = SPXI_PADDING;
-    }
+static size_t spxFileWrite(const void* src, size_t size, size_t count, FILE* file)
+{
+    spxStatsPush(SPXI_STAGE_IO);
+    count = fwrite(src, size, count, file);
+    spxStatsPop();
+    return count;
+}
 
-    return ret;
+static int spxFileClose(FILE* file, const int written)
+{
+#ifdef SPXI_STATS
+    long size;
+    spxStatsStage(SPXI_STAGE_IO);
+    size = ftell(file);
+    if (size > 0) {
+        spxStatsBytes(written ? 0 : (size_t)size, written ? (size_t)size : 0);
+    }
+#else
+    (void)written;
+#endif /* SPXI_STATS */
+    return fclose(file);
 }
 
-static Img2D spxImageReshape1to2(const Img2D img)
+/* loaders read through a stream over either an open file or a buffer
+ * that is already in memory */
+typedef struct SpxStream {
+    FILE* file;
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+} SpxStream;
+
+static SpxStream spxStreamFile(FILE* file)
 {
-    Img2D ret;
-    int i, size = img.width * img.height;
-    assert(img.channels == 1);
+    SpxStream stream;
+    stream.file = file;
+    stream.data = NULL;
+    stream.size = 0;
+    stream.pos = 0;
+    return stream;
+}
 
-    ret.channels = 2;
-    ret.width = img.width;
-    ret.height = img.height;
-    ret.pixbuf = (uint8_t*)malloc(size << 1);
+static SpxStream spxStreamMemory(const uint8_t* data, const size_t size)
+{
+    SpxStream stream;
+    stream.file = NULL;
+    stream.data = data;
+    stream.size = size;
+    stream.pos = 0;
+    return stream;
+}
 
-    for (i = 0; i < size; ++i) {
-        uint8_t* dst = ret.pixbuf + (i << 1);
-        dst[0] = img.pixbuf[i];
-        dst[1] = SPXI_PADDING;
+static size_t spxStreamRead(void* dst, size_t size, size_t count, SpxStream* stream)
+{
+    size_t left;
+    if (stream->file) {
+        return spxFileRead(dst, size, count, stream->file);
     }
 
-    return ret;
+    left = size ? (stream->size - stream->pos) / size : 0;
+    count = count < left ? count : left;
+    memcpy(dst, stream->data + stream->pos, size * count);
+    stream->pos += size * count;
+    return count;
 }
 
-static Img2D spxImageReshape4or3to1(const Img2D img)
+static char* spxStreamGets(char* line, const int count, SpxStream* stream)
 {
-    Img2D ret;
-    int i, size = img.width * img.height;
-    assert(img.channels == 4 || img.channels == 3);
+    int i = 0;
+    if (stream->file) {
+        return fgets(line, count, stream->file);
+    }
 
-    ret.channels = 1;
-    ret.width = img.width;
-    ret.height = img.height;
-    ret.pixbuf = (uint8_t*)malloc(size);
+    if (stream->pos >= stream->size || count < 2) {
+        return NULL;
+    }
 
-    for (i = 0; i < size; ++i) {
-        uint8_t* src = img.pixbuf + i * img.channels;
-        ret.pixbuf[i] = (uint8_t)(((int)src[0] + (int)src[1] + (int)src[2]) / 3);
+    while (i < count - 1 && stream->pos < stream->size) {
+        line[i] = (char)stream->data[stream->pos++];
+        if (line[i++] == '\n') {
+            break;
+        }
     }
 
-    return ret;
+    line[i] = 0;
+    return line;
 }
 
-static Img2D spxImageReshape2to1(const Img2D img)
+static int spxStreamGetc(SpxStream* stream)
 {
-    Img2D ret;
-    int i, size = img.width * img.height;
-    assert(img.channels == 2);
-    
-    ret.channels = 1;
-    ret.width = img.width;
-    ret.height = img.height;
-    ret.pixbuf = (uint8_t*)malloc(size);
-    
-    for (i = 0; i < size; ++i) {
-        ret.pixbuf[i] = img.pixbuf[i << 1];
+    if (stream->file) {
+        return fgetc(stream->file);
     }
-
-    return ret;
+    return stream->pos < stream->size ? stream->data[stream->pos++] : EOF;
 }
 
-static Img2D (*spxImageReshapeFunctions[4][4])(const Img2D) = {
-    {&spxImageCopy, &spxImageReshape1to2, &spxImageReshape1to3, &spxImageReshape1to4},
-    {&spxImageReshape2to1, &spxImageCopy, &spxImageReshape2to3, &spxImageReshape2to4},
-    {&spxImageReshape4or3to1, &spxImageReshape3to2, &spxImageCopy, &spxImageReshape3to4},
-    {&spxImageReshape4or3to1, &spxImageReshape4to2, &spxImageReshape4to3, &spxImageCopy}
-};
+static long spxStreamTell(SpxStream* stream)
+{
+    return stream->file ? ftell(stream->file) : (long)stream->pos;
+}
 
-Img2D spxImageReshape(const Img2D img, const int channels)
+static int spxStreamSeek(SpxStream* stream, const long offset, const int whence)
 {
-    Img2D ret = {NULL, 0, 0, 0};
-    if (img.channels > 0 && img.channels <= 4 && channels > 0 && channels <= 4) {
-        return spxImageReshapeFunctions[img.channels - 1][channels - 1](img);
+    long pos;
+    if (stream->file) {
+        return fseek(stream->file, offset, whence);
     }
 
-    fprintf(
-        stderr, "spximg does not support reshape from %d to %d channels\n",
-        img.channels, channels
-    );
+    pos = offset + (whence == SEEK_CUR ? (long)stream->pos :
+        whence == SEEK_END ? (long)stream->size : 0);
+    if (pos < 0 || pos > (long)stream->size) {
+        return -1;
+    }
 
-    return ret;
+    stream->pos = (size_t)pos;
+    return 0;
+}
+
+#if (defined __unix__ || defined __APPLE__) && (defined __APPLE__ ||\
+    defined _GNU_SOURCE || defined _DEFAULT_SOURCE ||\
+    (defined _POSIX_C_SOURCE && _POSIX_C_SOURCE >= 200809L) ||\
+    (defined _XOPEN_SOURCE && _XOPEN_SOURCE >= 500))
+#define SPXI_PREAD
+#include <unistd.h>
+#endif /* SPXI_PREAD */
+
+/* bands of a stream can be read from several threads at once */
+static int spxStreamConcurrent(const SpxStream* stream)
+{
+#ifdef SPXI_PREAD
+    (void)stream;
+    return 1;
+#else
+    return !stream->file;
+#endif /* SPXI_PREAD */
+}
+
+/* read size bytes at offset without statistics, leaving the stream in
+ * place when concurrent, whatever could not be read is zeroed */
+static size_t spxStreamReadAt(SpxStream* stream, void* dst, const size_t size,
+    const long offset)
+{
+    size_t done = 0;
+    if (!stream->file) {
+        if (offset >= 0 && (size_t)offset < stream->size) {
+            done = stream->size - (size_t)offset;
+            done = done < size ? done : size;
+            memcpy(dst, stream->data + offset, done);
+        }
+    } else {
+#ifdef SPXI_PREAD
+        ssize_t n;
+        while (done < size && (n = pread(fileno(stream->file), (uint8_t*)dst + done,
+            size - done, (off_t)offset + (off_t)done)) > 0) {
+            done += (size_t)n;
+        }
+#else
+        if (!fseek(stream->file, offset, SEEK_SET)) {
+            done = fread(dst, 1, size, stream->file);
+        }
+#endif /* SPXI_PREAD */
+    }
+
+    memset((uint8_t*)dst + done, 0, size - done);
+    return done;
+}
+
+/* Optional Multithreading and SIMD */
+
+#if !defined SPXI_NO_SIMD && (defined __SSE2__ || defined _M_X64)
+    #define SPXI_SSE2
+    #include <emmintrin.h>
+#endif /* SPXI_NO_SIMD */
+
+typedef void (*SpxParallelFunc)(void* arg, int begin, int end);
+
+#ifdef SPXI_THREADS
+#include <pthread.h>
+#include <unistd.h>
+
+#ifndef SPXI_THREAD_MAX
+#define SPXI_THREAD_MAX         64
+#endif /* SPXI_THREAD_MAX */
+
+typedef struct SpxParallelTask {
+    SpxParallelFunc func;
+    void* arg;
+    SpxProgress* progress;
+    int begin;
+    int end;
+} SpxParallelTask;
+
+/* workers are started on first use and then wait for more bands, so
+ * small conversions do not pay for thread creation on every call */
+static pthread_mutex_t spxPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spxPoolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t spxPoolDone = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t spxProgressLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct SpxThreadPool {
+    pthread_t threads[SPXI_THREAD_MAX];
+    SpxParallelTask* tasks;
+    int started;
+    int busy;
+    int next;
+    int count;
+    int pending;
+    int forked;
+} spxPool;
+
+static int spxThreadLimit = 0;
+
+static void* spxPoolMain(void* data)
+{
+    (void)data;
+    pthread_mutex_lock(&spxPoolLock);
+    for (;;) {
+        SpxParallelTask* task;
+        while (spxPool.next >= spxPool.count) {
+            pthread_cond_wait(&spxPoolWake, &spxPoolLock);
+        }
+
+        task = spxPool.tasks + spxPool.next++;
+        pthread_mutex_unlock(&spxPoolLock);
+        spxProgressCall = task->progress;
+        task->func(task->arg, task->begin, task->end);
+        spxProgressCall = NULL;
+        pthread_mutex_lock(&spxPoolLock);
+        if (!--spxPool.pending) {
+            pthread_cond_signal(&spxPoolDone);
+        }
+    }
+    return NULL;
+}
+
+/* worker threads do not survive fork, the child starts a new pool */
+static void spxPoolFork(void)
+{
+    pthread_mutex_init(&spxPoolLock, NULL);
+    pthread_cond_init(&spxPoolWake, NULL);
+    pthread_cond_init(&spxPoolDone, NULL);
+    pthread_mutex_init(&spxProgressLock, NULL);
+#ifdef SPXI_STATS
+    pthread_mutex_init(&spxStatsLock, NULL);
+#endif /* SPXI_STATS */
+#ifdef SPXI_ATOMIC_LOCK
+    pthread_mutex_init(&spxAtomicLock, NULL);
+#endif /* SPXI_ATOMIC_LOCK */
+    spxPool.started = spxPool.busy = 0;
+    spxPool.next = spxPool.count = spxPool.pending = 0;
+}
+
+static int spxThreadCount(void)
+{
+    long n = spxThreadLimit > 0 ? spxThreadLimit : sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > SPXI_THREAD_MAX ? SPXI_THREAD_MAX : (int)n;
+}
+
+void spxImageSetThreads(int count)
+{
+    spxThreadLimit = count > 0 ? count : 0;
+}
+
+/* split [0, count) in contiguous bands of at least grain items, calls
+ * made while the pool is busy, from a worker or another thread, run
+ * serially on the calling thread */
+static void spxParallelFor(const int count, const int grain,
+    SpxParallelFunc func, void* arg)
+{
+    int i, n = spxThreadCount();
+    SpxParallelTask tasks[SPXI_THREAD_MAX];
+
+    if (n > count / (grain > 0 ? grain : 1)) {
+        n = count / (grain > 0 ? grain : 1);
+    }
+
+    if (n <= 1) {
+        func(arg, 0, count);
+        return;
+    }
+
+    pthread_mutex_lock(&spxPoolLock);
+    if (spxPool.busy) {
+        pthread_mutex_unlock(&spxPoolLock);
+        func(arg, 0, count);
+        return;
+    }
+
+    if (!spxPool.forked) {
+        spxPool.forked = !pthread_atfork(NULL, NULL, &spxPoolFork);
+    }
+
+    while (spxPool.started < n - 1 && !pthread_create(
+        spxPool.threads + spxPool.started, NULL, &spxPoolMain, NULL)) {
+        pthread_detach(spxPool.threads[spxPool.started++]);
+    }
+
+    n = n < spxPool.started + 1 ? n : spxPool.started + 1;
+    for (i = 0; i < n; ++i) {
+        tasks[i].func = func;
+        tasks[i].arg = arg;
+        tasks[i].progress = spxProgressCall;
+        tasks[i].begin = (int)((long)count * i / n);
+        tasks[i].end = (int)((long)count * (i + 1) / n);
+    }
+
+    spxPool.busy = 1;
+    spxPool.tasks = tasks;
+    spxPool.next = 1;
+    spxPool.count = n;
+    spxPool.pending = n - 1;
+    pthread_cond_broadcast(&spxPoolWake);
+    pthread_mutex_unlock(&spxPoolLock);
+
+    func(arg, tasks[0].begin, tasks[0].end);
+
+    pthread_mutex_lock(&spxPoolLock);
+    while (spxPool.pending) {
+        pthread_cond_wait(&spxPoolDone, &spxPoolLock);
+    }
+    spxPool.count = spxPool.next = 0;
+    spxPool.busy = 0;
+    pthread_mutex_unlock(&spxPoolLock);
+}
+
+#else
+
+static int spxThreadCount(void)
+{
+    return 1;
+}
+
+void spxImageSetThreads(int count)
+{
+    (void)count;
+}
+
+static void spxParallelFor(const int count, const int grain,
+    SpxParallelFunc func, void* arg)
+{
+    (void)grain;
+    func(arg, 0, count);
+}
+
+#endif /* SPXI_THREADS */
+
+/* Progress and Cancellation */
+
+void spxImageSetProgress(SpxImageProgress func, void* user)
+{
+    spxProgressFunc = func;
+    spxProgressUser = user;
+}
+
+/* count the rows of all passes of the codec starting on the calling
+ * thread, unless the codec that called it is already counting */
+static void spxProgressBegin(SpxProgress* progress, const int rows, const int passes)
+{
+    const int total = rows * passes;
+    progress->func = spxProgressCall ? NULL : spxProgressFunc;
+    progress->user = spxProgressUser;
+    progress->total = total;
+    progress->pass = rows;
+    progress->rows = 0;
+    progress->next = total < SPXI_PROGRESS_ROWS ? total : SPXI_PROGRESS_ROWS;
+    progress->cancel = 0;
+    if (progress->func) {
+        spxProgressCall = progress;
+    }
+}
+
+/* nonzero when the callback cancelled, which spxImageLastError reports */
+static int spxProgressEnd(SpxProgress* progress)
+{
+    if (spxProgressCall == progress) {
+        spxProgressCall = NULL;
+    }
+    if (progress->cancel) {
+        spxLimitsError = SPXI_ERROR_CANCEL;
+    }
+    return progress->cancel;
+}
+
+/* add rows finished by any thread, or with add 0 set how far the codec
+ * got, calling back every SPXI_PROGRESS_ROWS rows and after the last,
+ * one call at a time; nonzero once cancelled */
+static int spxProgressUpdate(const int rows, const int add)
+{
+    SpxProgress* progress = spxProgressCall;
+    int cancel;
+    if (!progress) {
+        return 0;
+    }
+
+#ifdef SPXI_THREADS
+    pthread_mutex_lock(&spxProgressLock);
+#endif /* SPXI_THREADS */
+    progress->rows = add ? progress->rows + rows : rows;
+    if (!progress->cancel && progress->rows >= progress->next) {
+        const int next = (progress->rows / SPXI_PROGRESS_ROWS + 1) * SPXI_PROGRESS_ROWS;
+        progress->next = progress->rows >= progress->total ? INT_MAX :
+            next < progress->total ? next : progress->total;
+        progress->cancel = progress->func(progress->user, progress->rows, progress->total);
+    }
+    cancel = progress->cancel;
+#ifdef SPXI_THREADS
+    pthread_mutex_unlock(&spxProgressLock);
+#endif /* SPXI_THREADS */
+    return cancel;
+}
+
+#define spxProgressStep(rows) spxProgressUpdate(rows, 1)
+#define spxProgressAt(rows) spxProgressUpdate(rows, 0)
+
+/* Parsing Name Extensions and File Headers */
+
+#define spxParseHeaderPng(h) (!memcmp(h, "\211PNG\r\n\032\n", 8))
+#define spxParseHeaderJpeg(h) (h[0] == 0xFF && h[1] == 0xD8 && h[2] == 0xFF)
+#define spxParseHeaderGif(h) (!memcmp(h, "GIF87a", 6) || !memcmp(h, "GIF89a", 6))
+#define spxParseHeaderPnm(h) ((h[0] == 0x50 && (h[1] > 0x30 || h[1] < 0x37) &&\
+                                isspace(h[2])))
+#define spxParseHeaderBmp(h) (h[0] == 0x42 && h[1] == 0x4D)
+
+static int spxStrcmpLower(const char* s1, const char* s2)
+{
+    while (*s1 && *s2) {
+        if (tolower(*s1++) != *s2++) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int spxParseExtension(const char* path)
+{
+    size_t i, dotpos = 0;
+    for (i = 0; path[i]; ++i) {
+        if (path[i] == '.') {
+            dotpos = i;
+        }
+    }
+
+    if (dotpos) {
+        const char* ext = path + dotpos + 1;
+        if (spxStrcmpLower(ext, "png")) {
+            return SPXI_FORMAT_PNG;
+        } else if (spxStrcmpLower(ext, "jpeg") || spxStrcmpLower(ext, "jpg")) {
+            return SPXI_FORMAT_JPEG;
+        } else if (spxStrcmpLower(ext, "gif")) {
+            return SPXI_FORMAT_GIF;
+        } else if (spxStrcmpLower(ext, "pnm") || spxStrcmpLower(ext, "ppm") ||
+                    spxStrcmpLower(ext, "pgm") || spxStrcmpLower(ext, "pbm")) {
+            return SPXI_FORMAT_PNM;
+        } else if (spxStrcmpLower(ext, "bmp")) {
+            return SPXI_FORMAT_BMP;
+        }
+    }
+
+    return SPXI_FORMAT_UNKNOWN;
+}
+
+static int spxParseHeader(const uint8_t* header)
+{
+    if (spxParseHeaderPng(header)) {
+        return SPXI_FORMAT_PNG;
+    } else if (spxParseHeaderJpeg(header)) {
+        return SPXI_FORMAT_JPEG;
+    } else if (spxParseHeaderGif(header)) {
+        return SPXI_FORMAT_GIF;
+    } else if (spxParseHeaderPnm(header)) {
+        return SPXI_FORMAT_PNM;
+    } else if (spxParseHeaderBmp(header)) {
+        return SPXI_FORMAT_BMP;
+    }
+
+    return SPXI_FORMAT_UNKNOWN;
+}
+
+static int spxParseFormat(const char* path)
+{
+    int format;
+    uint8_t header[SPXI_HEADER_SIZE];
+    FILE* file = fopen(path, "rb");
+
+    if (!file) {
+        fprintf(stderr, "spximg could not open file: '%s'\n", path);
+        return SPXI_FORMAT_NULL;
+    }
+
+    fread(header, SPXI_HEADER_SIZE, sizeof(uint8_t), file);
+    fclose(file);
+
+    format = spxParseExtension(path);
+    if ((format == SPXI_FORMAT_PNG && spxParseHeaderPng(header)) ||
+        (format == SPXI_FORMAT_JPEG && spxParseHeaderJpeg(header)) ||
+        (format == SPXI_FORMAT_GIF && spxParseHeaderGif(header)) ||
+        (format == SPXI_FORMAT_PNM && spxParseHeaderPnm(header)) ||
+        (format == SPXI_FORMAT_BMP && spxParseHeaderBmp(header))) {
+        return format;
+    }
+
+    return spxParseHeader(header);
+}
+
+/* Image Reshape Implementation */
+
+#ifndef SPXI_PARALLEL_GRAIN
+#define SPXI_PARALLEL_GRAIN     (1 << 16)
+#endif /* SPXI_PARALLEL_GRAIN */
+
+typedef void (*SpxReshapeFunc)(const uint8_t* src, uint8_t* dst, size_t count);
+
+typedef struct SpxReshapeTask {
+    SpxReshapeFunc func;
+    const uint8_t* src;
+    uint8_t* dst;
+    int srcchannels;
+    int dstchannels;
+    int samplesize;
+    int width;
+} SpxReshapeTask;
+
+static void spxReshape1to4(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, dst += 4) {
+        dst[0] = src[i];
+        dst[1] = src[i];
+        dst[2] = src[i];
+        dst[3] = SPXI_PADDING;
+    }
+}
+
+static void spxReshape2to4(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, src += 2, dst += 4) {
+        dst[0] = src[0];
+        dst[1] = src[0];
+        dst[2] = src[0];
+        dst[3] = src[1];
+    }
+}
+
+static void spxReshape3to4(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, src += 3, dst += 4) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = SPXI_PADDING;
+    }
+}
+
+static void spxReshape4to3(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, src += 4, dst += 3) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+    }
+}
+
+static void spxReshape2to3(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, src += 2, dst += 3) {
+        dst[0] = src[0];
+        dst[1] = src[0];
+        dst[2] = src[0];
+    }
+}
+
+static void spxReshape1to3(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, dst += 3) {
+        dst[0] = src[i];
+        dst[1] = src[i];
+        dst[2] = src[i];
+    }
+}
+
+static void spxReshape4to2(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, src += 4, dst += 2) {
+        dst[0] = (uint8_t)(((int)src[0] + (int)src[1] + (int)src[2]) / 3);
+        dst[1] = src[3];
+    }
+}
+
+static void spxReshape3to2(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, src += 3, dst += 2) {
+        dst[0] = (uint8_t)(((int)src[0] + (int)src[1] + (int)src[2]) / 3);
+        dst[1] = SPXI_PADDING;
+    }
+}
+
+static void spxReshape1to2(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, dst += 2) {
+        dst[0] = src[i];
+        dst[1] = SPXI_PADDING;
+    }
+}
+
+static void spxReshape4to1(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, src += 4) {
+        dst[i] = (uint8_t)(((int)src[0] + (int)src[1] + (int)src[2]) / 3);
+    }
+}
+
+static void spxReshape3to1(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, src += 3) {
+        dst[i] = (uint8_t)(((int)src[0] + (int)src[1] + (int)src[2]) / 3);
+    }
+}
+
+static void spxReshape2to1(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i, src += 2) {
+        dst[i] = src[0];
+    }
+}
+
+/* the same conversions for 16 bit samples, which come in as bytes so
+ * every kernel fits SpxReshapeFunc */
+
+static void spxReshapeWide1to4(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, d += 4) {
+        d[0] = s[i];
+        d[1] = s[i];
+        d[2] = s[i];
+        d[3] = SPXI_PADDING * 0x101;
+    }
+}
+
+static void spxReshapeWide2to4(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, s += 2, d += 4) {
+        d[0] = s[0];
+        d[1] = s[0];
+        d[2] = s[0];
+        d[3] = s[1];
+    }
+}
+
+static void spxReshapeWide3to4(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, s += 3, d += 4) {
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+        d[3] = SPXI_PADDING * 0x101;
+    }
+}
+
+static void spxReshapeWide4to3(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, s += 4, d += 3) {
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+    }
+}
+
+static void spxReshapeWide2to3(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, s += 2, d += 3) {
+        d[0] = s[0];
+        d[1] = s[0];
+        d[2] = s[0];
+    }
+}
+
+static void spxReshapeWide1to3(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, d += 3) {
+        d[0] = s[i];
+        d[1] = s[i];
+        d[2] = s[i];
+    }
+}
+
+static void spxReshapeWide4to2(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, s += 4, d += 2) {
+        d[0] = (uint16_t)(((long)s[0] + (long)s[1] + (long)s[2]) / 3);
+        d[1] = s[3];
+    }
+}
+
+static void spxReshapeWide3to2(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, s += 3, d += 2) {
+        d[0] = (uint16_t)(((long)s[0] + (long)s[1] + (long)s[2]) / 3);
+        d[1] = SPXI_PADDING * 0x101;
+    }
+}
+
+static void spxReshapeWide1to2(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, d += 2) {
+        d[0] = s[i];
+        d[1] = SPXI_PADDING * 0x101;
+    }
+}
+
+static void spxReshapeWide4to1(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, s += 4) {
+        d[i] = (uint16_t)(((long)s[0] + (long)s[1] + (long)s[2]) / 3);
+    }
+}
+
+static void spxReshapeWide3to1(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, s += 3) {
+        d[i] = (uint16_t)(((long)s[0] + (long)s[1] + (long)s[2]) / 3);
+    }
+}
+
+static void spxReshapeWide2to1(const uint8_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i;
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dst;
+    for (i = 0; i < count; ++i, s += 2) {
+        d[i] = s[0];
+    }
+}
+
+static void spxReshapeWork(void* arg, const int begin, const int end)
+{
+    const SpxReshapeTask* task = (const SpxReshapeTask*)arg;
+    size_t offset = (size_t)begin * task->width * task->samplesize;
+    task->func(
+        task->src + offset * task->srcchannels,
+        task->dst + offset * task->dstchannels,
+        (size_t)(end - begin) * task->width
+    );
+}
+
+/* convert bands of rows in parallel, each band at least a grain of pixels */
+static Img2D spxReshapeRun(const Img2D img, const int channels,
+    SpxReshapeFunc func, SpxReshapeFunc wide)
+{
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    SpxReshapeTask task;
+    int grain = img.width ? SPXI_PARALLEL_GRAIN / img.width : 1;
+
+    ret.channels = channels;
+    ret.width = img.width;
+    ret.height = img.height;
+    ret.depth = img.depth;
+    task.samplesize = spxSampleSize(img);
+    ret.pixbuf = spxPixbufAlloc(
+        (size_t)img.width * img.height * channels * task.samplesize
+    );
+    if (!ret.pixbuf) {
+        return ret;
+    }
+
+    task.func = task.samplesize > 1 ? wide : func;
+    task.src = img.pixbuf;
+    task.dst = ret.pixbuf;
+    task.srcchannels = img.channels;
+    task.dstchannels = channels;
+    task.width = img.width;
+    spxParallelFor(img.height, grain > 0 ? grain : 1, &spxReshapeWork, &task);
+    return ret;
+}
+
+static Img2D spxImageReshape1to4(const Img2D img)
+{
+    assert(img.channels == 1);
+    return spxReshapeRun(img, 4, &spxReshape1to4, &spxReshapeWide1to4);
+}
+
+static Img2D spxImageReshape2to4(const Img2D img)
+{
+    assert(img.channels == 2);
+    return spxReshapeRun(img, 4, &spxReshape2to4, &spxReshapeWide2to4);
+}
+
+static Img2D spxImageReshape3to4(const Img2D img)
+{
+    assert(img.channels == 3);
+    return spxReshapeRun(img, 4, &spxReshape3to4, &spxReshapeWide3to4);
+}
+
+static Img2D spxImageReshape4to3(const Img2D img)
+{
+    assert(img.channels == 4);
+    return spxReshapeRun(img, 3, &spxReshape4to3, &spxReshapeWide4to3);
+}
+
+static Img2D spxImageReshape2to3(const Img2D img)
+{
+    assert(img.channels == 2);
+    return spxReshapeRun(img, 3, &spxReshape2to3, &spxReshapeWide2to3);
+}
+
+static Img2D spxImageReshape1to3(const Img2D img)
+{
+    assert(img.channels == 1);
+    return spxReshapeRun(img, 3, &spxReshape1to3, &spxReshapeWide1to3);
+}
+
+static Img2D spxImageReshape4to2(const Img2D img)
+{
+    assert(img.channels == 4);
+    return spxReshapeRun(img, 2, &spxReshape4to2, &spxReshapeWide4to2);
+}
+
+static Img2D spxImageReshape3to2(const Img2D img)
+{
+    assert(img.channels == 3);
+    return spxReshapeRun(img, 2, &spxReshape3to2, &spxReshapeWide3to2);
+}
+
+static Img2D spxImageReshape1to2(const Img2D img)
+{
+    assert(img.channels == 1);
+    return spxReshapeRun(img, 2, &spxReshape1to2, &spxReshapeWide1to2);
+}
+
+static Img2D spxImageReshape2to1(const Img2D img)
+{
+    assert(img.channels == 2);
+    return spxReshapeRun(img, 1, &spxReshape2to1, &spxReshapeWide2to1);
+}
+
+static Img2D spxImageReshape4or3to1(const Img2D img)
+{
+    assert(img.channels == 4 || img.channels == 3);
+    if (img.channels == 4) {
+        return spxReshapeRun(img, 1, &spxReshape4to1, &spxReshapeWide4to1);
+    }
+    return spxReshapeRun(img, 1, &spxReshape3to1, &spxReshapeWide3to1);
+}
+
+/* row kernels by sample size, source and target channels */
+static const SpxReshapeFunc spxReshapeKernels[2][4][4] = {{
+    {NULL, &spxReshape1to2, &spxReshape1to3, &spxReshape1to4},
+    {&spxReshape2to1, NULL, &spxReshape2to3, &spxReshape2to4},
+    {&spxReshape3to1, &spxReshape3to2, NULL, &spxReshape3to4},
+    {&spxReshape4to1, &spxReshape4to2, &spxReshape4to3, NULL}
+}, {
+    {NULL, &spxReshapeWide1to2, &spxReshapeWide1to3, &spxReshapeWide1to4},
+    {&spxReshapeWide2to1, NULL, &spxReshapeWide2to3, &spxReshapeWide2to4},
+    {&spxReshapeWide3to1, &spxReshapeWide3to2, NULL, &spxReshapeWide3to4},
+    {&spxReshapeWide4to1, &spxReshapeWide4to2, &spxReshapeWide4to3, NULL}
+}};
+
+static Img2D (*spxImageReshapeFunctions[4][4])(const Img2D) = {
+    {&spxImageCopy, &spxImageReshape1to2, &spxImageReshape1to3, &spxImageReshape1to4},
+    {&spxImageReshape2to1, &spxImageCopy, &spxImageReshape2to3, &spxImageReshape2to4},
+    {&spxImageReshape4or3to1, &spxImageReshape3to2, &spxImageCopy, &spxImageReshape3to4},
+    {&spxImageReshape4or3to1, &spxImageReshape4to2, &spxImageReshape4to3, &spxImageCopy}
+};
+
+/* look up the colors of an indexed image */
+static Img2D spxPaletteExpand(const Img2D img, const int channels)
+{
+    size_t i;
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0}, rgba = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    const size_t size = (size_t)img.width * img.height;
+
+    rgba.pixbuf = spxPixbufAlloc(size * 4);
+    if (rgba.pixbuf) {
+        rgba.width = img.width;
+        rgba.height = img.height;
+        rgba.channels = 4;
+        for (i = 0; i < size; ++i) {
+            memcpy(rgba.pixbuf + i * 4, img.palette + (img.pixbuf[i] << 2), 4);
+        }
+    }
+
+    if (channels == 4 || !rgba.pixbuf) {
+        return rgba;
+    }
+
+    ret = spxImageReshapeFunctions[3][channels - 1](rgba);
+    spxImageFree(&rgba);
+    return ret;
+}
+
+/* planar reshapes move whole planes, only gray from color is computed */
+static Img2D spxReshapePlanar(const Img2D img, const int channels)
+{
+    size_t i;
+    int c;
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    const size_t count = (size_t)img.width * img.height;
+    const size_t plane = count * spxSampleSize(img);
+    const int srccolor = img.channels >= 3, dstcolor = channels >= 3;
+
+    ret.pixbuf = spxPixbufAlloc(plane * channels);
+    if (!ret.pixbuf) {
+        return ret;
+    }
+
+    ret.width = img.width;
+    ret.height = img.height;
+    ret.channels = channels;
+    ret.depth = img.depth;
+    ret.layout = SPXI_LAYOUT_PLANAR;
+
+    if (srccolor && !dstcolor && spxSampleSize(img) > 1) {
+        const uint16_t* s = (const uint16_t*)img.pixbuf;
+        for (i = 0; i < count; ++i) {
+            ((uint16_t*)ret.pixbuf)[i] = (uint16_t)(
+                ((long)s[i] + (long)s[count + i] + (long)s[2 * count + i]) / 3
+            );
+        }
+    } else if (srccolor && !dstcolor) {
+        const uint8_t* s = img.pixbuf;
+        for (i = 0; i < count; ++i) {
+            ret.pixbuf[i] = (uint8_t)(((int)s[i] + (int)s[count + i] + (int)s[2 * count + i]) / 3);
+        }
+    } else {
+        for (c = 0; c < (dstcolor ? 3 : 1); ++c) {
+            memcpy(ret.pixbuf + c * plane, img.pixbuf + (srccolor ? c : 0) * plane, plane);
+        }
+    }
+
+    if (!(channels & 1)) {
+        uint8_t* alpha = ret.pixbuf + (channels - 1) * plane;
+        if (!(img.channels & 1)) {
+            memcpy(alpha, img.pixbuf + (img.channels - 1) * plane, plane);
+        } else if (spxSampleSize(img) > 1) {
+            for (i = 0; i < count; ++i) {
+                ((uint16_t*)alpha)[i] = SPXI_PADDING * 0x101;
+            }
+        } else {
+            memset(alpha, SPXI_PADDING, plane);
+        }
+    }
+
+    return ret;
+}
+
+Img2D spxImageReshape(const Img2D img, const int channels)
+{
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    if (img.pixbuf && !spxImagePacked(img)) {
+        Img2D tmp = spxImagePack(img);
+        ret = tmp.pixbuf ? spxImageReshape(tmp, channels) : ret;
+        spxImageFree(&tmp);
+        return ret;
+    }
+
+    if (img.layout == SPXI_LAYOUT_PLANAR && !img.palette && img.channels != channels &&
+        img.channels > 0 && img.channels <= 4 && channels > 0 && channels <= 4) {
+        spxStatsBegin(SPXI_FORMAT_UNKNOWN);
+        spxStatsPush(SPXI_STAGE_CONVERT);
+        ret = spxReshapePlanar(img, channels);
+        spxStatsPop();
+        spxStatsEnd();
+        return ret;
+    }
+
+    if (img.palette && channels > 0 && channels <= 4) {
+        spxStatsBegin(SPXI_FORMAT_UNKNOWN);
+        spxStatsPush(SPXI_STAGE_CONVERT);
+        ret = spxPaletteExpand(img, channels);
+        spxStatsPop();
+        spxStatsEnd();
+        return ret;
+    }
+
+    if (img.channels > 0 && img.channels <= 4 && channels > 0 && channels <= 4) {
+        spxStatsBegin(SPXI_FORMAT_UNKNOWN);
+        spxStatsPush(SPXI_STAGE_CONVERT);
+        ret = spxImageReshapeFunctions[img.channels - 1][channels - 1](img);
+        spxStatsPop();
+        spxStatsEnd();
+        return ret;
+    }
+
+    fprintf(
+        stderr, "spximg does not support reshape from %d to %d channels\n",
+        img.channels, channels
+    );
+
+    return ret;
+}
+
+/* Sample Depth Conversion */
+
+typedef struct SpxDepthTask {
+    const uint8_t* src;
+    uint8_t* dst;
+    size_t linesize;
+    int depth;
+} SpxDepthTask;
+
+/* swap the bytes of count 16 bit samples, src and dst may be the same */
+static void spxSwap16(uint8_t* dst, const uint8_t* src, const size_t count)
+{
+    size_t i = 0;
+#ifdef SPXI_SSE2
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(dst + i * 2), v);
+    }
+#endif /* SPXI_SSE2 */
+    for (; i < count; ++i) {
+        const uint8_t hi = src[i * 2];
+        dst[i * 2] = src[i * 2 + 1];
+        dst[i * 2 + 1] = hi;
+    }
+}
+
+/* round v / 257, the SSE2 path takes (v + 128) >> 8 from an unsigned
+ * average so no lane overflows */
+static void spxDepthNarrow(const uint16_t* src, uint8_t* dst, const size_t count)
+{
+    size_t i = 0;
+#ifdef SPXI_SSE2
+    const __m128i bias = _mm_set1_epi16(127), half = _mm_set1_epi16(128);
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 8));
+        a = _mm_sub_epi16(a, _mm_srli_epi16(_mm_avg_epu16(a, bias), 7));
+        b = _mm_sub_epi16(b, _mm_srli_epi16(_mm_avg_epu16(b, bias), 7));
+        a = _mm_srli_epi16(_mm_add_epi16(a, half), 8);
+        b = _mm_srli_epi16(_mm_add_epi16(b, half), 8);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+    }
+#endif /* SPXI_SSE2 */
+    for (; i < count; ++i) {
+        const int t = src[i] + 128;
+        dst[i] = (uint8_t)((t - (t >> 8)) >> 8);
+    }
+}
+
+static void spxDepthWiden(const uint8_t* src, uint16_t* dst, const size_t count)
+{
+    size_t i = 0;
+#ifdef SPXI_SSE2
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi8(v, v));
+        _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpackhi_epi8(v, v));
+    }
+#endif /* SPXI_SSE2 */
+    for (; i < count; ++i) {
+        dst[i] = (uint16_t)(src[i] * 0x101);
+    }
+}
+
+static void spxDepthWork(void* arg, const int begin, const int end)
+{
+    const SpxDepthTask* task = (const SpxDepthTask*)arg;
+    const size_t offset = (size_t)begin * task->linesize;
+    const size_t count = (size_t)(end - begin) * task->linesize;
+    if (task->depth > SPXI_BIT_DEPTH) {
+        spxDepthWiden(task->src + offset, (uint16_t*)task->dst + offset, count);
+    } else {
+        spxDepthNarrow((const uint16_t*)task->src + offset, task->dst + offset, count);
+    }
+}
+
+Img2D spxImageDepth(const Img2D img, int depth)
+{
+    SpxDepthTask task;
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    int grain = img.width ? SPXI_PARALLEL_GRAIN / img.width : 1;
+
+    if (!img.pixbuf || (depth != 8 && depth != 16)) {
+        fprintf(stderr, "spximg does not support %d bits per sample\n", depth);
+        return ret;
+    }
+
+    if (img.pixbuf && !spxImagePacked(img)) {
+        Img2D tmp = spxImagePack(img);
+        ret = tmp.pixbuf ? spxImageDepth(tmp, depth) : ret;
+        spxImageFree(&tmp);
+        return ret;
+    }
+
+    if (img.palette && depth > SPXI_BIT_DEPTH) {
+        Img2D rgba = spxImageReshape(img, 4);
+        ret = rgba.pixbuf ? spxImageDepth(rgba, depth) : ret;
+        spxImageFree(&rgba);
+        return ret;
+    }
+
+    if (spxSampleSize(img) == depth / SPXI_BIT_DEPTH) {
+        ret = spxImageCopy(img);
+        ret.depth = ret.pixbuf ? depth : 0;
+        return ret;
+    }
+
+    spxStatsBegin(SPXI_FORMAT_UNKNOWN);
+    spxStatsPush(SPXI_STAGE_CONVERT);
+    ret.pixbuf = spxPixbufAlloc(
+        (size_t)img.width * img.height * img.channels * (depth / SPXI_BIT_DEPTH)
+    );
+    if (ret.pixbuf) {
+        ret.width = img.width;
+        ret.height = img.height;
+        ret.channels = img.channels;
+        ret.depth = depth;
+        ret.layout = img.layout;
+        task.src = img.pixbuf;
+        task.dst = ret.pixbuf;
+        task.linesize = (size_t)img.width * img.channels;
+        task.depth = depth;
+        spxParallelFor(img.height, grain > 0 ? grain : 1, &spxDepthWork, &task);
+    }
+
+    spxStatsPop();
+    spxStatsEnd();
+    return ret;
+}
+
+/* Planar Channel Layout */
+
+/* planar images keep one contiguous plane per channel, channel c of
+ * pixel i lives at sample c * width * height + i */
+#define spxImagePlanar(img) ((img).layout == SPXI_LAYOUT_PLANAR && (img).channels > 1)
+
+typedef struct SpxLayoutTask {
+    const uint8_t* src;
+    uint8_t* dst;
+    size_t planesize;
+    int width;
+    int channels;
+    int samplesize;
+    int layout;
+} SpxLayoutTask;
+
+#ifdef SPXI_SSE2
+
+/* bytewise perfect shuffle of count registers, registers k and
+ * k + count / 2 are interleaved into 2k and 2k + 1 */
+static void spxPlanarZip(__m128i* v, const int count)
+{
+    int k;
+    __m128i t[6];
+    for (k = 0; k < count / 2; ++k) {
+        t[2 * k] = _mm_unpacklo_epi8(v[k], v[k + count / 2]);
+        t[2 * k + 1] = _mm_unpackhi_epi8(v[k], v[k + count / 2]);
+    }
+    for (k = 0; k < count; ++k) {
+        v[k] = t[k];
+    }
+}
+
+/* inverse of spxPlanarZip, even bytes of 2k and 2k + 1 go to k and odd
+ * bytes to k + count / 2 */
+static void spxPlanarUnzip(__m128i* v, const int count)
+{
+    int k;
+    __m128i t[6];
+    const __m128i mask = _mm_set1_epi16(0xFF);
+    for (k = 0; k < count / 2; ++k) {
+        t[k] = _mm_packus_epi16(
+            _mm_and_si128(v[2 * k], mask), _mm_and_si128(v[2 * k + 1], mask)
+        );
+        t[k + count / 2] = _mm_packus_epi16(
+            _mm_srli_epi16(v[2 * k], 8), _mm_srli_epi16(v[2 * k + 1], 8)
+        );
+    }
+    for (k = 0; k < count; ++k) {
+        v[k] = t[k];
+    }
+}
+
+#endif /* SPXI_SSE2 */
+
+/* split count interleaved pixels into planes planesize bytes apart; 2
+ * and 4 channels unzip 16 pixels in one and two rounds, 3 channels take
+ * five zip rounds over 32 pixels to come out in plane order */
+static void spxDeinterleave(const uint8_t* src, uint8_t* dst, const size_t planesize,
+    const int channels, const size_t count, const int samplesize)
+{
+    size_t i = 0;
+    int c;
+#ifdef SPXI_SSE2
+    int k;
+    const int regs = channels == 3 ? 6 : channels;
+    const int pixels = regs * 16 / channels;
+    const int rounds = channels == 3 ? 5 : channels / 2;
+    for (; samplesize == 1 && i + pixels <= count; i += pixels) {
+        __m128i v[6];
+        for (k = 0; k < regs; ++k) {
+            v[k] = _mm_loadu_si128((const __m128i*)(src + i * channels + k * 16));
+        }
+        for (k = 0; k < rounds; ++k) {
+            if (channels == 3) {
+                spxPlanarZip(v, regs);
+            } else {
+                spxPlanarUnzip(v, regs);
+            }
+        }
+        for (k = 0; k < regs; ++k) {
+            const int per = regs / channels;
+            _mm_storeu_si128(
+                (__m128i*)(dst + (k / per) * planesize + i + (k % per) * 16), v[k]
+            );
+        }
+    }
+#endif /* SPXI_SSE2 */
+    if (samplesize > 1) {
+        const uint16_t* s = (const uint16_t*)src;
+        for (; i < count; ++i) {
+            for (c = 0; c < channels; ++c) {
+                ((uint16_t*)(dst + c * planesize))[i] = s[i * channels + c];
+            }
+        }
+        return;
+    }
+
+    for (; i < count; ++i) {
+        for (c = 0; c < channels; ++c) {
+            dst[c * planesize + i] = src[i * channels + c];
+        }
+    }
+}
+
+/* merge count pixels from planes planesize bytes apart, running the
+ * rounds of spxDeinterleave backwards */
+static void spxInterleave(const uint8_t* src, const size_t planesize, uint8_t* dst,
+    const int channels, const size_t count, const int samplesize)
+{
+    size_t i = 0;
+    int c;
+#ifdef SPXI_SSE2
+    int k;
+    const int regs = channels == 3 ? 6 : channels;
+    const int pixels = regs * 16 / channels;
+    const int rounds = channels == 3 ? 5 : channels / 2;
+    for (; samplesize == 1 && i + pixels <= count; i += pixels) {
+        __m128i v[6];
+        for (k = 0; k < regs; ++k) {
+            const int per = regs / channels;
+            v[k] = _mm_loadu_si128(
+                (const __m128i*)(src + (k / per) * planesize + i + (k % per) * 16)
+            );
+        }
+        for (k = 0; k < rounds; ++k) {
+            if (channels == 3) {
+                spxPlanarUnzip(v, regs);
+            } else {
+                spxPlanarZip(v, regs);
+            }
+        }
+        for (k = 0; k < regs; ++k) {
+            _mm_storeu_si128((__m128i*)(dst + i * channels + k * 16), v[k]);
+        }
+    }
+#endif /* SPXI_SSE2 */
+    if (samplesize > 1) {
+        uint16_t* d = (uint16_t*)dst;
+        for (; i < count; ++i) {
+            for (c = 0; c < channels; ++c) {
+                d[i * channels + c] = ((const uint16_t*)(src + c * planesize))[i];
+            }
+        }
+        return;
+    }
+
+    for (; i < count; ++i) {
+        for (c = 0; c < channels; ++c) {
+            dst[i * channels + c] = src[c * planesize + i];
+        }
+    }
+}
+
+static void spxLayoutWork(void* arg, const int begin, const int end)
+{
+    const SpxLayoutTask* task = (const SpxLayoutTask*)arg;
+    const size_t pixel = (size_t)begin * task->width;
+    const size_t offset = pixel * task->samplesize;
+    const size_t count = (size_t)(end - begin) * task->width;
+    if (task->layout == SPXI_LAYOUT_PLANAR) {
+        spxDeinterleave(
+            task->src + offset * task->channels, task->dst + offset, task->planesize,
+            task->channels, count, task->samplesize
+        );
+    } else {
+        spxInterleave(
+            task->src + offset, task->planesize, task->dst + offset * task->channels,
+            task->channels, count, task->samplesize
+        );
+    }
+}
+
+Img2D spxImageLayout(const Img2D img, int layout)
+{
+    SpxLayoutTask task;
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    int grain = img.width ? SPXI_PARALLEL_GRAIN / img.width : 1;
+
+    if (!img.pixbuf || (layout != SPXI_LAYOUT_INTERLEAVED && layout != SPXI_LAYOUT_PLANAR)) {
+        fprintf(stderr, "spximg does not support layout %d\n", layout);
+        return ret;
+    }
+
+    if (img.pixbuf && !spxImagePacked(img)) {
+        Img2D tmp = spxImagePack(img);
+        ret = tmp.pixbuf ? spxImageLayout(tmp, layout) : ret;
+        spxImageFree(&tmp);
+        return ret;
+    }
+
+    /* a single channel, or palette indices, look the same either way */
+    if (img.channels == 1 || img.palette || img.layout == layout) {
+        ret = spxImageCopy(img);
+        ret.layout = img.channels == 1 && !img.palette ? layout : img.layout;
+        return ret;
+    }
+
+    spxStatsBegin(SPXI_FORMAT_UNKNOWN);
+    spxStatsPush(SPXI_STAGE_CONVERT);
+    task.samplesize = spxSampleSize(img);
+    task.planesize = (size_t)img.width * img.height * task.samplesize;
+    ret.pixbuf = spxPixbufAlloc(task.planesize * img.channels);
+    if (ret.pixbuf) {
+        ret.width = img.width;
+        ret.height = img.height;
+        ret.channels = img.channels;
+        ret.depth = img.depth;
+        ret.layout = layout;
+        task.src = img.pixbuf;
+        task.dst = ret.pixbuf;
+        task.width = img.width;
+        task.channels = img.channels;
+        task.layout = layout;
+        spxParallelFor(img.height, grain > 0 ? grain : 1, &spxLayoutWork, &task);
+    }
+
+    spxStatsPop();
+    spxStatsEnd();
+    return ret;
+}
+
+/* Image Resize Implementation */
+
+#define SPXI_RESIZE_BITS        14
+#define SPXI_RESIZE_EXTRA       6
+#define SPXI_RESIZE_ROWS        64
+#define SPXI_RESIZE_COLS        256
+
+typedef struct SpxResizeAxis {
+    int* bounds;
+    int16_t* weights;
+    int ksize;
+} SpxResizeAxis;
+
+typedef struct SpxResizeTask {
+    Img2D src;
+    Img2D dst;
+    SpxResizeAxis h;
+    SpxResizeAxis v;
+    int ic;
+    int premultiply;
+} SpxResizeTask;
+
+static double spxSin(double x)
+{
+    static const double pi = 3.14159265358979323846;
+    double x2;
+    while (x > pi) x -= 2.0 * pi;
+    while (x < -pi) x += 2.0 * pi;
+    if (x > pi * 0.5) x = pi - x;
+    else if (x < -pi * 0.5) x = -pi - x;
+    x2 = x * x;
+    return x * (1.0 - x2 / 6.0 * (1.0 - x2 / 20.0 * (1.0 - x2 / 42.0 *
+        (1.0 - x2 / 72.0 * (1.0 - x2 / 110.0)))));
+}
+
+static double spxSinc(double x)
+{
+    static const double pi = 3.14159265358979323846;
+    return x == 0.0 ? 1.0 : spxSin(pi * x) / (pi * x);
+}
+
+static double spxResizeFilter(const int filter, double x)
+{
+    x = x < 0.0 ? -x : x;
+    switch (filter) {
+        case SPXI_FILTER_BOX:
+            return x <= 0.5 ? 1.0 : 0.0;
+        case SPXI_FILTER_BILINEAR:
+            return x < 1.0 ? 1.0 - x : 0.0;
+        case SPXI_FILTER_BICUBIC:
+            /* Catmull-Rom, a = -0.5 */
+            if (x < 1.0) {
+                return (1.5 * x - 2.5) * x * x + 1.0;
+            }
+            return x < 2.0 ? ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0 : 0.0;
+    }
+    return x < 3.0 ? spxSinc(x) * spxSinc(x / 3.0) : 0.0;
+}
+
+static void spxResizeAxisFree(SpxResizeAxis* ax)
+{
+    SPXI_FREE(ax->bounds);
+    SPXI_FREE(ax->weights);
+    ax->bounds = NULL;
+    ax->weights = NULL;
+}
+
+/* precompute first source index, tap count and fixed point weights of 
+ * every output index, with weights of each output summing exactly to one */
+static int spxResizeAxisInit(SpxResizeAxis* ax, const int insize,
+    const int outsize, const int filter)
+{
+    static const double supports[] = {0.5, 1.0, 2.0, 3.0};
+    int x, j, n, xmin, xmax, sum, top;
+    double* tmp, total, scale = (double)insize / outsize;
+    double fscale = scale > 1.0 ? scale : 1.0;
+    double center, support = supports[filter] * fscale;
+
+    ax->ksize = 2 * ((int)support + 1) + 1;
+    ax->bounds = (int*)spxMalloc(outsize * 2 * sizeof(int));
+    ax->weights = (int16_t*)spxMalloc(outsize * ax->ksize * sizeof(int16_t));
+    tmp = (double*)spxMalloc(ax->ksize * sizeof(double));
+    if (!ax->bounds || !ax->weights || !tmp) {
+        spxResizeAxisFree(ax);
+        SPXI_FREE(tmp);
+        return EXIT_FAILURE;
+    }
+
+    memset(ax->weights, 0, outsize * ax->ksize * sizeof(int16_t));
+    for (x = 0; x < outsize; ++x) {
+        int16_t* w = ax->weights + x * ax->ksize;
+        center = (x + 0.5) * scale;
+        xmin = (int)(center - support + 0.5);
+        xmax = (int)(center + support + 0.5);
+        xmin = xmin < 0 ? 0 : xmin;
+        xmax = xmax > insize ? insize : xmax;
+        n = xmax - xmin > ax->ksize ? ax->ksize : xmax - xmin;
+
+        total = 0.0;
+        for (j = 0; j < n; ++j) {
+            tmp[j] = spxResizeFilter(filter, (j + xmin - center + 0.5) / fscale);
+            total += tmp[j];
+        }
+
+        if (n <= 0 || total == 0.0) {
+            xmin = (int)center < insize ? (int)center : insize - 1;
+            n = 1;
+            tmp[0] = total = 1.0;
+        }
+
+        sum = top = 0;
+        for (j = 0; j < n; ++j) {
+            double f = tmp[j] / total * (1 << SPXI_RESIZE_BITS);
+            w[j] = (int16_t)(f < 0.0 ? f - 0.5 : f + 0.5);
+            sum += w[j];
+            top = w[j] > w[top] ? j : top;
+        }
+
+        w[top] = (int16_t)(w[top] + (1 << SPXI_RESIZE_BITS) - sum);
+        ax->bounds[x * 2] = xmin;
+        ax->bounds[x * 2 + 1] = n;
+    }
+
+    SPXI_FREE(tmp);
+    return EXIT_SUCCESS;
+}
+
+static int16_t spxResizeClampH(const int sum)
+{
+    const int n = (sum + (1 << (SPXI_RESIZE_BITS - SPXI_RESIZE_EXTRA - 1))) >>
+        (SPXI_RESIZE_BITS - SPXI_RESIZE_EXTRA);
+    return (int16_t)(n < -32768 ? -32768 : n > 32767 ? 32767 : n);
+}
+
+static uint8_t spxResizeClampV(const int sum)
+{
+    const int n = (sum + (1 << (SPXI_RESIZE_BITS + SPXI_RESIZE_EXTRA - 1))) >>
+        (SPXI_RESIZE_BITS + SPXI_RESIZE_EXTRA);
+    return (uint8_t)(n < 0 ? 0 : n > 0xFF ? 0xFF : n);
+}
+
+/* horizontal passes read pixels [cmin, ...) from src and write 
+ * x1 - x0 intermediate pixels with SPXI_RESIZE_EXTRA bits of precision */
+
+static void spxResizeRowH1(const uint8_t* src, const int cmin, int16_t* dst,
+    const SpxResizeAxis* ax, const int x0, const int x1)
+{
+    int x, j;
+    for (x = x0; x < x1; ++x) {
+        const uint8_t* p = src + ax->bounds[x * 2] - cmin;
+        const int16_t* w = ax->weights + x * ax->ksize;
+        const int n = ax->bounds[x * 2 + 1];
+        int sum = 0;
+        j = 0;
+#ifdef SPXI_SSE2
+        if (n >= 8) {
+            const __m128i zero = _mm_setzero_si128();
+            __m128i acc = zero;
+            for (; j + 8 <= n; j += 8) {
+                __m128i pix = _mm_loadl_epi64((const __m128i*)(p + j));
+                pix = _mm_unpacklo_epi8(pix, zero);
+                acc = _mm_add_epi32(acc, 
+                    _mm_madd_epi16(pix, _mm_loadu_si128((const __m128i*)(w + j)))
+                );
+            }
+            acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+            acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+            sum = _mm_cvtsi128_si32(acc);
+        }
+#endif /* SPXI_SSE2 */
+        for (; j < n; ++j) {
+            sum += p[j] * w[j];
+        }
+        *dst++ = spxResizeClampH(sum);
+    }
+}
+
+static void spxResizeRowH2(const uint8_t* src, const int cmin, int16_t* dst,
+    const SpxResizeAxis* ax, const int x0, const int x1)
+{
+    int x, j;
+    for (x = x0; x < x1; ++x) {
+        const uint8_t* p = src + ((ax->bounds[x * 2] - cmin) << 1);
+        const int16_t* w = ax->weights + x * ax->ksize;
+        const int n = ax->bounds[x * 2 + 1];
+        int sum[2] = {0, 0};
+        j = 0;
+#ifdef SPXI_SSE2
+        if (n >= 4) {
+            const __m128i zero = _mm_setzero_si128();
+            __m128i acc = zero;
+            for (; j + 4 <= n; j += 4) {
+                __m128i pix = _mm_loadl_epi64((const __m128i*)(p + (j << 1)));
+                __m128i wv = _mm_loadl_epi64((const __m128i*)(w + j));
+                pix = _mm_unpacklo_epi8(pix, zero);
+                pix = _mm_shufflelo_epi16(pix, _MM_SHUFFLE(3, 1, 2, 0));
+                pix = _mm_shufflehi_epi16(pix, _MM_SHUFFLE(3, 1, 2, 0));
+                wv = _mm_unpacklo_epi32(wv, wv);
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(pix, wv));
+            }
+            acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+            sum[0] = _mm_cvtsi128_si32(acc);
+            sum[1] = _mm_cvtsi128_si32(_mm_srli_si128(acc, 4));
+        }
+#endif /* SPXI_SSE2 */
+        for (; j < n; ++j) {
+            sum[0] += p[(j << 1)] * w[j];
+            sum[1] += p[(j << 1) + 1] * w[j];
+        }
+        *dst++ = spxResizeClampH(sum[0]);
+        *dst++ = spxResizeClampH(sum[1]);
+    }
+}
+
+static void spxResizeRowH4(const uint8_t* src, const int cmin, int16_t* dst,
+    const SpxResizeAxis* ax, const int x0, const int x1)
+{
+    int x, j, c;
+    for (x = x0; x < x1; ++x) {
+        const uint8_t* p = src + ((ax->bounds[x * 2] - cmin) << 2);
+        const int16_t* w = ax->weights + x * ax->ksize;
+        const int n = ax->bounds[x * 2 + 1];
+#ifdef SPXI_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc = _mm_set1_epi32(
+            1 << (SPXI_RESIZE_BITS - SPXI_RESIZE_EXTRA - 1)
+        );
+        for (j = 0; j + 2 <= n; j += 2) {
+            __m128i pix = _mm_loadl_epi64((const __m128i*)(p + (j << 2)));
+            __m128i wv = _mm_set1_epi32(
+                (int)((uint32_t)(uint16_t)w[j] | ((uint32_t)(uint16_t)w[j + 1] << 16))
+            );
+            pix = _mm_unpacklo_epi8(pix, zero);
+            pix = _mm_unpacklo_epi16(pix, _mm_srli_si128(pix, 8));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(pix, wv));
+        }
+        if (j < n) {
+            uint32_t last;
+            __m128i pix;
+            memcpy(&last, p + (j << 2), sizeof(last));
+            pix = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)last), zero);
+            pix = _mm_unpacklo_epi16(pix, zero);
+            acc = _mm_add_epi32(acc, 
+                _mm_madd_epi16(pix, _mm_set1_epi32((uint16_t)w[j]))
+            );
+        }
+        acc = _mm_srai_epi32(acc, SPXI_RESIZE_BITS - SPXI_RESIZE_EXTRA);
+        _mm_storel_epi64((__m128i*)dst, _mm_packs_epi32(acc, acc));
+        dst += 4;
+        (void)c;
+#else
+        int sum[4] = {0, 0, 0, 0};
+        for (j = 0; j < n; ++j) {
+            for (c = 0; c < 4; ++c) {
+                sum[c] += p[(j << 2) + c] * w[j];
+            }
+        }
+        for (c = 0; c < 4; ++c) {
+            *dst++ = spxResizeClampH(sum[c]);
+        }
+#endif /* SPXI_SSE2 */
+    }
+}
+
+static int16_t spxResizeClampWide(const int sum)
+{
+    const int n = (sum + (1 << (SPXI_RESIZE_BITS - 1))) >> SPXI_RESIZE_BITS;
+    return (int16_t)(n < -32768 ? -32768 : n > 32767 ? 32767 : n);
+}
+
+/* horizontal pass over premultiplied samples that already carry
+ * SPXI_RESIZE_EXTRA bits, for 2 and 4 channels */
+static void spxResizeRowHWide(const int16_t* src, const int cmin, int16_t* dst,
+    const SpxResizeAxis* ax, const int x0, const int x1, const int ic)
+{
+    int x, j, c;
+    for (x = x0; x < x1; ++x) {
+        const int16_t* p = src + (ax->bounds[x * 2] - cmin) * ic;
+        const int16_t* w = ax->weights + x * ax->ksize;
+        const int n = ax->bounds[x * 2 + 1];
+        int sum[4] = {0, 0, 0, 0};
+        j = 0;
+#ifdef SPXI_SSE2
+        if (ic == 4) {
+            __m128i acc = _mm_setzero_si128();
+            for (; j + 2 <= n; j += 2) {
+                const __m128i a = _mm_loadl_epi64((const __m128i*)(p + (j << 2)));
+                const __m128i b = _mm_loadl_epi64((const __m128i*)(p + (j << 2) + 4));
+                const __m128i wv = _mm_set1_epi32(
+                    (int)((uint32_t)(uint16_t)w[j] | ((uint32_t)(uint16_t)w[j + 1] << 16))
+                );
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wv));
+            }
+            _mm_storeu_si128((__m128i*)sum, acc);
+        }
+#endif /* SPXI_SSE2 */
+        for (; j < n; ++j) {
+            for (c = 0; c < ic; ++c) {
+                sum[c] += p[j * ic + c] * w[j];
+            }
+        }
+        for (c = 0; c < ic; ++c) {
+            *dst++ = spxResizeClampWide(sum[c]);
+        }
+    }
+}
+
+/* vertical pass over count intermediate samples of the rows of a tile */
+static void spxResizeRowV(const int16_t* tile, const int pitch, const int rmin,
+    const SpxResizeAxis* ax, const int y, uint8_t* dst, const int count)
+{
+    const int16_t* w = ax->weights + y * ax->ksize;
+    const int16_t* rows = tile + (ax->bounds[y * 2] - rmin) * pitch;
+    const int n = ax->bounds[y * 2 + 1];
+    int i = 0, k;
+
+#ifdef SPXI_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(
+        1 << (SPXI_RESIZE_BITS + SPXI_RESIZE_EXTRA - 1)
+    );
+    for (; i + 8 <= count; i += 8) {
+        __m128i lo = round, hi = round;
+        for (k = 0; k + 2 <= n; k += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows + k * pitch + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(rows + (k + 1) * pitch + i));
+            __m128i wv = _mm_set1_epi32(
+                (int)((uint32_t)(uint16_t)w[k] | ((uint32_t)(uint16_t)w[k + 1] << 16))
+            );
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wv));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wv));
+        }
+        if (k < n) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows + k * pitch + i));
+            __m128i wv = _mm_set1_epi32((uint16_t)w[k]);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), wv));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), wv));
+        }
+        lo = _mm_srai_epi32(lo, SPXI_RESIZE_BITS + SPXI_RESIZE_EXTRA);
+        hi = _mm_srai_epi32(hi, SPXI_RESIZE_BITS + SPXI_RESIZE_EXTRA);
+        lo = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(lo, lo));
+    }
+#endif /* SPXI_SSE2 */
+
+    for (; i < count; ++i) {
+        int sum = 0;
+        for (k = 0; k < n; ++k) {
+            sum += rows[k * pitch + i] * w[k];
+        }
+        dst[i] = spxResizeClampV(sum);
+    }
+}
+
+/* the same keeping SPXI_RESIZE_EXTRA bits, for premultiplied samples */
+static void spxResizeRowVWide(const int16_t* tile, const int pitch, const int rmin,
+    const SpxResizeAxis* ax, const int y, int16_t* dst, const int count)
+{
+    const int16_t* w = ax->weights + y * ax->ksize;
+    const int16_t* rows = tile + (ax->bounds[y * 2] - rmin) * pitch;
+    const int n = ax->bounds[y * 2 + 1];
+    int i = 0, k;
+
+#ifdef SPXI_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (SPXI_RESIZE_BITS - 1));
+    for (; i + 8 <= count; i += 8) {
+        __m128i lo = round, hi = round;
+        for (k = 0; k + 2 <= n; k += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows + k * pitch + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(rows + (k + 1) * pitch + i));
+            __m128i wv = _mm_set1_epi32(
+                (int)((uint32_t)(uint16_t)w[k] | ((uint32_t)(uint16_t)w[k + 1] << 16))
+            );
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wv));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wv));
+        }
+        if (k < n) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows + k * pitch + i));
+            __m128i wv = _mm_set1_epi32((uint16_t)w[k]);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), wv));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), wv));
+        }
+        lo = _mm_srai_epi32(lo, SPXI_RESIZE_BITS);
+        hi = _mm_srai_epi32(hi, SPXI_RESIZE_BITS);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(lo, hi));
+    }
+#endif /* SPXI_SSE2 */
+
+    for (; i < count; ++i) {
+        int sum = 0;
+        for (k = 0; k < n; ++k) {
+            sum += rows[k * pitch + i] * w[k];
+        }
+        dst[i] = spxResizeClampWide(sum);
+    }
+}
+
+/* copy source pixels [cmin, cmax) of a row into the layout the horizontal
+ * kernels read, RGB padded to 4 */
+static const uint8_t* spxResizePrepare(const uint8_t* row, const int cmin,
+    const int cmax, const int channels, uint8_t* scratch)
+{
+    int x;
+    const uint8_t* src = row + cmin * channels;
+    uint8_t* dst = scratch;
+
+    if (channels != 3) {
+        return src;
+    }
+
+    for (x = cmin; x < cmax; ++x, src += 3, dst += 4) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 0;
+    }
+    return scratch;
+}
+
+/* premultiply alpha of 2 and 4 channel pixels into samples with
+ * SPXI_RESIZE_EXTRA bits, so colors under low alpha keep their precision.
+ * 16448 / 65536 is 64 / 255 within a quarter of the last bit */
+static const int16_t* spxResizePremultiply(const uint8_t* row, const int cmin,
+    const int cmax, const int channels, int16_t* scratch)
+{
+    const int last = channels - 1;
+    const uint8_t* src = row + cmin * channels;
+    int16_t* dst = scratch;
+    int x, c;
+
+    for (x = cmin; x < cmax; ++x, src += channels, dst += channels) {
+        const int a = src[last];
+        for (c = 0; c < last; ++c) {
+            dst[c] = (int16_t)((src[c] * a * 16448 + 0x8000) >> 16);
+        }
+        dst[last] = (int16_t)(a << SPXI_RESIZE_EXTRA);
+    }
+    return scratch;
+}
+
+/* write a resampled row of premultiplied samples to the destination
+ * image, dividing colors by their alpha before dropping the extra bits */
+static void spxResizeFinish(const int16_t* src, uint8_t* dst, const int count,
+    const int channels)
+{
+    const int last = channels - 1;
+    int x, c;
+    for (x = 0; x < count; ++x, src += channels, dst += channels) {
+        const int a = src[last];
+        if (a <= 0) {
+            memset(dst, 0, channels);
+            continue;
+        }
+        for (c = 0; c < last; ++c) {
+            const int v = src[c] <= 0 ? 0 : (src[c] * 255 + (a >> 1)) / a;
+            dst[c] = (uint8_t)(v > 0xFF ? 0xFF : v);
+        }
+        c = (a + (1 << (SPXI_RESIZE_EXTRA - 1))) >> SPXI_RESIZE_EXTRA;
+        dst[last] = (uint8_t)(c > 0xFF ? 0xFF : c);
+    }
+}
+
+/* whether any alpha sample of a 2 or 4 channel image is not opaque */
+static int spxResizeTranslucent(const Img2D img)
+{
+    const size_t count = (size_t)img.width * img.height;
+    const uint8_t* p = img.pixbuf + img.channels - 1;
+    size_t i;
+    for (i = 0; i < count; ++i, p += img.channels) {
+        if (*p != 0xFF) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void spxResizeWork(void* arg, const int begin, const int end)
+{
+    const SpxResizeTask* task = (const SpxResizeTask*)arg;
+    const int ch = task->src.channels, ic = task->ic;
+    const size_t sstride = (size_t)task->src.width * ch;
+    const size_t dstride = (size_t)task->dst.width * ch;
+    size_t tilesize = 0;
+    int16_t* tile = NULL, *rowbuf;
+    uint8_t* scratch;
+    int b, x0, x1, y, r;
+
+    scratch = (uint8_t*)SPXI_MALLOC((size_t)task->src.width * ic * sizeof(int16_t) + 16);
+    rowbuf = (int16_t*)SPXI_MALLOC((SPXI_RESIZE_COLS * ic + 16) * sizeof(int16_t));
+
+    for (b = begin; b < end && scratch && rowbuf; ++b) {
+        const int y0 = b * SPXI_RESIZE_ROWS;
+        const int y1 = y0 + SPXI_RESIZE_ROWS < task->dst.height ?
+            y0 + SPXI_RESIZE_ROWS : task->dst.height;
+        const int rmin = task->v.bounds[y0 * 2];
+        const int rmax = task->v.bounds[(y1 - 1) * 2] + task->v.bounds[(y1 - 1) * 2 + 1];
+        const size_t need = (size_t)(rmax - rmin) * SPXI_RESIZE_COLS * ic;
+
+        if (need > tilesize) {
+            SPXI_FREE(tile);
+            tile = (int16_t*)SPXI_MALLOC(need * sizeof(int16_t));
+            tilesize = tile ? need : 0;
+            if (!tile) {
+                break;
+            }
+        }
+
+        for (x0 = 0; x0 < task->dst.width; x0 += SPXI_RESIZE_COLS) {
+            const int pitch = SPXI_RESIZE_COLS * ic;
+            int cmin, cmax, count;
+            x1 = x0 + SPXI_RESIZE_COLS < task->dst.width ? 
+                x0 + SPXI_RESIZE_COLS : task->dst.width;
+            count = (x1 - x0) * ic;
+            cmin = task->h.bounds[x0 * 2];
+            cmax = task->h.bounds[(x1 - 1) * 2] + task->h.bounds[(x1 - 1) * 2 + 1];
+
+            for (r = rmin; r < rmax; ++r) {
+                const uint8_t* row = task->src.pixbuf + r * sstride, *src;
+                int16_t* dst = tile + (r - rmin) * pitch;
+                if (task->premultiply) {
+                    spxResizeRowHWide(
+                        spxResizePremultiply(row, cmin, cmax, ch, (int16_t*)scratch),
+                        cmin, dst, &task->h, x0, x1, ic
+                    );
+                    continue;
+                }
+
+                src = spxResizePrepare(row, cmin, cmax, ch, scratch);
+                switch (ic) {
+                    case 1: spxResizeRowH1(src, cmin, dst, &task->h, x0, x1); break;
+                    case 2: spxResizeRowH2(src, cmin, dst, &task->h, x0, x1); break;
+                    default: spxResizeRowH4(src, cmin, dst, &task->h, x0, x1);
+                }
+            }
+
+            for (y = y0; y < y1; ++y) {
+                uint8_t* dst = task->dst.pixbuf + y * dstride + x0 * ch;
+                uint8_t* out = (uint8_t*)rowbuf;
+                if (task->premultiply) {
+                    spxResizeRowVWide(tile, pitch, rmin, &task->v, y, rowbuf, count);
+                    spxResizeFinish(rowbuf, dst, x1 - x0, ch);
+                } else if (ic == ch) {
+                    spxResizeRowV(tile, pitch, rmin, &task->v, y, dst, count);
+                } else {
+                    spxResizeRowV(tile, pitch, rmin, &task->v, y, out, count);
+                    for (r = 0; r < x1 - x0; ++r, dst += 3, out += 4) {
+                        dst[0] = out[0];
+                        dst[1] = out[1];
+                        dst[2] = out[2];
+                    }
+                }
+            }
+        }
+    }
+
+    SPXI_FREE(tile);
+    SPXI_FREE(scratch);
+    SPXI_FREE(rowbuf);
+}
+
+Img2D spxImageResize(const Img2D img, int width, int height, int filter)
+{
+    SpxResizeTask task;
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+
+    if (!img.pixbuf || img.channels < 1 || img.channels > 4 ||
+        width <= 0 || height <= 0) {
+        fprintf(stderr, "spximg does not support resize from %dx%d to %dx%d\n",
+            img.width, img.height, width, height
+        );
+        return ret;
+    }
+
+    if (img.pixbuf && !spxImagePacked(img)) {
+        Img2D tmp = spxImagePack(img);
+        ret = tmp.pixbuf ? spxImageResize(tmp, width, height, filter) : ret;
+        spxImageFree(&tmp);
+        return ret;
+    }
+
+    if (spxImagePlanar(img)) {
+        Img2D tmp = spxImageLayout(img, SPXI_LAYOUT_INTERLEAVED), out;
+        out = tmp.pixbuf ? spxImageResize(tmp, width, height, filter) : ret;
+        ret = out.pixbuf ? spxImageLayout(out, SPXI_LAYOUT_PLANAR) : ret;
+        spxImageFree(&tmp);
+        spxImageFree(&out);
+        return ret;
+    }
+
+    /* filters run on 8 bit samples */
+    if (img.palette || spxSampleSize(img) > 1) {
+        Img2D tmp = img.palette ? spxImageReshape(img, 4) : spxImageDepth(img, 8);
+        ret = tmp.pixbuf ? spxImageResize(tmp, width, height, filter) : ret;
+        spxImageFree(&tmp);
+        return ret;
+    }
+
+    filter = filter < SPXI_FILTER_BOX || filter > SPXI_FILTER_LANCZOS3 ?
+        SPXI_FILTER_LANCZOS3 : filter;
+
+    spxStatsBegin(SPXI_FORMAT_UNKNOWN);
+    spxStatsPush(SPXI_STAGE_CONVERT);
+
+    task.src = img;
+    task.ic = img.channels == 3 ? 4 : img.channels;
+    task.h.bounds = task.v.bounds = NULL;
+    task.h.weights = task.v.weights = NULL;
+    task.premultiply = !(img.channels & 1) && spxResizeTranslucent(img);
+
+    if (!spxResizeAxisInit(&task.h, img.width, width, filter) &&
+        !spxResizeAxisInit(&task.v, img.height, height, filter)) {
+        task.dst = ret;
+        task.dst.width = width;
+        task.dst.height = height;
+        task.dst.channels = img.channels;
+        task.dst.pixbuf = spxPixbufAlloc((size_t)width * height * img.channels);
+        if (task.dst.pixbuf) {
+            spxParallelFor(
+                (height + SPXI_RESIZE_ROWS - 1) / SPXI_RESIZE_ROWS, 1,
+                &spxResizeWork, &task
+            );
+            ret = task.dst;
+        }
+    }
+
+    spxResizeAxisFree(&task.h);
+    spxResizeAxisFree(&task.v);
+    spxStatsPop();
+    spxStatsEnd();
+    return ret;
+}
+
+/* Image Rotate, Flip and Transpose Implementation */
+
+#define SPXI_TRANSFORM_TILE     64
+
+typedef struct SpxTransformTask {
+    Img2D src;
+    Img2D dst;
+    int transform;
+} SpxTransformTask;
+
+/* write count pixels of src into dst in reverse order */
+static void spxTransformReverse(uint8_t* dst, const uint8_t* src,
+    const int count, const int ch)
+{
+    int i = 0, c;
+#ifdef SPXI_SSE2
+    if (ch == 1) {
+        for (; i + 16 <= count; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + count - 16 - i));
+            v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i*)(dst + i), v);
+        }
+    } else if (ch == 2) {
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + (count - 8 - i) * 2));
+            v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            _mm_storeu_si128((__m128i*)(dst + i * 2), v);
+        }
+    } else if (ch == 4) {
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + (count - 4 - i) * 4));
+            v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+            _mm_storeu_si128((__m128i*)(dst + i * 4), v);
+        }
+    }
+#endif /* SPXI_SSE2 */
+    for (; i < count; ++i) {
+        const uint8_t* s = src + (size_t)(count - 1 - i) * ch;
+        for (c = 0; c < ch; ++c) {
+            dst[i * ch + c] = s[c];
+        }
+    }
+}
+
+#ifdef SPXI_SSE2
+
+/* in register transposes of 8x8 gray, 8x8 gray alpha and 4x4 RGBA blocks,
+ * dst points to the output row of the first source column and step is
+ * the signed distance between output rows */
+
+static __m128i spxTransposeReverse8(__m128i v)
+{
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static void spxTransposeBlock1(const uint8_t* src, const size_t sstride,
+    uint8_t* dst, const ptrdiff_t step, const int reverse)
+{
+    int k;
+    __m128i a[8], b[4], c[4], d[4];
+    for (k = 0; k < 8; ++k) {
+        a[k] = _mm_loadl_epi64((const __m128i*)(src + k * sstride));
+    }
+
+    b[0] = _mm_unpacklo_epi8(a[0], a[1]);
+    b[1] = _mm_unpacklo_epi8(a[2], a[3]);
+    b[2] = _mm_unpacklo_epi8(a[4], a[5]);
+    b[3] = _mm_unpacklo_epi8(a[6], a[7]);
+    c[0] = _mm_unpacklo_epi16(b[0], b[1]);
+    c[1] = _mm_unpackhi_epi16(b[0], b[1]);
+    c[2] = _mm_unpacklo_epi16(b[2], b[3]);
+    c[3] = _mm_unpackhi_epi16(b[2], b[3]);
+    d[0] = _mm_unpacklo_epi32(c[0], c[2]);
+    d[1] = _mm_unpackhi_epi32(c[0], c[2]);
+    d[2] = _mm_unpacklo_epi32(c[1], c[3]);
+    d[3] = _mm_unpackhi_epi32(c[1], c[3]);
+
+    for (k = 0; k < 8; ++k) {
+        __m128i v = (k & 1) ? _mm_srli_si128(d[k >> 1], 8) : d[k >> 1];
+        v = reverse ? spxTransposeReverse8(v) : v;
+        _mm_storel_epi64((__m128i*)(dst + k * step), v);
+    }
+}
+
+static void spxTransposeBlock2(const uint8_t* src, const size_t sstride,
+    uint8_t* dst, const ptrdiff_t step, const int reverse)
+{
+    int k;
+    __m128i a[8], b[8], c[8];
+    for (k = 0; k < 8; ++k) {
+        a[k] = _mm_loadu_si128((const __m128i*)(src + k * sstride));
+    }
+
+    for (k = 0; k < 8; k += 2) {
+        b[k] = _mm_unpacklo_epi16(a[k], a[k + 1]);
+        b[k + 1] = _mm_unpackhi_epi16(a[k], a[k + 1]);
+    }
+
+    for (k = 0; k < 8; k += 4) {
+        c[k] = _mm_unpacklo_epi32(b[k], b[k + 2]);
+        c[k + 1] = _mm_unpackhi_epi32(b[k], b[k + 2]);
+        c[k + 2] = _mm_unpacklo_epi32(b[k + 1], b[k + 3]);
+        c[k + 3] = _mm_unpackhi_epi32(b[k + 1], b[k + 3]);
+    }
+
+    for (k = 0; k < 4; ++k) {
+        __m128i lo = _mm_unpacklo_epi64(c[k], c[k + 4]);
+        __m128i hi = _mm_unpackhi_epi64(c[k], c[k + 4]);
+        if (reverse) {
+            lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(0, 1, 2, 3));
+            lo = _mm_shufflelo_epi16(lo, _MM_SHUFFLE(2, 3, 0, 1));
+            lo = _mm_shufflehi_epi16(lo, _MM_SHUFFLE(2, 3, 0, 1));
+            hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(0, 1, 2, 3));
+            hi = _mm_shufflelo_epi16(hi, _MM_SHUFFLE(2, 3, 0, 1));
+            hi = _mm_shufflehi_epi16(hi, _MM_SHUFFLE(2, 3, 0, 1));
+        }
+        _mm_storeu_si128((__m128i*)(dst + (2 * k) * step), lo);
+        _mm_storeu_si128((__m128i*)(dst + (2 * k + 1) * step), hi);
+    }
+}
+
+static void spxTransposeBlock4(const uint8_t* src, const size_t sstride,
+    uint8_t* dst, const ptrdiff_t step, const int reverse)
+{
+    int k;
+    __m128i a[4], t[4], r[4];
+    for (k = 0; k < 4; ++k) {
+        a[k] = _mm_loadu_si128((const __m128i*)(src + k * sstride));
+    }
+
+    t[0] = _mm_unpacklo_epi32(a[0], a[1]);
+    t[1] = _mm_unpacklo_epi32(a[2], a[3]);
+    t[2] = _mm_unpackhi_epi32(a[0], a[1]);
+    t[3] = _mm_unpackhi_epi32(a[2], a[3]);
+    r[0] = _mm_unpacklo_epi64(t[0], t[1]);
+    r[1] = _mm_unpackhi_epi64(t[0], t[1]);
+    r[2] = _mm_unpacklo_epi64(t[2], t[3]);
+    r[3] = _mm_unpackhi_epi64(t[2], t[3]);
+
+    for (k = 0; k < 4; ++k) {
+        if (reverse) {
+            r[k] = _mm_shuffle_epi32(r[k], _MM_SHUFFLE(0, 1, 2, 3));
+        }
+        _mm_storeu_si128((__m128i*)(dst + k * step), r[k]);
+    }
+}
+
+#endif /* SPXI_SSE2 */
+
+/* transform source rows [y0, y1) held in rows into their place in dst,
+ * transposing tile by tile so neither side is walked column by column */
+static void spxTransformStrip(const Img2D src, const int y0, const int y1,
+    const uint8_t* rows, const size_t rstride, const Img2D dst, const int transform)
+{
+    const int ch = src.channels;
+    const int flipx = transform & SPXI_TRANSFORM_FLIP_X;
+    const int flipy = transform & SPXI_TRANSFORM_FLIP_Y;
+    const size_t dstride = (size_t)dst.width * ch;
+    int x, y, tx, ty, bx, by, c;
+    int block = ch == 4 ? 4 : 8;
+    void (*kernel)(const uint8_t*, size_t, uint8_t*, ptrdiff_t, int) = NULL;
+
+    if (!(transform & SPXI_TRANSFORM_TRANSPOSE)) {
+        for (y = y0; y < y1; ++y) {
+            const uint8_t* s = rows + (size_t)(y - y0) * rstride;
+            uint8_t* d = dst.pixbuf + (size_t)(flipy ? src.height - 1 - y : y) * dstride;
+            if (flipx) {
+                spxTransformReverse(d, s, src.width, ch);
+            } else {
+                memcpy(d, s, (size_t)src.width * ch);
+            }
+        }
+        return;
+    }
+
+#ifdef SPXI_SSE2
+    switch (ch) {
+        case 1: kernel = &spxTransposeBlock1; break;
+        case 2: kernel = &spxTransposeBlock2; break;
+        case 4: kernel = &spxTransposeBlock4; break;
+    }
+#endif /* SPXI_SSE2 */
+
+    for (ty = y0; ty < y1; ty += SPXI_TRANSFORM_TILE) {
+        const int tyend = ty + SPXI_TRANSFORM_TILE < y1 ? ty + SPXI_TRANSFORM_TILE : y1;
+        for (tx = 0; tx < src.width; tx += SPXI_TRANSFORM_TILE) {
+            const int txend = tx + SPXI_TRANSFORM_TILE < src.width ?
+                tx + SPXI_TRANSFORM_TILE : src.width;
+            for (by = ty; by < tyend; by += block) {
+                const int byend = by + block < tyend ? by + block : tyend;
+                for (bx = tx; bx < txend; bx += block) {
+                    const int bxend = bx + block < txend ? bx + block : txend;
+                    if (kernel && byend - by == block && bxend - bx == block) {
+                        const int dy = flipy ? dst.height - 1 - bx : bx;
+                        const int dx = flipx ? dst.width - block - by : by;
+                        kernel(
+                            rows + (size_t)(by - y0) * rstride + (size_t)bx * ch, rstride,
+                            dst.pixbuf + (size_t)dy * dstride + (size_t)dx * ch,
+                            flipy ? -(ptrdiff_t)dstride : (ptrdiff_t)dstride, flipx
+                        );
+                        continue;
+                    }
+                    for (y = by; y < byend; ++y) {
+                        const uint8_t* s = rows + (size_t)(y - y0) * rstride + (size_t)bx * ch;
+                        const int dx = flipx ? dst.width - 1 - y : y;
+                        for (x = bx; x < bxend; ++x, s += ch) {
+                            const int dy = flipy ? dst.height - 1 - x : x;
+                            uint8_t* d = dst.pixbuf + (size_t)dy * dstride + (size_t)dx * ch;
+                            for (c = 0; c < ch; ++c) {
+                                d[c] = s[c];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static Img2D spxTransformCreate(const Img2D img, const int transform)
+{
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    const int transpose = transform & SPXI_TRANSFORM_TRANSPOSE;
+    if (img.palette) {
+        ret = spxIndexedCreate(transpose ? img.height : img.width,
+            transpose ? img.width : img.height
+        );
+        if (ret.palette) {
+            memcpy(ret.palette, img.palette, SPXI_PALETTE_SIZE);
+        }
+        return ret;
+    }
+
+    ret.width = transpose ? img.height : img.width;
+    ret.height = transpose ? img.width : img.height;
+    ret.channels = img.channels;
+    ret.depth = img.depth;
+    ret.layout = img.layout;
+    ret.pixbuf = spxPixbufAlloc(
+        (size_t)img.width * img.height * img.channels * spxSampleSize(img)
+    );
+    return ret;
+}
+
+static void spxTransformWork(void* arg, const int begin, const int end)
+{
+    const SpxTransformTask* task = (const SpxTransformTask*)arg;
+    const size_t stride = (size_t)task->src.width * task->src.channels;
+    const int y0 = begin * SPXI_TRANSFORM_TILE;
+    const int y1 = end * SPXI_TRANSFORM_TILE < task->src.height ?
+        end * SPXI_TRANSFORM_TILE : task->src.height;
+    spxTransformStrip(
+        task->src, y0, y1, task->src.pixbuf + y0 * stride, stride,
+        task->dst, task->transform
+    );
+}
+
+Img2D spxImageTransform(const Img2D img, const int transform)
+{
+    SpxTransformTask task;
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    int c, planes = spxImagePlanar(img) ? img.channels : 1;
+    size_t plane;
+    if (!img.pixbuf || img.channels < 1 || img.channels > 4 ||
+        transform < SPXI_TRANSFORM_NONE || transform > SPXI_TRANSFORM_TRANSVERSE) {
+        fprintf(stderr, "spximg does not support transform %d\n", transform);
+        return ret;
+    }
+
+    if (img.pixbuf && !spxImagePacked(img)) {
+        Img2D tmp = spxImagePack(img);
+        ret = tmp.pixbuf ? spxImageTransform(tmp, transform) : ret;
+        spxImageFree(&tmp);
+        return ret;
+    }
+
+    spxStatsBegin(SPXI_FORMAT_UNKNOWN);
+    spxStatsPush(SPXI_STAGE_CONVERT);
+
+    /* 16 bit samples move as pixels of twice as many bytes, and planar
+     * images turn one plane at a time as if they had a single channel */
+    task.src = img;
+    task.src.channels = spxSampleSize(img) * img.channels / planes;
+    ret = spxTransformCreate(img, transform);
+    task.dst = ret;
+    task.dst.channels = task.src.channels;
+    task.transform = transform;
+    plane = (size_t)img.width * img.height * task.src.channels;
+    for (c = 0; ret.pixbuf && c < planes; ++c) {
+        task.src.pixbuf = img.pixbuf + c * plane;
+        task.dst.pixbuf = ret.pixbuf + c * plane;
+        spxParallelFor(
+            (img.height + SPXI_TRANSFORM_TILE - 1) / SPXI_TRANSFORM_TILE, 1,
+            &spxTransformWork, &task
+        );
+    }
+
+    spxStatsPop();
+    spxStatsEnd();
+    return ret;
+}
+
+/* Fused Operation Pipeline */
+
+#define SPXI_APPLY_CHAIN        8
+
+typedef struct SpxApplyTask {
+    Img2D src;
+    Img2D dst;
+    SpxReshapeFunc funcs[SPXI_APPLY_CHAIN];
+    int rect[4];
+    int steps;
+    int transform;
+    int srcpixel;
+    int samplesize;
+} SpxApplyTask;
+
+/* where transform moves pixel (x, y) of a width by height image */
+static void spxTransformPoint(const int transform, const int width, const int height,
+    int* x, int* y)
+{
+    const int transpose = transform & SPXI_TRANSFORM_TRANSPOSE;
+    const int tx = transpose ? *y : *x, ty = transpose ? *x : *y;
+    *x = (transform & SPXI_TRANSFORM_FLIP_X) ? (transpose ? height : width) - 1 - tx : tx;
+    *y = (transform & SPXI_TRANSFORM_FLIP_Y) ? (transpose ? width : height) - 1 - ty : ty;
+}
+
+/* the one transform doing first and then second, found by following
+ * three corners of a 2 by 3 image through both */
+static int spxTransformCompose(const int first, const int second)
+{
+    const int transpose = first & SPXI_TRANSFORM_TRANSPOSE;
+    int t, k;
+    for (t = SPXI_TRANSFORM_NONE; t <= SPXI_TRANSFORM_TRANSVERSE; ++t) {
+        for (k = 0; k < 3; ++k) {
+            int ax = k == 1, ay = k == 2, bx = ax, by = ay;
+            spxTransformPoint(first, 2, 3, &ax, &ay);
+            spxTransformPoint(second, transpose ? 3 : 2, transpose ? 2 : 3, &ax, &ay);
+            spxTransformPoint(t, 2, 3, &bx, &by);
+            if (ax != bx || ay != by) {
+                break;
+            }
+        }
+        if (k == 3) {
+            return t;
+        }
+    }
+    return SPXI_TRANSFORM_NONE;
+}
+
+/* reshaping s to m to c gives the same as s to c unless m drops the
+ * color or the alpha that both s and c have */
+static int spxReshapeFuses(const int s, const int m, const int c)
+{
+    return !(s >= 3 && c >= 3 && m < 3) && !(!(s & 1) && !(c & 1) && (m & 1));
+}
+
+/* crop, reshape and transform a range of tiles, the rows of each tile
+ * are reshaped into a strip buffer and moved into place from there */
+static void spxApplyWork(void* arg, const int begin, const int end)
+{
+    const SpxApplyTask* task = (const SpxApplyTask*)arg;
+    const size_t width = task->rect[2];
+    const size_t sstride = spxImageStride(task->src);
+    const size_t stride = width * task->dst.channels;
+    const int y0 = begin * SPXI_TRANSFORM_TILE;
+    const int y1 = end * SPXI_TRANSFORM_TILE < task->rect[3] ?
+        end * SPXI_TRANSFORM_TILE : task->rect[3];
+    const uint8_t* rows = task->src.pixbuf + (size_t)(task->rect[1] + y0) * sstride +
+        (size_t)task->rect[0] * task->srcpixel;
+    const size_t linesize = width * 4 * task->samplesize;
+    Img2D view = task->dst;
+    uint8_t* strip, *lines[2];
+    int y, ty, k;
+
+    view.width = task->rect[2];
+    view.height = task->rect[3];
+    if (!task->steps) {
+        spxTransformStrip(view, y0, y1, rows, sstride, task->dst, task->transform);
+        return;
+    }
+
+    strip = (uint8_t*)SPXI_MALLOC(SPXI_TRANSFORM_TILE * stride + 2 * linesize);
+    if (!strip) {
+        return;
+    }
+
+    lines[0] = strip + SPXI_TRANSFORM_TILE * stride;
+    lines[1] = lines[0] + linesize;
+    for (ty = y0; ty < y1; ty += SPXI_TRANSFORM_TILE) {
+        const int tyend = ty + SPXI_TRANSFORM_TILE < y1 ? ty + SPXI_TRANSFORM_TILE : y1;
+        for (y = ty; y < tyend; ++y, rows += sstride) {
+            const uint8_t* in = rows;
+            uint8_t* out = task->transform == SPXI_TRANSFORM_NONE ?
+                task->dst.pixbuf + (size_t)y * stride : strip + (size_t)(y - ty) * stride;
+            for (k = 0; k < task->steps; ++k) {
+                uint8_t* to = k + 1 == task->steps ? out : lines[k & 1];
+                task->funcs[k](in, to, (int)width);
+                in = to;
+            }
+        }
+        if (task->transform != SPXI_TRANSFORM_NONE) {
+            spxTransformStrip(view, ty, tyend, strip, stride, task->dst, task->transform);
+        }
+    }
+    SPXI_FREE(strip);
+}
+
+/* run a crop rect, transform and reshape chain in one pass over the
+ * image; palette and planar images are cropped and turned first and
+ * reshaped whole afterwards */
+static Img2D spxApplySegment(const Img2D img, const int* rect, const int transform,
+    const int* chain, const int steps, const int expand)
+{
+    SpxApplyTask task;
+    Img2D view = img, ret;
+    const int fused = !img.palette && img.layout != SPXI_LAYOUT_PLANAR;
+    int c, k, planes;
+    size_t plane;
+
+    if ((!steps || !fused) && transform == SPXI_TRANSFORM_NONE && !rect[0] && !rect[1] &&
+        rect[2] == img.width && rect[3] == img.height) {
+        ret = spxImageCopy(img);
+    } else {
+        spxStatsBegin(SPXI_FORMAT_UNKNOWN);
+        spxStatsPush(SPXI_STAGE_CONVERT);
+        task.samplesize = spxSampleSize(img);
+        task.steps = fused ? steps : 0;
+        for (k = 0; k < task.steps; ++k) {
+            const int from = chain[k] - 1, to = chain[k + 1] - 1;
+            task.funcs[k] = spxReshapeKernels[task.samplesize - 1][from][to];
+        }
+        memcpy(task.rect, rect, sizeof(task.rect));
+        task.transform = transform;
+
+        view.width = rect[2];
+        view.height = rect[3];
+        view.channels = task.steps ? chain[steps] : img.channels;
+        ret = spxTransformCreate(view, transform);
+
+        /* planes are moved one at a time as single channel images */
+        planes = spxImagePlanar(img) ? img.channels : 1;
+        plane = spxImageStride(img) * img.height;
+        task.src = img;
+        task.srcpixel = img.channels * task.samplesize / planes;
+        task.dst = ret;
+        task.dst.channels = view.channels * task.samplesize / planes;
+        for (c = 0; ret.pixbuf && c < planes; ++c) {
+            task.src.pixbuf = img.pixbuf + c * plane;
+            task.dst.pixbuf = ret.pixbuf + c * (size_t)rect[2] * rect[3] * task.samplesize;
+            spxParallelFor(
+                (rect[3] + SPXI_TRANSFORM_TILE - 1) / SPXI_TRANSFORM_TILE, 1,
+                &spxApplyWork, &task
+            );
+        }
+
+        spxStatsPop();
+        spxStatsEnd();
+    }
+
+    for (k = 0; ret.pixbuf && !fused && k < steps + (img.palette && expand && !steps); ++k) {
+        Img2D tmp = spxImageReshape(ret, k < steps ? chain[k + 1] : 4);
+        spxImageFree(&ret);
+        ret = tmp;
+    }
+
+    return ret;
+}
+
+Img2D spxImageApply(const Img2D img, const SpxImageOp* ops, const int count)
+{
+    Img2D cur = img, next = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    int i = 0, j, owned = 0;
+
+    if (!img.pixbuf || count < 0 || (count && !ops)) {
+        fprintf(stderr, "spximg cannot apply operations to an empty image\n");
+        return next;
+    }
+
+    while (i < count) {
+        if (ops[i].type == SPXI_OP_RESIZE) {
+            next = spxImageResize(cur, ops[i].args[0], ops[i].args[1], ops[i].args[2]);
+            ++i;
+        } else {
+            int rect[4], chain[SPXI_APPLY_CHAIN + 1];
+            int transform = SPXI_TRANSFORM_NONE, steps = 0, expand = 0, valid = 1;
+            rect[0] = rect[1] = 0;
+            rect[2] = cur.width;
+            rect[3] = cur.height;
+            chain[0] = cur.palette ? 4 : cur.channels;
+
+            /* crops and transforms compose into one crop of the source
+             * followed by one transform, reshapes commute with both */
+            for (j = i; j < count && ops[j].type != SPXI_OP_RESIZE; ++j) {
+                const int* a = ops[j].args;
+                const int transpose = transform & SPXI_TRANSFORM_TRANSPOSE;
+                const int width = transpose ? rect[3] : rect[2];
+                const int height = transpose ? rect[2] : rect[3];
+                if (ops[j].type == SPXI_OP_RESHAPE && a[0] > 0 && a[0] <= 4) {
+                    expand = 1;
+                    if (a[0] != chain[steps]) {
+                        chain[++steps] = a[0];
+                    }
+                    while (steps >= 2 && spxReshapeFuses(
+                            chain[steps - 2], chain[steps - 1], chain[steps])) {
+                        chain[steps - 1] = chain[steps];
+                        steps -= 1 + (chain[steps - 1] == chain[steps - 2]);
+                    }
+                    if (steps == SPXI_APPLY_CHAIN) {
+                        ++j;
+                        break;
+                    }
+                } else if (ops[j].type == SPXI_OP_TRANSFORM &&
+                    a[0] >= SPXI_TRANSFORM_NONE && a[0] <= SPXI_TRANSFORM_TRANSVERSE) {
+                    transform = spxTransformCompose(transform, a[0]);
+                } else if (ops[j].type == SPXI_OP_CROP && a[0] >= 0 && a[1] >= 0 &&
+                    a[2] > 0 && a[3] > 0 && a[0] + a[2] <= width && a[1] + a[3] <= height) {
+                    int inverse = SPXI_TRANSFORM_NONE;
+                    int x0 = a[0], y0 = a[1], x1 = a[0] + a[2] - 1, y1 = a[1] + a[3] - 1;
+                    while (spxTransformCompose(transform, inverse) != SPXI_TRANSFORM_NONE) {
+                        ++inverse;
+                    }
+                    spxTransformPoint(inverse, width, height, &x0, &y0);
+                    spxTransformPoint(inverse, width, height, &x1, &y1);
+                    rect[0] += x0 < x1 ? x0 : x1;
+                    rect[1] += y0 < y1 ? y0 : y1;
+                    rect[2] = (x0 < x1 ? x1 - x0 : x0 - x1) + 1;
+                    rect[3] = (y0 < y1 ? y1 - y0 : y0 - y1) + 1;
+                } else {
+                    fprintf(stderr, "spximg does not support operation %d (%d %d %d %d) "
+                        "on a %dx%d image\n", ops[j].type, a[0], a[1], a[2], a[3],
+                        width, height
+                    );
+                    valid = 0;
+                    break;
+                }
+            }
+
+            next.pixbuf = NULL;
+            if (valid) {
+                next = spxApplySegment(cur, rect, transform, chain, steps, expand);
+            }
+            i = j;
+        }
+
+        if (owned) {
+            spxImageFree(&cur);
+        }
+        if (!next.pixbuf) {
+            Img2D empty = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+            return empty;
+        }
+        cur = next;
+        owned = 1;
+    }
+
+    return owned ? cur : spxImageCopy(img);
+}
+
+Img2D spxImageCrop(const Img2D img, int x, int y, int width, int height)
+{
+    SpxImageOp op;
+    op.type = SPXI_OP_CROP;
+    op.args[0] = x;
+    op.args[1] = y;
+    op.args[2] = width;
+    op.args[3] = height;
+    return spxImageApply(img, &op, 1);
+}
+
+/* Palette Quantization */
+
+#ifndef SPXI_QUANTIZE_SAMPLES
+#define SPXI_QUANTIZE_SAMPLES   (1 << 18)
+#endif /* SPXI_QUANTIZE_SAMPLES */
+
+#define SPXI_QUANTIZE_CACHE     4096
+
+typedef struct SpxColorBox {
+    int begin;
+    int end;
+    uint8_t min[4];
+    uint8_t max[4];
+} SpxColorBox;
+
+typedef struct SpxQuantizeTask {
+    const uint8_t* src;
+    Img2D dst;
+    int count;
+} SpxQuantizeTask;
+
+static void spxColorBoxFit(SpxColorBox* box, const uint8_t* colors)
+{
+    int i, c;
+    memset(box->min, 0xFF, 4);
+    memset(box->max, 0, 4);
+    for (i = box->begin; i < box->end; ++i) {
+        for (c = 0; c < 4; ++c) {
+            uint8_t v = colors[(i << 2) + c];
+            box->min[c] = v < box->min[c] ? v : box->min[c];
+            box->max[c] = v > box->max[c] ? v : box->max[c];
+        }
+    }
+}
+
+static int spxColorBoxWidest(const SpxColorBox* box)
+{
+    int c, widest = 0;
+    for (c = 1; c < 4; ++c) {
+        if (box->max[c] - box->min[c] > box->max[widest] - box->min[widest]) {
+            widest = c;
+        }
+    }
+    return widest;
+}
+
+/* split a box at the median of its widest channel, found by counting,
+ * samples at or below it are swapped in front of the rest in place */
+static void spxColorBoxSplit(SpxColorBox* box, SpxColorBox* next, uint8_t* colors)
+{
+    int i, m, c = spxColorBoxWidest(box), left = box->begin, right = box->end, sum = 0;
+    int count[256], half = (box->end - box->begin) >> 1;
+
+    memset(count, 0, sizeof(count));
+    for (i = box->begin; i < box->end; ++i) {
+        ++count[colors[(i << 2) + c]];
+    }
+
+    for (m = box->min[c]; m < box->max[c] - 1 && sum + count[m] < half; ++m) {
+        sum += count[m];
+    }
+
+    while (left < right) {
+        if (colors[(left << 2) + c] <= m) {
+            ++left;
+        } else {
+            uint8_t tmp[4];
+            --right;
+            memcpy(tmp, colors + (left << 2), 4);
+            memcpy(colors + (left << 2), colors + (right << 2), 4);
+            memcpy(colors + (right << 2), tmp, 4);
+        }
+    }
+
+    next->begin = left;
+    next->end = box->end;
+    box->end = next->begin;
+    spxColorBoxFit(box, colors);
+    spxColorBoxFit(next, colors);
+}
+
+/* median cut over a sample of the pixels, each box becomes its mean */
+static int spxPaletteMedianCut(const Img2D img, uint8_t* palette, const int colors)
+{
+    SpxColorBox boxes[SPXI_PALETTE_COLORS];
+    const size_t size = (size_t)img.width * img.height;
+    const size_t step = size > SPXI_QUANTIZE_SAMPLES ? size / SPXI_QUANTIZE_SAMPLES : 1;
+    int i, j, c, count = 1, samples = (int)(size / step);
+    uint8_t* buf;
+
+    if (samples <= 0 || !(buf = (uint8_t*)spxMalloc((size_t)samples << 2))) {
+        return 0;
+    }
+
+    for (i = 0; i < samples; ++i) {
+        memcpy(buf + (i << 2), img.pixbuf + ((size_t)i * step << 2), 4);
+    }
+
+    boxes[0].begin = 0;
+    boxes[0].end = samples;
+    spxColorBoxFit(boxes, buf);
+    while (count < colors) {
+        int best = -1;
+        long score, bestscore = 0;
+        for (i = 0; i < count; ++i) {
+            c = spxColorBoxWidest(boxes + i);
+            score = (long)(boxes[i].max[c] - boxes[i].min[c]) * (boxes[i].end - boxes[i].begin);
+            if (score > bestscore) {
+                bestscore = score;
+                best = i;
+            }
+        }
+
+        if (best < 0) {
+            break;
+        }
+
+        spxColorBoxSplit(boxes + best, boxes + count++, buf);
+    }
+
+    for (i = 0; i < count; ++i) {
+        for (c = 0; c < 4; ++c) {
+            long sum = 0, n = boxes[i].end - boxes[i].begin;
+            for (j = boxes[i].begin; j < boxes[i].end; ++j) {
+                sum += buf[(j << 2) + c];
+            }
+            palette[(i << 2) + c] = (uint8_t)(n ? (sum + n / 2) / n : 0);
+        }
+    }
+
+    SPXI_FREE(buf);
+    return count;
+}
+
+/* the palette itself when the image has no more distinct colors */
+static int spxPaletteExact(const Img2D img, uint8_t* palette, const int colors)
+{
+    uint32_t table[SPXI_PALETTE_COLORS * 2];
+    uint8_t used[SPXI_PALETTE_COLORS * 2];
+    const size_t size = (size_t)img.width * img.height;
+    size_t i;
+    int count = 0;
+
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < size; ++i) {
+        uint32_t color, h;
+        memcpy(&color, img.pixbuf + (i << 2), 4);
+        h = (color * 2654435761U) >> 23;
+        while (used[h] && table[h] != color) {
+            h = (h + 1) & (SPXI_PALETTE_COLORS * 2 - 1);
+        }
+        if (!used[h]) {
+            if (count == colors) {
+                return 0;
+            }
+            used[h] = 1;
+            table[h] = color;
+            memcpy(palette + (count++ << 2), &color, 4);
+        }
+    }
+
+    return count;
+}
+
+/* index of the closest palette entry by squared RGBA distance */
+static int spxPaletteNearest(const uint8_t* palette, const int count, const uint8_t* px)
+{
+    int i, j, best = 0, bestdist = 0x7FFFFFFF;
+#ifdef SPXI_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i p;
+    memcpy(&i, px, 4);
+    p = _mm_unpacklo_epi8(_mm_cvtsi32_si128(i), zero);
+    p = _mm_unpacklo_epi64(p, p);
+    for (i = 0; i < count; i += 4) {
+        int dist[4];
+        __m128i e = _mm_loadu_si128((const __m128i*)(palette + (i << 2)));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(e, zero), p);
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(e, zero), p);
+        __m128 a, b;
+        lo = _mm_madd_epi16(lo, lo);
+        hi = _mm_madd_epi16(hi, hi);
+        a = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+        b = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_si128(
+            (__m128i*)dist, _mm_add_epi32(_mm_castps_si128(a), _mm_castps_si128(b))
+        );
+        for (j = 0; j < 4 && i + j < count; ++j) {
+            if (dist[j] < bestdist) {
+                bestdist = dist[j];
+                best = i + j;
+            }
+        }
+    }
+#else
+    for (i = 0; i < count; ++i) {
+        int d = 0;
+        for (j = 0; j < 4; ++j) {
+            int v = palette[(i << 2) + j] - px[j];
+            d += v * v;
+        }
+        if (d < bestdist) {
+            bestdist = d;
+            best = i;
+        }
+    }
+#endif /* SPXI_SSE2 */
+    return best;
+}
+
+/* map rows to their nearest entries, remembering recent colors */
+static void spxQuantizeWork(void* arg, const int begin, const int end)
+{
+    const SpxQuantizeTask* task = (const SpxQuantizeTask*)arg;
+    const size_t first = (size_t)begin * task->dst.width;
+    const size_t last = (size_t)end * task->dst.width;
+    uint32_t* cache = (uint32_t*)SPXI_MALLOC(SPXI_QUANTIZE_CACHE * 2 * sizeof(uint32_t));
+    size_t i;
+
+    if (cache) {
+        memset(cache, 0xFF, SPXI_QUANTIZE_CACHE * 2 * sizeof(uint32_t));
+    }
+
+    for (i = first; i < last; ++i) {
+        const uint8_t* px = task->src + (i << 2);
+        uint32_t color, h;
+        memcpy(&color, px, 4);
+        h = ((color * 2654435761U) >> 20) % SPXI_QUANTIZE_CACHE;
+        if (cache && cache[h * 2 + 1] < SPXI_PALETTE_COLORS && cache[h * 2] == color) {
+            task->dst.pixbuf[i] = (uint8_t)cache[h * 2 + 1];
+            continue;
+        }
+
+        task->dst.pixbuf[i] = (uint8_t)spxPaletteNearest(task->dst.palette, task->count, px);
+        if (cache) {
+            cache[h * 2] = color;
+            cache[h * 2 + 1] = task->dst.pixbuf[i];
+        }
+    }
+
+    if (cache) {
+        SPXI_FREE(cache);
+    }
+}
+
+/* reduce an image to an indexed one of at most colors entries, exact
+ * when it already has that few, otherwise by median cut */
+Img2D spxImageQuantize(const Img2D img, int colors)
+{
+    SpxQuantizeTask task;
+    Img2D rgba = img, ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    int grain = img.width ? SPXI_PARALLEL_GRAIN / img.width : 1;
+
+    if (!img.pixbuf || img.channels < 1 || img.channels > 4) {
+        fprintf(stderr, "spximg could not quantize image with %d channels\n", img.channels);
+        return ret;
+    }
+
+    if (img.pixbuf && !spxImagePacked(img)) {
+        Img2D tmp = spxImagePack(img);
+        ret = tmp.pixbuf ? spxImageQuantize(tmp, colors) : ret;
+        spxImageFree(&tmp);
+        return ret;
+    }
+
+    if (spxSampleSize(img) > 1 || spxImagePlanar(img)) {
+        Img2D narrow = spxSampleSize(img) > 1 ?
+            spxImageDepth(img, 8) : spxImageLayout(img, SPXI_LAYOUT_INTERLEAVED);
+        ret = narrow.pixbuf ? spxImageQuantize(narrow, colors) : ret;
+        spxImageFree(&narrow);
+        return ret;
+    }
+
+    colors = colors < 2 ? 2 : colors > SPXI_PALETTE_COLORS ? SPXI_PALETTE_COLORS : colors;
+    if (img.channels != 4 || img.palette) {
+        rgba = spxImageReshape(img, 4);
+        if (!rgba.pixbuf) {
+            return ret;
+        }
+    }
+
+    spxStatsBegin(SPXI_FORMAT_UNKNOWN);
+    spxStatsPush(SPXI_STAGE_CONVERT);
+    ret = spxIndexedCreate(img.width, img.height);
+    if (ret.pixbuf) {
+        task.src = rgba.pixbuf;
+        task.dst = ret;
+        task.count = spxPaletteExact(rgba, ret.palette, colors);
+        if (!task.count) {
+            task.count = spxPaletteMedianCut(rgba, ret.palette, colors);
+        }
+        spxParallelFor(img.height, grain > 0 ? grain : 1, &spxQuantizeWork, &task);
+    }
+
+    spxStatsPop();
+    spxStatsEnd();
+    if (rgba.pixbuf != img.pixbuf) {
+        spxImageFree(&rgba);
+    }
+    return ret;
 }
 
 /* Image Formats Saver and Loaders */
 
-#ifndef SPXI_NO_PNG
-#include <png.h>
+#ifndef SPXI_NO_PNG
+#include <png.h>
+#include <zlib.h>
+
+#ifndef SPXI_PNG_CHUNK
+#define SPXI_PNG_CHUNK (1 << 16)
+#endif /* SPXI_PNG_CHUNK */
+
+#ifndef SPXI_PNG_BATCH
+#define SPXI_PNG_BATCH (1 << 18)
+#endif /* SPXI_PNG_BATCH */
+
+static int spxPngChannelsToColorType(int channels)
+{
+    switch (channels) {
+        case SPXI_COLOR_GRAY: return PNG_COLOR_TYPE_GRAY;
+        case SPXI_COLOR_GRAY_ALPHA: return PNG_COLOR_TYPE_GRAY_ALPHA;
+        case SPXI_COLOR_RGB: return PNG_COLOR_TYPE_RGB;
+        case SPXI_COLOR_RGBA: return PNG_COLOR_TYPE_RGBA;
+    }
+    
+    fprintf(stderr, "spximg does not support %d channels per pixel\n", channels);
+    return -1;
+}
+
+static void spxPngReadData(png_structp png, png_bytep data, png_size_t size)
+{
+    if (spxStreamRead(data, size, 1, (SpxStream*)png_get_io_ptr(png)) != 1) {
+        png_error(png, "unexpected end of file");
+    }
+}
+
+static void spxPngWriteData(png_structp png, png_bytep data, png_size_t size)
+{
+    if (spxFileWrite(data, size, 1, (FILE*)png_get_io_ptr(png)) != 1) {
+        png_error(png, "write error");
+    }
+}
+
+static void spxPngFlushData(png_structp png)
+{
+    fflush((FILE*)png_get_io_ptr(png));
+}
+
+/* libpng reports the row and pass it goes on with after each row */
+static void spxPngProgress(png_structp png, png_uint_32 row, int pass)
+{
+    const SpxProgress* progress = spxProgressCall;
+    if (progress && spxProgressAt(pass * progress->pass + (int)row)) {
+        png_longjmp(png, 1);
+    }
+}
+
+static int spxPngReadImage(png_structp png, uint8_t** rows)
+{
+    if (setjmp(png_jmpbuf(png))) {
+        return EXIT_FAILURE;
+    }
+
+    png_read_image(png, rows);
+    return EXIT_SUCCESS;
+}
+
+/* transformations only take effect once the header is written */
+static void spxPngWriteInfo(png_structp png, png_infop info)
+{
+    png_write_info(png, info);
+    if (png_get_bit_depth(png, info) < SPXI_BIT_DEPTH) {
+        png_set_packing(png);
+    } else if (png_get_bit_depth(png, info) > SPXI_BIT_DEPTH && spxLittleEndian()) {
+        png_set_swap(png);
+    }
+}
+
+static int spxPngWriteImage(png_structp png, png_infop info, uint8_t** rows)
+{
+    if (setjmp(png_jmpbuf(png))) {
+        return EXIT_FAILURE;
+    }
+
+    spxPngWriteInfo(png, info);
+    png_write_image(png, rows);
+    png_write_end(png, NULL);
+    return EXIT_SUCCESS;
+}
+
+/* merge the planes of img into one row at a time */
+static int spxPngWritePlanar(png_structp png, png_infop info, const Img2D img,
+    uint8_t* row)
+{
+    int y;
+    const int samplesize = spxSampleSize(img);
+
+    if (setjmp(png_jmpbuf(png))) {
+        return EXIT_FAILURE;
+    }
+
+    spxPngWriteInfo(png, info);
+    for (y = 0; y < img.height; ++y) {
+        spxInterleave(
+            img.pixbuf + y * spxImageStride(img), spxImageStride(img) * img.height, row,
+            img.channels, img.width, samplesize
+        );
+        png_write_row(png, row);
+    }
+    png_write_end(png, NULL);
+    return EXIT_SUCCESS;
+}
+
+/* read rows one at a time and split each into the planes of img */
+static int spxPngReadPlanar(png_structp png, const Img2D img, uint8_t* row)
+{
+    int y;
+    const int samplesize = spxSampleSize(img);
+    const size_t plane = (size_t)img.width * img.height * samplesize;
+
+    if (setjmp(png_jmpbuf(png))) {
+        return EXIT_FAILURE;
+    }
+
+    for (y = 0; y < img.height; ++y) {
+        png_read_row(png, row, NULL);
+        spxDeinterleave(
+            row, img.pixbuf + (size_t)y * img.width * samplesize, plane,
+            img.channels, img.width, samplesize
+        );
+    }
+    return EXIT_SUCCESS;
+}
+
+/* keep the indices of a palette PNG and fill the RGBA palette from its
+ * PLTE and tRNS chunks */
+static Img2D spxPngLoadIndexed(png_structp png, png_infop info)
+{
+    int i, count = 0, transcount = 0;
+    png_colorp colors = NULL;
+    png_bytep trans = NULL;
+    Img2D img = spxIndexedCreate(
+        png_get_image_width(png, info), png_get_image_height(png, info)
+    );
+
+    if (img.palette) {
+        png_get_PLTE(png, info, &colors, &count);
+        if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+            png_get_tRNS(png, info, &trans, &transcount, NULL);
+        }
+        for (i = 0; i < count && i < SPXI_PALETTE_COLORS; ++i) {
+            img.palette[i * 4 + 0] = colors[i].red;
+            img.palette[i * 4 + 1] = colors[i].green;
+            img.palette[i * 4 + 2] = colors[i].blue;
+            img.palette[i * 4 + 3] = i < transcount ? trans[i] : 0xFF;
+        }
+    }
+
+    return img;
+}
+
+/* set the transforms for a read header, returns whether palette indices
+ * are kept */
+static int spxPngTransforms(png_structp png, png_infop info, const int flags)
+{
+    const uint8_t colorType = png_get_color_type(png, info);
+    const uint8_t bitDepth = png_get_bit_depth(png, info);
+    const int indexed = colorType == PNG_COLOR_TYPE_PALETTE && (flags & SPXI_LOAD_INDEXED);
+    const int wide = bitDepth == 16 && (flags & SPXI_LOAD_16BIT);
+
+    if (wide && spxLittleEndian()) {
+        png_set_swap(png);
+    } else if (bitDepth == 16 && !wide) {
+        png_set_strip_16(png);
+    }
+
+    if (indexed) {
+        if (bitDepth < 8) {
+            png_set_packing(png);
+        }
+    } else if (colorType == PNG_COLOR_TYPE_PALETTE) {
+        /* palettes always expand to RGBA */
+        png_set_palette_to_rgb(png);
+        if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+            png_set_tRNS_to_alpha(png);
+        } else {
+            png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+        }
+    } else if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_set_tRNS_to_alpha(png);
+    }
+
+    if (colorType == PNG_COLOR_TYPE_GRAY && bitDepth < 8) {
+        png_set_expand_gray_1_2_4_to_8(png);
+    }
+
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    return indexed;
+}
+
+/* set the transforms for a read header and allocate the image they
+ * produce, interlaced rows are combined in place pass by pass */
+static Img2D spxPngSetup(png_structp png, png_infop info, const char* name,
+    const int flags)
+{
+    Img2D img = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    const int wide = png_get_bit_depth(png, info) == 16 && (flags & SPXI_LOAD_16BIT);
+    const int indexed = spxPngTransforms(png, info, flags);
+
+    if (spxImageAdmit(png_get_image_width(png, info), png_get_image_height(png, info),
+        indexed ? 1 : png_get_channels(png, info), wide ? 2 : 1, name)) {
+        return img;
+    } else if (indexed) {
+        img = spxPngLoadIndexed(png, info);
+    } else {
+        img.width = png_get_image_width(png, info);
+        img.height = png_get_image_height(png, info);
+        img.channels = png_get_channels(png, info);
+        img.depth = wide ? 16 : SPXI_BIT_DEPTH;
+        img.pixbuf = spxPixbufAlloc(
+            (size_t)img.height * img.width * img.channels * spxSampleSize(img)
+        );
+    }
+
+    return img;
+}
+
+/* Direct PNG Decoding */
+
+#define spxPngU32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) |\
+                      ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+
+/* inflates the data of consecutive IDAT chunks, checking their CRC */
+typedef struct SpxPngInflate {
+    z_stream z;
+    SpxStream* stream;
+    uint8_t* buf;
+    uint32_t left;
+    uint32_t crc;
+} SpxPngInflate;
+
+/* read a chunk header, its type is the start of its CRC */
+static int spxPngChunk(SpxStream* stream, uint32_t* length, uint8_t* type)
+{
+    uint8_t head[8];
+    if (spxStreamRead(head, sizeof(head), 1, stream) != 1) {
+        return EXIT_FAILURE;
+    }
+    *length = spxPngU32(head);
+    memcpy(type, head + 4, 4);
+    return *length > PNG_UINT_31_MAX;
+}
+
+/* give zlib the next piece of IDAT data, checking the CRC of each chunk
+ * once it is all read and moving on to the next one */
+static int spxPngInflateFill(SpxPngInflate* s)
+{
+    uint8_t type[4], crc[4];
+    size_t size;
+
+    while (!s->left) {
+        if (spxStreamRead(crc, sizeof(crc), 1, s->stream) != 1 || spxPngU32(crc) != s->crc ||
+            spxPngChunk(s->stream, &s->left, type) || memcmp(type, "IDAT", 4)) {
+            return EXIT_FAILURE;
+        }
+        s->crc = crc32(0, type, 4);
+    }
+
+    size = s->left < SPXI_PNG_CHUNK ? s->left : SPXI_PNG_CHUNK;
+    if (spxStreamRead(s->buf, size, 1, s->stream) != 1) {
+        return EXIT_FAILURE;
+    }
+
+    s->crc = crc32(s->crc, s->buf, (uInt)size);
+    s->left -= (uint32_t)size;
+    s->z.next_in = s->buf;
+    s->z.avail_in = (uInt)size;
+    return EXIT_SUCCESS;
+}
+
+static int spxPngInflateRead(SpxPngInflate* s, uint8_t* dst, const size_t size)
+{
+    s->z.next_out = dst;
+    s->z.avail_out = (uInt)size;
+    while (s->z.avail_out) {
+        int ret;
+        if (!s->z.avail_in && spxPngInflateFill(s)) {
+            return EXIT_FAILURE;
+        }
+        ret = inflate(&s->z, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            return s->z.avail_out ? EXIT_FAILURE : EXIT_SUCCESS;
+        } else if (ret != Z_OK) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* the predictor of the three nearest to a + b - c, ties going to a then
+ * b, found by where c * 3 - (a + b) falls against the lower and higher of
+ * a and b so it compiles without branches */
+static int spxPngPaeth(const int a, const int b, const int c)
+{
+    const int t = c * 3 - (a + b);
+    const int lo = a < b ? a : b, hi = a < b ? b : a;
+    return t <= lo ? hi : hi <= t ? lo : c;
+}
+
+#ifdef SPXI_SSE2
+
+/* pixels of 3 or 4 bytes in the low lanes of a register, 3 byte ones
+ * are put together in a register rather than stored short and loaded
+ * whole, which would stall every pixel */
+#define spxPngLoadPixel(v, p, bpp) do { int spxPixel_;\
+    if (bpp == 4) memcpy(&spxPixel_, p, 4);\
+    else spxPixel_ = (p)[0] | (p)[1] << 8 | (p)[2] << 16;\
+    v = _mm_cvtsi32_si128(spxPixel_); } while (0)
+
+#define spxPngStorePixel(p, v, bpp) do { const int spxPixel_ = _mm_cvtsi128_si32(v);\
+    if (bpp == 4) memcpy(p, &spxPixel_, 4);\
+    else { (p)[0] = (uint8_t)spxPixel_; (p)[1] = (uint8_t)(spxPixel_ >> 8);\
+    (p)[2] = (uint8_t)(spxPixel_ >> 16); } } while (0)
+
+#define spxPngSelect(mask, a, b) _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b))
+
+/* Sub, Avg and Paeth of RGB and RGBA rows, a pixel at a time with all
+ * of its channels in one register */
+static void spxPngUnfilterPixels(uint8_t* dst, const uint8_t* src, const uint8_t* prev,
+    const size_t size, const int bpp, const int filter)
+{
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+    __m128i a = zero, b, c = zero, d;
+    size_t i;
+
+    if (filter == PNG_FILTER_VALUE_SUB) {
+        for (i = 0; i < size; i += bpp) {
+            spxPngLoadPixel(d, src + i, bpp);
+            a = _mm_add_epi8(a, d);
+            spxPngStorePixel(dst + i, a, bpp);
+        }
+    } else if (filter == PNG_FILTER_VALUE_AVG) {
+        /* pavgb rounds up, the low bit of a ^ b takes it back down */
+        for (i = 0; i < size; i += bpp) {
+            spxPngLoadPixel(d, src + i, bpp);
+            spxPngLoadPixel(b, prev + i, bpp);
+            c = _mm_and_si128(_mm_xor_si128(a, b), one);
+            a = _mm_add_epi8(d, _mm_sub_epi8(_mm_avg_epu8(a, b), c));
+            spxPngStorePixel(dst + i, a, bpp);
+        }
+    } else {
+        /* in 16-bit lanes as spxPngPaeth does it, keeping the sum in
+         * them too so the next pixel does not wait on a pack */
+        const __m128i mask = _mm_set1_epi16(0xFF);
+        for (i = 0; i < size; i += bpp) {
+            __m128i t, lo, hi;
+            spxPngLoadPixel(d, src + i, bpp);
+            spxPngLoadPixel(b, prev + i, bpp);
+            b = _mm_unpacklo_epi8(b, zero);
+            t = _mm_sub_epi16(_mm_add_epi16(c, _mm_add_epi16(c, c)), _mm_add_epi16(a, b));
+            lo = _mm_min_epi16(a, b);
+            hi = _mm_max_epi16(a, b);
+            lo = spxPngSelect(_mm_cmpgt_epi16(hi, t), c, lo);
+            lo = spxPngSelect(_mm_cmpgt_epi16(t, _mm_min_epi16(a, b)), lo, hi);
+            a = _mm_and_si128(_mm_add_epi16(_mm_unpacklo_epi8(d, zero), lo), mask);
+            spxPngStorePixel(dst + i, _mm_packus_epi16(a, a), bpp);
+            c = b;
+        }
+    }
+}
+
+#endif /* SPXI_SSE2 */
+
+/* undo the filter of an inflated row into the image, prev is the row
+ * above it already unfiltered or zeros for the first row */
+static void spxPngUnfilter(uint8_t* dst, const uint8_t* src, const uint8_t* prev,
+    const size_t size, const int bpp, const int filter)
+{
+    size_t i = 0;
+
+#ifdef SPXI_SSE2
+    if (filter == PNG_FILTER_VALUE_UP) {
+        for (; i + 16 <= size; i += 16) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+            _mm_storeu_si128((__m128i*)(dst + i),
+                _mm_add_epi8(v, _mm_loadu_si128((const __m128i*)(prev + i)))
+            );
+        }
+    } else if (filter != PNG_FILTER_VALUE_NONE && bpp >= 3) {
+        spxPngUnfilterPixels(dst, src, prev, size, bpp, filter);
+        return;
+    }
+#endif /* SPXI_SSE2 */
+
+    switch (filter) {
+        case PNG_FILTER_VALUE_NONE:
+            memcpy(dst, src, size);
+            break;
+        case PNG_FILTER_VALUE_SUB:
+            for (; i < (size_t)bpp; ++i) {
+                dst[i] = src[i];
+            }
+            for (; i < size; ++i) {
+                dst[i] = (uint8_t)(src[i] + dst[i - bpp]);
+            }
+            break;
+        case PNG_FILTER_VALUE_UP:
+            for (; i < size; ++i) {
+                dst[i] = (uint8_t)(src[i] + prev[i]);
+            }
+            break;
+        case PNG_FILTER_VALUE_AVG:
+            for (; i < (size_t)bpp; ++i) {
+                dst[i] = (uint8_t)(src[i] + (prev[i] >> 1));
+            }
+            for (; i < size; ++i) {
+                dst[i] = (uint8_t)(src[i] + ((dst[i - bpp] + prev[i]) >> 1));
+            }
+            break;
+        case PNG_FILTER_VALUE_PAETH:
+            for (; i < (size_t)bpp; ++i) {
+                dst[i] = (uint8_t)(src[i] + prev[i]);
+            }
+            for (; i < size; ++i) {
+                dst[i] = (uint8_t)(src[i] + spxPngPaeth(dst[i - bpp], prev[i], prev[i - bpp]));
+            }
+            break;
+    }
+}
+
+/* decode an 8-bit non-interlaced gray, gray alpha, RGB or RGBA file
+ * without libpng, inflating about SPXI_PNG_BATCH bytes of rows at a time
+ * and unfiltering each straight into its place in the image. Other files,
+ * and those with a tRNS chunk to expand into alpha, seek back and return
+ * an empty image with fallback set for libpng to take them */
+static Img2D spxPngLoadDirect(SpxStream* stream, const char* name, const int flags,
+    int* fallback)
+{
+    static const int channels[7] = {1, 0, 3, 0, 2, 0, 4};
+    Img2D img = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    const long start = spxStreamTell(stream);
+    SpxPngInflate s;
+    SpxProgress progress;
+    uint8_t head[8 + 8 + 13 + 4], type[4], *zero, *batch;
+    size_t rowsize;
+    uint32_t width, height, length;
+    int i, n, y, rows, bpp;
+
+    *fallback = 1;
+    if (start < 0 || (flags & SPXI_LOAD_PLANAR) ||
+        spxStreamRead(head, sizeof(head), 1, stream) != 1) {
+        spxStreamSeek(stream, start, SEEK_SET);
+        return img;
+    }
+
+    width = spxPngU32(head + 16);
+    height = spxPngU32(head + 20);
+    bpp = head[25] < 7 ? channels[head[25]] : 0;
+    if (!spxParseHeaderPng(head) || spxPngU32(head + 8) != 13 || memcmp(head + 12, "IHDR", 4) ||
+        spxPngU32(head + 29) != crc32(0, head + 12, 17) || !width || !height ||
+        width > PNG_USER_WIDTH_MAX || height > PNG_USER_HEIGHT_MAX ||
+        head[24] != 8 || !bpp || head[26] || head[27] || head[28]) {
+        spxStreamSeek(stream, start, SEEK_SET);
+        return img;
+    }
+
+    /* ancillary chunks are skipped unread, like libpng ignores them */
+    while (!spxPngChunk(stream, &length, type) && memcmp(type, "IDAT", 4)) {
+        if (!memcmp(type, "tRNS", 4) || !memcmp(type, "IEND", 4) ||
+            (!(type[0] & 0x20) && memcmp(type, "PLTE", 4)) ||
+            spxStreamSeek(stream, (long)length + 4, SEEK_CUR)) {
+            spxStreamSeek(stream, start, SEEK_SET);
+            return img;
+        }
+    }
+
+    if (memcmp(type, "IDAT", 4)) {
+        spxStreamSeek(stream, start, SEEK_SET);
+        return img;
+    }
+
+    *fallback = 0;
+    if (spxImageAdmit((int)width, (int)height, bpp, 1, name)) {
+        return img;
+    }
+
+    img.width = (int)width;
+    img.height = (int)height;
+    img.channels = bpp;
+    img.depth = SPXI_BIT_DEPTH;
+    rowsize = spxImageRowSize(img);
+    rows = SPXI_PNG_BATCH / (rowsize + 1);
+    rows = rows < 1 ? 1 : rows > img.height ? img.height : rows;
+    img.pixbuf = spxPixbufAlloc(rowsize * img.height);
+    s.buf = (uint8_t*)spxMalloc(SPXI_PNG_CHUNK + rowsize + rows * (rowsize + 1));
+    if (!img.pixbuf || !s.buf) {
+        spxImageFree(&img);
+        SPXI_FREE(s.buf);
+        return img;
+    }
+
+    zero = s.buf + SPXI_PNG_CHUNK;
+    batch = zero + rowsize;
+    memset(zero, 0, rowsize);
+    memset(&s.z, 0, sizeof(z_stream));
+    s.stream = stream;
+    s.left = length;
+    s.crc = crc32(0, type, 4);
+    if (inflateInit(&s.z) != Z_OK) {
+        spxImageFree(&img);
+        SPXI_FREE(s.buf);
+        return img;
+    }
+
+    spxProgressBegin(&progress, img.height, 1);
+    for (y = 0; y < img.height; y += n) {
+        n = img.height - y < rows ? img.height - y : rows;
+        if (spxPngInflateRead(&s, batch, n * (rowsize + 1))) {
+            break;
+        }
+
+        for (i = 0; i < n; ++i) {
+            const uint8_t* src = batch + i * (rowsize + 1);
+            uint8_t* row = img.pixbuf + (size_t)(y + i) * rowsize;
+            if (src[0] > PNG_FILTER_VALUE_PAETH) {
+                break;
+            }
+            spxPngUnfilter(row, src + 1, y + i ? row - rowsize : zero, rowsize, bpp, src[0]);
+        }
+
+        if (i < n || spxProgressStep(n)) {
+            break;
+        }
+    }
+
+    if (y < img.height) {
+        if (!progress.cancel) {
+            fprintf(stderr, "spximg could not read image as PNG file: '%s'\n", name);
+        }
+        spxImageFree(&img);
+    }
+    inflateEnd(&s.z);
+    SPXI_FREE(s.buf);
+    spxProgressEnd(&progress);
+    return img;
+}
+
+static Img2D spxPngLoad(SpxStream* stream, const char* name, const int flags)
+{
+    int i;
+    size_t stride;
+    Img2D img = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    uint8_t **rows;
+    png_structp png;
+    png_infop info;
+    SpxProgress progress;
+
+    spxStatsStage(SPXI_STAGE_CODEC);
+    img = spxPngLoadDirect(stream, name, flags, &i);
+    if (!i) {
+        return img;
+    }
+    
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        fprintf(stderr, "spximg could not create PNG read struct\n");
+        return img;
+    }
+
+    info = png_create_info_struct(png);
+    if (!info || setjmp(png_jmpbuf(png))) {
+        Img2D err = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+        fprintf(stderr, "spximg could not read image as PNG file: '%s'\n", name);
+        png_destroy_read_struct(&png, &info, NULL);
+        return err;
+    }
+
+    spxStatsStage(SPXI_STAGE_CODEC);
+    png_set_read_fn(png, stream, &spxPngReadData);
+    png_read_info(png, info);
+    img = spxPngSetup(png, info, name, flags);
+    if (!img.pixbuf) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return img;
+    }
+
+    stride = spxImageRowSize(img);
+    assert(stride == png_get_rowbytes(png, info));
+    spxProgressBegin(&progress, img.height,
+        png_get_interlace_type(png, info) == PNG_INTERLACE_NONE ? 1 : 7
+    );
+    if (progress.func) {
+        png_set_read_status_fn(png, &spxPngProgress);
+    }
+
+    /* interlaced files come back in passes and are split afterwards */
+    if ((flags & SPXI_LOAD_PLANAR) && img.channels > 1 &&
+        png_get_interlace_type(png, info) == PNG_INTERLACE_NONE) {
+        uint8_t* row = (uint8_t*)spxMalloc(stride);
+        img.layout = SPXI_LAYOUT_PLANAR;
+        if (!row || spxPngReadPlanar(png, img, row)) {
+            if (!progress.cancel) {
+                fprintf(stderr, "spximg could not read image as PNG file: '%s'\n", name);
+            }
+            spxImageFree(&img);
+        }
+        png_destroy_read_struct(&png, &info, NULL);
+        SPXI_FREE(row);
+        spxProgressEnd(&progress);
+        return img;
+    }
+
+    rows = (uint8_t**)spxMalloc(img.height * sizeof(uint8_t*));
+    for (i = 0; rows && i < img.height; i++) {
+        rows[i] = img.pixbuf + i * stride;
+    }
+
+    /* the last pass of an interlaced file reports no row past its own */
+    if (!rows || spxPngReadImage(png, rows)) {
+        if (!progress.cancel) {
+            fprintf(stderr, "spximg could not read image as PNG file: '%s'\n", name);
+        }
+        spxImageFree(&img);
+    } else if (spxProgressAt(progress.total)) {
+        spxImageFree(&img);
+    }
+
+    png_destroy_read_struct(&png, &info, NULL);
+    SPXI_FREE(rows);
+    spxProgressEnd(&progress);
+    return img;
+}
+
+static Img2D spxPngLoadFile(const char* path, const int flags)
+{
+    Img2D img = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    SpxStream stream;
+    FILE* file;
+    
+    spxStatsBegin(SPXI_FORMAT_PNG);
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "spximg could not open file: '%s'\n", path);
+        spxStatsEnd();
+        return img;
+    }
+
+    stream = spxStreamFile(file);
+    img = spxPngLoad(&stream, path, flags);
+    spxFileClose(file, 0);
+    spxStatsEnd();
+    return img;
+}
+
+Img2D spxImageLoadPng(const char* path)
+{
+    return spxPngLoadFile(path, 0);
+}
+
+/* write the used part of the palette, its alpha as tRNS up to the last
+ * translucent entry, and pick the smallest bit depth that holds it */
+static void spxPngWritePalette(png_structp png, png_infop info, const Img2D img)
+{
+    png_color colors[SPXI_PALETTE_COLORS];
+    uint8_t trans[SPXI_PALETTE_COLORS];
+    const size_t stride = spxImageStride(img);
+    int i, x, y, count = 1, transcount = 0, depth;
+
+    for (y = 0; y < img.height; ++y) {
+        const uint8_t* row = img.pixbuf + y * stride;
+        for (x = 0; x < img.width; ++x) {
+            count = row[x] >= count ? row[x] + 1 : count;
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        colors[i].red = img.palette[i * 4 + 0];
+        colors[i].green = img.palette[i * 4 + 1];
+        colors[i].blue = img.palette[i * 4 + 2];
+        trans[i] = img.palette[i * 4 + 3];
+        transcount = trans[i] != 0xFF ? i + 1 : transcount;
+    }
+
+    depth = count <= 2 ? 1 : count <= 4 ? 2 : count <= 16 ? 4 : 8;
+    png_set_IHDR(
+        png, info, img.width, img.height, depth, PNG_COLOR_TYPE_PALETTE,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT
+    );
+    png_set_PLTE(png, info, colors, count);
+    if (transcount) {
+        png_set_tRNS(png, info, trans, transcount, NULL);
+    }
+}
+
+int spxImageSavePng(const Img2D img, const char* path) 
+{
+    int i;
+    size_t stride;
+    uint8_t **rows, *row, colorType;
+    png_structp png;
+    png_infop info;
+    FILE* file;
+    SpxProgress progress;
+
+    spxStatsBegin(SPXI_FORMAT_PNG);
+    spxLimitsError = SPXI_ERROR_NONE;
+    file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "spximg could not write file: '%s'\n", path);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        fprintf(stderr, "spximg could not create PNG write struct\n");
+        fclose(file);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    info = png_create_info_struct(png);
+    if (!info || setjmp(png_jmpbuf(png))) {
+        fprintf(stderr, "spximg could not write image as PNG file: '%s'\n", path);
+        png_destroy_write_struct(&png, &info);
+        fclose(file);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    spxStatsStage(SPXI_STAGE_CODEC);
+    png_set_write_fn(png, file, &spxPngWriteData, &spxPngFlushData);
+    if (img.palette) {
+        spxPngWritePalette(png, info, img);
+    } else {
+        colorType = spxPngChannelsToColorType(img.channels);
+        png_set_IHDR(
+            png, info, img.width, img.height, SPXI_BIT_DEPTH * spxSampleSize(img),
+            colorType, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+            PNG_FILTER_TYPE_DEFAULT
+        );
+    }
+
+    stride = spxImageStride(img);
+    spxProgressBegin(&progress, img.height, 1);
+    if (progress.func) {
+        png_set_write_status_fn(png, &spxPngProgress);
+    }
+
+    if (spxImagePlanar(img)) {
+        rows = NULL;
+        row = (uint8_t*)spxMalloc((size_t)img.width * img.channels * spxSampleSize(img));
+        i = row ? spxPngWritePlanar(png, info, img, row) : EXIT_FAILURE;
+    } else {
+        row = NULL;
+        rows = (uint8_t**)spxMalloc(img.height * sizeof(uint8_t*));
+        for (i = 0; rows && i < img.height; i++) {
+            rows[i] = img.pixbuf + (size_t)i * stride;
+        }
+        i = rows ? spxPngWriteImage(png, info, rows) : EXIT_FAILURE;
+    }
+
+    if (i && !progress.cancel) {
+        fprintf(stderr, "spximg could not write image as PNG file: '%s'\n", path);
+    }
+
+    png_destroy_write_struct(&png, &info);
+    SPXI_FREE(rows);
+    SPXI_FREE(row);
+    i |= spxFileClose(file, 1);
+    if (spxProgressEnd(&progress)) {
+        remove(path);
+    }
+    spxStatsEnd();
+    return i;
+}
+
+#endif /* SPXI_NO_PNG */
+#ifndef SPXI_NO_JPEG
+
+#include <jpeglib.h>
+#include <setjmp.h>
+
+#ifndef SPXI_JPEG_QUALITY 
+#define SPXI_JPEG_QUALITY 100
+#endif /* SPXI_JPEG_QUALITY */
+
+#define SPXI_JPEG_GRAYSCALE     0x01
+#define SPXI_JPEG_STRIP         0x02
+
+/* error manager that returns to the caller instead of exiting */
+typedef struct SpxJpegError {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+} SpxJpegError;
+
+static void spxJpegErrorExit(j_common_ptr info)
+{
+    SpxJpegError* err = (SpxJpegError*)info->err;
+    err->mgr.output_message(info);
+    longjmp(err->jump, 1);
+}
+
+/* libjpeg calls that can fail, each catches the jump of spxJpegErrorExit
+ * so that callers free their own buffers and destroy the decompressor */
+static int spxJpegReadHeader(j_decompress_ptr info, const uint8_t* data, const size_t size)
+{
+    if (setjmp(((SpxJpegError*)info->err)->jump)) {
+        return EXIT_FAILURE;
+    }
+
+    jpeg_mem_src(info, (unsigned char*)data, (unsigned long)size);
+    return jpeg_read_header(info, TRUE) == JPEG_HEADER_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int spxJpegStartDecompress(j_decompress_ptr info)
+{
+    if (setjmp(((SpxJpegError*)info->err)->jump)) {
+        return EXIT_FAILURE;
+    }
+
+    jpeg_start_decompress(info);
+    return EXIT_SUCCESS;
+}
+
+static int spxJpegReadRow(j_decompress_ptr info, uint8_t* row)
+{
+    if (setjmp(((SpxJpegError*)info->err)->jump)) {
+        return EXIT_FAILURE;
+    }
+
+    return jpeg_read_scanlines(info, &row, 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int spxJpegReadRaw(j_decompress_ptr info, JSAMPIMAGE planes, const int rows)
+{
+    if (setjmp(((SpxJpegError*)info->err)->jump)) {
+        return EXIT_FAILURE;
+    }
+
+    return jpeg_read_raw_data(info, planes, rows) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int spxJpegFinishDecompress(j_decompress_ptr info)
+{
+    if (setjmp(((SpxJpegError*)info->err)->jump)) {
+        return EXIT_FAILURE;
+    }
+
+    jpeg_finish_decompress(info);
+    return EXIT_SUCCESS;
+}
+
+static int spxJpegStartCompress(j_compress_ptr info, const char* comment)
+{
+    if (setjmp(((SpxJpegError*)info->err)->jump)) {
+        return EXIT_FAILURE;
+    }
+
+    jpeg_start_compress(info, TRUE);
+    if (comment) {
+        jpeg_write_marker(info, JPEG_COM, (const JOCTET*)comment, (unsigned int)strlen(comment));
+    }
+    return EXIT_SUCCESS;
+}
+
+static int spxJpegWriteRow(j_compress_ptr info, uint8_t* row)
+{
+    if (setjmp(((SpxJpegError*)info->err)->jump)) {
+        return EXIT_FAILURE;
+    }
+
+    return jpeg_write_scanlines(info, &row, 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int spxJpegWriteRaw(j_compress_ptr info, JSAMPIMAGE planes, const int rows)
+{
+    if (setjmp(((SpxJpegError*)info->err)->jump)) {
+        return EXIT_FAILURE;
+    }
+
+    return (int)jpeg_write_raw_data(info, planes, rows) == rows ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int spxJpegFinishCompress(j_compress_ptr info)
+{
+    if (setjmp(((SpxJpegError*)info->err)->jump)) {
+        return EXIT_FAILURE;
+    }
+
+    jpeg_finish_compress(info);
+    return EXIT_SUCCESS;
+}
+
+static uint32_t spxExifRead(const uint8_t* p, const int bytes, const int le)
+{
+    int i;
+    uint32_t n = 0;
+    for (i = 0; i < bytes; ++i) {
+        n |= (uint32_t)p[le ? i : bytes - 1 - i] << (i * 8);
+    }
+    return n;
+}
+
+/* orientation tag of the EXIF APP1 marker as a transform to apply */
+static int spxJpegOrientation(j_decompress_ptr info)
+{
+    static const int transforms[9] = {
+        SPXI_TRANSFORM_NONE, SPXI_TRANSFORM_NONE, SPXI_TRANSFORM_FLIP_X,
+        SPXI_TRANSFORM_ROTATE_180, SPXI_TRANSFORM_FLIP_Y, SPXI_TRANSFORM_TRANSPOSE,
+        SPXI_TRANSFORM_ROTATE_90, SPXI_TRANSFORM_TRANSVERSE, SPXI_TRANSFORM_ROTATE_270
+    };
+
+    jpeg_saved_marker_ptr marker;
+    for (marker = info->marker_list; marker; marker = marker->next) {
+        const uint8_t* tiff = marker->data + 6;
+        uint32_t i, count, ifd, size = marker->data_length;
+        int le;
+
+        if (marker->marker != JPEG_APP0 + 1 || size < 14 ||
+            memcmp(marker->data, "Exif\0\0", 6)) {
+            continue;
+        }
+
+        size -= 6;
+        le = tiff[0] == 'I';
+        ifd = spxExifRead(tiff + 4, 4, le);
+        if ((!le && tiff[0] != 'M') || ifd + 2 > size) {
+            continue;
+        }
+
+        count = spxExifRead(tiff + ifd, 2, le);
+        for (i = 0; i < count && ifd + 2 + (i + 1) * 12 <= size; ++i) {
+            const uint8_t* entry = tiff + ifd + 2 + i * 12;
+            if (spxExifRead(entry, 2, le) == 0x0112) {
+                uint32_t n = spxExifRead(entry + 8, 2, le);
+                return n < 9 ? transforms[n] : SPXI_TRANSFORM_NONE;
+            }
+        }
+    }
+
+    return SPXI_TRANSFORM_NONE;
+}
+
+#ifndef SPXI_JPEG_STRIP_ROWS
+#define SPXI_JPEG_STRIP_ROWS    4
+#endif /* SPXI_JPEG_STRIP_ROWS */
+
+/* smallest image encoded in strips, smaller ones are written serially
+ * without restart markers, the same with or without threads */
+#ifndef SPXI_JPEG_STRIP_PIXELS
+#define SPXI_JPEG_STRIP_PIXELS  (1UL << 22)
+#endif /* SPXI_JPEG_STRIP_PIXELS */
+
+/* comment of the files written in strips, only those are decoded in
+ * strips as well */
+#define SPXI_JPEG_STRIP_COMMENT "spximg strips"
+
+typedef struct SpxJpegStrip {
+    unsigned char* data;
+    unsigned long size;
+} SpxJpegStrip;
+
+typedef struct SpxJpegEncodeTask {
+    Img2D img;
+    SpxJpegStrip* strips;
+    int count;
+    int mcurows;
+    int mcuheight;
+    int quality;
+} SpxJpegEncodeTask;
+
+typedef struct SpxJpegDecodeTask {
+    Img2D img;
+    const uint8_t* data;
+    const size_t* starts;
+    const size_t* ends;
+    const uint8_t* header;
+    size_t headersize;
+    size_t sof;
+    uint8_t* failed;
+    int intervals;
+    int rows;
+    int count;
+} SpxJpegDecodeTask;
+
+/* offsets of the SOF marker and of the first entropy coded byte after
+ * the SOS header of a JPEG stream */
+static int spxJpegScanStart(const uint8_t* data, const size_t size, 
+    size_t* sof, size_t* sos)
+{
+    size_t i = 2;
+    *sof = 0;
+    while (i + 4 <= size && data[i] == 0xFF) {
+        int marker = data[i + 1];
+        if (marker == 0xFF) {
+            ++i;
+            continue;
+        }
+        if (marker == 0xC0 || marker == 0xC1) {
+            *sof = i;
+        }
+        i += 2 + ((size_t)data[i + 2] << 8 | data[i + 3]);
+        if (marker == 0xDA) {
+            *sos = i;
+            return *sof && i <= size ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+/* nonzero when the markers before the scan hold the comment that the
+ * strip encoder writes */
+static int spxJpegStripTagged(const uint8_t* data, const size_t sos)
+{
+    const size_t taglen = sizeof(SPXI_JPEG_STRIP_COMMENT) - 1;
+    size_t pos = 2;
+    while (pos + 4 <= sos && data[pos] == 0xFF) {
+        size_t len = data[pos + 1] == 0xFF ? 1 : 2 + ((size_t)data[pos + 2] << 8 | data[pos + 3]);
+        if (data[pos + 1] == 0xFE && len == taglen + 4 && pos + len <= sos &&
+            !memcmp(data + pos + 4, SPXI_JPEG_STRIP_COMMENT, taglen)) {
+            return 1;
+        }
+        pos += len;
+    }
+    return 0;
+}
+
+/* decode restart intervals of one strip as a JPEG of their own, with one 
+ * extra interval above and below so chroma upsampling sees the same 
+ * neighbours as a serial decode. A strip that fails is flagged for the
+ * caller to decode the file serially instead */
+static void spxJpegDecodeWork(void* arg, const int begin, const int end)
+{
+    SpxJpegDecodeTask* task = (SpxJpegDecodeTask*)arg;
+    const size_t stride = (size_t)task->img.width * task->img.channels;
+    int s, i, y;
+
+    for (s = begin; s < end; ++s) {
+        struct jpeg_decompress_struct info;
+        SpxJpegError err;
+        int i0 = task->intervals * s / task->count;
+        int i1 = task->intervals * (s + 1) / task->count;
+        int j0 = i0 > 0 ? i0 - 1 : 0, j1 = i1 < task->intervals ? i1 + 1 : task->intervals;
+        int top = j0 * task->rows, bottom = j1 * task->rows;
+        int keep0 = i0 * task->rows, keep1 = i1 * task->rows;
+        size_t size = task->headersize + 2, pos;
+        uint8_t *buf, *scratch;
+
+        bottom = bottom < task->img.height ? bottom : task->img.height;
+        keep1 = keep1 < task->img.height ? keep1 : task->img.height;
+        for (i = j0; i < j1; ++i) {
+            size += task->ends[i] - task->starts[i] + 2;
+        }
+
+        buf = (uint8_t*)SPXI_MALLOC(size);
+        scratch = (uint8_t*)SPXI_MALLOC(stride);
+        if (!buf || !scratch) {
+            task->failed[s] = 1;
+            SPXI_FREE(scratch);
+            SPXI_FREE(buf);
+            continue;
+        }
+
+        memcpy(buf, task->header, task->headersize);
+        buf[task->sof + 5] = (uint8_t)((bottom - top) >> 8);
+        buf[task->sof + 6] = (uint8_t)(bottom - top);
+        pos = task->headersize;
+        for (i = j0; i < j1; ++i) {
+            memcpy(buf + pos, task->data + task->starts[i], task->ends[i] - task->starts[i]);
+            pos += task->ends[i] - task->starts[i];
+            buf[pos++] = 0xFF;
+            buf[pos++] = (uint8_t)(i + 1 < j1 ? 0xD0 | ((i - j0) & 7) : 0xD9);
+        }
+
+        info.err = jpeg_std_error(&err.mgr);
+        err.mgr.error_exit = &spxJpegErrorExit;
+        jpeg_create_decompress(&info);
+        task->failed[s] = (uint8_t)(spxJpegReadHeader(&info, buf, pos) ||
+            spxJpegStartDecompress(&info));
+        for (y = top; !task->failed[s] && (int)info.output_scanline < bottom - top; ++y) {
+            uint8_t* row = y >= keep0 && y < keep1 ? task->img.pixbuf + y * stride : scratch;
+            task->failed[s] = (uint8_t)spxJpegReadRow(&info, row);
+            if (!task->failed[s] && y >= keep0 && y < keep1 && spxProgressStep(1)) {
+                break;
+            }
+        }
+        if (!task->failed[s] && (int)info.output_scanline == bottom - top) {
+            task->failed[s] = (uint8_t)spxJpegFinishDecompress(&info);
+        }
+        jpeg_destroy_decompress(&info);
+        SPXI_FREE(scratch);
+        SPXI_FREE(buf);
+    }
+}
+
+/* split a single scan JPEG written in strips by spximg, whose restart
+ * intervals span whole MCU rows, into strips decoded in parallel. Returns
+ * an empty image when the file does not qualify or a strip fails, so the
+ * caller can decode it serially */
+static Img2D spxJpegDecodeStrips(const uint8_t* data, const size_t size, 
+    j_decompress_ptr info)
+{
+    int i, count, mcuwidth, mcuheight, mcusperrow, mcurows, intervals;
+    size_t sof, sos, pos, *starts;
+    uint8_t *header, *failed;
+    SpxJpegDecodeTask task;
+    Img2D img = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+
+    if (spxThreadCount() < 2 || info->progressive_mode || !info->restart_interval ||
+        info->comps_in_scan != info->num_components ||
+        (info->jpeg_color_space != JCS_GRAYSCALE && info->jpeg_color_space != JCS_YCbCr &&
+        info->jpeg_color_space != JCS_RGB)) {
+        return img;
+    }
+
+    mcuwidth = info->max_h_samp_factor * DCTSIZE;
+    mcuheight = info->max_v_samp_factor * DCTSIZE;
+    mcusperrow = (info->image_width + mcuwidth - 1) / mcuwidth;
+    mcurows = (info->image_height + mcuheight - 1) / mcuheight;
+    if (info->num_components == 1) {
+        mcusperrow = (info->image_width + DCTSIZE - 1) / DCTSIZE;
+        mcurows = (info->image_height + DCTSIZE - 1) / DCTSIZE;
+        mcuheight = DCTSIZE;
+    }
+
+    if (info->restart_interval % mcusperrow || spxJpegScanStart(data, size, &sof, &sos) ||
+        !spxJpegStripTagged(data, sos)) {
+        return img;
+    }
+
+    task.rows = info->restart_interval / mcusperrow * mcuheight;
+    intervals = (mcurows * mcuheight + task.rows - 1) / task.rows;
+    count = spxThreadCount();
+    count = count < intervals / SPXI_JPEG_STRIP_ROWS ? count : intervals / SPXI_JPEG_STRIP_ROWS;
+    if (count < 2) {
+        return img;
+    }
+
+    /* locate the entropy coded data of every restart interval */
+    starts = (size_t*)spxMalloc(2 * intervals * sizeof(size_t));
+    if (!starts) {
+        return img;
+    }
+
+    starts[0] = sos;
+    for (i = 0, pos = sos; pos + 1 < size; ++pos) {
+        if (data[pos] != 0xFF || !data[pos + 1] || data[pos + 1] == 0xFF) {
+            continue;
+        }
+        if ((data[pos + 1] & 0xF8) != 0xD0) {
+            break;
+        }
+        if (i + 1 >= intervals) {
+            i = -1;
+            break;
+        }
+        starts[intervals + i++] = pos;
+        starts[i] = pos + 2;
+        ++pos;
+    }
+
+    if (i != intervals - 1 || pos + 1 >= size || data[pos + 1] != 0xD9) {
+        SPXI_FREE(starts);
+        return img;
+    }
+    starts[2 * intervals - 1] = pos;
+
+    /* every strip reuses the tables and frame header, without metadata */
+    header = (uint8_t*)spxMalloc(sos);
+    failed = (uint8_t*)spxMalloc(count);
+    if (!header || !failed) {
+        SPXI_FREE(failed);
+        SPXI_FREE(header);
+        SPXI_FREE(starts);
+        return img;
+    }
+
+    memset(failed, 0, count);
+    memcpy(header, data, 2);
+    task.headersize = 2;
+    task.sof = 0;
+    for (pos = 2; pos < sos;) {
+        int marker = data[pos + 1];
+        size_t len = marker == 0xFF ? 1 : 2 + ((size_t)data[pos + 2] << 8 | data[pos + 3]);
+        if (marker != 0xFF && ((marker & 0xF0) != 0xE0 || marker == 0xE0 || marker == 0xEE) &&
+            marker != 0xFE) {
+            if (pos == sof) {
+                task.sof = task.headersize;
+            }
+            memcpy(header + task.headersize, data + pos, len);
+            task.headersize += len;
+        }
+        pos += len;
+    }
+
+    img.width = info->image_width;
+    img.height = info->image_height;
+    img.channels = info->num_components;
+    img.pixbuf = spxPixbufAlloc((size_t)img.width * img.height * img.channels);
+
+    task.img = img;
+    task.data = data;
+    task.starts = starts;
+    task.ends = starts + intervals;
+    task.header = header;
+    task.failed = failed;
+    task.intervals = intervals;
+    task.count = count;
+    if (img.pixbuf) {
+        spxParallelFor(count, 1, &spxJpegDecodeWork, &task);
+    }
+
+    /* rows of the strips that did decode are counted again serially */
+    for (i = 0; img.pixbuf && i < count; ++i) {
+        if (failed[i] && !spxProgressStep(0)) {
+            spxProgressAt(0);
+            spxImageFree(&img);
+        }
+    }
+    if (spxProgressStep(0)) {
+        spxImageFree(&img);
+    }
+
+    SPXI_FREE(failed);
+    SPXI_FREE(header);
+    SPXI_FREE(starts);
+    return img;
+}
+
+static Img2D spxJpegDecode(const uint8_t* data, const size_t size, const char* name,
+    const int width, const int height, const int flags)
+{
+    int i, transform = SPXI_TRANSFORM_NONE;
+	size_t stride;
+	Img2D img = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    SpxProgress progress;
+    
+    struct jpeg_decompress_struct info;
+	SpxJpegError err;
+
+    spxStatsStage(SPXI_STAGE_CODEC);
+	info.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = &spxJpegErrorExit;
+	jpeg_create_decompress(&info);
+
+    if (flags & SPXI_LOAD_ORIENT) {
+        jpeg_save_markers(&info, JPEG_APP0 + 1, 0xFFFF);
+    }
+
+	if (spxJpegReadHeader(&info, data, size)) {
+		fprintf(stderr, "spximg could not read image as JPEG file: '%s'\n", name);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        jpeg_destroy_decompress(&info);
+		return img;
+	}
+
+    if (flags & SPXI_LOAD_ORIENT) {
+        transform = spxJpegOrientation(&info);
+    }
+
+    if (width > 0 || height > 0) {
+        for (i = 1; i <= 8; ++i) {
+            info.scale_num = i;
+            info.scale_denom = 8;
+            jpeg_calc_output_dimensions(&info);
+            if ((int)info.output_width >= width && (int)info.output_height >= height) {
+                break;
+            }
+        }
+    }
+
+    jpeg_calc_output_dimensions(&info);
+    if (spxImageAdmit(info.output_width, info.output_height, info.output_components, 1, name)) {
+        jpeg_destroy_decompress(&info);
+        return img;
+    }
+
+    spxProgressBegin(&progress, info.output_height, 1);
+    if (transform == SPXI_TRANSFORM_NONE && width <= 0 && height <= 0) {
+        img = spxJpegDecodeStrips(data, size, &info);
+        if (img.pixbuf || spxProgressStep(0)) {
+            jpeg_destroy_decompress(&info);
+            spxProgressEnd(&progress);
+            return img;
+        }
+    }
+
+	if (spxJpegStartDecompress(&info)) {
+		fprintf(stderr, "spximg could not read image as JPEG file: '%s'\n", name);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        jpeg_destroy_decompress(&info);
+        spxProgressEnd(&progress);
+        return img;
+    }
+
+    img.width = info.output_width;
+	img.height = info.output_height;
+	img.channels = info.output_components;
+	stride = img.width * img.channels;
+
+    if (transform == SPXI_TRANSFORM_NONE) {
+        img.pixbuf = spxPixbufAlloc(img.height * stride);
+        for (i = 0; img.pixbuf && i < img.height; ++i) {
+            if (spxJpegReadRow(&info, img.pixbuf + i * stride) || spxProgressStep(1)) {
+                spxImageFree(&img);
+            }
+        }
+    } else {
+        /* decode strips of rows and transform each one into place */
+        Img2D out = spxTransformCreate(img, transform);
+        uint8_t* strip = (uint8_t*)spxMalloc(SPXI_TRANSFORM_TILE * stride);
+        while (out.pixbuf && strip && (int)info.output_scanline < img.height) {
+            int y0 = info.output_scanline, y1 = y0;
+            while (y1 - y0 < SPXI_TRANSFORM_TILE && y1 < img.height) {
+                if (spxJpegReadRow(&info, strip + (y1 - y0) * stride)) {
+                    break;
+                }
+                ++y1;
+            }
+            if (y1 == y0 || spxProgressStep(y1 - y0)) {
+                break;
+            }
+            spxStatsPush(SPXI_STAGE_CONVERT);
+            spxTransformStrip(img, y0, y1, strip, stride, out, transform);
+            spxStatsPop();
+        }
+        SPXI_FREE(strip);
+        if ((int)info.output_scanline < img.height || spxProgressStep(0)) {
+            spxImageFree(&out);
+        }
+        img = out;
+    }
+
+    if (img.pixbuf && spxJpegFinishDecompress(&info)) {
+        spxImageFree(&img);
+    }
+	jpeg_destroy_decompress(&info);
+    if (!spxProgressEnd(&progress) && !img.pixbuf) {
+		fprintf(stderr, "spximg could not read image as JPEG file: '%s'\n", name);
+        spxLimitsError = SPXI_ERROR_DECODE;
+    }
+    return img;
+}
+
+static Img2D spxJpegLoad(const char* path, const int width, const int height,
+    const int flags)
+{
+    uint8_t* fbuffer;
+	size_t fsize;
+	Img2D img = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+	FILE* file;
+
+    spxStatsBegin(SPXI_FORMAT_JPEG);
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "spximg could not open file: '%s'\n", path);
+        spxStatsEnd();
+        return img;
+    } 
+
+    fseek(file, 0, SEEK_END);
+    fsize = ftell(file);
+    fbuffer = (uint8_t*)spxMalloc(fsize ? fsize : 1);
+    if (!fbuffer) {
+        spxFileClose(file, 0);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        spxStatsEnd();
+        return img;
+    }
+    
+    fseek(file, 0, SEEK_SET);
+	spxFileRead(fbuffer, fsize, sizeof(uint8_t), file);
+	spxFileClose(file, 0);
+
+    img = spxJpegDecode(fbuffer, fsize, path, width, height, flags);
+	SPXI_FREE(fbuffer);
+    spxStatsEnd();
+    return img;
+}
+
+/* decode at the smallest DCT scale M/8 whose output still covers
+ * width x height, pass zero in both to decode at full size */
+Img2D spxImageLoadJpegScaled(const char* path, const int width, const int height)
+{
+    return spxJpegLoad(path, width, height, 0);
+}
+
+Img2D spxImageLoadJpeg(const char* path)
+{
+    return spxJpegLoad(path, 0, 0, 0);
+}
+
+/* Progressive Refinement */
+
+struct SpxImageScans {
+    struct jpeg_decompress_struct info;
+    SpxJpegError err;
+    uint8_t* data;
+    int state;
+};
+
+/* the file is decoded at the smallest DCT scale covering width x height,
+ * progressive files are read in buffered image mode so that any scan
+ * can be output while later ones are still pending */
+SpxImageScans* spxImageScansOpen(const char* path, int width, int height)
+{
+    int i;
+    size_t fsize;
+    FILE* file;
+    SpxImageScans* scans;
+
+    spxLimitsError = SPXI_ERROR_NONE;
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "spximg could not open file: '%s'\n", path);
+        return NULL;
+    }
+
+    scans = (SpxImageScans*)SPXI_MALLOC(sizeof(SpxImageScans));
+    if (!scans) {
+        spxFileClose(file, 0);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    fsize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    scans->data = (uint8_t*)SPXI_MALLOC(fsize ? fsize : 1);
+    if (scans->data) {
+        spxFileRead(scans->data, fsize, sizeof(uint8_t), file);
+    }
+    spxFileClose(file, 0);
+
+    scans->state = 1;
+    scans->info.err = jpeg_std_error(&scans->err.mgr);
+    scans->err.mgr.error_exit = &spxJpegErrorExit;
+    jpeg_create_decompress(&scans->info);
+    if (!scans->data || setjmp(scans->err.jump)) {
+        fprintf(stderr, "spximg could not read image as JPEG file: '%s'\n", path);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        spxImageScansClose(scans);
+        return NULL;
+    }
+
+    jpeg_mem_src(&scans->info, scans->data, fsize);
+    jpeg_read_header(&scans->info, TRUE);
+    if (width > 0 || height > 0) {
+        for (i = 1; i <= 8; ++i) {
+            scans->info.scale_num = i;
+            scans->info.scale_denom = 8;
+            jpeg_calc_output_dimensions(&scans->info);
+            if ((int)scans->info.output_width >= width &&
+                (int)scans->info.output_height >= height) {
+                break;
+            }
+        }
+    }
+
+    jpeg_calc_output_dimensions(&scans->info);
+    if (spxImageAdmit(scans->info.output_width, scans->info.output_height,
+        scans->info.output_components, 1, path)) {
+        spxImageScansClose(scans);
+        return NULL;
+    }
+
+    scans->info.buffered_image = jpeg_has_multiple_scans(&scans->info);
+    jpeg_start_decompress(&scans->info);
+    return scans;
+}
+
+/* output the coefficients read up to scan, an earlier scan than the
+ * one being read shows it partially without reading any further */
+static int spxJpegScansOutput(SpxImageScans* scans, Img2D* image, const int scan)
+{
+    j_decompress_ptr info = &scans->info;
+    image->pixbuf = NULL;
+    if (scans->state <= 0) {
+        return -1;
+    } else if (setjmp(scans->err.jump)) {
+        spxImageFree(image);
+        scans->state = -1;
+        spxStatsEnd();
+        return -1;
+    }
+
+    spxStatsBegin(SPXI_FORMAT_JPEG);
+    spxStatsStage(SPXI_STAGE_CODEC);
+    if (info->buffered_image) {
+        jpeg_start_output(info, scan);
+    }
+
+    image->width = info->output_width;
+    image->height = info->output_height;
+    image->channels = info->output_components;
+    image->pixbuf = spxPixbufAlloc(
+        (size_t)image->width * image->height * image->channels
+    );
+    if (!image->pixbuf) {
+        longjmp(scans->err.jump, 1);
+    }
+
+    while (info->output_scanline < info->output_height) {
+        uint8_t* row = image->pixbuf +
+            (size_t)info->output_scanline * image->width * image->channels;
+        jpeg_read_scanlines(info, &row, 1);
+    }
+
+    if (info->buffered_image) {
+        jpeg_finish_output(info);
+    }
+
+    if (!info->buffered_image || (jpeg_input_complete(info) &&
+        info->output_scan_number == info->input_scan_number)) {
+        jpeg_finish_decompress(info);
+        scans->state = 0;
+    }
+
+    spxStatsEnd();
+    return scans->state;
+}
+
+/* the next refinement with every scan read so far, returns 1 while more
+ * will follow, 0 with the final image and -1 once there is none left */
+int spxImageScansNext(SpxImageScans* scans, Img2D* image)
+{
+    Img2D img = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    *image = img;
+    return scans ? spxJpegScansOutput(scans, image, scans->info.input_scan_number) : -1;
+}
+
+void spxImageScansClose(SpxImageScans* scans)
+{
+    if (scans) {
+        jpeg_destroy_decompress(&scans->info);
+        SPXI_FREE(scans->data);
+        SPXI_FREE(scans);
+    }
+}
+
+/* read no further than scans complete scans or msec milliseconds, 0 in
+ * either means no limit, and output once; a scan cut short by the time
+ * limit still shows what was read of it */
+Img2D spxImageLoadJpegPreview(const char* path, int width, int height, int scans, int msec)
+{
+    const double deadline = spxTime() + msec * 0.001;
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    SpxImageScans* s = spxImageScansOpen(path, width, height);
+    int scan, ret = JPEG_REACHED_SOS;
+
+    if (!s) {
+        return image;
+    } else if (s->info.buffered_image) {
+        if (setjmp(s->err.jump)) {
+            spxImageScansClose(s);
+            return image;
+        }
+        while (ret != JPEG_REACHED_EOI && (scans <= 0 || s->info.input_scan_number < scans) &&
+            (msec <= 0 || spxTime() < deadline)) {
+            ret = jpeg_consume_input(&s->info);
+        }
+    }
+
+    scan = s->info.input_scan_number;
+    if (ret == JPEG_ROW_COMPLETED || (ret == JPEG_REACHED_SOS && scan > 1 &&
+        (scans <= 0 || scan < scans))) {
+        --scan;
+    }
+
+    spxJpegScansOutput(s, &image, scan);
+    spxImageScansClose(s);
+    return image;
+}
+
+static void spxJpegEncodeWork(void* arg, const int begin, const int end)
+{
+    SpxJpegEncodeTask* task = (SpxJpegEncodeTask*)arg;
+    const Img2D img = task->img;
+    const size_t stride = spxImageStride(img);
+    int s, y, ret;
+
+    for (s = begin; s < end; ++s) {
+        struct jpeg_compress_struct info;
+        SpxJpegError err;
+        int y0 = task->mcurows * s / task->count * task->mcuheight;
+        int y1 = task->mcurows * (s + 1) / task->count * task->mcuheight;
+        y1 = y1 < img.height ? y1 : img.height;
+        if (spxProgressStep(0)) {
+            break;
+        }
+
+        info.err = jpeg_std_error(&err.mgr);
+        err.mgr.error_exit = &spxJpegErrorExit;
+        jpeg_create_compress(&info);
+        jpeg_mem_dest(&info, &task->strips[s].data, &task->strips[s].size);
+
+        info.image_width = img.width;
+        info.image_height = y1 - y0;
+        info.input_components = img.channels;
+        info.in_color_space = img.channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+        jpeg_set_defaults(&info);
+        jpeg_set_quality(&info, task->quality, 1);
+        info.restart_in_rows = 1;
+        ret = spxJpegStartCompress(&info, SPXI_JPEG_STRIP_COMMENT);
+        for (y = y0; !ret && y < y1; ++y) {
+            ret = spxJpegWriteRow(&info, img.pixbuf + y * stride);
+            if (!ret && spxProgressStep(1)) {
+                break;
+            }
+        }
+
+        /* a failed or cancelled strip still hands its grown buffer back
+         * to be freed, left empty so that joining the strips fails */
+        if (ret || y != y1 || spxJpegFinishCompress(&info)) {
+            (*info.dest->term_destination)(&info);
+            task->strips[s].size = 0;
+        }
+        jpeg_destroy_compress(&info);
+    }
+}
+
+/* encode strips of MCU rows in parallel with a restart marker after
+ * every MCU row, then join their scans renumbering the markers. The
+ * standard Huffman tables are shared by all strips, so the result is the
+ * same baseline JPEG a serial encoder with restart_in_rows = 1 writes,
+ * plus the comment that lets spximg decode it in strips. Nothing is
+ * written when a strip fails, so the caller can encode serially instead */
+static int spxJpegEncodeStrips(const Img2D img, FILE* file, const int quality, 
+    const int count)
+{
+    static const uint8_t eoi[2] = {0xFF, 0xD9};
+    int s, rst = 0, ret = EXIT_SUCCESS;
+    size_t i, sof, sos;
+    SpxJpegEncodeTask task;
+
+    task.img = img;
+    task.count = count;
+    /* jpeg_set_defaults samples color chroma at 2x2 */
+    task.mcuheight = img.channels == 1 ? DCTSIZE : 2 * DCTSIZE;
+    task.mcurows = (img.height + task.mcuheight - 1) / task.mcuheight;
+    task.quality = quality;
+    task.strips = (SpxJpegStrip*)spxMalloc(count * sizeof(SpxJpegStrip));
+    if (!task.strips) {
+        return EXIT_FAILURE;
+    }
+
+    memset(task.strips, 0, count * sizeof(SpxJpegStrip));
+    spxParallelFor(count, 1, &spxJpegEncodeWork, &task);
+    for (s = 0; s < count; ++s) {
+        if (spxJpegScanStart(task.strips[s].data, task.strips[s].size, &sof, &sos) ||
+            task.strips[s].size < sos + 2) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    for (s = 0; !ret && s < count; ++s) {
+        uint8_t* data = task.strips[s].data, marker[2];
+        size_t size = task.strips[s].size;
+        spxJpegScanStart(data, size, &sof, &sos);
+        if (!s) {
+            data[sof + 5] = (uint8_t)(img.height >> 8);
+            data[sof + 6] = (uint8_t)img.height;
+            spxFileWrite(data, sos, 1, file);
+        }
+
+        for (i = sos; i + 3 < size; ++i) {
+            if (data[i] == 0xFF && (data[i + 1] & 0xF8) == 0xD0) {
+                data[++i] = (uint8_t)(0xD0 | (rst++ & 7));
+            }
+        }
+
+        spxFileWrite(data + sos, size - 2 - sos, 1, file);
+        marker[0] = 0xFF;
+        marker[1] = (uint8_t)(0xD0 | (rst++ & 7));
+        spxFileWrite(s + 1 < count ? marker : eoi, 2, 1, file);
+    }
+
+    for (s = 0; s < count; ++s) {
+        free(task.strips[s].data);
+    }
+
+    SPXI_FREE(task.strips);
+    return ret;
+}
+
+int spxImageSaveJpeg(const Img2D img, const char* path, const int quality) 
+{
+    FILE* file;
+    int i, ret;
+    size_t stride;
+    SpxProgress progress;
+    struct jpeg_compress_struct info;
+    SpxJpegError err;
+
+    spxStatsBegin(SPXI_FORMAT_JPEG);
+    spxLimitsError = SPXI_ERROR_NONE;
+    if (spxSampleSize(img) > 1 || spxImagePlanar(img)) {
+        Img2D tmp = spxSampleSize(img) > 1 ?
+            spxImageDepth(img, 8) : spxImageLayout(img, SPXI_LAYOUT_INTERLEAVED);
+        i = tmp.pixbuf ? spxImageSaveJpeg(tmp, path, quality) : EXIT_FAILURE;
+        spxImageFree(&tmp);
+        spxStatsEnd();
+        return i;
+    }
+
+    if (img.channels == 2 || img.channels == 4 || img.palette) {
+        Img2D tmp = spxImageReshape(img, img.palette ? 3 : img.channels - 1);
+        i = tmp.pixbuf ? spxImageSaveJpeg(tmp, path, quality) : EXIT_FAILURE;
+        spxImageFree(&tmp);
+        spxStatsEnd();
+        return i;
+    }
+
+    assert(img.channels == 1 || img.channels == 3);
+    file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "spximg could not write image as JPEG file: '%s'\n", path);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    spxStatsStage(SPXI_STAGE_CODEC);
+    spxProgressBegin(&progress, img.height, 1);
+    i = spxThreadCount();
+    if (i > 1 && (size_t)img.width * img.height >= SPXI_JPEG_STRIP_PIXELS &&
+        img.height / (SPXI_JPEG_STRIP_ROWS * 2 * DCTSIZE) >= 2) {
+        int mcurows = img.height / (img.channels == 1 ? DCTSIZE : 2 * DCTSIZE);
+        i = i < mcurows / SPXI_JPEG_STRIP_ROWS ? i : mcurows / SPXI_JPEG_STRIP_ROWS;
+        if (!spxJpegEncodeStrips(img, file, quality, i) || spxProgressStep(0)) {
+            i = spxFileClose(file, 1);
+            if (spxProgressEnd(&progress)) {
+                remove(path);
+                i = EXIT_FAILURE;
+            }
+            spxStatsEnd();
+            return i;
+        }
+
+        /* the rows of the strips that did encode are counted again */
+        spxProgressAt(0);
+    }
+
+    info.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = &spxJpegErrorExit;
+    jpeg_create_compress(&info);
+    jpeg_stdio_dest(&info, file);
+
+    info.image_width = img.width;
+    info.image_height = img.height;
+    info.input_components = img.channels;
+    info.in_color_space = img.channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, quality, 1);
+    ret = spxJpegStartCompress(&info, NULL);
+
+    stride = spxImageStride(img);
+    for (i = 0; !ret && i < img.height; ++i) {
+        ret = spxJpegWriteRow(&info, img.pixbuf + (size_t)i * stride);
+        if (!ret && spxProgressStep(1)) {
+            break;
+        }
+    }
+
+    if (!ret && i == img.height) {
+        ret = spxJpegFinishCompress(&info);
+    }
+    jpeg_destroy_compress(&info);
+    i = spxFileClose(file, 1);
+    if (ret) {
+        fprintf(stderr, "spximg could not write image as JPEG file: '%s'\n", path);
+    }
+    if (spxProgressEnd(&progress) || ret) {
+        remove(path);
+        i = EXIT_FAILURE;
+    }
+    spxStatsEnd();
+    return i;
+}
+
+/* Target Size JPEG Encoding */
+
+#ifndef SPXI_JPEG_TARGET_SAMPLE
+#define SPXI_JPEG_TARGET_SAMPLE 8
+#endif /* SPXI_JPEG_TARGET_SAMPLE */
+
+/* one quality tried by the search and the file it encoded to */
+typedef struct SpxJpegTrial {
+    Img2D img;
+    int quality;
+    SpxJpegStrip out;
+} SpxJpegTrial;
+
+/* encode each trial into memory with the defaults spxImageSaveJpeg uses */
+static void spxJpegTargetWork(void* arg, const int begin, const int end)
+{
+    SpxJpegTrial* trials = (SpxJpegTrial*)arg;
+    int i, y, ret;
+
+    for (i = begin; i < end; ++i) {
+        const Img2D img = trials[i].img;
+        const size_t stride = spxImageStride(img);
+        struct jpeg_compress_struct info;
+        SpxJpegError err;
+
+        info.err = jpeg_std_error(&err.mgr);
+        err.mgr.error_exit = &spxJpegErrorExit;
+        jpeg_create_compress(&info);
+        jpeg_mem_dest(&info, &trials[i].out.data, &trials[i].out.size);
+
+        info.image_width = img.width;
+        info.image_height = img.height;
+        info.input_components = img.channels;
+        info.in_color_space = img.channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+        jpeg_set_defaults(&info);
+        jpeg_set_quality(&info, trials[i].quality, 1);
+        ret = spxJpegStartCompress(&info, NULL);
+        for (y = 0; !ret && y < img.height; ++y) {
+            ret = spxJpegWriteRow(&info, img.pixbuf + (size_t)y * stride);
+        }
+
+        /* a failed trial frees its buffer and counts as not fitting */
+        if (ret || spxJpegFinishCompress(&info)) {
+            (*info.dest->term_destination)(&info);
+            free(trials[i].out.data);
+            trials[i].out.data = NULL;
+            trials[i].out.size = 0;
+        }
+        jpeg_destroy_compress(&info);
+    }
+}
+
+/* size of the sample encoded at a quality, tried once and remembered */
+static unsigned long spxJpegTargetSample(const Img2D sample, unsigned long* sizes,
+    const int quality)
+{
+    if (!sizes[quality]) {
+        SpxJpegTrial trial;
+        trial.img = sample;
+        trial.quality = quality;
+        trial.out.data = NULL;
+        trial.out.size = 0;
+        spxJpegTargetWork(&trial, 0, 1);
+        sizes[quality] = trial.out.data ? trial.out.size : ~0UL;
+        free(trial.out.data);
+    }
+    return sizes[quality];
+}
+
+/* save the highest quality JPEG that fits in bytes and return that
+ * quality, or 0 when nothing fits or the image could not be saved.
+ * Entropy coding is most of what an encode costs, so the search runs
+ * on a sample of every SPXI_JPEG_TARGET_SAMPLE'th row of MCUs, scaled
+ * by how much larger the whole image came out the last time. Only the
+ * qualities around each guess are encoded in full, as many at once as
+ * there are threads, until the highest that fits is next to one that
+ * does not */
+int spxImageSaveJpegTarget(const Img2D img, const char* path, const size_t bytes)
+{
+    Img2D sample = img;
+    SpxJpegTrial* trials;
+    SpxJpegTrial best = {{NULL, 0, 0, 0, NULL, 0, 0, 0}, 0, {NULL, 0}};
+    unsigned long sizes[102];
+    const int mcuheight = img.channels == 1 ? DCTSIZE : 2 * DCTSIZE;
+    const int mcurows = (img.height + mcuheight - 1) / mcuheight;
+    int a, b, i, n, lo = 0, hi = 101, threads;
+    double ratio;
+    FILE* file;
+
+    if (spxSampleSize(img) > 1 || spxImagePlanar(img) || img.channels == 2 ||
+        img.channels == 4 || img.palette) {
+        Img2D tmp = spxSampleSize(img) > 1 ? spxImageDepth(img, 8) :
+            spxImagePlanar(img) ? spxImageLayout(img, SPXI_LAYOUT_INTERLEAVED) :
+            spxImageReshape(img, img.palette ? 3 : img.channels - 1);
+        i = tmp.pixbuf ? spxImageSaveJpegTarget(tmp, path, bytes) : 0;
+        spxImageFree(&tmp);
+        return i;
+    }
+
+    spxStatsBegin(SPXI_FORMAT_JPEG);
+    spxStatsStage(SPXI_STAGE_CODEC);
+    threads = spxThreadCount();
+    trials = (SpxJpegTrial*)spxMalloc(threads * sizeof(SpxJpegTrial));
+    memset(sizes, 0, sizeof(sizes));
+
+    /* whole rows of MCUs from the middle of every stretch, so the sample
+     * is split into blocks the same way the image is */
+    if (mcurows >= SPXI_JPEG_TARGET_SAMPLE * 4) {
+        const size_t stride = spxImageStride(img), rowsize = spxImageRowSize(img);
+        n = mcurows / SPXI_JPEG_TARGET_SAMPLE;
+        sample = spxImageCreate(img.width, n * mcuheight, img.channels);
+        for (i = 0; sample.pixbuf && i < n * mcuheight; ++i) {
+            const int y = (i / mcuheight * SPXI_JPEG_TARGET_SAMPLE +
+                SPXI_JPEG_TARGET_SAMPLE / 2) * mcuheight + i % mcuheight;
+            memcpy(sample.pixbuf + (size_t)i * rowsize, img.pixbuf + (size_t)y * stride, rowsize);
+        }
+    }
+
+    ratio = sample.pixbuf ? (double)img.height / sample.height : 1.0;
+    if (!trials || !sample.pixbuf) {
+        hi = lo;
+    }
+
+    while (hi - lo > 1) {
+        int fit = -1, miss = hi, guess;
+        a = lo;
+        b = hi;
+        while (b - a > 1) {
+            const int m = (a + b) / 2;
+            if (spxJpegTargetSample(sample, sizes, m) * ratio <= (double)bytes) {
+                a = m;
+            } else {
+                b = m;
+            }
+        }
+
+        /* a guess at a bound is tried anyway to close the range */
+        guess = a > lo ? a : lo + 1;
+        n = hi - lo - 1 < threads ? hi - lo - 1 : threads;
+        a = guess - (n - 1) / 2;
+        a = a < lo + 1 ? lo + 1 : a > hi - n ? hi - n : a;
+        for (i = 0; i < n; ++i) {
+            trials[i].img = img;
+            trials[i].quality = a + i;
+            trials[i].out.data = NULL;
+            trials[i].out.size = 0;
+        }
+
+        spxParallelFor(n, 1, &spxJpegTargetWork, trials);
+        for (i = 0; i < n; ++i) {
+            if (trials[i].out.data && trials[i].out.size <= bytes) {
+                fit = i;
+            }
+            if (trials[i].out.data && trials[i].quality == guess) {
+                ratio = (double)trials[i].out.size / spxJpegTargetSample(sample, sizes, guess);
+            }
+        }
+
+        for (i = n - 1; i > fit; --i) {
+            miss = !trials[i].out.data || trials[i].out.size > bytes ?
+                trials[i].quality : miss;
+        }
+
+        if (fit >= 0) {
+            free(best.out.data);
+            best = trials[fit];
+            lo = best.quality;
+        }
+
+        hi = miss;
+        for (i = 0; i < n; ++i) {
+            if (i != fit) {
+                free(trials[i].out.data);
+            }
+        }
+    }
+
+    if (sample.pixbuf != img.pixbuf) {
+        spxImageFree(&sample);
+    }
+    SPXI_FREE(trials);
+
+    if (!best.quality) {
+        fprintf(stderr, "spximg could not fit image in %lu bytes as JPEG file: '%s'\n",
+            (unsigned long)bytes, path
+        );
+        spxStatsEnd();
+        return 0;
+    }
+
+    file = fopen(path, "wb");
+    if (!file || spxFileWrite(best.out.data, best.out.size, 1, file) != 1) {
+        fprintf(stderr, "spximg could not write image as JPEG file: '%s'\n", path);
+        best.quality = 0;
+    }
+
+    if (file && spxFileClose(file, 1)) {
+        best.quality = 0;
+    }
+    free(best.out.data);
+    spxStatsEnd();
+    return best.quality;
+}
+
+/* Raw Planar YCbCr JPEG Access */
+
+/* planes keep the native subsampling of the JPEG, with strides padded to
+ * whole blocks and rows to whole iMCU rows so libjpeg reads and writes
+ * them in place without color conversion or resampling */
+static SpxImageYCbCr spxYCbCrAlloc(const int width, const int height,
+    const int components, const int* hsamp, const int* vsamp)
+{
+    SpxImageYCbCr image;
+    int c, hmax = 1, vmax = 1, rows[3];
+    size_t size = 0;
+
+    memset(&image, 0, sizeof(SpxImageYCbCr));
+    for (c = 0; c < components; ++c) {
+        hmax = hsamp[c] > hmax ? hsamp[c] : hmax;
+        vmax = vsamp[c] > vmax ? vsamp[c] : vmax;
+    }
+
+    for (c = 0; c < components; ++c) {
+        image.widths[c] = (width * hsamp[c] + hmax - 1) / hmax;
+        image.heights[c] = (height * vsamp[c] + vmax - 1) / vmax;
+        image.strides[c] = (image.widths[c] + DCTSIZE - 1) / DCTSIZE * DCTSIZE;
+        rows[c] = (height + vmax * DCTSIZE - 1) / (vmax * DCTSIZE) * vsamp[c] * DCTSIZE;
+        size += (size_t)image.strides[c] * rows[c];
+    }
+
+    image.planes[0] = (uint8_t*)spxMalloc(size);
+    if (!image.planes[0]) {
+        memset(&image, 0, sizeof(SpxImageYCbCr));
+        return image;
+    }
+
+    for (c = 1; c < components; ++c) {
+        image.planes[c] = image.planes[c - 1] + (size_t)image.strides[c - 1] * rows[c - 1];
+    }
+
+    image.components = components;
+    image.width = width;
+    image.height = height;
+    return image;
+}
+
+SpxImageYCbCr spxImageCreateYCbCr(int width, int height, int components,
+    int hsub, int vsub)
+{
+    int hsamp[3] = {1, 1, 1}, vsamp[3] = {1, 1, 1};
+    if (width <= 0 || height <= 0 || (components != 1 && components != 3) ||
+        hsub < 1 || hsub > 2 || vsub < 1 || vsub > 2) {
+        SpxImageYCbCr image;
+        fprintf(stderr, "spximg does not support %dx%d YCbCr planes subsampled %dx%d\n",
+            width, height, hsub, vsub
+        );
+        memset(&image, 0, sizeof(SpxImageYCbCr));
+        return image;
+    }
+
+    hsamp[0] = components == 3 ? hsub : 1;
+    vsamp[0] = components == 3 ? vsub : 1;
+    return spxYCbCrAlloc(width, height, components, hsamp, vsamp);
+}
+
+static SpxImageYCbCr spxJpegDecodeYCbCr(const uint8_t* data, const size_t size,
+    const char* name)
+{
+    int c, y, rows, hsamp[3], vsamp[3];
+    JSAMPROW rowptrs[3][MAX_SAMP_FACTOR * DCTSIZE];
+    JSAMPARRAY arrays[3];
+    SpxImageYCbCr image;
+
+    struct jpeg_decompress_struct info;
+    SpxJpegError err;
+
+    memset(&image, 0, sizeof(SpxImageYCbCr));
+    if (size < SPXI_HEADER_SIZE || spxParseHeader(data) != SPXI_FORMAT_JPEG) {
+        fprintf(stderr, "spximg could not read image as JPEG file: '%s'\n", name);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        return image;
+    }
+
+    spxStatsStage(SPXI_STAGE_CODEC);
+    info.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = &spxJpegErrorExit;
+    jpeg_create_decompress(&info);
+
+    if (spxJpegReadHeader(&info, data, size)) {
+        fprintf(stderr, "spximg could not read image as JPEG file: '%s'\n", name);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        jpeg_destroy_decompress(&info);
+        return image;
+    }
+
+    if (!(info.jpeg_color_space == JCS_YCbCr && info.num_components == 3) &&
+        !(info.jpeg_color_space == JCS_GRAYSCALE && info.num_components == 1)) {
+        fprintf(stderr, "spximg could not read JPEG file as YCbCr planes: '%s'\n", name);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        jpeg_destroy_decompress(&info);
+        return image;
+    }
+
+    if (spxImageAdmit(info.image_width, info.image_height, info.num_components, 1, name)) {
+        jpeg_destroy_decompress(&info);
+        return image;
+    }
+
+    info.raw_data_out = 1;
+    info.out_color_space = info.jpeg_color_space;
+    if (spxJpegStartDecompress(&info)) {
+        fprintf(stderr, "spximg could not read image as JPEG file: '%s'\n", name);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        jpeg_destroy_decompress(&info);
+        return image;
+    }
+
+    for (c = 0; c < info.num_components; ++c) {
+        hsamp[c] = info.comp_info[c].h_samp_factor;
+        vsamp[c] = info.comp_info[c].v_samp_factor;
+    }
+
+    image = spxYCbCrAlloc(
+        info.image_width, info.image_height, info.num_components, hsamp, vsamp
+    );
+
+    /* each call returns one iMCU row, max_v_samp_factor blocks high */
+    rows = info.max_v_samp_factor * DCTSIZE;
+    while (image.planes[0] && info.output_scanline < info.output_height) {
+        const int imcu = info.output_scanline / rows;
+        for (c = 0; c < image.components; ++c) {
+            const int n = vsamp[c] * DCTSIZE;
+            for (y = 0; y < n; ++y) {
+                rowptrs[c][y] = image.planes[c] + ((size_t)imcu * n + y) * image.strides[c];
+            }
+            arrays[c] = rowptrs[c];
+        }
+        if (spxJpegReadRaw(&info, arrays, rows)) {
+            break;
+        }
+    }
+
+    if (!image.planes[0] || info.output_scanline < info.output_height ||
+        spxJpegFinishDecompress(&info)) {
+        fprintf(stderr, "spximg could not read image as JPEG file: '%s'\n", name);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        spxImageFreeYCbCr(&image);
+    }
+    jpeg_destroy_decompress(&info);
+    return image;
+}
+
+SpxImageYCbCr spxImageLoadYCbCr(const char* path)
+{
+    uint8_t* fbuffer;
+    size_t fsize;
+    SpxImageYCbCr image;
+    FILE* file;
+
+    spxStatsBegin(SPXI_FORMAT_JPEG);
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "spximg could not open file: '%s'\n", path);
+        memset(&image, 0, sizeof(SpxImageYCbCr));
+        spxStatsEnd();
+        return image;
+    }
+
+    fseek(file, 0, SEEK_END);
+    fsize = ftell(file);
+    fbuffer = (uint8_t*)spxMalloc(fsize ? fsize : 1);
+    if (!fbuffer) {
+        spxFileClose(file, 0);
+        memset(&image, 0, sizeof(SpxImageYCbCr));
+        spxLimitsError = SPXI_ERROR_DECODE;
+        spxStatsEnd();
+        return image;
+    }
+
+    fseek(file, 0, SEEK_SET);
+    spxFileRead(fbuffer, fsize, sizeof(uint8_t), file);
+    spxFileClose(file, 0);
+
+    image = spxJpegDecodeYCbCr(fbuffer, fsize, path);
+    SPXI_FREE(fbuffer);
+    spxStatsEnd();
+    return image;
+}
+
+/* chroma subsampling of a plane, 1 or 2, or 0 when it matches neither */
+static int spxYCbCrFactor(const int size, const int subsampled)
+{
+    return subsampled == size ? 1 : subsampled == (size + 1) / 2 ? 2 : 0;
+}
+
+/* the subsampling is taken from the plane sizes, rows are replicated
+ * past the bottom edge and partial blocks at the right edge are padded
+ * with their last sample, as libjpeg would do while downsampling */
+int spxImageSaveYCbCr(const SpxImageYCbCr image, const char* path, const int quality)
+{
+    int c, y, rows, ret, hsub = 1, vsub = 1, pad[3] = {0, 0, 0};
+    JSAMPROW rowptrs[3][2 * DCTSIZE];
+    JSAMPARRAY arrays[3];
+    uint8_t* edge[3] = {NULL, NULL, NULL}, *edges;
+    size_t edgesize = 0;
+    FILE* file;
+
+    struct jpeg_compress_struct info;
+    SpxJpegError err;
+
+    if (image.components == 3) {
+        hsub = spxYCbCrFactor(image.width, image.widths[1]);
+        vsub = spxYCbCrFactor(image.height, image.heights[1]);
+    }
+
+    if (!image.planes[0] || (image.components != 1 && image.components != 3) ||
+        !hsub || !vsub || image.widths[0] != image.width || image.heights[0] != image.height ||
+        (image.components == 3 && (image.widths[2] != image.widths[1] ||
+        image.heights[2] != image.heights[1]))) {
+        fprintf(stderr, "spximg does not support saving these YCbCr planes: '%s'\n", path);
+        return EXIT_FAILURE;
+    }
+
+    for (c = 0; c < image.components; ++c) {
+        if (!image.planes[c] || image.strides[c] < image.widths[c]) {
+            fprintf(stderr, "spximg does not support saving these YCbCr planes: '%s'\n", path);
+            return EXIT_FAILURE;
+        }
+        pad[c] = (image.widths[c] + DCTSIZE - 1) / DCTSIZE * DCTSIZE;
+        edgesize += pad[c] != image.widths[c] ? (size_t)pad[c] * 2 * DCTSIZE : 0;
+    }
+
+    spxStatsBegin(SPXI_FORMAT_JPEG);
+    edges = (uint8_t*)spxMalloc(edgesize ? edgesize : 1);
+    file = edges ? fopen(path, "wb") : NULL;
+    if (!file) {
+        fprintf(stderr, "spximg could not write image as JPEG file: '%s'\n", path);
+        SPXI_FREE(edges);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    for (c = 0; c < image.components; ++c) {
+        if (pad[c] != image.widths[c]) {
+            edge[c] = edges;
+            edges += (size_t)pad[c] * 2 * DCTSIZE;
+        }
+    }
+    edges -= edgesize;
+
+    spxStatsStage(SPXI_STAGE_CODEC);
+    info.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = &spxJpegErrorExit;
+    jpeg_create_compress(&info);
+    jpeg_stdio_dest(&info, file);
+
+    info.image_width = image.width;
+    info.image_height = image.height;
+    info.input_components = image.components;
+    info.in_color_space = image.components == 1 ? JCS_GRAYSCALE : JCS_YCbCr;
+
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, quality, 1);
+    for (c = 0; c < image.components; ++c) {
+        info.comp_info[c].h_samp_factor = c ? 1 : hsub;
+        info.comp_info[c].v_samp_factor = c ? 1 : vsub;
+    }
+    info.raw_data_in = 1;
+    ret = spxJpegStartCompress(&info, NULL);
+
+    rows = vsub * DCTSIZE;
+    while (!ret && info.next_scanline < info.image_height) {
+        const int imcu = info.next_scanline / rows;
+        for (c = 0; c < image.components; ++c) {
+            const int n = info.comp_info[c].v_samp_factor * DCTSIZE;
+            for (y = 0; y < n; ++y) {
+                const int row = imcu * n + y < image.heights[c] ?
+                    imcu * n + y : image.heights[c] - 1;
+                const uint8_t* src = image.planes[c] + (size_t)row * image.strides[c];
+                if (edge[c]) {
+                    uint8_t* dst = edge[c] + (size_t)y * pad[c];
+                    memcpy(dst, src, image.widths[c]);
+                    memset(dst + image.widths[c], src[image.widths[c] - 1],
+                        pad[c] - image.widths[c]
+                    );
+                    src = dst;
+                }
+                rowptrs[c][y] = (JSAMPROW)src;
+            }
+            arrays[c] = rowptrs[c];
+        }
+        ret = spxJpegWriteRaw(&info, arrays, rows);
+    }
+
+    if (!ret) {
+        ret = spxJpegFinishCompress(&info);
+    }
+    jpeg_destroy_compress(&info);
+    SPXI_FREE(edges);
+    c = spxFileClose(file, 1);
+    if (ret) {
+        fprintf(stderr, "spximg could not write image as JPEG file: '%s'\n", path);
+        remove(path);
+        c = EXIT_FAILURE;
+    }
+    spxStatsEnd();
+    return c;
+}
+
+void spxImageFreeYCbCr(SpxImageYCbCr* image)
+{
+    if (image->planes[0]) {
+        SPXI_FREE(image->planes[0]);
+    }
+    memset(image, 0, sizeof(SpxImageYCbCr));
+}
+
+/* coefficient order and signs of a transform: transposing swaps the
+ * horizontal and vertical frequencies and mirroring an axis negates its
+ * odd frequencies */
+static void spxJpegBlockTable(int* index, JCOEF* sign, const int transform)
+{
+    int i, j;
+    for (i = 0; i < DCTSIZE; ++i) {
+        for (j = 0; j < DCTSIZE; ++j) {
+            int neg = ((transform & SPXI_TRANSFORM_FLIP_X) && (j & 1)) !=
+                      ((transform & SPXI_TRANSFORM_FLIP_Y) && (i & 1));
+            index[i * DCTSIZE + j] = transform & SPXI_TRANSFORM_TRANSPOSE ?
+                j * DCTSIZE + i : i * DCTSIZE + j;
+            sign[i * DCTSIZE + j] = neg ? -1 : 1;
+        }
+    }
+}
+
+static void spxJpegBlockTransform(JCOEF* dst, const JCOEF* src, 
+    const int* index, const JCOEF* sign)
+{
+    int i;
+    for (i = 0; i < DCTSIZE2; ++i) {
+        dst[i] = (JCOEF)(src[index[i]] * sign[i]);
+    }
+}
+
+/* rotate, flip, crop or gray a JPEG file by moving its quantized DCT
+ * coefficients, without decoding or quantizing again. crop is NULL or
+ * {x, y, width, height} in source pixels, its origin snaps down to the
+ * MCU grid. Partial MCUs at an edge that a flip moves to the origin are
+ * trimmed, since they cannot be represented there */
+int spxImageTransformJpeg(const char* inpath, const char* outpath,
+    const int transform, const int* crop, const int flags)
+{
+    int ci, x, y, x0, y0, width, height, unitx, unity, count, gray;
+    int index[DCTSIZE2];
+    JCOEF sign[DCTSIZE2];
+    int swap = transform & SPXI_TRANSFORM_TRANSPOSE;
+    int flipx = transform & SPXI_TRANSFORM_FLIP_X;
+    int flipy = transform & SPXI_TRANSFORM_FLIP_Y;
+    uint8_t* fbuffer;
+    size_t fsize;
+    FILE* volatile file;
+
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    SpxJpegError err;
+    jvirt_barray_ptr* scoefs;
+    jvirt_barray_ptr dcoefs[MAX_COMPONENTS];
+    jpeg_saved_marker_ptr marker;
+    
+    spxStatsBegin(SPXI_FORMAT_JPEG);
+    file = fopen(inpath, "rb");
+    if (!file) {
+        fprintf(stderr, "spximg could not open file: '%s'\n", inpath);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    fseek(file, 0, SEEK_END);
+    fsize = ftell(file);
+    fbuffer = (uint8_t*)spxMalloc(fsize ? fsize : 1);
+    if (!fbuffer) {
+        spxFileClose(file, 0);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+    
+    fseek(file, 0, SEEK_SET);
+    spxFileRead(fbuffer, fsize, sizeof(uint8_t), file);
+    spxFileClose(file, 0);
+    file = NULL;
+
+    /* both objects report to one error manager, a failure anywhere
+     * destroys them and removes the partial output */
+    spxStatsStage(SPXI_STAGE_CODEC);
+    memset(&dst, 0, sizeof(dst));
+    src.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = &spxJpegErrorExit;
+    jpeg_create_decompress(&src);
+    if (setjmp(err.jump)) {
+        fprintf(stderr, "spximg could not transform JPEG file: '%s'\n", inpath);
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        if (file) {
+            spxFileClose(file, 1);
+            remove(outpath);
+        }
+        SPXI_FREE(fbuffer);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    jpeg_mem_src(&src, fbuffer, (unsigned long)fsize);
+
+    if (!(flags & SPXI_JPEG_STRIP)) {
+        jpeg_save_markers(&src, JPEG_COM, 0xFFFF);
+        for (ci = 0; ci < 16; ++ci) {
+            jpeg_save_markers(&src, JPEG_APP0 + ci, 0xFFFF);
+        }
+    }
+
+    if (jpeg_read_header(&src, TRUE) != JPEG_HEADER_OK) {
+        fprintf(stderr, "spximg could not read image as JPEG file: '%s'\n", inpath);
+        spxLimitsError = SPXI_ERROR_DECODE;
+        jpeg_destroy_decompress(&src);
+        SPXI_FREE(fbuffer);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    /* only luma is kept, which needs no chroma MCU alignment */
+    gray = (flags & SPXI_JPEG_GRAYSCALE) && src.num_components == 3 &&
+        src.jpeg_color_space == JCS_YCbCr &&
+        src.comp_info[0].h_samp_factor == src.max_h_samp_factor &&
+        src.comp_info[0].v_samp_factor == src.max_v_samp_factor;
+    count = gray ? 1 : src.num_components;
+    x0 = y0 = 0;
+    unitx = gray ? DCTSIZE : src.max_h_samp_factor * DCTSIZE;
+    unity = gray ? DCTSIZE : src.max_v_samp_factor * DCTSIZE;
+    width = src.image_width;
+    height = src.image_height;
+
+    if (crop) {
+        int x1 = crop[2] > 0 ? crop[0] + crop[2] : width;
+        int y1 = crop[3] > 0 ? crop[1] + crop[3] : height;
+        x0 = crop[0] > 0 ? crop[0] < width ? crop[0] : width - 1 : 0;
+        y0 = crop[1] > 0 ? crop[1] < height ? crop[1] : height - 1 : 0;
+        x0 -= x0 % unitx;
+        y0 -= y0 % unity;
+        width = (x1 < width ? x1 : width) - x0;
+        height = (y1 < height ? y1 : height) - y0;
+        if (width <= 0 || height <= 0) {
+            fprintf(stderr, "spximg crop area is outside of JPEG file: '%s'\n", inpath);
+            jpeg_destroy_decompress(&src);
+            SPXI_FREE(fbuffer);
+            spxStatsEnd();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((swap ? flipy : flipx) && width > unitx) {
+        width -= width % unitx;
+    }
+    if ((swap ? flipx : flipy) && height > unity) {
+        height -= height % unity;
+    }
+
+    /* destination coefficient arrays live in the source object's memory
+     * pool so jpeg_read_coefficients realizes them with its own arrays,
+     * pre zeroed as the encoder also reads the padding of partial MCUs */
+    for (ci = 0; ci < count; ++ci) {
+        const jpeg_component_info* comp = src.comp_info + ci;
+        int h = gray ? 1 : swap ? comp->v_samp_factor : comp->h_samp_factor;
+        int v = gray ? 1 : swap ? comp->h_samp_factor : comp->v_samp_factor;
+        int maxh = gray ? 1 : swap ? src.max_v_samp_factor : src.max_h_samp_factor;
+        int maxv = gray ? 1 : swap ? src.max_h_samp_factor : src.max_v_samp_factor;
+        int bw = ((swap ? height : width) * h + maxh * DCTSIZE - 1) / (maxh * DCTSIZE);
+        int bh = ((swap ? width : height) * v + maxv * DCTSIZE - 1) / (maxv * DCTSIZE);
+        dcoefs[ci] = (*src.mem->request_virt_barray)((j_common_ptr)&src, JPOOL_IMAGE, 1,
+            (bw + h - 1) / h * h, (bh + v - 1) / v * v, v);
+    }
+
+    scoefs = jpeg_read_coefficients(&src);
+
+    spxStatsPush(SPXI_STAGE_CONVERT);
+    spxJpegBlockTable(index, sign, transform);
+    for (ci = 0; ci < count; ++ci) {
+        const jpeg_component_info* comp = src.comp_info + ci;
+        int h = comp->h_samp_factor, v = comp->v_samp_factor;
+        int maxh = src.max_h_samp_factor, maxv = src.max_v_samp_factor;
+        int bx0 = x0 * h / (maxh * DCTSIZE), by0 = y0 * v / (maxv * DCTSIZE);
+        int sbw = (width * h + maxh * DCTSIZE - 1) / (maxh * DCTSIZE);
+        int sbh = (height * v + maxv * DCTSIZE - 1) / (maxv * DCTSIZE);
+        int bw = swap ? sbh : sbw, bh = swap ? sbw : sbh;
+
+        for (y = 0; y < bh; ++y) {
+            JBLOCKROW drow = (*src.mem->access_virt_barray)(
+                (j_common_ptr)&src, dcoefs[ci], y, 1, 1)[0];
+            int ty = flipy ? bh - 1 - y : y;
+            JBLOCKROW srow = swap ? NULL : (*src.mem->access_virt_barray)(
+                (j_common_ptr)&src, scoefs[ci], by0 + ty, 1, 0)[0];
+            if (!swap && !flipx && !flipy) {
+                memcpy(drow, srow + bx0, bw * sizeof(JBLOCK));
+                continue;
+            }
+            for (x = 0; x < bw; ++x) {
+                int tx = flipx ? bw - 1 - x : x;
+                if (swap) {
+                    srow = (*src.mem->access_virt_barray)(
+                        (j_common_ptr)&src, scoefs[ci], by0 + tx, 1, 0)[0];
+                    spxJpegBlockTransform(drow[x], srow[bx0 + ty], index, sign);
+                } else {
+                    spxJpegBlockTransform(drow[x], srow[bx0 + tx], index, sign);
+                }
+            }
+        }
+    }
+    spxStatsPop();
+
+    dst.err = &err.mgr;
+    jpeg_create_compress(&dst);
+    jpeg_copy_critical_parameters(&src, &dst);
+    if (gray) {
+        int table = dst.comp_info[0].quant_tbl_no;
+        jpeg_set_colorspace(&dst, JCS_GRAYSCALE);
+        dst.comp_info[0].quant_tbl_no = table;
+    }
+
+    dst.image_width = swap ? height : width;
+    dst.image_height = swap ? width : height;
+    if (swap) {
+        UINT16 density = dst.X_density;
+        dst.X_density = dst.Y_density;
+        dst.Y_density = density;
+        for (ci = 0; ci < dst.num_components; ++ci) {
+            int h = dst.comp_info[ci].h_samp_factor;
+            dst.comp_info[ci].h_samp_factor = dst.comp_info[ci].v_samp_factor;
+            dst.comp_info[ci].v_samp_factor = h;
+        }
+        for (ci = 0; ci < NUM_QUANT_TBLS; ++ci) {
+            JQUANT_TBL* table = dst.quant_tbl_ptrs[ci];
+            for (y = 0; table && y < DCTSIZE; ++y) {
+                for (x = y + 1; x < DCTSIZE; ++x) {
+                    UINT16 q = table->quantval[y * DCTSIZE + x];
+                    table->quantval[y * DCTSIZE + x] = table->quantval[x * DCTSIZE + y];
+                    table->quantval[x * DCTSIZE + y] = q;
+                }
+            }
+        }
+    }
+
+    spxStatsStage(SPXI_STAGE_IO);
+    file = fopen(outpath, "wb");
+    if (!file) {
+        fprintf(stderr, "spximg could not write image as JPEG file: '%s'\n", outpath);
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        SPXI_FREE(fbuffer);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    spxStatsStage(SPXI_STAGE_CODEC);
+    jpeg_stdio_dest(&dst, file);
+    jpeg_write_coefficients(&dst, dcoefs);
+
+    /* JFIF and Adobe markers are rewritten by the library itself */
+    for (marker = src.marker_list; marker; marker = marker->next) {
+        if ((dst.write_JFIF_header && marker->marker == JPEG_APP0 &&
+            marker->data_length >= 5 && !memcmp(marker->data, "JFIF", 5)) ||
+            (dst.write_Adobe_marker && marker->marker == JPEG_APP0 + 14 &&
+            marker->data_length >= 5 && !memcmp(marker->data, "Adobe", 5))) {
+            continue;
+        }
+        jpeg_write_marker(&dst, marker->marker, marker->data, marker->data_length);
+    }
+
+    jpeg_finish_compress(&dst);
+    jpeg_destroy_compress(&dst);
+    jpeg_finish_decompress(&src);
+    jpeg_destroy_decompress(&src);
+    SPXI_FREE(fbuffer);
+
+    x = spxFileClose(file, 1);
+    spxStatsEnd();
+    return x;
+}
+
+#endif /* SPXI_NO_JPEG */
+#ifndef SPXI_NO_PNM
+
+#define LINESIZE 256
+
+#ifndef SPXI_READ_CHUNK
+#define SPXI_READ_CHUNK (1 << 16)
+#endif /* SPXI_READ_CHUNK */
+
+typedef struct SpxPnmTask {
+    SpxStream* stream;
+    uint8_t* dst;
+    long offset;
+    int width;
+    int channels;
+    int bitdepth;
+    int wide;
+    int planar;
+    size_t stride;
+    size_t planesize;
+} SpxPnmTask;
+
+/* turn count stored samples into output samples in place, 16 bit ones
+ * are narrowed front to back so no sample is overwritten before use */
+static void spxPnmSamples(const SpxPnmTask* task, uint8_t* buf, const size_t count)
+{
+    const int bitdepth = task->bitdepth;
+    size_t i;
+
+    if (task->wide) {
+        uint16_t* samples = (uint16_t*)buf;
+        if (spxLittleEndian()) {
+            spxSwap16(buf, buf, count);
+        }
+        for (i = 0; bitdepth != 0xFFFF && i < count; ++i) {
+            samples[i] = (uint16_t)(0xFFFFUL * samples[i] / bitdepth);
+        }
+    } else if (bitdepth > 0xFF) {
+        for (i = 0; i < count; ++i) {
+            int n = (buf[i << 1] << 8) | buf[(i << 1) + 1];
+            buf[i] = (uint8_t)(0xFF * n / bitdepth);
+        }
+    } else {
+        for (i = 0; bitdepth != 0xFF && i < count; ++i) {
+            buf[i] = (uint8_t)(0xFF * buf[i] / bitdepth);
+        }
+    }
+}
+
+/* convert one stored row of packed bits or narrowed 16 bit samples */
+static void spxPnmRow(const SpxPnmTask* task, uint8_t* src, uint8_t* dst)
+{
+    int x;
+    if (!task->bitdepth) {
+        for (x = 0; x < task->width; ++x) {
+            dst[x] = !((src[x >> 3] >> (7 - (x & 7))) & 0x01) * 0xFF;
+        }
+    } else {
+        spxPnmSamples(task, src, (size_t)task->width * task->channels);
+        memcpy(dst, src, (size_t)task->width * task->channels * (task->wide ? 2 : 1));
+    }
+}
+
+/* read and normalize stored rows [begin, end), 8 bit samples and kept
+ * 16 bit samples are read straight into place while packed bits,
+ * narrowed 16 bit samples and planar output go through a chunk of rows */
+static void spxPnmWork(void* arg, const int begin, const int end)
+{
+    const SpxPnmTask* task = (const SpxPnmTask*)arg;
+    const size_t linesize = (size_t)task->width * task->channels;
+    const int bitdepth = task->bitdepth;
+    uint8_t* chunk, *src, *dst = task->dst + begin * linesize;
+    int y, i, rows = (int)(SPXI_READ_CHUNK / task->stride);
+
+    /* the whole band is read at once unless someone counts its rows */
+    if (!task->planar && (task->wide || (bitdepth && bitdepth <= 0xFF))) {
+        const int most = spxProgressCall ? SPXI_PROGRESS_ROWS : end - begin;
+        for (y = begin; y < end; y += rows) {
+            rows = most < end - y ? most : end - y;
+            dst = task->dst + y * task->stride;
+            spxStreamReadAt(
+                task->stream, dst, rows * task->stride,
+                task->offset + (long)(y * task->stride)
+            );
+            spxPnmSamples(task, dst, rows * linesize);
+            if (spxProgressStep(rows)) {
+                break;
+            }
+        }
+        return;
+    }
+
+    rows = rows < 1 ? 1 : rows;
+    chunk = (uint8_t*)SPXI_MALLOC(rows * task->stride);
+    if (!chunk) {
+        return;
+    }
+
+    for (y = begin; y < end; y += rows) {
+        src = chunk;
+        rows = rows < end - y ? rows : end - y;
+        spxStreamReadAt(
+            task->stream, chunk, rows * task->stride,
+            task->offset + (long)(y * task->stride)
+        );
+        if (task->planar) {
+            const int samplesize = task->wide ? 2 : 1;
+            spxPnmSamples(task, chunk, rows * linesize);
+            spxDeinterleave(
+                chunk, task->dst + (size_t)y * task->width * samplesize, task->planesize,
+                task->channels, rows * task->width, samplesize
+            );
+        } else {
+            for (i = 0; i < rows; ++i, src += task->stride, dst += linesize) {
+                spxPnmRow(task, src, dst);
+            }
+        }
+        if (spxProgressStep(rows)) {
+            break;
+        }
+    }
+
+    SPXI_FREE(chunk);
+}
+
+/* allocate a binary PNM image and describe its stored rows in task */
+static Img2D spxPnmSetup(SpxPnmTask* task, const int width, const int height,
+    const int channels, const int bitdepth, const int wide, const int planar)
+{
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    int bitsize = 1 + (bitdepth > 0xFF);
+
+    image.depth = wide ? 16 : SPXI_BIT_DEPTH;
+    image.pixbuf = spxPixbufAlloc((size_t)width * height * channels * spxSampleSize(image));
+    image.width = width;
+    image.height = height;
+    image.channels = channels;
+    image.layout = planar && channels > 1 ? SPXI_LAYOUT_PLANAR : SPXI_LAYOUT_INTERLEAVED;
+
+    task->stream = NULL;
+    task->dst = image.pixbuf;
+    task->offset = 0;
+    task->width = width;
+    task->channels = channels;
+    task->bitdepth = bitdepth;
+    task->wide = wide;
+    task->planar = image.layout == SPXI_LAYOUT_PLANAR;
+    task->planesize = (size_t)width * height * spxSampleSize(image);
+    task->stride = bitdepth ?
+        (size_t)width * channels * bitsize : (size_t)(width >> 3) + !!(width % 8);
+    return image;
+}
+
+static Img2D spxImageLoadPnmBinary(SpxStream* stream, const int width,
+    const int height, const int channels, const int bitdepth, const int wide,
+    const int planar)
+{
+    SpxPnmTask task;
+    SpxProgress progress;
+    int grain = SPXI_PARALLEL_GRAIN / width;
+    Img2D image = spxPnmSetup(&task, width, height, channels, bitdepth, wide, planar);
+    if (!image.pixbuf) {
+        return image;
+    }
+
+    task.stream = stream;
+    task.offset = spxStreamTell(stream);
+    spxStatsPush(bitdepth == 0xFF ? SPXI_STAGE_IO : SPXI_STAGE_CONVERT);
+    spxProgressBegin(&progress, height, 1);
+    spxParallelFor(
+        height, spxStreamConcurrent(stream) && grain > 0 ? grain : height,
+        &spxPnmWork, &task
+    );
+    if (spxProgressEnd(&progress)) {
+        spxImageFree(&image);
+    }
+    spxStreamSeek(stream, task.offset + (long)(height * task.stride), SEEK_SET);
+    spxStatsPop();
+    return image;
+}
+
+static Img2D spxImageLoadPnmASCII(SpxStream* stream, char* line, 
+    const int width, const int height, const int channels, const int bitdepth,
+    const int wide)
+{
+    static const char* div = " \t\n\r";
+    
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    SpxProgress progress;
+    uint8_t* end, *p;
+    char *tok, *key = NULL;
+    const size_t size = (size_t)width * height * channels;
+    const size_t linesize = (size_t)width * channels;
+
+    image.depth = wide ? 16 : SPXI_BIT_DEPTH;
+    image.pixbuf = spxPixbufAlloc(size * spxSampleSize(image));
+    if (!image.pixbuf) {
+        return image;
+    }
+
+    image.width = width;
+    image.height = height;
+    image.channels = channels;
+    p = image.pixbuf;
+
+    spxProgressBegin(&progress, height, 1);
+    for (end = p + size; p != end; ++p) {
+        tok = strtok(key, div);
+        key = NULL;
+        if (!tok) {
+            if (!(key = spxStreamGets(line, LINESIZE, stream))) {
+                spxImageFree(&image);
+                break;
+            }
+            --p;
+            continue;
+        } else if (wide) {
+            ((uint16_t*)image.pixbuf)[p - image.pixbuf] =
+                (uint16_t)(0xFFFFUL * atoi(tok) / bitdepth);
+        } else {
+            *p = (uint8_t)(0xFF * atoi(tok) / bitdepth);
+        }
+        if (!((size_t)(p + 1 - image.pixbuf) % linesize) && spxProgressStep(1)) {
+            break;
+        }
+    }
+
+    if (spxProgressEnd(&progress)) {
+        spxImageFree(&image);
+    }
+    return image;
+}
+
+static Img2D spxImageLoadPbmASCII(SpxStream* stream, const int width, const int height)
+{
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    SpxProgress progress;
+    int c;
+    size_t i = 0;
+    const size_t size = (size_t)width * height;
+
+    image.pixbuf = spxPixbufAlloc(size);
+    image.width = width;
+    image.height = height;
+    image.channels = 1;
+
+    spxProgressBegin(&progress, height, 1);
+    while (image.pixbuf && i < size && (c = spxStreamGetc(stream)) != EOF) {
+        if (c == '0' || c == '1') {
+            image.pixbuf[i++] = 0xFF * (c == '0');
+            if (!(i % width) && spxProgressStep(1)) {
+                break;
+            }
+        }
+    }
+
+    if (spxProgressEnd(&progress)) {
+        spxImageFree(&image);
+    }
+    return image;
+}
+
+static Img2D spxPnmLoad(SpxStream* stream, const char* path, const int flags)
+{
+    static const char* div = " \t\n\r";
+    
+    int params[3] = {0}, paramsize, paramcount = 0, filepos = 0, wide;
+    char N, line[LINESIZE], *tok, *key = NULL;
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+
+    spxStatsStage(SPXI_STAGE_CODEC);
+    if (!spxStreamGets(line, LINESIZE, stream)) {
+        fprintf(stderr, "spximg could not parse file: %s\n", path);
+        goto spxImageLoadPnmEnd;
+    }
+
+    if (line[0] != 0x50) {
+        fprintf(stderr, "spximg: file is not PNM file format: %s\n", path);
+        goto spxImageLoadPnmEnd;
+    }
+    
+    N = line[1];
+    if (N < '1' || N > '6') {
+        fprintf(stderr, "spximg does not support this kind of PNM: %s: P%c\n", path, N);
+        goto spxImageLoadPnmEnd;
+    }
+
+    paramsize = (N == '1' || N == '4') ? 2 : 3;
+    tok = strtok(line, div);
+
+    while (paramcount < paramsize) {
+        tok = strtok(key, div);
+        key = NULL;
+        if (!tok || tok[0] == '#') {
+            filepos = spxStreamTell(stream);
+            if (!(key = spxStreamGets(line, LINESIZE, stream))) {
+                fprintf(stderr, "spximg could not parse complete PNM in file: %s\n",
+                    path
+                );
+                goto spxImageLoadPnmEnd;
+            }
+        } else if (!isdigit(tok[0])) {
+            fprintf(stderr, "spximg detected invalid token in PNM header: %s: %s\n",
+                path, tok
+            );
+            goto spxImageLoadPnmEnd;
+        } else {
+            params[paramcount++] = atoi(tok);
+        }
+    }
+
+    for (paramcount = 0; paramcount < paramsize; ++paramcount) {
+         if (!params[paramcount]) {
+            fprintf( stderr, 
+                "spximg detected illegal PNM with zero value in: %s\n", path
+            );
+            goto spxImageLoadPnmEnd;
+        }
+    }
+
+    wide = (flags & SPXI_LOAD_16BIT) && paramsize == 3 && params[2] > 0xFF;
+    if (spxImageAdmit(params[0], params[1], (N == '3' || N == '6') ? 3 : 1,
+        wide ? 2 : 1, path)) {
+        goto spxImageLoadPnmEnd;
+    }
+
+    switch (N) {
+        case '1':
+            spxStreamSeek(stream, filepos + (tok - line) + strlen(tok) + 1, SEEK_SET);
+            image = spxImageLoadPbmASCII(stream, params[0], params[1]);
+            break;
+        case '2':
+        case '3':
+            image = spxImageLoadPnmASCII(
+                stream, line, params[0], params[1], (N == '3') ? 3 : 1, params[2], wide
+            );
+            break;
+        default:
+            spxStreamSeek(stream, filepos + (tok - line) + strlen(tok) + 1, SEEK_SET);
+            image = spxImageLoadPnmBinary(
+                stream, params[0], params[1], (N == '6') ? 3 : 1, params[2], wide,
+                flags & SPXI_LOAD_PLANAR
+            );
+    }
+
+    if (!image.pixbuf && spxLimitsError != SPXI_ERROR_CANCEL) {
+        fprintf(stderr,
+             "spximg detected incomplete or corrupted PNM file: %s\n", path
+        );
+    }
+
+spxImageLoadPnmEnd:
+    return image;
+}
+
+static Img2D spxPnmLoadFile(const char* path, const int flags)
+{
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    SpxStream stream;
+    FILE* file;
+    
+    spxStatsBegin(SPXI_FORMAT_PNM);
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "spximg could not open file: %s\n", path);
+        spxStatsEnd();
+        return image;
+    }
+
+    stream = spxStreamFile(file);
+    image = spxPnmLoad(&stream, path, flags);
+    spxFileClose(file, 0);
+    spxStatsEnd();
+    return image;
+}
+
+Img2D spxImageLoadPnm(const char* path)
+{
+    return spxPnmLoadFile(path, 0);
+}
+
+/* PNM stores interleaved samples and 16 bit ones big endian, planar
+ * pixels are merged and samples swapped a chunk at a time */
+static int spxPnmWrite(const Img2D img, FILE* file)
+{
+    const int samplesize = spxSampleSize(img);
+    const int swap = samplesize > 1 && spxLittleEndian();
+    const size_t pixelsize = (size_t)img.channels * samplesize;
+    const size_t planesize = (size_t)img.width * img.height * samplesize;
+    const size_t most = SPXI_READ_CHUNK / pixelsize;
+    size_t i, count, size = (size_t)img.width * img.height;
+    uint8_t* chunk;
+
+    if (!swap && !spxImagePlanar(img) && spxImagePacked(img) && !spxProgressCall) {
+        spxFileWrite(img.pixbuf, size, pixelsize, file);
+        return EXIT_SUCCESS;
+    } else if (!swap && !spxImagePlanar(img)) {
+        for (i = 0; i < (size_t)img.height; ++i) {
+            spxFileWrite(img.pixbuf + i * spxImageStride(img), img.width, pixelsize, file);
+            if (spxProgressStep(1)) {
+                break;
+            }
+        }
+        return EXIT_SUCCESS;
+    }
+
+    chunk = (uint8_t*)SPXI_MALLOC(SPXI_READ_CHUNK);
+    if (!chunk) {
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < size; i += count) {
+        const uint8_t* src = img.pixbuf + i * pixelsize;
+        count = size - i < most ? size - i : most;
+        if (spxImagePlanar(img)) {
+            spxInterleave(
+                img.pixbuf + i * samplesize, planesize, chunk, img.channels,
+                count, samplesize
+            );
+            src = chunk;
+        }
+        if (swap) {
+            spxSwap16(chunk, src, count * img.channels);
+            src = chunk;
+        }
+        spxFileWrite(src, count, pixelsize, file);
+        if (spxProgressAt((int)((i + count) / img.width))) {
+            break;
+        }
+    }
+    SPXI_FREE(chunk);
+    return EXIT_SUCCESS;
+}
+
+int spxImageSavePnm(const Img2D img, const char* path)
+{
+    int ret;
+    FILE* file;
+    SpxProgress progress;
+    
+    spxStatsBegin(SPXI_FORMAT_PNM);
+    spxLimitsError = SPXI_ERROR_NONE;
+    if (img.channels != 3) {
+        Img2D tmp = spxImageReshape(img, 3);
+        ret = tmp.pixbuf ? spxImageSavePnm(tmp, path) : EXIT_FAILURE;
+        spxImageFree(&tmp);
+        spxStatsEnd();
+        return ret;
+    }
+
+    /* samples converted on the way out are walked as one packed run */
+    if (!spxImagePacked(img) && (spxImagePlanar(img) || spxSampleSize(img) > 1)) {
+        Img2D tmp = spxImagePack(img);
+        ret = tmp.pixbuf ? spxImageSavePnm(tmp, path) : EXIT_FAILURE;
+        spxImageFree(&tmp);
+        spxStatsEnd();
+        return ret;
+    }
+
+    file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "spximg could not write file: '%s'\n", path);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    fprintf(file, "P6 %d %d %d\n",
+        img.width, img.height, spxSampleSize(img) > 1 ? 0xFFFF : 0xFF
+    );
+    spxProgressBegin(&progress, img.height, 1);
+    ret = spxPnmWrite(img, file);
+    ret |= spxFileClose(file, 1);
+    if (spxProgressEnd(&progress)) {
+        remove(path);
+        ret = EXIT_FAILURE;
+    }
+    spxStatsEnd();
+    return ret;
+}
+
+#endif /* SPXI_NO_PNM */
+#ifndef SPXI_NO_BMP
+
+typedef struct SpxBmpTask {
+    SpxStream* stream;
+    const uint8_t* palette;
+    uint8_t* dst;
+    long offset;
+    int width;
+    int height;
+    int channels;
+    int bpp;
+    int planar;
+    size_t stride;
+    uint32_t mask[4];
+    int shift[4];
+    int scale[4];
+} SpxBmpTask;
+
+/* position of a channel mask and the shift widening it to 8 bits */
+static void spxBmpMaskShift(const uint32_t mask, int* shift, int* scale)
+{
+    int n = 0;
+    *shift = 0;
+    while (mask && !((mask >> *shift) & 0x01)) ++*shift;
+    while (*shift + n < 32 && ((mask >> (*shift + n)) & 0x01)) ++n;
+    *scale = n ? 8 - n : 0;
+}
+
+static uint8_t spxBmpChannel(const SpxBmpTask* task, const uint32_t n, const int c)
+{
+    uint32_t v = (n & task->mask[c]) >> task->shift[c];
+    return (uint8_t)(task->scale[c] >= 0 ? v << task->scale[c] : v >> -task->scale[c]);
+}
+
+/* convert a stored row of any supported depth into an output row */
+static void spxBmpRow(const SpxBmpTask* task, const uint8_t* src, uint8_t* dst)
+{
+    int x, j;
+    if (task->bpp == 24) {
+        for (x = 0; x < task->width; ++x, src += 3) {
+            *dst++ = src[2];
+            *dst++ = src[1];
+            *dst++ = src[0];
+        }
+        return;
+    }
+
+    for (x = 0; x < task->width; ++x) {
+        uint32_t n;
+        if (task->bpp == 32) {
+            n = *(const uint32_t*)(src + (x << 2));
+        } else if (task->bpp == 16) {
+            n = *(const uint16_t*)(src + (x << 1));
+        } else {
+            int div = 8 / task->bpp, ibit = (x % div) * task->bpp;
+            int ibyte = x / div, index = 0;
+            for (j = 0; j < task->bpp; ++j) {
+                index |= ((src[ibyte] >> (ibit + j)) & 0x01) << j;
+            }
+            if (task->channels == 1) {
+                *dst++ = (uint8_t)index;
+                continue;
+            }
+            n = *(const uint32_t*)(task->palette + (index << 2));
+        }
+
+        *dst++ = spxBmpChannel(task, n, 0);
+        *dst++ = spxBmpChannel(task, n, 1);
+        *dst++ = spxBmpChannel(task, n, 2);
+        *dst++ = task->mask[3] ? spxBmpChannel(task, n, 3) : 0xff;
+    }
+}
+
+/* stored rows run bottom up, so output rows [begin, end) are the stored
+ * rows [height - end, height - begin) read in chunks from the stream,
+ * planar rows are converted behind the chunk and then split */
+static void spxBmpWork(void* arg, const int begin, const int end)
+{
+    const SpxBmpTask* task = (const SpxBmpTask*)arg;
+    const size_t linesize = (size_t)task->width * task->channels;
+    const size_t planesize = (size_t)task->width * task->height;
+    int y, i, rows = (int)(SPXI_READ_CHUNK / task->stride);
+    uint8_t* chunk, *line;
+
+    rows = rows < 1 ? 1 : rows;
+    chunk = (uint8_t*)SPXI_MALLOC(rows * task->stride + linesize);
+    if (!chunk) {
+        return;
+    }
+    line = chunk + rows * task->stride;
+
+    for (y = task->height - end; y < task->height - begin; y += rows) {
+        rows = rows < task->height - begin - y ? rows : task->height - begin - y;
+        spxStreamReadAt(
+            task->stream, chunk, rows * task->stride,
+            task->offset + (long)(y * task->stride)
+        );
+        for (i = 0; i < rows; ++i) {
+            const size_t row = task->height - 1 - y - i;
+            if (task->planar) {
+                spxBmpRow(task, chunk + i * task->stride, line);
+                spxDeinterleave(
+                    line, task->dst + row * task->width, planesize,
+                    task->channels, task->width, 1
+                );
+            } else {
+                spxBmpRow(task, chunk + i * task->stride, task->dst + row * linesize);
+            }
+        }
+        if (spxProgressStep(rows)) {
+            break;
+        }
+    }
+
+    SPXI_FREE(chunk);
+}
+
+/* parse the headers and palette, allocate the image and describe its
+ * stored rows in task; the caller frees task->palette */
+static Img2D spxBmpSetup(SpxStream* stream, const char* path, const int flags,
+    SpxBmpTask* task)
+{
+    uint16_t id;
+    int dif;
+    size_t stride;
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    struct BmpHeader {
+        uint32_t size;
+        uint16_t reserved1, reserved2;
+        uint32_t offset; 
+        struct BmpDibHeader {
+            uint32_t size;
+            int32_t width, height;
+            uint16_t planes, bpp;
+            uint32_t compression, imgsize;
+            int32_t res[2];
+            uint32_t colors[2];
+        } dib;
+        char padding[256];
+    } bmp;
+
+    task->palette = NULL;
+    if (!spxStreamRead(&id, sizeof(id), 1, stream)) {
+        fprintf(stderr, "spximg could not parse file: %s\n", path);
+        goto spxImageLoadBmpEnd;
+    }
+
+    if (id != 0x4D42) {
+        fprintf(stderr, "spximg: file is not BMP format: %s\n", path);
+        goto spxImageLoadBmpEnd;
+    }
+
+    if (!spxStreamRead(&bmp, offsetof(struct BmpHeader, dib), 1, stream)) {
+        fprintf(stderr, "spximg could not parse file: %s\n", path);
+        goto spxImageLoadBmpEnd;
+    }
+
+    if (!spxStreamRead(&bmp.dib, sizeof(bmp.dib.size), 1, stream)) {
+        fprintf(stderr, "spximg: file is not BMP format: %s\n", path);
+        goto spxImageLoadBmpEnd;
+    }
+
+    if (bmp.dib.size < 16 || bmp.dib.size > sizeof(bmp.dib) + sizeof(bmp.padding) ||
+        !spxStreamRead(&bmp.dib.width, bmp.dib.size - sizeof(bmp.dib.size), 1, stream)) {
+        fprintf(stderr, "spximg could not parse file: %s\n", path);
+        goto spxImageLoadBmpEnd;
+    }
+
+    if (bmp.dib.planes != 1 || bmp.dib.bpp == 0 || bmp.dib.bpp > 32 ||
+        bmp.dib.width <= 0 || bmp.dib.height <= 0 ||
+        ((bmp.dib.bpp != 32 && bmp.dib.bpp != 16) && bmp.dib.compression != 0)) {
+        fprintf(stderr, "spximg does not support this kind of BMP file: %s\n", path);
+        goto spxImageLoadBmpEnd;
+    }
+
+    stride = (((size_t)bmp.dib.width * bmp.dib.bpp + 31) >> 5) << 2;
+
+    assert(spxStreamTell(stream) == 14 + bmp.dib.size);
+
+    image.width = bmp.dib.width;
+    image.height = bmp.dib.height;
+    task->stream = stream;
+    task->palette = NULL;
+    task->width = image.width;
+    task->height = image.height;
+    task->stride = stride;
+    task->bpp = bmp.dib.bpp;
+
+    if (bmp.dib.bpp <= 8 && (bmp.dib.compression == 0 || bmp.dib.compression == 3)) {
+        /* remove scanline, read into pixelbuffer */
+        uint8_t* palette;
+        int i, colorcount, palette_size;
+        dif = bmp.offset - spxStreamTell(stream);
+        palette_size = bmp.dib.colors[0] ? bmp.dib.colors[0] << 2 : dif;
+
+        if (bmp.dib.size > 40) {
+            memcpy(task->mask, bmp.padding, 3 * sizeof(uint32_t));
+        } else {
+            task->mask[0] = 0x00ff0000;
+            task->mask[1] = 0x0000ff00;
+            task->mask[2] = 0x000000ff;
+        }
+        task->mask[3] = 0;
+
+        colorcount = palette_size >> 2;
+        if (palette_size < 0 || bmp.dib.colors[0] > (1 << bmp.dib.bpp)) {
+            fprintf(stderr,
+                "spximg could not guess size of color pallete in BMP file: %s\n", path
+            );
+            goto spxImageLoadBmpEnd;
+        }
+
+        /* indices past the stored colors read zeroes instead of the heap */
+        image.channels = 4;
+        i = (1 << bmp.dib.bpp) << 2;
+        palette = (uint8_t*)spxMalloc(palette_size > i ? palette_size : i);
+        memset(palette, 0, palette_size > i ? palette_size : i);
+        spxStreamRead(palette, palette_size, 1, stream);
+
+#if 1   /* FILL ALPHA WITH 0xFF FOR EASY DEBUGGING */
+        for (i = 0; i < colorcount; ++i) {
+            palette[i * 4 + 3] = 0xFF;
+        }
+#endif
+        task->palette = palette;
+    } else if (bmp.dib.bpp == 24) {
+        image.channels = 3;
+    } else if (bmp.dib.bpp == 32 && bmp.dib.compression == 3) {
+        dif = bmp.offset - spxStreamTell(stream);
+        memset(task->mask, 0, sizeof(task->mask));
+        if (bmp.dib.size <= 40 && dif) {
+            spxStreamRead(task->mask, dif < 12 ? dif : 12, 1, stream);
+        } else {
+            memcpy(task->mask, bmp.padding, sizeof(task->mask));
+        }
+        image.channels = 4;
+    } else if (bmp.dib.bpp == 32 && bmp.dib.compression == 0) {
+        image.channels = 4;
+        task->mask[0] = 0x00ff0000;
+        task->mask[1] = 0x0000ff00;
+        task->mask[2] = 0x000000ff;
+        task->mask[3] = 0xff000000;
+    } else if (bmp.dib.bpp == 16 && (!bmp.dib.compression || bmp.dib.compression == 3)) {
+        dif = bmp.offset - spxStreamTell(stream);
+        if (dif) {
+            spxStreamRead(task->mask, dif < 12 ? dif : 12, 1, stream);
+        } else {
+            memcpy(task->mask, bmp.padding, 3 * sizeof(uint32_t));
+        }
+        if (!bmp.dib.compression) {
+            task->mask[0] = 0x7c00;
+            task->mask[1] = 0x03e0;
+            task->mask[2] = 0x001f;
+        }
+        task->mask[3] = 0;
+        image.channels = 4;
+    } else {
+        fprintf(stderr, "spximg is not ready to parse this kind of BMP yet: %s\n",
+            path
+        );
+        goto spxImageLoadBmpEnd;
+    }
+
+    if (spxImageAdmit(image.width, image.height,
+        task->palette && (flags & SPXI_LOAD_INDEXED) ? 1 : image.channels, 1, path)) {
+        goto spxImageLoadBmpEnd;
+    } else if (task->palette && (flags & SPXI_LOAD_INDEXED)) {
+        image = spxIndexedCreate(image.width, image.height);
+    } else {
+        image.pixbuf = spxPixbufAlloc((size_t)image.width * image.height * image.channels);
+    }
+
+    if (image.pixbuf) {
+        int i;
+        for (i = 0; i < 4; ++i) {
+            spxBmpMaskShift(task->mask[i], task->shift + i, task->scale + i);
+        }
+
+        for (i = 0; image.palette && i < (1 << task->bpp); ++i) {
+            uint32_t n = *(const uint32_t*)(task->palette + (i << 2));
+            image.palette[i * 4 + 0] = spxBmpChannel(task, n, 0);
+            image.palette[i * 4 + 1] = spxBmpChannel(task, n, 1);
+            image.palette[i * 4 + 2] = spxBmpChannel(task, n, 2);
+            image.palette[i * 4 + 3] = 0xFF;
+        }
+
+        task->dst = image.pixbuf;
+        task->channels = image.channels;
+        task->offset = bmp.offset;
+        task->planar = (flags & SPXI_LOAD_PLANAR) && !image.palette;
+        image.layout = task->planar ? SPXI_LAYOUT_PLANAR : SPXI_LAYOUT_INTERLEAVED;
+    }
+
+spxImageLoadBmpEnd:
+    return image;
+}
+
+static Img2D spxBmpLoad(SpxStream* stream, const char* path, const int flags)
+{
+    SpxBmpTask task;
+    SpxProgress progress;
+    Img2D image;
+
+    spxStatsStage(SPXI_STAGE_CODEC);
+    image = spxBmpSetup(stream, path, flags, &task);
+    if (image.pixbuf) {
+        int grain = image.width ? SPXI_PARALLEL_GRAIN / image.width : 1;
+        spxStatsPush(SPXI_STAGE_CONVERT);
+        spxProgressBegin(&progress, image.height, 1);
+        spxParallelFor(
+            image.height, spxStreamConcurrent(stream) && grain > 0 ? grain : image.height,
+            &spxBmpWork, &task
+        );
+        if (spxProgressEnd(&progress)) {
+            spxImageFree(&image);
+        }
+        spxStreamSeek(stream, task.offset + (long)(image.height * task.stride), SEEK_SET);
+        spxStatsPop();
+    }
+
+    SPXI_FREE((void*)task.palette);
+    return image;
+}
+
+static Img2D spxBmpLoadFile(const char* path, const int flags)
+{
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    SpxStream stream;
+    FILE* file;
+
+    spxStatsBegin(SPXI_FORMAT_BMP);
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "spximg could not open file: %s\n", path);
+        spxStatsEnd();
+        return image;
+    }
+
+    stream = spxStreamFile(file);
+    image = spxBmpLoad(&stream, path, flags);
+    spxFileClose(file, 0);
+    spxStatsEnd();
+    return image;
+}
+
+Img2D spxImageLoadBmp(const char* path)
+{
+    return spxBmpLoadFile(path, 0);
+}
+
+#endif /* SPXI_NO_BMP */
+
+/* Generic Saving and Loading */
+
+Img2D spxImageLoad(const char* path)
+{
+    return spxImageLoadEx(path, 0);
+}
+
+/* loaders that cannot write planes directly, like JPEG or interlaced
+ * PNG, decode interleaved and are split here */
+static Img2D spxImageLoadLayout(Img2D image, const int flags)
+{
+    if ((flags & SPXI_LOAD_PLANAR) && image.pixbuf && image.channels > 1 &&
+        !image.palette && image.layout != SPXI_LAYOUT_PLANAR) {
+        Img2D planar = spxImageLayout(image, SPXI_LAYOUT_PLANAR);
+        spxImageFree(&image);
+        return planar;
+    }
+    return image;
+}
+
+Img2D spxImageLoadEx(const char* path, int flags)
+{
+    int format;
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    
+    spxLimitsError = SPXI_ERROR_NONE;
+    format = spxParseFormat(path);
+    switch (format) {
+        case SPXI_FORMAT_PNG: image = spxPngLoadFile(path, flags); break;
+        case SPXI_FORMAT_JPEG: image = spxJpegLoad(path, 0, 0, flags); break;
+        case SPXI_FORMAT_PNM: image = spxPnmLoadFile(path, flags); break;
+        case SPXI_FORMAT_BMP: image = spxBmpLoadFile(path, flags); break;
+        case SPXI_FORMAT_UNKNOWN: 
+            fprintf(stderr, "spximg could not recognize format: %s\n", path);
+    }
+
+    return spxImageChecked(spxImageLoadLayout(image, flags));
+}
+
+static Img2D spxImageDecode(const uint8_t* data, const size_t size, 
+    const char* name, const int flags)
+{
+    int format = SPXI_FORMAT_UNKNOWN;
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    SpxStream stream = spxStreamMemory(data, size);
+
+    spxLimitsError = SPXI_ERROR_NONE;
+    if (data && size >= SPXI_HEADER_SIZE) {
+        format = spxParseHeader(data);
+    }
+
+    spxStatsBegin(format);
+    spxStatsBytes(size, 0);
+    switch (format) {
+        case SPXI_FORMAT_PNG: image = spxPngLoad(&stream, name, flags); break;
+        case SPXI_FORMAT_JPEG: image = spxJpegDecode(data, size, name, 0, 0, flags); break;
+        case SPXI_FORMAT_PNM: image = spxPnmLoad(&stream, name, flags); break;
+        case SPXI_FORMAT_BMP: image = spxBmpLoad(&stream, name, flags); break;
+        default:
+            fprintf(stderr, "spximg could not recognize format: %s\n", name);
+    }
+
+    spxStatsEnd();
+    return spxImageChecked(spxImageLoadLayout(image, flags));
+}
+
+Img2D spxImageLoadMemory(const void* data, size_t size, int flags)
+{
+    return spxImageDecode((const uint8_t*)data, size, "<memory>", flags);
+}
+
+/* limits for this call only, in place of the ones set globally */
+Img2D spxImageLoadLimited(const char* path, int flags, const SpxImageLimits* limits)
+{
+    const SpxImageLimits* prev = spxLimitsCall;
+    Img2D image;
+    spxLimitsCall = limits;
+    image = spxImageLoadEx(path, flags);
+    spxLimitsCall = prev;
+    return image;
+}
+
+Img2D spxImageLoadMemoryLimited(const void* data, size_t size, int flags,
+    const SpxImageLimits* limits)
+{
+    const SpxImageLimits* prev = spxLimitsCall;
+    Img2D image;
+    spxLimitsCall = limits;
+    image = spxImageDecode((const uint8_t*)data, size, "<memory>", flags);
+    spxLimitsCall = prev;
+    return image;
+}
+
+Img2D spxImageThumbnail(const char* path, int width, int height, int filter)
+{
+    Img2D image, ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    if (width <= 0 && height <= 0) {
+        fprintf(stderr, "spximg needs a thumbnail width or height: %s\n", path);
+        return ret;
+    }
+
+#ifndef SPXI_NO_JPEG
+    if (spxParseFormat(path) == SPXI_FORMAT_JPEG) {
+        image = spxImageLoadJpegScaled(path, width, height);
+    } else {
+        image = spxImageLoad(path);
+    }
+#else
+    image = spxImageLoad(path);
+#endif /* SPXI_NO_JPEG */
+
+    if (image.pixbuf) {
+        if (width <= 0) {
+            width = (int)((double)image.width * height / image.height + 0.5);
+            width = width < 1 ? 1 : width;
+        } else if (height <= 0) {
+            height = (int)((double)image.height * width / image.width + 0.5);
+            height = height < 1 ? 1 : height;
+        }
+        ret = spxImageResize(image, width, height, filter);
+        spxImageFree(&image);
+    }
+
+    return ret;
+}
+
+int spxImageSave(const Img2D image, const char* path)
+{
+    switch (spxParseExtension(path)) {
+        case SPXI_FORMAT_PNG: return spxImageSavePng(image, path);
+        case SPXI_FORMAT_JPEG: return spxImageSaveJpeg(image, path, SPXI_JPEG_QUALITY);
+        case SPXI_FORMAT_PNM: return spxImageSavePnm(image, path);
+    }
+
+    fprintf(stderr, "spximg only supports saving images as PNG, JPEG and PPM\n");
+    return EXIT_FAILURE;
+}
+
+/* Lossless Passthrough */
+
+#define spxCopyU16(p) (((size_t)(p)[0] << 8) | (size_t)(p)[1])
+#define spxCopyU32(p) (((size_t)(p)[0] << 24) | ((size_t)(p)[1] << 16) |\
+    ((size_t)(p)[2] << 8) | (size_t)(p)[3])
+
+/* critical PNG chunks and the ancillary ones that change how the
+ * samples are shown are kept, text, time, EXIF and the rest are not */
+static int spxCopyPngKeep(const uint8_t* type)
+{
+    static const char* keep[] = {"tRNS", "gAMA", "cHRM", "sRGB", "iCCP", "sBIT"};
+    size_t i;
+    if (!(type[0] & 0x20)) {
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(keep) / sizeof(keep[0]); ++i) {
+        if (!memcmp(type, keep[i], 4)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* each copy walks the file up to where its metadata can be and writes
+ * the rest as it is, including anything it could not parse */
+static void spxCopyPng(const uint8_t* data, const size_t size, FILE* file)
+{
+    size_t next, pos = 8;
+    spxFileWrite(data, pos, 1, file);
+    while (pos + 12 <= size) {
+        next = pos + 12 + spxCopyU32(data + pos);
+        if (next > size || next < pos) {
+            break;
+        }
+        if (spxCopyPngKeep(data + pos + 4)) {
+            spxFileWrite(data + pos, next - pos, 1, file);
+        }
+        pos = next;
+    }
+    spxFileWrite(data + pos, size - pos, 1, file);
+}
+
+/* segments before the first scan, dropping comments and APP1 to APP15
+ * but APP14, which like the JFIF APP0 tells how samples decode */
+static void spxCopyJpeg(const uint8_t* data, const size_t size, FILE* file)
+{
+    size_t next, pos = 2;
+    spxFileWrite(data, pos, 1, file);
+    while (pos + 4 <= size && data[pos] == 0xFF) {
+        const int marker = data[pos + 1];
+        if (marker < 0xC0 || (marker >= 0xD0 && marker <= 0xDA) || marker == 0xFF) {
+            break;
+        }
+        next = pos + 2 + spxCopyU16(data + pos + 2);
+        if (next > size) {
+            break;
+        }
+        if (marker != 0xFE && (marker <= 0xE0 || marker >= 0xF0 || marker == 0xEE)) {
+            spxFileWrite(data + pos, next - pos, 1, file);
+        }
+        pos = next;
+    }
+    spxFileWrite(data + pos, size - pos, 1, file);
+}
+
+/* header comments, up to the last number before the samples */
+static void spxCopyPnm(const uint8_t* data, const size_t size, FILE* file)
+{
+    int numbers = (data[1] == '1' || data[1] == '4') ? 2 : 3;
+    size_t start = 0, pos = 2;
+    while (pos < size && numbers) {
+        if (data[pos] == '#') {
+            /* the line break goes too when space already parts the numbers */
+            const int space = isspace(data[pos - 1]);
+            spxFileWrite(data + start, pos - start, 1, file);
+            while (pos < size && data[pos] != '\n' && data[pos] != '\r') {
+                ++pos;
+            }
+            start = pos += space && pos < size;
+        } else if (isdigit(data[pos])) {
+            while (pos < size && isdigit(data[pos])) {
+                ++pos;
+            }
+            --numbers;
+        } else {
+            ++pos;
+        }
+    }
+    spxFileWrite(data + start, size - start, 1, file);
+}
+
+/* copy the compressed bytes of an unchanged image to a path of its own
+ * format instead of decoding and encoding them again, with
+ * SPXI_COPY_STRIP dropping metadata chunks, markers or comments */
+int spxImageCopyFile(const char* inpath, const char* outpath, const int flags)
+{
+    int format = spxParseFormat(inpath);
+    uint8_t* data;
+    long size;
+    FILE* file;
+
+    if (format == SPXI_FORMAT_NULL) {
+        return EXIT_FAILURE;
+    } else if (format != spxParseExtension(outpath)) {
+        fprintf(stderr, "spximg cannot copy '%s' to another format: '%s'\n",
+            inpath, outpath
+        );
+        return EXIT_FAILURE;
+    } else if (!(flags & SPXI_COPY_STRIP) && !strcmp(inpath, outpath)) {
+        return EXIT_SUCCESS;
+    }
+
+    spxStatsBegin(format);
+    file = fopen(inpath, "rb");
+    if (!file) {
+        fprintf(stderr, "spximg could not open file: '%s'\n", inpath);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    data = size > 0 ? (uint8_t*)spxMalloc(size) : NULL;
+    fseek(file, 0, SEEK_SET);
+    if (!data || spxFileRead(data, size, 1, file) != 1) {
+        fprintf(stderr, "spximg could not read file: '%s'\n", inpath);
+        spxFileClose(file, 0);
+        SPXI_FREE(data);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+    spxFileClose(file, 0);
+
+    file = fopen(outpath, "wb");
+    if (!file) {
+        fprintf(stderr, "spximg could not write file: '%s'\n", outpath);
+        SPXI_FREE(data);
+        spxStatsEnd();
+        return EXIT_FAILURE;
+    }
+
+    if (!(flags & SPXI_COPY_STRIP) || size < SPXI_HEADER_SIZE) {
+        spxFileWrite(data, size, 1, file);
+    } else if (format == SPXI_FORMAT_PNG) {
+        spxCopyPng(data, size, file);
+    } else if (format == SPXI_FORMAT_JPEG) {
+        spxCopyJpeg(data, size, file);
+    } else if (format == SPXI_FORMAT_PNM && data[1] >= '1' && data[1] <= '6') {
+        spxCopyPnm(data, size, file);
+    } else {
+        spxFileWrite(data, size, 1, file);
+    }
+
+    SPXI_FREE(data);
+    format = spxFileClose(file, 1) ? EXIT_FAILURE : EXIT_SUCCESS;
+    spxStatsEnd();
+    return format;
+}
+
+/* Image Comparison */
+
+#include <math.h>
+
+#ifndef SPXI_COMPARE_LEVELS
+#define SPXI_COMPARE_LEVELS     5
+#endif /* SPXI_COMPARE_LEVELS */
+
+#define SPXI_COMPARE_FLUSH      4096
+
+/* squared and largest differences of each channel */
+typedef struct SpxCompareSums {
+    double sse[4];
+    int maxdiff[4];
+} SpxCompareSums;
+
+/* SSIM over 8x8 windows 4 pixels apart, the sums of each 4x4 block in a
+ * row of blocks are kept until the row after it is complete */
+typedef struct SpxSsim {
+    int32_t* sums;
+    uint8_t* planes;
+    int width;
+    int channels;
+    int blocks;
+    int rows;
+    double ssim[4];
+    double cs[4];
+    double windows;
+} SpxSsim;
+
+/* what one band of rows or one level of the pyramid adds up to */
+typedef struct SpxCompareBand {
+    SpxCompareSums err;
+    double ssim[4];
+    double cs[4];
+    double windows;
+    int failed;
+} SpxCompareBand;
+
+typedef struct SpxCompareTask {
+    Img2D a;
+    Img2D b;
+    SpxCompareBand* bands;
+    int count;
+    int errors;
+} SpxCompareTask;
+
+static double spxLog(double x)
+{
+    static const double ln2 = 0.69314718055994530942;
+    double z, z2, term, sum = 0.0;
+    int k, e = 0;
+    while (x >= 2.0) {
+        x *= 0.5;
+        ++e;
+    }
+    while (x < 1.0) {
+        x *= 2.0;
+        --e;
+    }
+    /* ln x = 2 atanh((x - 1) / (x + 1)), a third at most for x in [1, 2) */
+    z = (x - 1.0) / (x + 1.0);
+    z2 = z * z;
+    for (k = 1, term = z; k < 40; k += 2, term *= z2) {
+        sum += term / k;
+    }
+    return 2.0 * sum + e * ln2;
+}
+
+static double spxExp(double x)
+{
+    static const double ln2 = 0.69314718055994530942;
+    double r, term = 1.0, sum = 1.0;
+    int i, k;
+    if (x < -700.0) {
+        return 0.0;
+    }
+    k = (int)(x / ln2 + (x < 0.0 ? -0.5 : 0.5));
+    r = x - k * ln2;
+    for (i = 1; i < 20; ++i) {
+        term *= r / i;
+        sum += term;
+    }
+    for (; k > 0; --k) {
+        sum *= 2.0;
+    }
+    for (; k < 0; ++k) {
+        sum *= 0.5;
+    }
+    return sum;
+}
+
+static double spxComparePsnr(const double mse)
+{
+    static const double ln10 = 2.30258509299404568402;
+    return mse > 0.0 ? 10.0 * spxLog(255.0 * 255.0 / mse) / ln10 : HUGE_VAL;
+}
+
+#ifdef SPXI_SSE2
+/* add pairs of samples summed in lo and hi to the sums of 4 blocks */
+static void spxCompareQuads(int32_t* dst, const __m128i lo, const __m128i hi)
+{
+    const __m128 l = _mm_castsi128_ps(lo), h = _mm_castsi128_ps(hi);
+    const __m128i even = _mm_castps_si128(_mm_shuffle_ps(l, h, _MM_SHUFFLE(2, 0, 2, 0)));
+    const __m128i odd = _mm_castps_si128(_mm_shuffle_ps(l, h, _MM_SHUFFLE(3, 1, 3, 1)));
+    _mm_storeu_si128((__m128i*)dst, _mm_add_epi32(
+        _mm_loadu_si128((const __m128i*)dst), _mm_add_epi32(even, odd)
+    ));
+}
+#endif /* SPXI_SSE2 */
+
+/* squared and largest differences of a row of one channel, and what its
+ * first blocks * 4 samples add to the sums of a, b, a^2 + b^2 and ab of
+ * each block. Squares of 16 samples are summed in 32 bit lanes and moved
+ * out before SPXI_COMPARE_FLUSH rounds could overflow them */
+static void spxCompareKernel(const uint8_t* a, const uint8_t* b, const int width,
+    const int blocks, int32_t* sums, double* sse, int* maxdiff)
+{
+    int x = 0;
+    int m = 0;
+    double total = 0.0;
+#ifdef SPXI_SSE2
+    int k, run = 0;
+    int32_t lanes[4];
+    uint8_t bytes[16];
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1);
+    __m128i vmax = zero, vsse = zero;
+
+    for (; x + 16 <= width; x += 16) {
+        const __m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+        const __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+        const __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        const __m128i dl = _mm_unpacklo_epi8(d, zero), dh = _mm_unpackhi_epi8(d, zero);
+
+        vmax = _mm_max_epu8(vmax, d);
+        vsse = _mm_add_epi32(vsse,
+            _mm_add_epi32(_mm_madd_epi16(dl, dl), _mm_madd_epi16(dh, dh))
+        );
+        if (++run == SPXI_COMPARE_FLUSH) {
+            _mm_storeu_si128((__m128i*)lanes, vsse);
+            total += (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            vsse = zero;
+            run = 0;
+        }
+
+        if (sums) {
+            const __m128i al = _mm_unpacklo_epi8(va, zero), ah = _mm_unpackhi_epi8(va, zero);
+            const __m128i bl = _mm_unpacklo_epi8(vb, zero), bh = _mm_unpackhi_epi8(vb, zero);
+            int32_t* s = sums + x / 4;
+            spxCompareQuads(s, _mm_madd_epi16(al, one), _mm_madd_epi16(ah, one));
+            spxCompareQuads(s + blocks, _mm_madd_epi16(bl, one), _mm_madd_epi16(bh, one));
+            spxCompareQuads(s + 2 * blocks,
+                _mm_add_epi32(_mm_madd_epi16(al, al), _mm_madd_epi16(bl, bl)),
+                _mm_add_epi32(_mm_madd_epi16(ah, ah), _mm_madd_epi16(bh, bh))
+            );
+            spxCompareQuads(s + 3 * blocks, _mm_madd_epi16(al, bl), _mm_madd_epi16(ah, bh));
+        }
+    }
+
+    _mm_storeu_si128((__m128i*)lanes, vsse);
+    _mm_storeu_si128((__m128i*)bytes, vmax);
+    total += (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (k = 0; k < 16; ++k) {
+        m = bytes[k] > m ? bytes[k] : m;
+    }
+#endif /* SPXI_SSE2 */
+
+    for (; x < width; ++x) {
+        const int d = a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+        total += d * d;
+        m = d > m ? d : m;
+        if (sums && x < blocks * 4) {
+            int32_t* s = sums + x / 4;
+            s[0] += a[x];
+            s[blocks] += b[x];
+            s[2 * blocks] += a[x] * a[x] + b[x] * b[x];
+            s[3 * blocks] += a[x] * b[x];
+        }
+    }
+
+    if (sse) {
+        *sse += total;
+        *maxdiff = m > *maxdiff ? m : *maxdiff;
+    }
+}
+
+static int spxSsimInit(SpxSsim* s, const int width, const int channels)
+{
+    memset(s, 0, sizeof(SpxSsim));
+    s->width = width;
+    s->channels = channels;
+    s->blocks = width / 4;
+    s->sums = (int32_t*)SPXI_MALLOC(((size_t)8 * channels * s->blocks + 1) * sizeof(int32_t));
+    s->planes = (uint8_t*)SPXI_MALLOC((size_t)2 * width * channels + 1);
+    return !s->sums || !s->planes;
+}
+
+static void spxSsimFree(SpxSsim* s)
+{
+    SPXI_FREE(s->sums);
+    SPXI_FREE(s->planes);
+}
+
+/* the 8x8 windows made of 2x2 blocks of the last two rows of blocks */
+static void spxSsimWindows(SpxSsim* s, const int32_t* prev, const int32_t* cur)
+{
+    /* (0.01 * 255)^2 and (0.03 * 255)^2 */
+    static const double c1 = 6.5025, c2 = 58.5225;
+    const int n = s->blocks;
+    int c, k;
+
+    for (c = 0; c < s->channels; ++c) {
+        const int32_t* p = prev + (size_t)c * 4 * n, *q = cur + (size_t)c * 4 * n;
+        double ssim = 0.0, cs = 0.0;
+        for (k = 0; k + 1 < n; ++k) {
+            const double s1 = p[k] + p[k + 1] + q[k] + q[k + 1];
+            const double s2 = p[n + k] + p[n + k + 1] + q[n + k] + q[n + k + 1];
+            const double ss = p[2 * n + k] + p[2 * n + k + 1] + q[2 * n + k] + q[2 * n + k + 1];
+            const double s12 = p[3 * n + k] + p[3 * n + k + 1] + q[3 * n + k] + q[3 * n + k + 1];
+            const double var = (ss - (s1 * s1 + s2 * s2) / 64.0) / 63.0;
+            const double cov = (s12 - s1 * s2 / 64.0) / 63.0;
+            const double l = (2.0 * s1 * s2 / 4096.0 + c1) / ((s1 * s1 + s2 * s2) / 4096.0 + c1);
+            const double v = (2.0 * cov + c2) / (var + c2);
+            ssim += l * v;
+            cs += v;
+        }
+        s->ssim[c] += ssim;
+        s->cs[c] += cs;
+    }
+    s->windows += n - 1;
+}
+
+/* add one interleaved row of a and b to the current row of blocks, err
+ * also takes its differences */
+static void spxSsimRow(SpxSsim* s, const uint8_t* a, const uint8_t* b,
+    SpxCompareSums* err)
+{
+    const size_t plane = s->width;
+    const size_t size = (size_t)4 * s->channels * s->blocks;
+    const int half = (s->rows / 4) & 1;
+    int32_t* cur = s->sums + half * size;
+    int c;
+
+    if (s->rows % 4 == 0) {
+        memset(cur, 0, size * sizeof(int32_t));
+    }
+
+    if (s->channels > 1) {
+        spxDeinterleave(a, s->planes, plane, s->channels, s->width, 1);
+        spxDeinterleave(b, s->planes + plane * s->channels, plane, s->channels, s->width, 1);
+        a = s->planes;
+        b = s->planes + plane * s->channels;
+    }
+
+    for (c = 0; c < s->channels; ++c) {
+        spxCompareKernel(a + c * plane, b + c * plane, s->width, s->blocks,
+            s->blocks > 1 ? cur + c * 4 * s->blocks : NULL,
+            err ? err->sse + c : NULL, err ? err->maxdiff + c : NULL
+        );
+    }
+
+    if (++s->rows % 4 == 0 && s->rows > 4 && s->blocks > 1) {
+        spxSsimWindows(s, s->sums + (half ^ 1) * size, cur);
+    }
+}
+
+/* average 2x2 pixels of two rows into a row width pixels wide */
+static void spxCompareHalve(const uint8_t* r0, const uint8_t* r1, uint8_t* dst,
+    const int width, const int channels)
+{
+    int x, c;
+    for (x = 0; x < width; ++x, r0 += 2 * channels, r1 += 2 * channels) {
+        for (c = 0; c < channels; ++c) {
+            *dst++ = (uint8_t)((r0[c] + r0[c + channels] + r1[c] + r1[c + channels] + 2) >> 2);
+        }
+    }
+}
+
+static Img2D spxCompareHalveImage(const Img2D img)
+{
+    int y;
+    Img2D ret = spxImageCreate(img.width / 2, img.height / 2, img.channels);
+    for (y = 0; ret.pixbuf && y < ret.height; ++y) {
+        spxCompareHalve(
+            img.pixbuf + (size_t)2 * y * spxImageStride(img),
+            img.pixbuf + (size_t)(2 * y + 1) * spxImageStride(img),
+            ret.pixbuf + (size_t)y * spxImageStride(ret), ret.width, ret.channels
+        );
+    }
+    return ret;
+}
+
+/* levels of the pyramid that still fit one window */
+static int spxCompareLevels(const int width, const int height)
+{
+    int levels = 1;
+    while (levels < SPXI_COMPARE_LEVELS && (width >> levels) >= 8 && (height >> levels) >= 8) {
+        ++levels;
+    }
+    return levels;
+}
+
+/* each band starts a row of blocks early to have the windows across
+ * the seam, without counting the differences of those rows twice */
+static void spxCompareWork(void* arg, const int begin, const int end)
+{
+    const SpxCompareTask* task = (const SpxCompareTask*)arg;
+    const int blockrows = (task->a.height + 3) / 4;
+    const size_t astride = spxImageStride(task->a), bstride = spxImageStride(task->b);
+    int i, y;
+
+    for (i = begin; i < end; ++i) {
+        SpxCompareBand* band = task->bands + i;
+        const int y0 = 4 * (int)((long)blockrows * i / task->count);
+        const int y1 = i + 1 < task->count ?
+            4 * (int)((long)blockrows * (i + 1) / task->count) : task->a.height;
+        SpxSsim s;
+
+        if (spxSsimInit(&s, task->a.width, task->a.channels)) {
+            band->failed = 1;
+        }
+
+        for (y = y0 > 0 ? y0 - 4 : 0; !band->failed && y < y1; ++y) {
+            spxSsimRow(&s, task->a.pixbuf + y * astride, task->b.pixbuf + y * bstride,
+                y >= y0 && task->errors ? &band->err : NULL
+            );
+        }
+
+        memcpy(band->ssim, s.ssim, sizeof(s.ssim));
+        memcpy(band->cs, s.cs, sizeof(s.cs));
+        band->windows = s.windows;
+        spxSsimFree(&s);
+    }
+}
+
+/* compare one level in bands of rows and add the bands up in order */
+static int spxCompareLevel(const Img2D a, const Img2D b, const int errors,
+    SpxCompareBand* total)
+{
+    SpxCompareTask task;
+    const int rows = a.width ? SPXI_PARALLEL_GRAIN / a.width : 1;
+    int i, c, count = a.height / (rows > 4 ? rows : 4);
+
+    count = count < spxThreadCount() ? count : spxThreadCount();
+    task.a = a;
+    task.b = b;
+    task.count = count > 1 ? count : 1;
+    task.errors = errors;
+    task.bands = (SpxCompareBand*)spxMalloc(task.count * sizeof(SpxCompareBand));
+    memset(total, 0, sizeof(SpxCompareBand));
+    if (!task.bands) {
+        return EXIT_FAILURE;
+    }
+
+    memset(task.bands, 0, task.count * sizeof(SpxCompareBand));
+    spxParallelFor(task.count, 1, &spxCompareWork, &task);
+    for (i = 0; i < task.count; ++i) {
+        const SpxCompareBand* band = task.bands + i;
+        for (c = 0; c < a.channels; ++c) {
+            total->err.sse[c] += band->err.sse[c];
+            total->err.maxdiff[c] = band->err.maxdiff[c] > total->err.maxdiff[c] ?
+                band->err.maxdiff[c] : total->err.maxdiff[c];
+            total->ssim[c] += band->ssim[c];
+            total->cs[c] += band->cs[c];
+        }
+        total->windows += band->windows;
+        total->failed |= band->failed;
+    }
+
+    SPXI_FREE(task.bands);
+    return total->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* MS-SSIM weighs the contrast and structure of every level but the last
+ * and all of SSIM at the last, images too small for a window report
+ * 1 where they are equal and 0 otherwise */
+static void spxCompareFinish(SpxImageCompare* result, const int channels,
+    const double pixels, const SpxCompareBand* levels, const int count)
+{
+    static const double weights[SPXI_COMPARE_LEVELS] = {0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+    const double* sse = levels[0].err.sse;
+    double sum = 0.0;
+    int c, k;
+
+    for (k = 0; k < count; ++k) {
+        sum += weights[k];
+    }
+
+    memset(result, 0, sizeof(SpxImageCompare));
+    result->channels = channels;
+    for (c = 0; c < channels; ++c) {
+        double ms = 1.0;
+        for (k = 0; k < count && levels[k].windows > 0.0; ++k) {
+            const double v = (k + 1 < count ? levels[k].cs[c] : levels[k].ssim[c]) /
+                levels[k].windows;
+            ms *= v > 0.0 ? spxExp(weights[k] / sum * spxLog(v)) : 0.0;
+        }
+
+        result->mse[c] = sse[c] / pixels;
+        result->psnr[c] = spxComparePsnr(result->mse[c]);
+        result->maxdiff[c] = levels[0].err.maxdiff[c];
+        result->ssim[c] = levels[0].windows > 0.0 ? levels[0].ssim[c] / levels[0].windows :
+            sse[c] == 0.0;
+        result->msssim[c] = levels[0].windows > 0.0 ? ms : sse[c] == 0.0;
+
+        result->mse[SPXI_COMPARE_ALL] += result->mse[c] / channels;
+        result->ssim[SPXI_COMPARE_ALL] += result->ssim[c] / channels;
+        result->msssim[SPXI_COMPARE_ALL] += result->msssim[c] / channels;
+        result->maxdiff[SPXI_COMPARE_ALL] = result->maxdiff[c] > result->maxdiff[SPXI_COMPARE_ALL] ?
+            result->maxdiff[c] : result->maxdiff[SPXI_COMPARE_ALL];
+    }
+    result->psnr[SPXI_COMPARE_ALL] = spxComparePsnr(result->mse[SPXI_COMPARE_ALL]);
+}
+
+/* palettes count as RGBA */
+static int spxCompareChannels(const Img2D img)
+{
+    return img.palette ? 4 : img.channels;
+}
+
+/* 8 bit interleaved samples with the channels the other image has too */
+static Img2D spxCompareConvert(const Img2D img, const int channels)
+{
+    Img2D ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    if (spxSampleSize(img) > 1) {
+        ret = spxImageDepth(img, 8);
+    } else if (spxImagePlanar(img)) {
+        ret = spxImageLayout(img, SPXI_LAYOUT_INTERLEAVED);
+    } else if (img.palette || img.channels != channels) {
+        ret = spxImageReshape(img, channels);
+    }
+    return ret;
+}
+
+/* compare the samples of two images of the same size, one with more
+ * channels than the other is reshaped to match first. Each level of
+ * the pyramid is compared in bands of rows on every thread */
+int spxImageCompare(const Img2D a, const Img2D b, SpxImageCompare* result)
+{
+    SpxCompareBand levels[SPXI_COMPARE_LEVELS];
+    const int ca = spxCompareChannels(a), cb = spxCompareChannels(b);
+    const int channels = ca < cb ? ca : cb;
+    Img2D la = a, lb = b, tmp;
+    int k, count, status = EXIT_SUCCESS;
+
+    if (!a.pixbuf || !b.pixbuf || a.width != b.width || a.height != b.height) {
+        fprintf(stderr, "spximg cannot compare images of different sizes\n");
+        return EXIT_FAILURE;
+    }
+
+    tmp = spxCompareConvert(a, channels);
+    if (!tmp.pixbuf) {
+        tmp = spxCompareConvert(b, channels);
+        if (tmp.pixbuf) {
+            status = spxImageCompare(a, tmp, result);
+            spxImageFree(&tmp);
+            return status;
+        }
+    } else {
+        status = spxImageCompare(tmp, b, result);
+        spxImageFree(&tmp);
+        return status;
+    }
+
+    if (spxSampleSize(a) > 1 || spxSampleSize(b) > 1 || spxImagePlanar(a) ||
+        spxImagePlanar(b) || a.palette || b.palette || a.channels != b.channels) {
+        return EXIT_FAILURE;
+    }
+
+    count = spxCompareLevels(a.width, a.height);
+    for (k = 0; k < count && status == EXIT_SUCCESS; ++k) {
+        if (k) {
+            Img2D ha = spxCompareHalveImage(la), hb = spxCompareHalveImage(lb);
+            if (k > 1) {
+                spxImageFree(&la);
+                spxImageFree(&lb);
+            }
+            la = ha;
+            lb = hb;
+        }
+        status = la.pixbuf && lb.pixbuf ?
+            spxCompareLevel(la, lb, !k, levels + k) : EXIT_FAILURE;
+    }
+
+    if (la.pixbuf != a.pixbuf) {
+        spxImageFree(&la);
+        spxImageFree(&lb);
+    }
+
+    if (status == EXIT_SUCCESS) {
+        spxCompareFinish(result, channels, (double)a.width * a.height, levels, count);
+    }
+    return status;
+}
+
+/* Streaming Comparison */
+
+/* pulls 8 bit interleaved rows of a PNG or JPEG file one at a time,
+ * interlaced PNG files and other formats are loaded whole and handed
+ * out a row at a time from there */
+typedef struct SpxRowReader {
+    Img2D img;
+    FILE* file;
+    uint8_t* row;
+    int format;
+    int y;
+#ifndef SPXI_NO_PNG
+    SpxStream stream;
+    png_structp png;
+    png_infop info;
+#endif /* SPXI_NO_PNG */
+#ifndef SPXI_NO_JPEG
+    struct jpeg_decompress_struct jpeg;
+    SpxJpegError err;
+#endif /* SPXI_NO_JPEG */
+} SpxRowReader;
+
+#ifndef SPXI_NO_PNG
+static int spxRowReaderPng(SpxRowReader* reader, const char* path)
+{
+    reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    reader->info = reader->png ? png_create_info_struct(reader->png) : NULL;
+    if (!reader->info || setjmp(png_jmpbuf(reader->png))) {
+        return EXIT_FAILURE;
+    }
+
+    reader->stream = spxStreamFile(reader->file);
+    png_set_read_fn(reader->png, &reader->stream, &spxPngReadData);
+    png_read_info(reader->png, reader->info);
+    if (png_get_interlace_type(reader->png, reader->info) != PNG_INTERLACE_NONE) {
+        return EXIT_FAILURE;
+    }
+
+    spxPngTransforms(reader->png, reader->info, 0);
+    reader->img.width = png_get_image_width(reader->png, reader->info);
+    reader->img.height = png_get_image_height(reader->png, reader->info);
+    reader->img.channels = png_get_channels(reader->png, reader->info);
+    return spxImageAdmit(reader->img.width, reader->img.height, reader->img.channels, 1, path);
+}
+#endif /* SPXI_NO_PNG */
+
+#ifndef SPXI_NO_JPEG
+static int spxRowReaderJpeg(SpxRowReader* reader, const char* path)
+{
+    reader->jpeg.err = jpeg_std_error(&reader->err.mgr);
+    reader->err.mgr.error_exit = &spxJpegErrorExit;
+    jpeg_create_decompress(&reader->jpeg);
+    if (setjmp(reader->err.jump)) {
+        return EXIT_FAILURE;
+    }
+
+    jpeg_stdio_src(&reader->jpeg, reader->file);
+    jpeg_read_header(&reader->jpeg, 1);
+    jpeg_start_decompress(&reader->jpeg);
+    reader->img.width = reader->jpeg.output_width;
+    reader->img.height = reader->jpeg.output_height;
+    reader->img.channels = reader->jpeg.output_components;
+    return spxImageAdmit(reader->img.width, reader->img.height, reader->img.channels, 1, path);
+}
+#endif /* SPXI_NO_JPEG */
+
+static void spxRowReaderClose(SpxRowReader* reader)
+{
+#ifndef SPXI_NO_PNG
+    if (reader->format == SPXI_FORMAT_PNG) {
+        png_destroy_read_struct(&reader->png, &reader->info, NULL);
+    }
+#endif /* SPXI_NO_PNG */
+#ifndef SPXI_NO_JPEG
+    if (reader->format == SPXI_FORMAT_JPEG) {
+        jpeg_destroy_decompress(&reader->jpeg);
+    }
+#endif /* SPXI_NO_JPEG */
+    if (reader->file) {
+        fclose(reader->file);
+    }
+    SPXI_FREE(reader->row);
+    spxImageFree(&reader->img);
+    reader->format = SPXI_FORMAT_UNKNOWN;
+    reader->file = NULL;
+    reader->row = NULL;
+}
+
+static int spxRowReaderOpen(SpxRowReader* reader, const char* path)
+{
+    int status = EXIT_FAILURE;
+    Img2D tmp;
+
+    memset(reader, 0, sizeof(SpxRowReader));
+    spxLimitsError = SPXI_ERROR_NONE;
+    reader->format = spxParseFormat(path);
+    if (reader->format == SPXI_FORMAT_PNG || reader->format == SPXI_FORMAT_JPEG) {
+        reader->file = fopen(path, "rb");
+    }
+
+#ifndef SPXI_NO_PNG
+    if (reader->file && reader->format == SPXI_FORMAT_PNG) {
+        status = spxRowReaderPng(reader, path);
+    }
+#endif /* SPXI_NO_PNG */
+#ifndef SPXI_NO_JPEG
+    if (reader->file && reader->format == SPXI_FORMAT_JPEG) {
+        status = spxRowReaderJpeg(reader, path);
+    }
+#endif /* SPXI_NO_JPEG */
+
+    if (status == EXIT_SUCCESS) {
+        reader->row = (uint8_t*)spxMalloc((size_t)reader->img.width * reader->img.channels);
+        if (reader->row) {
+            return EXIT_SUCCESS;
+        }
+    }
+
+    spxRowReaderClose(reader);
+    if (spxImageLastError() == SPXI_ERROR_LIMIT) {
+        return EXIT_FAILURE;
+    }
+
+    reader->img = spxImageLoadEx(path, 0);
+    while ((tmp = spxCompareConvert(reader->img, spxCompareChannels(reader->img))).pixbuf) {
+        spxImageFree(&reader->img);
+        reader->img = tmp;
+    }
+    return reader->img.pixbuf ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static const uint8_t* spxRowReaderNext(SpxRowReader* reader)
+{
+    if (reader->img.pixbuf) {
+        return reader->img.pixbuf + (size_t)reader->y++ * spxImageStride(reader->img);
+    }
+
+#ifndef SPXI_NO_PNG
+    if (reader->format == SPXI_FORMAT_PNG) {
+        if (setjmp(png_jmpbuf(reader->png))) {
+            return NULL;
+        }
+        png_read_row(reader->png, reader->row, NULL);
+        return reader->row;
+    }
+#endif /* SPXI_NO_PNG */
+#ifndef SPXI_NO_JPEG
+    if (reader->format == SPXI_FORMAT_JPEG) {
+        JSAMPROW row = reader->row;
+        if (setjmp(reader->err.jump) || jpeg_read_scanlines(&reader->jpeg, &row, 1) != 1) {
+            return NULL;
+        }
+        return reader->row;
+    }
+#endif /* SPXI_NO_JPEG */
+    return NULL;
+}
+
+/* a level takes each row into its windows and hands the average of each
+ * pair of rows on to the level below, keeping the first of the pair and
+ * their average after it in rows */
+typedef struct SpxCompareStream {
+    SpxSsim levels[SPXI_COMPARE_LEVELS];
+    uint8_t* rows[SPXI_COMPARE_LEVELS];
+    SpxCompareSums err;
+    int count;
+} SpxCompareStream;
+
+static void spxCompareStreamRow(SpxCompareStream* st, const int level,
+    const uint8_t* a, const uint8_t* b)
+{
+    SpxSsim* s = st->levels + level;
+    const size_t size = (size_t)s->width * s->channels;
+    uint8_t* keep = st->rows[level];
+
+    spxSsimRow(s, a, b, level ? NULL : &st->err);
+    if (level + 1 >= st->count) {
+        return;
+    } else if (s->rows & 1) {
+        memcpy(keep, a, size);
+        memcpy(keep + size, b, size);
+    } else {
+        const int width = st->levels[level + 1].width;
+        uint8_t* half = keep + 2 * size;
+        spxCompareHalve(keep, a, half, width, s->channels);
+        spxCompareHalve(keep + size, b, half + size / 2, width, s->channels);
+        spxCompareStreamRow(st, level + 1, half, half + size / 2);
+    }
+}
+
+/* compare two image files a row of each at a time, so neither is held
+ * whole where its rows can be read in order */
+int spxImageCompareFiles(const char* apath, const char* bpath, SpxImageCompare* result)
+{
+    SpxCompareStream st;
+    SpxCompareBand levels[SPXI_COMPARE_LEVELS];
+    SpxRowReader ra, rb;
+    SpxReshapeFunc reshape = NULL;
+    uint8_t* shaped = NULL;
+    int k, y, ca, cb, channels, status;
+
+    status = spxRowReaderOpen(&ra, apath);
+    if (status == EXIT_SUCCESS && spxRowReaderOpen(&rb, bpath)) {
+        spxRowReaderClose(&ra);
+        status = EXIT_FAILURE;
+    }
+    if (status) {
+        return status;
+    }
+
+    ca = ra.img.channels;
+    cb = rb.img.channels;
+    channels = ca < cb ? ca : cb;
+    if (ra.img.width != rb.img.width || ra.img.height != rb.img.height) {
+        fprintf(stderr, "spximg cannot compare images of different sizes\n");
+        spxRowReaderClose(&ra);
+        spxRowReaderClose(&rb);
+        return EXIT_FAILURE;
+    }
+
+    memset(&st, 0, sizeof(SpxCompareStream));
+    st.count = spxCompareLevels(ra.img.width, ra.img.height);
+    for (k = 0; k < st.count && !status; ++k) {
+        const size_t size = (size_t)(ra.img.width >> k) * channels;
+        status = spxSsimInit(st.levels + k, ra.img.width >> k, channels);
+        st.rows[k] = (uint8_t*)spxMalloc(3 * size + 1);
+        status |= !st.rows[k];
+    }
+
+    if (ca != cb) {
+        reshape = spxReshapeKernels[0][(ca > cb ? ca : cb) - 1][channels - 1];
+        shaped = (uint8_t*)spxMalloc((size_t)ra.img.width * channels + 1);
+        status |= !shaped;
+    }
+
+    for (y = 0; !status && y < ra.img.height; ++y) {
+        const uint8_t* a = spxRowReaderNext(&ra), *b = spxRowReaderNext(&rb);
+        if (!a || !b) {
+            fprintf(stderr, "spximg could not read rows of '%s' and '%s'\n", apath, bpath);
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (reshape) {
+            reshape(ca > cb ? a : b, shaped, ra.img.width);
+            a = ca > cb ? shaped : a;
+            b = ca > cb ? b : shaped;
+        }
+        spxCompareStreamRow(&st, 0, a, b);
+    }
+
+    for (k = 0; k < st.count; ++k) {
+        memset(levels + k, 0, sizeof(SpxCompareBand));
+        memcpy(levels[k].ssim, st.levels[k].ssim, sizeof(levels[k].ssim));
+        memcpy(levels[k].cs, st.levels[k].cs, sizeof(levels[k].cs));
+        levels[k].windows = st.levels[k].windows;
+        spxSsimFree(st.levels + k);
+        SPXI_FREE(st.rows[k]);
+    }
+    levels[0].err = st.err;
+
+    if (!status) {
+        spxCompareFinish(
+            result, channels, (double)ra.img.width * ra.img.height, levels, st.count
+        );
+    }
+
+    SPXI_FREE(shaped);
+    spxRowReaderClose(&ra);
+    spxRowReaderClose(&rb);
+    return status;
+}
+
+/* Difference Mask */
+
+typedef struct SpxDiffTask {
+    Img2D a;
+    Img2D b;
+    Img2D mask;
+    int threshold;
+} SpxDiffTask;
+
+static void spxDiffMaskWork(void* arg, const int begin, const int end)
+{
+    const SpxDiffTask* task = (const SpxDiffTask*)arg;
+    const int channels = task->a.channels;
+    int x, y, c;
+
+    for (y = begin; y < end; ++y) {
+        const uint8_t* a = task->a.pixbuf + (size_t)y * spxImageStride(task->a);
+        const uint8_t* b = task->b.pixbuf + (size_t)y * spxImageStride(task->b);
+        uint8_t* m = task->mask.pixbuf + (size_t)y * spxImageStride(task->mask);
+        for (x = 0; x < task->a.width; ++x, a += channels, b += channels) {
+            int d = 0;
+            for (c = 0; c < channels; ++c) {
+                d |= (a[c] > b[c] ? a[c] - b[c] : b[c] - a[c]) > task->threshold;
+            }
+            m[x] = (uint8_t)(d ? 0xFF : 0);
+        }
+    }
+}
+
+/* a gray image that is white where any channel differs by more than
+ * threshold and black elsewhere */
+Img2D spxImageDiffMask(const Img2D a, const Img2D b, int threshold)
+{
+    SpxDiffTask task;
+    const int ca = spxCompareChannels(a), cb = spxCompareChannels(b);
+    const int channels = ca < cb ? ca : cb;
+    const int grain = a.width ? SPXI_PARALLEL_GRAIN / a.width : 1;
+    Img2D tmp, ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+
+    if (!a.pixbuf || !b.pixbuf || a.width != b.width || a.height != b.height) {
+        fprintf(stderr, "spximg cannot compare images of different sizes\n");
+        return ret;
+    }
+
+    tmp = spxCompareConvert(a, channels);
+    if (tmp.pixbuf) {
+        ret = spxImageDiffMask(tmp, b, threshold);
+        spxImageFree(&tmp);
+        return ret;
+    }
+
+    tmp = spxCompareConvert(b, channels);
+    if (tmp.pixbuf) {
+        ret = spxImageDiffMask(a, tmp, threshold);
+        spxImageFree(&tmp);
+        return ret;
+    }
+
+    task.a = a;
+    task.b = b;
+    task.threshold = threshold;
+    task.mask = ret = spxImageCreate(a.width, a.height, 1);
+    if (ret.pixbuf && a.channels == b.channels) {
+        spxParallelFor(a.height, grain > 0 ? grain : 1, &spxDiffMaskWork, &task);
+    }
+    return ret;
+}
+
+/* Image Analysis */
+
+/* what one band of rows adds up to, samples are counted in two tables
+ * taken in turns so runs of equal samples do not wait on each other */
+typedef struct SpxAnalyzeBand {
+    size_t counts[2][4 * 256];
+    double sums[4];
+    double squares[4];
+    int min[4];
+    int max[4];
+    int colored;
+} SpxAnalyzeBand;
+
+typedef struct SpxAnalyzeTask {
+    Img2D img;
+    SpxAnalyzeBand* bands;
+    int count;
+} SpxAnalyzeTask;
+
+static double spxSqrt(double x)
+{
+    double r, scale = 1.0;
+    int i;
+    if (x <= 0.0) {
+        return 0.0;
+    }
+    while (x >= 4.0) {
+        x *= 0.25;
+        scale *= 2.0;
+    }
+    while (x < 1.0) {
+        x *= 4.0;
+        scale *= 0.5;
+    }
+    for (i = 0, r = 0.5 * (1.0 + x); i < 6; ++i) {
+        r = 0.5 * (r + x / r);
+    }
+    return r * scale;
+}
+
+static void spxAnalyzeInit(SpxAnalyzeBand* band)
+{
+    int c;
+    memset(band, 0, sizeof(SpxAnalyzeBand));
+    for (c = 0; c < 4; ++c) {
+        band->min[c] = 0xFFFF;
+    }
+}
+
+/* whether any pixel of an interleaved RGB or RGBA row is not gray, with
+ * SSE2 each sample is xored with the next and those of R ^ G and G ^ B
+ * are kept, five RGB or four RGBA pixels at a time */
+static int spxAnalyzeColored(const uint8_t* row, const int width, const int channels)
+{
+    int x = 0, diff = 0;
+#ifdef SPXI_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    if (channels == 4) {
+        const __m128i mask = _mm_set1_epi32(0xFFFF);
+        for (; x + 4 <= width; x += 4) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(row + x * 4));
+            acc = _mm_or_si128(acc, _mm_and_si128(_mm_xor_si128(v, _mm_srli_epi32(v, 8)), mask));
+        }
+    } else {
+        const __m128i mask = _mm_setr_epi8(
+            -1, -1, 0, -1, -1, 0, -1, -1, 0, -1, -1, 0, -1, -1, 0, 0
+        );
+        for (; x + 6 <= width; x += 5) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(row + x * 3));
+            acc = _mm_or_si128(acc, _mm_and_si128(_mm_xor_si128(v, _mm_srli_si128(v, 1)), mask));
+        }
+    }
+    diff = _mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF;
+#endif /* SPXI_SSE2 */
+    for (; !diff && x < width; ++x) {
+        const uint8_t* p = row + x * channels;
+        diff = p[0] != p[1] || p[1] != p[2];
+    }
+    return diff;
+}
+
+/* the same for one row of each of three planes */
+static int spxAnalyzeColoredPlanes(const uint8_t* r, const uint8_t* g, const uint8_t* b,
+    const size_t size)
+{
+    size_t i = 0;
+    int diff = 0;
+#ifdef SPXI_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 16 <= size; i += 16) {
+        const __m128i vg = _mm_loadu_si128((const __m128i*)(g + i));
+        acc = _mm_or_si128(acc, _mm_or_si128(
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*)(r + i)), vg),
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*)(b + i)), vg)
+        ));
+    }
+    diff = _mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF;
+#endif /* SPXI_SSE2 */
+    for (; !diff && i < size; ++i) {
+        diff = r[i] != g[i] || b[i] != g[i];
+    }
+    return diff;
+}
+
+/* count count samples of a row that starts at channel first of channels,
+ * 16 bit ones by their high byte while their sums keep all of them */
+static void spxAnalyzeRow(SpxAnalyzeBand* band, const uint8_t* row, const size_t count,
+    const int channels, const int first, const int samplesize)
+{
+    size_t i;
+    int c;
+
+    if (samplesize > 1) {
+        const uint16_t* s = (const uint16_t*)row;
+        for (i = 0; i < count; ++i) {
+            const int v = s[i];
+            c = first + (int)(i % channels);
+            ++band->counts[i & 1][c * 256 + (v >> 8)];
+            band->sums[c] += v;
+            band->squares[c] += (double)v * v;
+            band->min[c] = v < band->min[c] ? v : band->min[c];
+            band->max[c] = v > band->max[c] ? v : band->max[c];
+        }
+        return;
+    }
+
+    if (channels == 1) {
+        size_t* t0 = band->counts[0] + first * 256, *t1 = band->counts[1] + first * 256;
+        for (i = 0; i + 2 <= count; i += 2) {
+            ++t0[row[i]];
+            ++t1[row[i + 1]];
+        }
+        if (i < count) {
+            ++t0[row[i]];
+        }
+        return;
+    }
+
+    for (i = 0; i < count; i += channels) {
+        size_t* t = band->counts[(i / channels) & 1];
+        for (c = 0; c < channels; ++c) {
+            ++t[c * 256 + row[i + c]];
+        }
+    }
+}
+
+static void spxAnalyzeWork(void* arg, const int begin, const int end)
+{
+    const SpxAnalyzeTask* task = (const SpxAnalyzeTask*)arg;
+    const Img2D img = task->img;
+    const size_t stride = spxImageStride(img);
+    const int samplesize = spxSampleSize(img);
+    int i, y, c;
+
+    for (i = begin; i < end; ++i) {
+        SpxAnalyzeBand* band = task->bands + i;
+        const int y0 = (int)((long)img.height * i / task->count);
+        const int y1 = (int)((long)img.height * (i + 1) / task->count);
+
+        spxAnalyzeInit(band);
+        for (y = y0; y < y1; ++y) {
+            if (img.layout != SPXI_LAYOUT_PLANAR || img.channels == 1) {
+                const uint8_t* row = img.pixbuf + (size_t)y * stride;
+                spxAnalyzeRow(band, row, (size_t)img.width * img.channels, img.channels,
+                    0, samplesize
+                );
+                if (!band->colored && img.channels >= 3 && samplesize == 1) {
+                    band->colored = spxAnalyzeColored(row, img.width, img.channels);
+                }
+                continue;
+            }
+
+            for (c = 0; c < img.channels; ++c) {
+                spxAnalyzeRow(band, img.pixbuf + ((size_t)c * img.height + y) * stride,
+                    img.width, 1, c, samplesize
+                );
+            }
+            if (!band->colored && img.channels >= 3) {
+                band->colored = spxAnalyzeColoredPlanes(
+                    img.pixbuf + (size_t)y * stride,
+                    img.pixbuf + ((size_t)img.height + y) * stride,
+                    img.pixbuf + ((size_t)2 * img.height + y) * stride,
+                    (size_t)img.width * samplesize
+                );
+            }
+        }
+    }
+}
 
-static int spxPngColorTypeToChannels(int channels)
+/* 16 bit RGB samples are compared whole, not by the high byte counted */
+static int spxAnalyzeColoredWide(const Img2D img)
 {
-    switch (channels) {
-        case PNG_COLOR_TYPE_GRAY: return SPXI_COLOR_GRAY;
-        case PNG_COLOR_TYPE_GRAY_ALPHA: return SPXI_COLOR_GRAY_ALPHA;
-        case PNG_COLOR_TYPE_RGB: return SPXI_COLOR_RGB;
-        case PNG_COLOR_TYPE_RGBA: return SPXI_COLOR_RGBA;
-        case PNG_COLOR_TYPE_PALETTE: return SPXI_COLOR_RGBA;
+    const size_t stride = spxImageStride(img);
+    int x, y;
+    for (y = 0; y < img.height; ++y) {
+        const uint16_t* s = (const uint16_t*)(img.pixbuf + (size_t)y * stride);
+        for (x = 0; x < img.width; ++x, s += img.channels) {
+            if (s[0] != s[1] || s[1] != s[2]) {
+                return 1;
+            }
+        }
     }
-    
-    return SPXI_COLOR_UNKNOWN;
+    return 0;
 }
 
-static int spxPngChannelsToColorType(int channels)
+/* add the bands up in order and work out the rest from the histograms,
+ * which hold every 8 bit sample exactly */
+static void spxAnalyzeFinish(SpxImageAnalysis* out, const SpxAnalyzeBand* bands,
+    const int count, const int channels, const int depth, const size_t pixels)
 {
-    switch (channels) {
-        case SPXI_COLOR_GRAY: return PNG_COLOR_TYPE_GRAY;
-        case SPXI_COLOR_GRAY_ALPHA: return PNG_COLOR_TYPE_GRAY_ALPHA;
-        case SPXI_COLOR_RGB: return PNG_COLOR_TYPE_RGB;
-        case SPXI_COLOR_RGBA: return PNG_COLOR_TYPE_RGBA;
+    const int wide = depth > SPXI_BIT_DEPTH;
+    const int top = wide ? 0xFFFF : 0xFF;
+    int c, i, v, colored = 0;
+
+    memset(out, 0, sizeof(SpxImageAnalysis));
+    out->channels = channels;
+    out->depth = wide ? 16 : SPXI_BIT_DEPTH;
+    for (c = 0; c < channels; ++c) {
+        double sum = 0.0, squares = 0.0;
+        out->min[c] = top;
+        for (i = 0; i < count; ++i) {
+            const SpxAnalyzeBand* band = bands + i;
+            for (v = 0; v < 256; ++v) {
+                out->histogram[c][v] += band->counts[0][c * 256 + v] + band->counts[1][c * 256 + v];
+            }
+            sum += band->sums[c];
+            squares += band->squares[c];
+            out->min[c] = band->min[c] < out->min[c] ? band->min[c] : out->min[c];
+            out->max[c] = band->max[c] > out->max[c] ? band->max[c] : out->max[c];
+        }
+
+        if (!wide) {
+            for (v = 0; v < 256; ++v) {
+                sum += (double)out->histogram[c][v] * v;
+                squares += (double)out->histogram[c][v] * v * v;
+            }
+            out->min[c] = 0;
+            out->max[c] = 255;
+            while (out->min[c] < 255 && !out->histogram[c][out->min[c]]) {
+                ++out->min[c];
+            }
+            while (out->max[c] > 0 && !out->histogram[c][out->max[c]]) {
+                --out->max[c];
+            }
+        }
+
+        if (pixels) {
+            out->mean[c] = sum / pixels;
+            out->stddev[c] = spxSqrt(squares / pixels - out->mean[c] * out->mean[c]);
+        } else {
+            out->min[c] = 0;
+        }
     }
-    
-    fprintf(stderr, "spximg does not support %d channels per pixel\n", channels);
-    return -1;
+
+    for (i = 0; i < count; ++i) {
+        colored |= bands[i].colored;
+    }
+
+    out->opaque = !(channels & 1) ? out->min[channels - 1] == top || !pixels : 1;
+    out->gray = channels < 3 || !colored;
+    out->channelsNeeded = (out->gray ? 1 : 3) + !out->opaque;
 }
 
-Img2D spxImageLoadPng(const char* path)
+/* count the indices and look their colors up once per palette entry */
+static void spxAnalyzeIndexed(const Img2D img, SpxImageAnalysis* out,
+    SpxAnalyzeBand* bands, const int count)
+{
+    SpxAnalyzeBand* colors = bands + count;
+    const size_t pixels = (size_t)img.width * img.height;
+    int c, i, k;
+
+    spxAnalyzeInit(colors);
+    for (k = 0; k < SPXI_PALETTE_COLORS; ++k) {
+        size_t n = 0;
+        for (i = 0; i < count; ++i) {
+            n += bands[i].counts[0][k] + bands[i].counts[1][k];
+        }
+        for (c = 0; c < 4 && n; ++c) {
+            colors->counts[0][c * 256 + img.palette[k * 4 + c]] += n;
+        }
+        colors->colored |= n && (img.palette[k * 4] != img.palette[k * 4 + 1] ||
+            img.palette[k * 4 + 1] != img.palette[k * 4 + 2]);
+    }
+    spxAnalyzeFinish(out, colors, 1, 4, SPXI_BIT_DEPTH, pixels);
+}
+
+/* per channel statistics and histograms of an image in one pass over
+ * its samples, in bands of rows on every thread. A palette image counts
+ * its indices and is reported as the RGBA colors they stand for */
+int spxImageAnalyze(const Img2D img, SpxImageAnalysis* analysis)
+{
+    SpxAnalyzeTask task;
+    const int rows = img.width ? SPXI_PARALLEL_GRAIN / img.width : 1;
+    int count = img.height / (rows > 1 ? rows : 1);
+
+    if (!img.pixbuf || img.channels < 1 || img.channels > 4) {
+        fprintf(stderr, "spximg cannot analyze an image with %d channels\n", img.channels);
+        return EXIT_FAILURE;
+    }
+
+    count = count < spxThreadCount() ? count : spxThreadCount();
+    task.img = img;
+    task.count = count > 1 ? count : 1;
+    task.bands = (SpxAnalyzeBand*)spxMalloc((task.count + 1) * sizeof(SpxAnalyzeBand));
+    if (!task.bands) {
+        return EXIT_FAILURE;
+    }
+
+    spxParallelFor(task.count, 1, &spxAnalyzeWork, &task);
+    if (img.palette) {
+        spxAnalyzeIndexed(img, analysis, task.bands, task.count);
+    } else {
+        spxAnalyzeFinish(analysis, task.bands, task.count, img.channels, img.depth,
+            (size_t)img.width * img.height
+        );
+        if (spxSampleSize(img) > 1 && img.channels >= 3 && img.layout != SPXI_LAYOUT_PLANAR) {
+            analysis->gray = !spxAnalyzeColoredWide(img);
+            analysis->channelsNeeded = (analysis->gray ? 1 : 3) + !analysis->opaque;
+        }
+    }
+
+    SPXI_FREE(task.bands);
+    return EXIT_SUCCESS;
+}
+
+/* the same while a file is decoded, each row counted as it comes out of
+ * the decoder so the image is never held whole where its rows can be
+ * read in order, samples are 8 bit and palettes expanded */
+int spxImageAnalyzeFile(const char* path, SpxImageAnalysis* analysis)
 {
-    int i, stride;
-    Img2D img = {NULL, 0, 0, 0};
-    uint8_t **rows, bitDepth, colorType;
+    SpxRowReader reader;
+    SpxAnalyzeBand* band;
+    int y, status = EXIT_SUCCESS;
+
+    if (spxRowReaderOpen(&reader, path)) {
+        return EXIT_FAILURE;
+    }
+
+    band = (SpxAnalyzeBand*)spxMalloc(sizeof(SpxAnalyzeBand));
+    if (band) {
+        spxAnalyzeInit(band);
+    }
+
+    for (y = 0; band && y < reader.img.height; ++y) {
+        const uint8_t* row = spxRowReaderNext(&reader);
+        if (!row) {
+            fprintf(stderr, "spximg could not read rows of '%s'\n", path);
+            status = EXIT_FAILURE;
+            break;
+        }
+        spxAnalyzeRow(band, row, (size_t)reader.img.width * reader.img.channels,
+            reader.img.channels, 0, 1
+        );
+        if (!band->colored && reader.img.channels >= 3) {
+            band->colored = spxAnalyzeColored(row, reader.img.width, reader.img.channels);
+        }
+    }
+
+    if (!band) {
+        status = EXIT_FAILURE;
+    } else if (status == EXIT_SUCCESS) {
+        spxAnalyzeFinish(analysis, band, 1, reader.img.channels, SPXI_BIT_DEPTH,
+            (size_t)reader.img.width * reader.img.height
+        );
+    }
+
+    SPXI_FREE(band);
+    spxRowReaderClose(&reader);
+    return status;
+}
+
+/* Incremental Push Decoding */
+
+#ifndef SPXI_DECODER_HEADER
+#define SPXI_DECODER_HEADER     (1 << 16)
+#endif /* SPXI_DECODER_HEADER */
+
+#define SPXI_DECODE_FORMAT      0
+#define SPXI_DECODE_HEADER      1
+#define SPXI_DECODE_START       2
+#define SPXI_DECODE_ROWS        3
+#define SPXI_DECODE_FINISH      4
+#define SPXI_DECODE_DONE        5
+#define SPXI_DECODE_BUFFER      6
+#define SPXI_DECODE_ERROR       (-1)
+
+struct SpxImageDecoder {
+    Img2D image;
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    size_t pos;
+    int format;
+    int flags;
+    int rows;
+    int state;
+    int transform;
+#ifndef SPXI_NO_PNG
     png_structp png;
     png_infop info;
-    
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "spximg could not open file: '%s'\n", path);
-        return img;
+#endif /* SPXI_NO_PNG */
+#ifndef SPXI_NO_JPEG
+    struct jpeg_decompress_struct jpeg;
+    struct jpeg_source_mgr source;
+    SpxJpegError err;
+    size_t skip;
+    int created;
+#endif /* SPXI_NO_JPEG */
+#ifndef SPXI_NO_PNM
+    SpxPnmTask pnm;
+#endif /* SPXI_NO_PNM */
+#ifndef SPXI_NO_BMP
+    SpxBmpTask bmp;
+#endif /* SPXI_NO_BMP */
+};
+
+/* move unread bytes to the front, which also aligns stored rows */
+static void spxDecoderDrop(SpxImageDecoder* decoder)
+{
+    if (decoder->pos) {
+        decoder->size -= decoder->pos;
+        memmove(decoder->data, decoder->data + decoder->pos, decoder->size);
+        decoder->pos = 0;
     }
-    
-    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        fprintf(stderr, "spximg could not create PNG read struct\n");
-        return img;
+}
+
+/* keep new bytes behind the ones not consumed yet */
+static int spxDecoderAppend(SpxImageDecoder* decoder, const uint8_t* data, size_t size)
+{
+    spxDecoderDrop(decoder);
+
+    if (decoder->size + size > decoder->capacity) {
+        size_t capacity = decoder->capacity ? decoder->capacity : 4096;
+        uint8_t* buf;
+        while (capacity < decoder->size + size) {
+            capacity <<= 1;
+        }
+        buf = (uint8_t*)spxRealloc(decoder->data, capacity);
+        if (!buf) {
+            return EXIT_FAILURE;
+        }
+        decoder->data = buf;
+        decoder->capacity = capacity;
+    }
+
+    memcpy(decoder->data + decoder->size, data, size);
+    decoder->size += size;
+    return EXIT_SUCCESS;
+}
+
+#ifndef SPXI_NO_PNG
+
+static void spxDecoderPngInfo(png_structp png, png_infop info)
+{
+    SpxImageDecoder* decoder = (SpxImageDecoder*)png_get_progressive_ptr(png);
+    decoder->image = spxPngSetup(
+        png, info, "<stream>", decoder->flags & ~SPXI_LOAD_PLANAR
+    );
+    if (!decoder->image.pixbuf) {
+        png_error(png, "could not allocate image");
+    }
+    decoder->state = SPXI_DECODE_ROWS;
+}
+
+/* interlaced rows are only final after the last pass */
+static void spxDecoderPngRow(png_structp png, png_bytep row, png_uint_32 y, int pass)
+{
+    SpxImageDecoder* decoder = (SpxImageDecoder*)png_get_progressive_ptr(png);
+    const Img2D img = decoder->image;
+    const size_t stride = (size_t)img.width * img.channels * spxSampleSize(img);
+    (void)pass;
+    if (row && (int)y < img.height) {
+        png_progressive_combine_row(png, img.pixbuf + y * stride, row);
+        if (png_get_interlace_type(png, decoder->info) == PNG_INTERLACE_NONE) {
+            decoder->rows = y + 1;
+        }
+    }
+}
+
+static void spxDecoderPngEnd(png_structp png, png_infop info)
+{
+    SpxImageDecoder* decoder = (SpxImageDecoder*)png_get_progressive_ptr(png);
+    (void)info;
+    decoder->rows = decoder->image.height;
+    decoder->state = SPXI_DECODE_DONE;
+}
+
+static int spxDecoderPng(SpxImageDecoder* decoder, const uint8_t* data, size_t size)
+{
+    if (!decoder->png) {
+        decoder->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        decoder->info = decoder->png ? png_create_info_struct(decoder->png) : NULL;
+        if (!decoder->info) {
+            return EXIT_FAILURE;
+        }
+        png_set_progressive_read_fn(decoder->png, decoder,
+            &spxDecoderPngInfo, &spxDecoderPngRow, &spxDecoderPngEnd
+        );
+        decoder->state = SPXI_DECODE_HEADER;
+    }
+
+    if (setjmp(png_jmpbuf(decoder->png))) {
+        return EXIT_FAILURE;
+    }
+
+    png_process_data(decoder->png, decoder->info, (png_bytep)data, size);
+    return EXIT_SUCCESS;
+}
+
+#endif /* SPXI_NO_PNG */
+#ifndef SPXI_NO_JPEG
+
+static void spxDecoderJpegInit(j_decompress_ptr info)
+{
+    (void)info;
+}
+
+/* running out of bytes suspends the decoder until the next push */
+static boolean spxDecoderJpegFill(j_decompress_ptr info)
+{
+    (void)info;
+    return FALSE;
+}
+
+static void spxDecoderJpegSkip(j_decompress_ptr info, long count)
+{
+    SpxImageDecoder* decoder = (SpxImageDecoder*)info->client_data;
+    struct jpeg_source_mgr* src = info->src;
+    if (count > (long)src->bytes_in_buffer) {
+        decoder->skip += count - src->bytes_in_buffer;
+        src->next_input_byte += src->bytes_in_buffer;
+        src->bytes_in_buffer = 0;
+    } else if (count > 0) {
+        src->next_input_byte += count;
+        src->bytes_in_buffer -= count;
+    }
+}
+
+static void spxDecoderJpegTerm(j_decompress_ptr info)
+{
+    (void)info;
+}
+
+static int spxDecoderJpegStep(SpxImageDecoder* decoder)
+{
+    j_decompress_ptr info = &decoder->jpeg;
+    if (setjmp(decoder->err.jump)) {
+        return EXIT_FAILURE;
+    }
+
+    if (decoder->state == SPXI_DECODE_HEADER) {
+        int ret = jpeg_read_header(info, TRUE);
+        if (ret == JPEG_SUSPENDED) {
+            return EXIT_SUCCESS;
+        } else if (ret != JPEG_HEADER_OK) {
+            return EXIT_FAILURE;
+        }
+        if (decoder->flags & SPXI_LOAD_ORIENT) {
+            decoder->transform = spxJpegOrientation(info);
+        }
+        jpeg_calc_output_dimensions(info);
+        if (spxImageAdmit(info->output_width, info->output_height,
+            info->output_components, 1, "<stream>")) {
+            return EXIT_FAILURE;
+        }
+        decoder->image.width = info->output_width;
+        decoder->image.height = info->output_height;
+        decoder->image.channels = info->output_components;
+        decoder->state = SPXI_DECODE_START;
+    }
+
+    if (decoder->state == SPXI_DECODE_START) {
+        Img2D* img = &decoder->image;
+        if (!jpeg_start_decompress(info)) {
+            return EXIT_SUCCESS;
+        }
+        img->pixbuf = spxPixbufAlloc((size_t)img->width * img->height * img->channels);
+        if (!img->pixbuf) {
+            return EXIT_FAILURE;
+        }
+        decoder->state = SPXI_DECODE_ROWS;
+    }
+
+    while (decoder->state == SPXI_DECODE_ROWS && info->output_scanline < info->output_height) {
+        const Img2D img = decoder->image;
+        uint8_t* row = img.pixbuf + (size_t)info->output_scanline * img.width * img.channels;
+        if (!jpeg_read_scanlines(info, &row, 1)) {
+            return EXIT_SUCCESS;
+        }
+        decoder->rows = info->output_scanline;
+    }
+
+    decoder->state = SPXI_DECODE_FINISH;
+    if (jpeg_finish_decompress(info)) {
+        decoder->state = SPXI_DECODE_DONE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int spxDecoderJpeg(SpxImageDecoder* decoder, const uint8_t* data, size_t size)
+{
+    struct jpeg_source_mgr* src = &decoder->source;
+    size_t skip = decoder->skip < size ? decoder->skip : size;
+    int ret;
+
+    if (!decoder->created) {
+        decoder->jpeg.err = jpeg_std_error(&decoder->err.mgr);
+        decoder->err.mgr.error_exit = &spxJpegErrorExit;
+        jpeg_create_decompress(&decoder->jpeg);
+        decoder->jpeg.client_data = decoder;
+        decoder->jpeg.src = src;
+        src->init_source = &spxDecoderJpegInit;
+        src->fill_input_buffer = &spxDecoderJpegFill;
+        src->skip_input_data = &spxDecoderJpegSkip;
+        src->resync_to_restart = &jpeg_resync_to_restart;
+        src->term_source = &spxDecoderJpegTerm;
+        src->bytes_in_buffer = 0;
+        src->next_input_byte = NULL;
+        if (decoder->flags & SPXI_LOAD_ORIENT) {
+            jpeg_save_markers(&decoder->jpeg, JPEG_APP0 + 1, 0xFFFF);
+        }
+        decoder->created = 1;
+        decoder->state = SPXI_DECODE_HEADER;
+    } else {
+        decoder->pos = src->next_input_byte - decoder->data;
+    }
+
+    /* libjpeg keeps pointing into the buffer, so it is only moved here */
+    decoder->skip -= skip;
+    if (data && spxDecoderAppend(decoder, data + skip, size - skip)) {
+        return EXIT_FAILURE;
+    }
+
+    src->next_input_byte = decoder->data;
+    src->bytes_in_buffer = decoder->size;
+    ret = spxDecoderJpegStep(decoder);
+    decoder->pos = src->next_input_byte - decoder->data;
+    return ret;
+}
+
+#endif /* SPXI_NO_JPEG */
+#ifndef SPXI_NO_PNM
+
+/* parse a PNM header, giving its length once the whitespace after the
+ * last value has arrived, 0 while more is needed and -1 if malformed */
+static int spxDecoderPnmHeader(const uint8_t* data, const size_t size, int* params)
+{
+    size_t i = 2;
+    int n = 0, count;
+
+    if (size < 2) {
+        return 0;
+    } else if (data[0] != 'P' || data[1] < '1' || data[1] > '6') {
+        return -1;
+    }
+
+    count = (data[1] == '1' || data[1] == '4') ? 2 : 3;
+    while (n < count) {
+        while (i < size && (isspace(data[i]) || data[i] == '#')) {
+            if (data[i] == '#') {
+                while (i < size && data[i] != '\n') ++i;
+            } else {
+                ++i;
+            }
+        }
+        if (i < size && !isdigit(data[i])) {
+            return -1;
+        }
+        for (params[n] = 0; i < size && isdigit(data[i]); ++i) {
+            if (params[n] > (0x7FFFFFFF - 9) / 10) {
+                return -1;
+            }
+            params[n] = params[n] * 10 + (data[i] - '0');
+        }
+        if (i == size) {
+            return 0;
+        }
+        ++n;
+    }
+
+    return isspace(data[i]) ? (int)i + 1 : -1;
+}
+
+static int spxDecoderPnm(SpxImageDecoder* decoder)
+{
+    SpxPnmTask* task = &decoder->pnm;
+    size_t linesize;
+
+    if (decoder->state == SPXI_DECODE_HEADER) {
+        int params[3] = {0, 0, 0}, N = decoder->data[1];
+        int length = spxDecoderPnmHeader(decoder->data, decoder->size, params);
+        if (!length) {
+            return decoder->size > SPXI_DECODER_HEADER ? EXIT_FAILURE : EXIT_SUCCESS;
+        } else if (length < 0 || !params[0] || !params[1] || params[2] > 0xFFFF ||
+            ((N != '1' && N != '4') && !params[2])) {
+            return EXIT_FAILURE;
+        } else if (spxImageAdmit(params[0], params[1], N == '1' || N == '4' ? 1 : 3,
+            (decoder->flags & SPXI_LOAD_16BIT) && params[2] > 0xFF ? 2 : 1, "<stream>")) {
+            return EXIT_FAILURE;
+        } else if (N <= '3') {
+            decoder->state = SPXI_DECODE_BUFFER;
+            return EXIT_SUCCESS;
+        }
+
+        decoder->image = spxPnmSetup(
+            task, params[0], params[1], N == '6' ? 3 : 1, params[2],
+            (decoder->flags & SPXI_LOAD_16BIT) && params[2] > 0xFF, 0
+        );
+        if (!decoder->image.pixbuf) {
+            return EXIT_FAILURE;
+        }
+        decoder->pos = length;
+        decoder->state = SPXI_DECODE_ROWS;
+        spxDecoderDrop(decoder);
+    }
+
+    linesize = (size_t)task->width * task->channels * spxSampleSize(decoder->image);
+    while (decoder->rows < decoder->image.height &&
+        decoder->size - decoder->pos >= task->stride) {
+        spxPnmRow(
+            task, decoder->data + decoder->pos, task->dst + decoder->rows * linesize
+        );
+        decoder->pos += task->stride;
+        ++decoder->rows;
+    }
+
+    if (decoder->rows == decoder->image.height) {
+        decoder->state = SPXI_DECODE_DONE;
+    }
+    return EXIT_SUCCESS;
+}
+
+#endif /* SPXI_NO_PNM */
+#ifndef SPXI_NO_BMP
+
+/* the whole header and palette arrive before the pixel offset, stored
+ * rows run bottom up so the image fills from its last row */
+static int spxDecoderBmp(SpxImageDecoder* decoder)
+{
+    SpxBmpTask* task = &decoder->bmp;
+    size_t linesize;
+
+    if (decoder->state == SPXI_DECODE_HEADER) {
+        SpxStream stream;
+        uint32_t offset;
+        if (decoder->size < 14) {
+            return EXIT_SUCCESS;
+        }
+        offset = decoder->data[10] | (decoder->data[11] << 8) |
+            ((uint32_t)decoder->data[12] << 16) | ((uint32_t)decoder->data[13] << 24);
+        if (offset > SPXI_DECODER_HEADER) {
+            return EXIT_FAILURE;
+        } else if (decoder->size < offset) {
+            return EXIT_SUCCESS;
+        }
+
+        stream = spxStreamMemory(decoder->data, decoder->size);
+        decoder->image = spxBmpSetup(
+            &stream, "<stream>", decoder->flags & ~SPXI_LOAD_PLANAR, task
+        );
+        if (!decoder->image.pixbuf) {
+            return EXIT_FAILURE;
+        }
+        decoder->pos = task->offset;
+        decoder->state = SPXI_DECODE_ROWS;
+        spxDecoderDrop(decoder);
+    }
+
+    linesize = (size_t)task->width * task->channels;
+    while (decoder->rows < task->height &&
+        decoder->size - decoder->pos >= task->stride) {
+        spxBmpRow(
+            task, decoder->data + decoder->pos,
+            task->dst + (size_t)(task->height - 1 - decoder->rows) * linesize
+        );
+        decoder->pos += task->stride;
+        ++decoder->rows;
+    }
+
+    if (decoder->rows == task->height) {
+        decoder->state = SPXI_DECODE_DONE;
+    }
+    return EXIT_SUCCESS;
+}
+
+#endif /* SPXI_NO_BMP */
+
+SpxImageDecoder* spxImageDecoderOpen(int flags)
+{
+    SpxImageDecoder* decoder = (SpxImageDecoder*)SPXI_MALLOC(sizeof(SpxImageDecoder));
+    if (decoder) {
+        memset(decoder, 0, sizeof(SpxImageDecoder));
+        decoder->flags = flags;
+        decoder->state = SPXI_DECODE_FORMAT;
+    }
+    spxLimitsError = SPXI_ERROR_NONE;
+    return decoder;
+}
+
+int spxImageDecoderPush(SpxImageDecoder* decoder, const void* data, size_t size)
+{
+    int ret = EXIT_SUCCESS;
+    if (!decoder || decoder->state == SPXI_DECODE_ERROR) {
+        return -1;
+    } else if (decoder->state == SPXI_DECODE_DONE) {
+        return decoder->rows;
+    }
+
+    switch (decoder->format) {
+#ifndef SPXI_NO_PNG
+        case SPXI_FORMAT_PNG:
+            ret = spxDecoderPng(decoder, (const uint8_t*)data, size);
+            break;
+#endif /* SPXI_NO_PNG */
+#ifndef SPXI_NO_JPEG
+        case SPXI_FORMAT_JPEG:
+            ret = spxDecoderJpeg(decoder, (const uint8_t*)data, size);
+            break;
+#endif /* SPXI_NO_JPEG */
+        default:
+            ret = spxDecoderAppend(decoder, (const uint8_t*)data, size);
+    }
+
+    /* the first bytes pick the format, PNG and JPEG then get what was
+     * held back and take later pushes straight through */
+    if (!ret && decoder->state == SPXI_DECODE_FORMAT && decoder->size >= SPXI_HEADER_SIZE) {
+        decoder->format = spxParseHeader(decoder->data);
+        decoder->state = SPXI_DECODE_HEADER;
+        switch (decoder->format) {
+#ifndef SPXI_NO_PNG
+            case SPXI_FORMAT_PNG:
+                ret = spxDecoderPng(decoder, decoder->data, decoder->size);
+                decoder->size = 0;
+                break;
+#endif /* SPXI_NO_PNG */
+#ifndef SPXI_NO_JPEG
+            case SPXI_FORMAT_JPEG:
+                ret = spxDecoderJpeg(decoder, NULL, 0);
+                break;
+#endif /* SPXI_NO_JPEG */
+#ifndef SPXI_NO_PNM
+            case SPXI_FORMAT_PNM: break;
+#endif /* SPXI_NO_PNM */
+#ifndef SPXI_NO_BMP
+            case SPXI_FORMAT_BMP: break;
+#endif /* SPXI_NO_BMP */
+            default:
+                fprintf(stderr, "spximg could not recognize format of pushed data\n");
+                ret = EXIT_FAILURE;
+        }
     }
 
-    info = png_create_info_struct(png);
-    if (!info || setjmp(png_jmpbuf(png))) {
-        fprintf(stderr, "spximg could not read image as PNG file: '%s'\n", path);
-        return img;
+#ifndef SPXI_NO_PNM
+    if (!ret && decoder->format == SPXI_FORMAT_PNM && decoder->state != SPXI_DECODE_BUFFER) {
+        ret = spxDecoderPnm(decoder);
     }
-
-    png_init_io(png, file);
-    png_read_info(png, info);
-    
-    colorType = png_get_color_type(png, info);
-    bitDepth = png_get_bit_depth(png, info);
-
-    img.width = png_get_image_width(png, info);
-    img.height = png_get_image_height(png, info);
-    img.channels = spxPngColorTypeToChannels(colorType);
-
-    if (bitDepth == 16) {
-        png_set_strip_16(png);
+#endif /* SPXI_NO_PNM */
+#ifndef SPXI_NO_BMP
+    if (!ret && decoder->format == SPXI_FORMAT_BMP) {
+        ret = spxDecoderBmp(decoder);
     }
+#endif /* SPXI_NO_BMP */
 
-    if (colorType == PNG_COLOR_TYPE_PALETTE) {
-        png_set_palette_to_rgb(png);
+    if (ret) {
+        fprintf(stderr, "spximg could not decode pushed data\n");
+        decoder->state = SPXI_DECODE_ERROR;
+        spxLimitsError = spxLimitsError ? spxLimitsError : SPXI_ERROR_DECODE;
+        return -1;
     }
+    return decoder->rows;
+}
 
-    if (colorType == PNG_COLOR_TYPE_GRAY && bitDepth < 8) {
-        png_set_expand_gray_1_2_4_to_8(png);
+Img2D spxImageDecoderPeek(const SpxImageDecoder* decoder, int* rows)
+{
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    if (rows) {
+        *rows = decoder && decoder->state != SPXI_DECODE_ERROR ? decoder->rows : 0;
     }
+    return decoder && decoder->state != SPXI_DECODE_ERROR ? decoder->image : image;
+}
 
-    if (png_get_valid(png, info, PNG_INFO_tRNS)) {
-        png_set_tRNS_to_alpha(png);
-        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
-        ++img.channels;
+Img2D spxImageDecoderFinish(SpxImageDecoder* decoder)
+{
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    if (!decoder || decoder->state == SPXI_DECODE_ERROR) {
+        return image;
     }
 
-    png_read_update_info(png, info);
-    colorType = png_get_color_type(png, info);
-
-    stride = img.channels * img.width;
-    assert(stride == (int)png_get_rowbytes(png, info));
-
-    rows = (uint8_t**)malloc(img.height * sizeof(uint8_t*));
-    img.pixbuf = (uint8_t*)malloc(img.height * stride);
-    
-    for (i = 0; i < img.height; i++) {
-        rows[i] = img.pixbuf + i * stride;
+    if (decoder->state == SPXI_DECODE_BUFFER) {
+        image = spxImageDecode(decoder->data, decoder->size, "<stream>", decoder->flags);
+    } else if (decoder->state == SPXI_DECODE_DONE || decoder->state == SPXI_DECODE_FINISH) {
+        image = decoder->image;
+        decoder->image.pixbuf = NULL;
+        if (decoder->transform != SPXI_TRANSFORM_NONE) {
+            Img2D tmp = spxImageTransform(image, decoder->transform);
+            spxImageFree(&image);
+            image = tmp;
+        }
+        image = spxImageLoadLayout(image, decoder->flags);
+    } else {
+        fprintf(stderr, "spximg pushed data ended before the image was complete\n");
+        spxLimitsError = SPXI_ERROR_DECODE;
     }
 
-    png_read_image(png, rows);
-
-    free(rows);
-    fclose(file);
-    return img;
+    decoder->state = SPXI_DECODE_ERROR;
+    return image;
 }
 
-int spxImageSavePng(const Img2D img, const char* path) 
+void spxImageDecoderClose(SpxImageDecoder* decoder)
 {
-    int i, stride;
-    uint8_t **rows, colorType;
-    png_structp png;
-    png_infop info;
-
-    FILE* file = fopen(path, "wb");
-    if (!file) {
-        fprintf(stderr, "spximg could not write file: '%s'\n", path);
-        return EXIT_FAILURE;
+    if (!decoder) {
+        return;
     }
 
-    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        fprintf(stderr, "spximg could not create PNG write struct\n");
-        return EXIT_FAILURE;
+#ifndef SPXI_NO_PNG
+    if (decoder->png) {
+        png_destroy_read_struct(&decoder->png, &decoder->info, NULL);
     }
-
-    info = png_create_info_struct(png);
-    if (!info || setjmp(png_jmpbuf(png))) {
-        fprintf(stderr, "spximg could not write image as PNG file: '%s'\n", path);
-        return EXIT_FAILURE;
+#endif /* SPXI_NO_PNG */
+#ifndef SPXI_NO_JPEG
+    if (decoder->created) {
+        jpeg_destroy_decompress(&decoder->jpeg);
     }
-
-    colorType = spxPngChannelsToColorType(img.channels);
-
-    png_init_io(png, file);
-    png_set_IHDR(
-        png, info, img.width, img.height, SPXI_BIT_DEPTH, colorType, 
-        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT
-    );
-
-    stride = img.width * img.channels;
-    rows = (uint8_t**)malloc(img.height * sizeof(uint8_t*));
-    
-    for (i = 0; i < img.height; i++) {
-        rows[i] = img.pixbuf + i * stride;
+#endif /* SPXI_NO_JPEG */
+#ifndef SPXI_NO_BMP
+    if (decoder->format == SPXI_FORMAT_BMP) {
+        SPXI_FREE((void*)decoder->bmp.palette);
     }
+#endif /* SPXI_NO_BMP */
 
-    png_write_info(png, info);
-    png_write_image(png, rows);
-    
-    png_write_end(png, NULL);
-    free(rows);
-    return fclose(file);
+    spxImageFree(&decoder->image);
+    SPXI_FREE(decoder->data);
+    SPXI_FREE(decoder);
 }
 
-#endif /* SPXI_NO_PNG */
-#ifndef SPXI_NO_JPEG
-
-#include <jpeglib.h>
+/* Asynchronous Batch Loading */
 
-#ifndef SPXI_JPEG_QUALITY 
-#define SPXI_JPEG_QUALITY 100
-#endif /* SPXI_JPEG_QUALITY */
+#if defined __unix__ || defined __APPLE__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif /* __unix__ */
 
-Img2D spxImageLoadJpeg(const char* path)
-{
-    int i;
-    uint8_t* fbuffer;
-	size_t fsize, stride;
-	Img2D img = {NULL, 0, 0, 0};
-    
-    struct jpeg_decompress_struct info;
-	struct jpeg_error_mgr err;
+#if defined SPXI_IO_URING && defined __linux__
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#else
+#undef SPXI_IO_URING
+#endif /* SPXI_IO_URING */
 
-	FILE* file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "spximg could not open file: '%s'\n", path);
-        return img;
-    } 
+#ifndef SPXI_BATCH_DEPTH
+#define SPXI_BATCH_DEPTH        4
+#endif /* SPXI_BATCH_DEPTH */
 
-    fseek(file, 0, SEEK_END);
-    fsize = ftell(file);
-    fbuffer = (uint8_t*)malloc(fsize);
-    
-    fseek(file, 0, SEEK_SET);
-	fread(fbuffer, fsize, sizeof(uint8_t), file);
-	fclose(file);  
+#define SPXI_BATCH_SYNC         0
+#define SPXI_BATCH_THREADS      1
+#define SPXI_BATCH_URING        2
 
-	info.err = jpeg_std_error(&err);	
-	jpeg_create_decompress(&info);
-	jpeg_mem_src(&info, fbuffer, fsize);
+#define SPXI_URING_CHUNK        (1 << 30)
 
-	if (jpeg_read_header(&info, 1) != 1) {
-		fprintf(stderr, "spximg could not read image as JPEG file: '%s'\n", path);
-		return img;
-	}
+typedef struct SpxBatchSlot {
+    uint8_t* data;
+    size_t size;
+    size_t done;
+    int fd;
+    int ready;
+} SpxBatchSlot;
+
+#ifdef SPXI_IO_URING
+
+typedef struct SpxUring {
+    int fd;
+    unsigned pending;
+    unsigned *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void *sqring, *cqring;
+    size_t sqsize, cqsize, sqesize;
+} SpxUring;
+
+static void spxUringFree(SpxUring* ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqesize);
+    }
+    if (ring->cqring && ring->cqring != ring->sqring) {
+        munmap(ring->cqring, ring->cqsize);
+    }
+    if (ring->sqring) {
+        munmap(ring->sqring, ring->sqsize);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(SpxUring));
+    ring->fd = -1;
+}
 
-	jpeg_start_decompress(&info);
+/* set up a ring through the raw system calls so no liburing is needed */
+static int spxUringInit(SpxUring* ring, const unsigned entries)
+{
+    struct io_uring_params params;
+    uint8_t *sq, *cq;
 
-    img.width = info.output_width;
-	img.height = info.output_height;
-	img.channels = info.output_components;
+    memset(ring, 0, sizeof(SpxUring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return EXIT_FAILURE;
+    }
 
-	stride = img.width * img.channels;
-	img.pixbuf = (uint8_t*)malloc(img.height * stride);
+    ring->sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesize = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqsize = ring->cqsize = ring->sqsize > ring->cqsize ? ring->sqsize : ring->cqsize;
+    }
 
-    for (i = 0; i < img.height; ++i) {
-        uint8_t* rowptr = img.pixbuf + i * stride;
-		jpeg_read_scanlines(&info, &rowptr, 1);
-	}
+    ring->sqring = mmap(NULL, ring->sqsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqring == MAP_FAILED) {
+        ring->sqring = NULL;
+        spxUringFree(ring);
+        return EXIT_FAILURE;
+    }
 
-	jpeg_finish_decompress(&info);
-	jpeg_destroy_decompress(&info);
-	free(fbuffer);
+    ring->cqring = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sqring :
+        mmap(NULL, ring->cqsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+            ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesize, 
+        PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->cqring == MAP_FAILED || (void*)ring->sqes == MAP_FAILED) {
+        ring->cqring = ring->cqring == MAP_FAILED ? NULL : ring->cqring;
+        ring->sqes = (void*)ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+        spxUringFree(ring);
+        return EXIT_FAILURE;
+    }
 
-    return img;
+    sq = (uint8_t*)ring->sqring;
+    cq = (uint8_t*)ring->cqring;
+    ring->sqtail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqmask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqarray = (unsigned*)(sq + params.sq_off.array);
+    ring->cqhead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqtail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqmask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return EXIT_SUCCESS;
 }
 
-int spxImageSaveJpeg(const Img2D img, const char* path, const int quality) 
+static void spxUringRead(SpxUring* ring, const int fd, void* dst, 
+    const unsigned size, const size_t offset, const int user)
 {
-    FILE* file;
-    int i, stride;
-    struct jpeg_compress_struct info;
-    struct jpeg_error_mgr err;
+    unsigned tail = *ring->sqtail, index = tail & *ring->sqmask;
+    struct io_uring_sqe* sqe = ring->sqes + index;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(size_t)dst;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t)user;
+    ring->sqarray[index] = index;
+    __atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->pending;
+}
 
-    if (img.channels == 2 || img.channels == 4) {
-        Img2D tmp = spxImageReshape(img, img.channels - 1);
-        i = spxImageSaveJpeg(tmp, path, quality);
-        spxImageFree(&tmp);
-        return i;
+static void spxUringSubmit(SpxUring* ring, const unsigned wait)
+{
+    if (ring->pending || wait) {
+        syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        ring->pending = 0;
     }
+}
 
-    assert(img.channels == 1 || img.channels == 3);
-    info.err = jpeg_std_error(&err);
-    jpeg_create_compress(&info);
+#endif /* SPXI_IO_URING */
+
+struct SpxImageBatch {
+    const char** paths;
+    SpxBatchSlot* slots;
+    int count;
+    int depth;
+    int next;
+    int issued;
+    int mode;
+#ifdef SPXI_IO_URING
+    SpxUring ring;
+    int inflight;
+#endif /* SPXI_IO_URING */
+#ifdef SPXI_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t threads[SPXI_THREAD_MAX];
+    int threadcount;
+    int stop;
+#endif /* SPXI_THREADS */
+};
 
-    file = fopen(path, "wb");
+/* read a whole file without touching statistics, so any thread can */
+static uint8_t* spxFileLoad(const char* path, size_t* size)
+{
+    long n;
+    uint8_t* data = NULL;
+    FILE* file = fopen(path, "rb");
+    *size = 0;
     if (!file) {
-        fprintf(stderr, "spximg could not write image as JPEG file: '%s'\n", path);
-        return EXIT_FAILURE;
+        return NULL;
     }
 
-    jpeg_stdio_dest(&info, file);
-
-    info.image_width = img.width;
-    info.image_height = img.height;
-    info.input_components = img.channels;
-    info.in_color_space = img.channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
-
-    jpeg_set_defaults(&info);
-    jpeg_set_quality(&info, quality, 1);
-    jpeg_start_compress(&info, 1);
-
-    stride = img.width * img.channels;
-    for (i = 0; i < img.height; ++i) {
-        uint8_t* rowptr = img.pixbuf + i * stride;
-        jpeg_write_scanlines(&info, &rowptr, 1);
+    if (!fseek(file, 0, SEEK_END) && (n = ftell(file)) >= 0 && !fseek(file, 0, SEEK_SET)) {
+        data = (uint8_t*)SPXI_MALLOC(n ? n : 1);
+        if (data && fread(data, 1, n, file) != (size_t)n) {
+            SPXI_FREE(data);
+            data = NULL;
+        }
+        *size = (size_t)n;
     }
 
-    jpeg_finish_compress(&info);
-    jpeg_destroy_compress(&info);
-    return fclose(file);
+    fclose(file);
+    return data;
 }
 
-#endif /* SPXI_NO_JPEG */
-#ifndef SPXI_NO_PNM
-
-#define LINESIZE 256
-
-static void spxImageLoadPbmNormalize(Img2D* img, int stride)
+/* hint the kernel to start reading a file we will soon need */
+static void spxFilePrefetch(const char* path)
 {
-    int x, y, i, j, dif;
-    stride <<= 3;
-    dif = stride - img->width;
-    i = img->height * img->width - 1;
-    for (y = img->height - 1; y >= 0; --y) {
-        j = (y + 1) * stride - dif - 1;
-        for (x = img->width - 1; x >= 0; --x) {
-            img->pixbuf[i] = !((img->pixbuf[j / 8] >> (7 - (j % 8))) & 0x01) * 0xFF;
-            --i, --j;
-        }
+#ifdef POSIX_FADV_WILLNEED
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
     }
+#else
+    (void)path;
+#endif /* POSIX_FADV_WILLNEED */
 }
 
-static void spxImageLoadPnmNormalize(Img2D* img, const int bitdepth)
+#ifdef SPXI_IO_URING
+
+static void spxBatchUringStart(SpxImageBatch* batch, const int index)
 {
-    int i;
-    const int size = img->width * img->height * img->channels;
-    const int bitsize = 1 + (bitdepth > 0xFF);
+    struct stat st;
+    SpxBatchSlot* slot = batch->slots + index % batch->depth;
     
-    if (bitsize == 2) {
-        for (i = 0; i < size; ++i) {
-            int n = *(((uint16_t*)img->pixbuf) + i);
-            img->pixbuf[i] = (uint8_t)(0xFF * n / bitdepth);
-        }
-        img->pixbuf = realloc(img->pixbuf, size);
-    } else {
-        for (i = 0; i < size; ++i) {
-            int n = img->pixbuf[i];
-            img->pixbuf[i] = (uint8_t)(0xFF * n / bitdepth);
+    slot->fd = open(batch->paths[index], O_RDONLY);
+    if (slot->fd < 0 || fstat(slot->fd, &st) || 
+        !(slot->data = (uint8_t*)SPXI_MALLOC(st.st_size ? st.st_size : 1))) {
+        if (slot->fd >= 0) {
+            close(slot->fd);
         }
+        slot->ready = 1;
+        return;
     }
-}
-
-static Img2D spxImageLoadPnmBinary(FILE* file, const int width,
-    const int height, const int channels, const int bitdepth)
-{
-    Img2D image;
-    int bitsize = 1 + (bitdepth > 0xFF);
-    size_t size = width * height * channels * bitsize;
-
-    image.pixbuf = (uint8_t*)malloc(size);
-    image.width = width;
-    image.height = height;
-    image.channels = channels;
 
-    if (!bitdepth) {
-        int i, stride = (width >> 3) + !!(width % 8);
-        for (i = 0; i < image.height; ++i) {
-            fread(image.pixbuf + i * stride, stride, sizeof(uint8_t), file);
-        }
-        spxImageLoadPbmNormalize(&image, stride);
-    } else {
-        fread(image.pixbuf, size, sizeof(uint8_t), file);
-        if (bitdepth != 0xFF) {
-            spxImageLoadPnmNormalize(&image, bitdepth);
-        }
+    slot->size = (size_t)st.st_size;
+    slot->done = 0;
+    if (!slot->size) {
+        close(slot->fd);
+        slot->ready = 1;
+        return;
     }
 
-    return image;
+    spxUringRead(&batch->ring, slot->fd, slot->data, 
+        slot->size < SPXI_URING_CHUNK ? (unsigned)slot->size : SPXI_URING_CHUNK, 0, index);
+    ++batch->inflight;
 }
 
-static Img2D spxImageLoadPnmASCII(FILE* file, char* line, 
-    const int width, const int height, const int channels, const int bitdepth)
+static void spxBatchUringComplete(SpxImageBatch* batch)
 {
-    static const char* div = " \t\n\r";
-    
-    Img2D image;
-    uint8_t* end, *p;
-    char *tok, *key = NULL;
-    const size_t size = width * height * channels;
-
-    image.pixbuf = (uint8_t*)malloc(size);
-    image.width = width;
-    image.height = height;
-    image.channels = channels;
-    p = image.pixbuf;
+    SpxUring* ring = &batch->ring;
+    unsigned head = *ring->cqhead;
+    unsigned tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe* cqe = ring->cqes + (head & *ring->cqmask);
+        int index = (int)cqe->user_data, res = cqe->res;
+        SpxBatchSlot* slot = batch->slots + index % batch->depth;
+
+        --batch->inflight;
+        if (res > 0 && slot->done + res < slot->size) {
+            size_t left = slot->size - (slot->done += res);
+            spxUringRead(ring, slot->fd, slot->data + slot->done, 
+                left < SPXI_URING_CHUNK ? (unsigned)left : SPXI_URING_CHUNK, 
+                slot->done, index);
+            ++batch->inflight;
+            continue;
+        }
 
-    for (end = p + size; p != end; ++p) {
-        tok = strtok(key, div);
-        key = NULL;
-        if (!tok) {
-            if (!(key = fgets(line, LINESIZE, file))) {
-                spxImageFree(&image);
-                return image;
-            }
-            --p;
+        close(slot->fd);
+        if (res == -EINVAL || res == -EOPNOTSUPP) {
+            /* kernels before 5.6 have no plain read operation */
+            SPXI_FREE(slot->data);
+            slot->data = spxFileLoad(batch->paths[index], &slot->size);
+        } else if (res < 0) {
+            SPXI_FREE(slot->data);
+            slot->data = NULL;
         } else {
-            *p = (uint8_t)(0xFF * atoi(tok) / bitdepth);
+            slot->size = slot->done + res;
         }
+        slot->ready = 1;
     }
 
-    return image;
+    __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
 }
 
-static Img2D spxImageLoadPbmASCII(FILE* file, const int width, const int height)
-{
-    Img2D image;
-    int c, i = 0;
-    const size_t size = width * height;
+#endif /* SPXI_IO_URING */
 
-    image.pixbuf = (uint8_t*)malloc(size);
-    image.width = width;
-    image.height = height;
-    image.channels = 1;
+#ifdef SPXI_THREADS
 
-    while ((c = fgetc(file)) != EOF) {
-        if (c == '0' || c == '1') {
-            image.pixbuf[i++] = 0xFF * (c == '0');
+static void* spxBatchReader(void* data)
+{
+    SpxImageBatch* batch = (SpxImageBatch*)data;
+    pthread_mutex_lock(&batch->lock);
+    while (!batch->stop && batch->issued < batch->count) {
+        int index = batch->issued;
+        SpxBatchSlot* slot = batch->slots + index % batch->depth;
+        uint8_t* buf;
+        size_t size = 0;
+
+        if (index >= batch->next + batch->depth) {
+            pthread_cond_wait(&batch->cond, &batch->lock);
+            continue;
         }
-    }
 
-    return image;
+        ++batch->issued;
+        pthread_mutex_unlock(&batch->lock);
+        buf = spxFileLoad(batch->paths[index], &size);
+        pthread_mutex_lock(&batch->lock);
+        slot->data = buf;
+        slot->size = size;
+        slot->ready = 1;
+        pthread_cond_broadcast(&batch->cond);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
 }
 
-Img2D spxImageLoadPnm(const char* path)
+#endif /* SPXI_THREADS */
+
+/* queue reads for every file inside the window [next, next + depth) */
+static void spxBatchIssue(SpxImageBatch* batch)
 {
-    static const char* div = " \t\n\r";
-    
-    int params[3] = {0}, paramsize, paramcount = 0, filepos = 0;
-    char N, line[LINESIZE], *tok, *key = NULL;
-    Img2D image = {NULL, 0, 0, 0};
-    
-    FILE* file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "spximg could not open file: %s\n", path);
-        return image;
+    while (batch->issued < batch->count && batch->issued < batch->next + batch->depth) {
+        int index = batch->issued++;
+#ifdef SPXI_IO_URING
+        if (batch->mode == SPXI_BATCH_URING) {
+            spxBatchUringStart(batch, index);
+            continue;
+        }
+#endif /* SPXI_IO_URING */
+        spxFilePrefetch(batch->paths[index]);
     }
 
-    if (!fgets(line, LINESIZE, file)) {
-        fprintf(stderr, "spximg could not parse file: %s\n", path);
-        goto spxImageLoadPnmEnd;
+#ifdef SPXI_IO_URING
+    if (batch->mode == SPXI_BATCH_URING) {
+        spxUringSubmit(&batch->ring, 0);
     }
+#endif /* SPXI_IO_URING */
+}
 
-    if (line[0] != 0x50) {
-        fprintf(stderr, "spximg: file is not PNM file format: %s\n", path);
-        goto spxImageLoadPnmEnd;
+/* load paths in order while reading up to depth files ahead of the
+ * decoder, with io_uring when SPXI_IO_URING is defined, reader threads
+ * with SPXI_THREADS and kernel read ahead hints otherwise. paths must
+ * outlive the batch */
+SpxImageBatch* spxImageBatchOpen(const char** paths, int count, int depth)
+{
+    int i;
+    SpxImageBatch* batch;
+
+    depth = depth > 0 ? depth : SPXI_BATCH_DEPTH;
+    depth = depth < count ? depth : count > 0 ? count : 1;
+    batch = (SpxImageBatch*)SPXI_MALLOC(sizeof(SpxImageBatch));
+    if (!batch) {
+        return NULL;
     }
-    
-    N = line[1];
-    if (N < '1' || N > '6') {
-        fprintf(stderr, "spximg does not support this kind of PNM: %s: P%c\n", path, N);
-        goto spxImageLoadPnmEnd;
+
+    memset(batch, 0, sizeof(SpxImageBatch));
+    batch->slots = (SpxBatchSlot*)SPXI_MALLOC(depth * sizeof(SpxBatchSlot));
+    if (!batch->slots) {
+        SPXI_FREE(batch);
+        return NULL;
     }
 
-    paramsize = (N == '1' || N == '4') ? 2 : 3;
-    tok = strtok(line, div);
+    memset(batch->slots, 0, depth * sizeof(SpxBatchSlot));
+    batch->paths = paths;
+    batch->count = count > 0 ? count : 0;
+    batch->depth = depth;
+    batch->mode = SPXI_BATCH_SYNC;
 
-    while (paramcount < paramsize) {
-        tok = strtok(key, div);
-        key = NULL;
-        if (!tok || tok[0] == '#') {
-            filepos = ftell(file);
-            if (!(key = fgets(line, LINESIZE, file))) {
-                fprintf(stderr, "spximg could not parse complete PNM in file: %s\n",
-                    path
-                );
-                goto spxImageLoadPnmEnd;
+#ifdef SPXI_IO_URING
+    if (!spxUringInit(&batch->ring, depth)) {
+        batch->mode = SPXI_BATCH_URING;
+    }
+#endif /* SPXI_IO_URING */
+#ifdef SPXI_THREADS
+    if (batch->mode == SPXI_BATCH_SYNC) {
+        batch->mode = SPXI_BATCH_THREADS;
+        pthread_mutex_init(&batch->lock, NULL);
+        pthread_cond_init(&batch->cond, NULL);
+        for (i = 0; i < depth && i < SPXI_THREAD_MAX; ++i) {
+            if (pthread_create(batch->threads + i, NULL, &spxBatchReader, batch)) {
+                break;
             }
-        } else if (!isdigit(tok[0])) {
-            fprintf(stderr, "spximg detected invalid token in PNM header: %s: %s\n",
-                path, tok
-            );
-            goto spxImageLoadPnmEnd;
-        } else {
-            params[paramcount++] = atoi(tok);
         }
+        batch->threadcount = i;
+        if (!i) {
+            pthread_cond_destroy(&batch->cond);
+            pthread_mutex_destroy(&batch->lock);
+            batch->mode = SPXI_BATCH_SYNC;
+        }
+    }
+#endif /* SPXI_THREADS */
+
+    (void)i;
+    if (batch->mode != SPXI_BATCH_THREADS) {
+        spxBatchIssue(batch);
+    }
+
+    return batch;
+}
+
+/* decode the next image of the batch into image, returns its index in
+ * paths or -1 once every path was returned */
+int spxImageBatchNext(SpxImageBatch* batch, Img2D* image, int flags)
+{
+    int index = batch->next;
+    SpxBatchSlot* slot = batch->slots + index % batch->depth;
+    uint8_t* data;
+    size_t size;
+
+    image->pixbuf = image->palette = NULL;
+    image->width = image->height = image->channels = image->depth = image->layout = 0;
+    if (index >= batch->count) {
+        return -1;
     }
 
-    for (paramcount = 0; paramcount < paramsize; ++paramcount) {
-         if (!params[paramcount]) {
-            fprintf( stderr, 
-                "spximg detected illegal PNM with zero value in: %s\n", path
-            );
-            goto spxImageLoadPnmEnd;
+#ifdef SPXI_THREADS
+    if (batch->mode == SPXI_BATCH_THREADS) {
+        pthread_mutex_lock(&batch->lock);
+        while (!slot->ready) {
+            pthread_cond_wait(&batch->cond, &batch->lock);
         }
     }
+#endif /* SPXI_THREADS */
+#ifdef SPXI_IO_URING
+    while (batch->mode == SPXI_BATCH_URING && !slot->ready) {
+        spxUringSubmit(&batch->ring, 1);
+        spxBatchUringComplete(batch);
+    }
+#endif /* SPXI_IO_URING */
+    if (batch->mode == SPXI_BATCH_SYNC) {
+        slot->data = spxFileLoad(batch->paths[index], &slot->size);
+    }
 
-    switch (N) {
-        case '1':
-            fseek(file, filepos + (tok - line) + strlen(tok) + 1, SEEK_SET);
-            image = spxImageLoadPbmASCII(file, params[0], params[1]);
-            break;
-        case '2':
-        case '3':
-            image = spxImageLoadPnmASCII(
-                file, line, params[0], params[1], (N == '3') ? 3 : 1, params[2]
-            );
-            break;
-        default:
-            fseek(file, filepos + (tok - line) + strlen(tok) + 1, SEEK_SET);
-            image = spxImageLoadPnmBinary(
-                file, params[0], params[1], (N == '6') ? 3 : 1, params[2]
-            );
+    data = slot->data;
+    size = slot->size;
+    memset(slot, 0, sizeof(SpxBatchSlot));
+    ++batch->next;
+
+    /* refill the window before decoding so reads overlap with it */
+#ifdef SPXI_THREADS
+    if (batch->mode == SPXI_BATCH_THREADS) {
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->lock);
+    }
+#endif /* SPXI_THREADS */
+    if (batch->mode != SPXI_BATCH_THREADS) {
+        spxBatchIssue(batch);
     }
 
-    if (!image.pixbuf) {
-        fprintf(stderr,
-             "spximg detected incomplete or corrupted PNM file: %s\n", path
-        );
+    if (!data) {
+        fprintf(stderr, "spximg could not open file: '%s'\n", batch->paths[index]);
+        return index;
     }
 
-spxImageLoadPnmEnd:
-    fclose(file);
-    return image;
+    *image = spxImageDecode(data, size, batch->paths[index], flags);
+    SPXI_FREE(data);
+    return index;
 }
 
-int spxImageSavePnm(const Img2D img, const char* path)
+void spxImageBatchClose(SpxImageBatch* batch)
 {
-    FILE* file;
-    
-    if (img.channels != 3) {
-        int ret;
-        Img2D tmp = spxImageReshape(img, 3);
-        ret = spxImageSavePnm(tmp, path);
-        spxImageFree(&tmp);
-        return ret;
+    int i;
+    if (!batch) {
+        return;
     }
 
-    file = fopen(path, "w");
-    if (!file) {
-        fprintf(stderr, "spximg could not write file: '%s'\n", path);
-        return EXIT_FAILURE;
+#ifdef SPXI_THREADS
+    if (batch->mode == SPXI_BATCH_THREADS) {
+        pthread_mutex_lock(&batch->lock);
+        batch->stop = 1;
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->lock);
+        for (i = 0; i < batch->threadcount; ++i) {
+            pthread_join(batch->threads[i], NULL);
+        }
+        pthread_cond_destroy(&batch->cond);
+        pthread_mutex_destroy(&batch->lock);
     }
+#endif /* SPXI_THREADS */
+#ifdef SPXI_IO_URING
+    if (batch->mode == SPXI_BATCH_URING) {
+        while (batch->inflight > 0) {
+            spxUringSubmit(&batch->ring, 1);
+            spxBatchUringComplete(batch);
+        }
+        spxUringFree(&batch->ring);
+    }
+#endif /* SPXI_IO_URING */
 
-    fprintf(file, "P6 %d %d 255\n", img.width, img.height);
-    fwrite(img.pixbuf, img.width * img.height, img.channels, file);
-    return fclose(file);
+    for (i = 0; i < batch->depth; ++i) {
+        if (batch->slots[i].data) {
+            SPXI_FREE(batch->slots[i].data);
+        }
+    }
+
+    SPXI_FREE(batch->slots);
+    SPXI_FREE(batch);
 }
 
-#endif /* SPXI_NO_PNM */
-#ifndef SPXI_NO_BMP
+/* Decoded Image Cache */
 
-Img2D spxImageLoadBmp(const char* path)
-{
-    FILE* file;
-    uint16_t id;
-    int dif, stride, rowsize;
-    Img2D image = {NULL, 0, 0, 0};
-    struct BmpHeader {
-        uint32_t size;
-        uint16_t reserved1, reserved2;
-        uint32_t offset; 
-        struct BmpDibHeader {
-            uint32_t size;
-            int32_t width, height;
-            uint16_t planes, bpp;
-            uint32_t compression, imgsize;
-            int32_t res[2];
-            uint32_t colors[2];
-        } dib;
-        char padding[256];
-    } bmp;
+#ifdef SPXI_CACHE
 
-    file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "spximg could not open file: %s\n", path);
-        return image;
-    }
+#ifndef SPXI_CACHE_BUDGET
+#define SPXI_CACHE_BUDGET       (256 << 20)
+#endif /* SPXI_CACHE_BUDGET */
 
-    if (!fread(&id, sizeof(id), 1, file)) {
-        fprintf(stderr, "spximg could not parse file: %s\n", path);
-        goto spxImageLoadBmpEnd;
-    }
+#ifndef SPXI_CACHE_SHARDS
+#define SPXI_CACHE_SHARDS       16
+#endif /* SPXI_CACHE_SHARDS */
 
-    if (id != 0x4D42) {
-        fprintf(stderr, "spximg: file is not BMP format: %s\n", path);
-        goto spxImageLoadBmpEnd;
-    }
+#define SPXI_CACHE_BUCKETS      64
 
-    if (!fread(&bmp, offsetof(struct BmpHeader, dib), 1, file)) {
-        fprintf(stderr, "spximg could not parse file: %s\n", path);
-        goto spxImageLoadBmpEnd;
+/* entries hold their pixels and path in the same block, so the pixbuf
+ * of a cached image leads back to its entry, shared buffers count one
+ * reference for the cache and one for its holders so none of them
+ * ever writes in place */
+typedef struct SpxCacheEntry {
+    struct SpxCacheEntry* next;
+    struct SpxCacheEntry* newer;
+    struct SpxCacheEntry* older;
+    const char* path;
+    Img2D image;
+    size_t bytes;
+    unsigned long hash;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    long mtime;
+    long mtimensec;
+    int channels;
+    int shard;
+    int refs;
+} SpxCacheEntry;
+
+/* nanoseconds of the modification time where struct stat has them, a
+ * file rewritten at the same size within the granularity of the file
+ * system timestamps is still served from the cache */
+#if defined __APPLE__ && (!defined _POSIX_C_SOURCE || defined _DARWIN_C_SOURCE)
+#define spxCacheMtimeNsec(st) ((long)(st).st_mtimespec.tv_nsec)
+#elif defined __APPLE__
+#define spxCacheMtimeNsec(st) ((long)(st).st_mtimensec)
+#elif defined __unix__ && (defined _GNU_SOURCE || defined _DEFAULT_SOURCE ||\
+    (defined _POSIX_C_SOURCE && _POSIX_C_SOURCE >= 200809L) ||\
+    (defined _XOPEN_SOURCE && _XOPEN_SOURCE >= 700))
+#define spxCacheMtimeNsec(st) ((long)(st).st_mtim.tv_nsec)
+#else
+#define spxCacheMtimeNsec(st) 0L
+#endif /* __APPLE__ */
+
+#ifdef SPXI_SHARED
+#define SPXI_CACHE_HEADER       (sizeof(SpxCacheEntry) + sizeof(SpxBuffer))
+#define spxCacheEntryOf(pixbuf) ((SpxCacheEntry*)spxPixbufBuffer(pixbuf) - 1)
+#define spxCacheHeld(entry) (entry->refs ||\
+    spxAtomicAdd(&spxPixbufBuffer(entry->image.pixbuf)->refs, 0) > 2)
+#else
+#define SPXI_CACHE_HEADER       sizeof(SpxCacheEntry)
+#define spxCacheEntryOf(pixbuf) ((SpxCacheEntry*)(pixbuf) - 1)
+#define spxCacheHeld(entry) (entry->refs)
+#endif /* SPXI_SHARED */
+
+typedef struct SpxCacheShard {
+#ifdef SPXI_THREADS
+    pthread_mutex_t lock;
+#endif /* SPXI_THREADS */
+    SpxCacheEntry** buckets;
+    SpxCacheEntry* newest;
+    SpxCacheEntry* oldest;
+    size_t bytes;
+    size_t budget;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long count;
+    unsigned long bucketcount;
+} SpxCacheShard;
+
+static SpxCacheShard spxCacheShards[SPXI_CACHE_SHARDS];
+
+#ifdef SPXI_THREADS
+static pthread_once_t spxCacheOnce = PTHREAD_ONCE_INIT;
+#define spxCacheLock(shard) pthread_mutex_lock(&(shard)->lock)
+#define spxCacheUnlock(shard) pthread_mutex_unlock(&(shard)->lock)
+#else
+static int spxCacheOnce = 0;
+#define spxCacheLock(shard) (void)(shard)
+#define spxCacheUnlock(shard) (void)(shard)
+#endif /* SPXI_THREADS */
+
+static void spxCacheInit(void)
+{
+    int i;
+    for (i = 0; i < SPXI_CACHE_SHARDS; ++i) {
+#ifdef SPXI_THREADS
+        pthread_mutex_init(&spxCacheShards[i].lock, NULL);
+#endif /* SPXI_THREADS */
+        spxCacheShards[i].budget = (size_t)SPXI_CACHE_BUDGET / SPXI_CACHE_SHARDS;
     }
+}
 
-    if (!fread(&bmp.dib, sizeof(bmp.dib.size), 1, file)) {
-        fprintf(stderr, "spximg: file is not BMP format: %s\n", path);
-        goto spxImageLoadBmpEnd;
+static void spxCacheStart(void)
+{
+#ifdef SPXI_THREADS
+    pthread_once(&spxCacheOnce, &spxCacheInit);
+#else
+    if (!spxCacheOnce) {
+        spxCacheOnce = 1;
+        spxCacheInit();
     }
+#endif /* SPXI_THREADS */
+}
 
-    if (!fread(&bmp.dib.width, bmp.dib.size - sizeof(bmp.dib.size), 1, file)) {
-        fprintf(stderr, "spximg could not parse file: %s\n", path);
-        goto spxImageLoadBmpEnd;
+/* fill the key of an entry from the file as it is on disk right now */
+static int spxCacheKey(SpxCacheEntry* key, const char* path, const int channels)
+{
+    const unsigned char* c;
+    unsigned long hash = 2166136261UL;
+#if defined __unix__ || defined __APPLE__
+    struct stat st;
+    if (stat(path, &st)) {
+        return EXIT_FAILURE;
     }
 
-    if (bmp.dib.planes != 1 || bmp.dib.bpp == 0 || 
-        ((bmp.dib.bpp != 32 && bmp.dib.bpp != 16) && bmp.dib.compression != 0)) {
-        fprintf(stderr, "spximg does not support this kind of BMP file: %s\n", path);
-        goto spxImageLoadBmpEnd;
+    key->device = (uint64_t)st.st_dev;
+    key->inode = (uint64_t)st.st_ino;
+    key->size = (uint64_t)st.st_size;
+    key->mtime = (long)st.st_mtime;
+    key->mtimensec = spxCacheMtimeNsec(st);
+#else
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return EXIT_FAILURE;
     }
 
-    rowsize = bmp.dib.width * bmp.dib.bpp;
-    for (stride = (rowsize >> 3) + !!(rowsize % 8); stride % 4; ++stride);
+    fseek(file, 0, SEEK_END);
+    key->device = key->inode = 0;
+    key->size = (uint64_t)ftell(file);
+    key->mtime = key->mtimensec = 0;
+    fclose(file);
+#endif /* __unix__ */
 
-    assert(ftell(file) == 14 + bmp.dib.size);
+    for (c = (const unsigned char*)path; *c; ++c) {
+        hash = ((hash ^ *c) * 16777619UL) & 0xFFFFFFFFUL;
+    }
 
-    image.width = bmp.dib.width;
-    image.height = bmp.dib.height;
+    hash ^= (unsigned long)(key->inode * 2654435761UL + key->size);
+    hash ^= (unsigned long)key->mtime * 40503UL + (unsigned long)key->mtimensec;
+    hash ^= (unsigned long)channels;
+    key->hash = hash & 0xFFFFFFFFUL;
+    key->path = path;
+    key->channels = channels;
+    key->shard = (int)(key->hash % SPXI_CACHE_SHARDS);
+    return EXIT_SUCCESS;
+}
 
-    if (bmp.dib.bpp <= 8 && (bmp.dib.compression == 0 || bmp.dib.compression == 3)) {
-        /* remove scanline, read into pixelbuffer */
-        uint8_t* palette, *scanline;
-        struct bitmask { int r, g, b, a; } bitmask, offset = {0}, maskdif = {0};
-        int x, y, i, j, div, colorcount, palette_size;
-        dif = bmp.offset - ftell(file);
-        palette_size = bmp.dib.colors[0] ? bmp.dib.colors[0] << 2 : dif;
+static SpxCacheEntry** spxCacheFind(SpxCacheShard* shard, const SpxCacheEntry* key)
+{
+    SpxCacheEntry** entry;
+    if (!shard->bucketcount) {
+        return NULL;
+    }
 
-        if (bmp.dib.size > 40) {
-            bitmask = *(struct bitmask*)bmp.padding;
-        } else {
-            struct bitmask bm = {0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000};
-            bitmask = bm;
+    entry = shard->buckets + (key->hash / SPXI_CACHE_SHARDS) % shard->bucketcount;
+    for (; *entry; entry = &(*entry)->next) {
+        const SpxCacheEntry* e = *entry;
+        if (e->hash == key->hash && e->inode == key->inode &&
+            e->device == key->device && e->size == key->size &&
+            e->mtime == key->mtime && e->mtimensec == key->mtimensec &&
+            e->channels == key->channels &&
+            !strcmp(e->path, key->path)) {
+            break;
         }
-        
-        while (!((bitmask.r >> offset.r) & 0x01)) ++offset.r;
-        while (!((bitmask.g >> offset.g) & 0x01)) ++offset.g;
-        while (!((bitmask.b >> offset.b) & 0x01)) ++offset.b;
-        while ((bitmask.r >> (offset.r + maskdif.r)) & 0x01) ++maskdif.r;
-        while ((bitmask.g >> (offset.g + maskdif.g)) & 0x01) ++maskdif.g;
-        while ((bitmask.b >> (offset.b + maskdif.b)) & 0x01) ++maskdif.b;
-
-        maskdif.r = 8 - maskdif.r;
-        maskdif.g = 8 - maskdif.g;
-        maskdif.b = 8 - maskdif.b;
+    }
 
-        colorcount = palette_size >> 2;
-        if (bmp.dib.colors[0] > (1 << bmp.dib.bpp)) {
-            fprintf(stderr,
-                "spximg could not guess size of color pallete in BMP file: %s\n", path
-            );
-            goto spxImageLoadBmpEnd;
-        }
+    return entry;
+}
 
-        image.channels = 4;
-        image.pixbuf = malloc(image.width * image.height * 4);
-        palette = (uint8_t*)malloc(palette_size);
-        scanline = (uint8_t*)malloc(stride);
-        fread(palette, palette_size, 1, file);
+static void spxCacheUnlink(SpxCacheShard* shard, SpxCacheEntry* entry)
+{
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        shard->newest = entry->older;
+    }
 
-#if 1   /* FILL ALPHA WITH 0xFF FOR EASY DEBUGGING */
-        for (i = 0; i < colorcount; ++i) {
-            palette[i * 4 + 3] = 0xFF;
-        }
-#endif
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        shard->oldest = entry->newer;
+    }
+}
 
-        dif = bmp.offset - ftell(file);
-        if (dif) {
-            fseek(file, dif, SEEK_CUR);
-        }
-
-        div = 8 / bmp.dib.bpp;
-        for (y = 0; y < image.height; ++y) {
-            i = (image.height - y - 1) * image.width * 4;
-            fread(scanline, stride, 1, file);
-            for (x = 0; x < image.width; ++x) {
-                int ibyte, ibit = x % div, n = 0;
-                ibyte = x / div;
-                ibit *= bmp.dib.bpp;
-                for (j = 0; j < bmp.dib.bpp; ++j) {
-                    int bit = (scanline[ibyte] >> ((ibit + j))) & 0x01;
-                    n |= bit << j;
-                }
- 
-                n = *(int*)(palette + (n << 2));
-                image.pixbuf[i++] = ((n & bitmask.r) >> offset.r) << maskdif.r;
-                image.pixbuf[i++] = ((n & bitmask.g) >> offset.g) << maskdif.g;
-                image.pixbuf[i++] = ((n & bitmask.b) >> offset.b) << maskdif.b;
-                image.pixbuf[i++] = 0xff;
-            }
-        }
+static void spxCachePushNewest(SpxCacheShard* shard, SpxCacheEntry* entry)
+{
+    entry->newer = NULL;
+    entry->older = shard->newest;
+    if (shard->newest) {
+        shard->newest->newer = entry;
+    } else {
+        shard->oldest = entry;
+    }
+    shard->newest = entry;
+}
 
-        free(palette);
-        free(scanline);
-    } else if (bmp.dib.bpp == 24) {
-        uint8_t* scanline;
-        int x, y, i, n, linesize = image.width * 3;
-        dif = bmp.offset - ftell(file);
-        if (dif) {
-            fseek(file, dif, SEEK_CUR);
-        }
+/* double the buckets once chains average more than one entry */
+static void spxCacheGrow(SpxCacheShard* shard)
+{
+    unsigned long i, count = shard->bucketcount ? shard->bucketcount << 1 : SPXI_CACHE_BUCKETS;
+    SpxCacheEntry** buckets = (SpxCacheEntry**)SPXI_MALLOC(count * sizeof(SpxCacheEntry*));
+    if (!buckets) {
+        return;
+    }
 
-        image.channels = 3;
-        image.pixbuf = (uint8_t*)malloc(image.height * linesize);
-        scanline = (uint8_t*)malloc(stride);
-        
-        for (y = image.height - 1; y >= 0; --y) {
-            fread(scanline, stride, 1, file);
-            n = 0, i = y * linesize;
-            for (x = 0; x < image.width; ++x) {
-                image.pixbuf[i++] = scanline[n++ + 2];
-                image.pixbuf[i++] = scanline[n++];
-                image.pixbuf[i++] = scanline[n++ - 2];
-            }
+    memset(buckets, 0, count * sizeof(SpxCacheEntry*));
+    for (i = 0; i < shard->bucketcount; ++i) {
+        SpxCacheEntry* entry = shard->buckets[i], *next;
+        for (; entry; entry = next) {
+            SpxCacheEntry** bucket = buckets + (entry->hash / SPXI_CACHE_SHARDS) % count;
+            next = entry->next;
+            entry->next = *bucket;
+            *bucket = entry;
         }
+    }
 
-        free(scanline);
-    } else if (bmp.dib.bpp == 32 && bmp.dib.compression == 3) {
-        int x, y, i, n;
-        struct bitmask {
-            int r, g, b, a;
-        } bitmask, offset = {0, 0, 0, 0};
-
-        bitmask = *(struct bitmask*)bmp.padding;
-        while (!((bitmask.r >> offset.r) & 1)) ++offset.r;
-        while (!((bitmask.g >> offset.g) & 1)) ++offset.g;
-        while (!((bitmask.b >> offset.b) & 1)) ++offset.b;
-        while (!((bitmask.a >> offset.a) & 1)) ++offset.a;
-
-        dif = bmp.offset - ftell(file);
-        if (dif) {
-            fseek(file, dif, SEEK_CUR);
-        }
+    if (shard->buckets) {
+        SPXI_FREE(shard->buckets);
+    }
 
-        image.channels = 4;
-        image.pixbuf = (uint8_t*)malloc(stride * image.height);
+    shard->buckets = buckets;
+    shard->bucketcount = count;
+}
 
-        for (y = image.height - 1; y >= 0; --y) {
-            i = y * stride;
-            fread(image.pixbuf + i, stride, 1, file);
-            for (x = 0; x < image.width; ++x) {
-                n = *(int*)(image.pixbuf + i);
-                image.pixbuf[i++] = (n & bitmask.r) >> offset.r;
-                image.pixbuf[i++] = (n & bitmask.g) >> offset.g;
-                image.pixbuf[i++] = (n & bitmask.b) >> offset.b;
-                image.pixbuf[i++] = (n & bitmask.a) >> offset.a;
-            }
-        }
-    } else if (bmp.dib.bpp == 32 && bmp.dib.compression == 0) {
-        int x, y, i, n;
-        struct bitmask {
-            int r, g, b, a;
-        } bitmask = {0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000}, offset = {0};
-        while (!((bitmask.r >> offset.r) & 1)) ++offset.r;
-        while (!((bitmask.g >> offset.g) & 1)) ++offset.g;
-        while (!((bitmask.b >> offset.b) & 1)) ++offset.b;
-        while (!((bitmask.a >> offset.a) & 1)) ++offset.a;
-
-        dif = bmp.offset - ftell(file);
-        if (dif) {
-            fseek(file, dif, SEEK_CUR);
+/* drop the least recently used entries nobody holds until the shard
+ * fits its budget, held entries stay and are dropped once released */
+static void spxCacheEvict(SpxCacheShard* shard)
+{
+    SpxCacheEntry* entry = shard->oldest, *newer;
+    for (; entry && shard->bytes > shard->budget; entry = newer) {
+        newer = entry->newer;
+        if (!spxCacheHeld(entry)) {
+            SpxCacheEntry** link = spxCacheFind(shard, entry);
+            *link = entry->next;
+            spxCacheUnlink(shard, entry);
+            shard->bytes -= entry->bytes;
+            --shard->count;
+            ++shard->evictions;
+            SPXI_FREE(entry);
         }
+    }
+}
 
-        image.channels = 4;
-        image.pixbuf = (uint8_t*)malloc(stride * image.height);
-
-        for (y = image.height - 1; y >= 0; --y) {
-            i = y * stride;
-            fread(image.pixbuf + i, stride, 1, file);
-            for (x = 0; x < image.width; ++x) {
-                n = *(int*)(image.pixbuf + i);
-                image.pixbuf[i++] = (n & bitmask.r) >> offset.r;
-                image.pixbuf[i++] = (n & bitmask.g) >> offset.g;
-                image.pixbuf[i++] = (n & bitmask.b) >> offset.b;
-                image.pixbuf[i++] = (n & bitmask.a) >> offset.a;
-            }
-        }
-    } else if (bmp.dib.bpp == 16 && (!bmp.dib.compression || bmp.dib.compression == 3)) {
-        uint8_t* scanline;
-        int x, y, i, linesize = 4 * image.width;
-        struct bitmask {
-            uint32_t r, g, b;
-        } bitmask, maskdif = {0}, offset = {0};
+/* load an image through the cache, channels of 0 keeps them as stored,
+ * the pixels are shared and must only be read and then given back with
+ * spxImageCacheRelease */
+Img2D spxImageCacheLoad(const char* path, int channels)
+{
+    Img2D image, ret = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    SpxCacheEntry key, *entry, **link;
+    SpxCacheShard* shard;
+    size_t size, pathsize, palette;
+    uint8_t* block;
+
+    spxCacheStart();
+    if (channels < 0 || channels > 4 || spxCacheKey(&key, path, channels)) {
+        fprintf(stderr, "spximg could not open file: %s\n", path);
+        return ret;
+    }
 
-        dif = bmp.offset - ftell(file);
-        if (dif) {
-            fread(&bitmask, dif, 1, file);
-        } else {
-            bitmask = *(struct bitmask*)bmp.padding;
-        }
-        if (!bmp.dib.compression) {
-            bitmask.r = 0x7c00;
-            bitmask.g = 0x03e0;
-            bitmask.b = 0x001f;
-        }
+    shard = spxCacheShards + key.shard;
+    spxCacheLock(shard);
+    link = spxCacheFind(shard, &key);
+    if (link && *link) {
+        entry = *link;
+        ++entry->refs;
+        ++shard->hits;
+        spxCacheUnlink(shard, entry);
+        spxCachePushNewest(shard, entry);
+        spxCacheUnlock(shard);
+        return entry->image;
+    }
+    ++shard->misses;
+    spxCacheUnlock(shard);
+
+    image = spxImageLoad(path);
+    if (image.pixbuf && channels && image.channels != channels) {
+        Img2D tmp = spxImageReshape(image, channels);
+        spxImageFree(&image);
+        image = tmp;
+    }
 
-        while (!((bitmask.r >> offset.r) & 0x01)) ++offset.r;
-        while (!((bitmask.g >> offset.g) & 0x01)) ++offset.g;
-        while (!((bitmask.b >> offset.b) & 0x01)) ++offset.b;
-        while ((bitmask.r >> (offset.r + maskdif.r)) & 0x01) ++maskdif.r;
-        while ((bitmask.g >> (offset.g + maskdif.g)) & 0x01) ++maskdif.g;
-        while ((bitmask.b >> (offset.b + maskdif.b)) & 0x01) ++maskdif.b;
+    if (image.pixbuf && !spxImagePacked(image)) {
+        Img2D tmp = spxImagePack(image);
+        spxImageFree(&image);
+        image = tmp;
+    }
 
-        maskdif.r = 8 - maskdif.r;
-        maskdif.g = 8 - maskdif.g;
-        maskdif.b = 8 - maskdif.b;
+    if (!image.pixbuf) {
+        return ret;
+    }
 
-        image.channels = 4;
-        image.pixbuf = (uint8_t*)malloc(linesize * image.height);
-        scanline = (uint8_t*)malloc(stride);
+    /* the block the image was decoded into grows to hold the entry in
+     * front of the pixels and the path behind them, the pixels are moved
+     * in place so a miss never keeps two copies of the image */
+    size = spxImageRows(image) * spxImageRowSize(image);
+    palette = image.palette ? (size_t)(image.palette - image.pixbuf) : 0;
+    size += image.palette ? SPXI_PALETTE_SIZE : 0;
+    pathsize = strlen(path) + 1;
+    block = image.pixbuf - (SPXI_CACHE_HEADER - sizeof(SpxCacheEntry));
+    block = (uint8_t*)SPXI_REALLOC(block, SPXI_CACHE_HEADER + size + pathsize);
+    if (!block) {
+        spxImageFree(&image);
+        return ret;
+    }
 
-        for (y = image.height - 1; y >= 0; --y) {
-            i = y * linesize;
-            fread(scanline, stride, 1, file);
-            for (x = 0; x < image.width; ++x) {
-                uint16_t n = *(uint16_t*)(scanline + (x << 1));
-                image.pixbuf[i++] = ((n & bitmask.r) >> offset.r) << maskdif.r;
-                image.pixbuf[i++] = ((n & bitmask.g) >> offset.g) << maskdif.g;
-                image.pixbuf[i++] = ((n & bitmask.b) >> offset.b) << maskdif.b;
-                image.pixbuf[i++] = 0xff;
-            }
-        }
+    memmove(block + SPXI_CACHE_HEADER, block + SPXI_CACHE_HEADER - sizeof(SpxCacheEntry), size);
+    entry = (SpxCacheEntry*)block;
+    *entry = key;
+    entry->image = image;
+    entry->image.pixbuf = block + SPXI_CACHE_HEADER;
+    entry->image.palette = image.palette ? entry->image.pixbuf + palette : NULL;
+    entry->path = (const char*)entry->image.pixbuf + size;
+    entry->bytes = SPXI_CACHE_HEADER + size + pathsize;
+#ifdef SPXI_SHARED
+    spxPixbufBuffer(entry->image.pixbuf)->refs = 2;
+#endif /* SPXI_SHARED */
+    entry->refs = 1;
+    memcpy((char*)entry->path, path, pathsize);
+
+    /* another thread may have loaded the same file meanwhile */
+    spxCacheLock(shard);
+    link = spxCacheFind(shard, &key);
+    if (link && *link) {
+        SPXI_FREE(entry);
+        entry = *link;
+        ++entry->refs;
+        spxCacheUnlock(shard);
+        return entry->image;
+    }
 
-        free(scanline);
-    } else {
-        fprintf(stderr, "spximg is not ready to parse this kind of BMP yet: %s\n",
-            path
-        );
-        goto spxImageLoadBmpEnd;
+    if (shard->count >= shard->bucketcount) {
+        spxCacheGrow(shard);
     }
 
-spxImageLoadBmpEnd:
-    fclose(file);
-    return image;
+    link = shard->buckets + (entry->hash / SPXI_CACHE_SHARDS) % shard->bucketcount;
+    entry->next = *link;
+    *link = entry;
+    spxCachePushNewest(shard, entry);
+    shard->bytes += entry->bytes;
+    ++shard->count;
+    spxCacheEvict(shard);
+    spxCacheUnlock(shard);
+    return entry->image;
 }
 
-#endif /* SPXI_NO_BMP */
-
-/* Generic Saving and Loading */
-
-Img2D spxImageLoad(const char* path)
+void spxImageCacheRelease(Img2D* image)
 {
-    int format;
-    Img2D image = {NULL, 0, 0, 0};
-    
-    format = spxParseFormat(path);
-    switch (format) {
-        case SPXI_FORMAT_PNG: image = spxImageLoadPng(path); break;
-        case SPXI_FORMAT_JPEG: image = spxImageLoadJpeg(path); break;
-        case SPXI_FORMAT_PNM: image = spxImageLoadPnm(path); break;
-        case SPXI_FORMAT_BMP: image = spxImageLoadBmp(path); break;
-        case SPXI_FORMAT_UNKNOWN: 
-            fprintf(stderr, "spximg could not recognize format: %s\n", path);
+    if (image->pixbuf) {
+        SpxCacheEntry* entry = spxCacheEntryOf(image->pixbuf);
+        SpxCacheShard* shard = spxCacheShards + entry->shard;
+        spxCacheLock(shard);
+        --entry->refs;
+        spxCacheEvict(shard);
+        spxCacheUnlock(shard);
+        image->pixbuf = NULL;
+        image->width = 0;
+        image->height = 0;
+        image->channels = 0;
+        image->depth = 0;
+        image->layout = 0;
     }
-
-    return image;
 }
 
-int spxImageSave(const Img2D image, const char* path)
+/* a budget of 0 keeps only the images still held */
+void spxImageCacheBudget(size_t bytes)
 {
-    switch (spxParseExtension(path)) {
-        case SPXI_FORMAT_PNG: return spxImageSavePng(image, path);
-        case SPXI_FORMAT_JPEG: return spxImageSaveJpeg(image, path, SPXI_JPEG_QUALITY);
-        case SPXI_FORMAT_PNM: return spxImageSavePnm(image, path);
+    int i;
+    spxCacheStart();
+    for (i = 0; i < SPXI_CACHE_SHARDS; ++i) {
+        SpxCacheShard* shard = spxCacheShards + i;
+        spxCacheLock(shard);
+        shard->budget = bytes / SPXI_CACHE_SHARDS;
+        spxCacheEvict(shard);
+        spxCacheUnlock(shard);
     }
+}
 
-    fprintf(stderr, "spximg only supports saving images as PNG, JPEG and PPM\n");
-    return EXIT_FAILURE;
+void spxImageCacheStatsGet(SpxImageCacheStats* stats)
+{
+    int i;
+    spxCacheStart();
+    memset(stats, 0, sizeof(SpxImageCacheStats));
+    for (i = 0; i < SPXI_CACHE_SHARDS; ++i) {
+        SpxCacheShard* shard = spxCacheShards + i;
+        spxCacheLock(shard);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->count;
+        stats->bytes += shard->bytes;
+        stats->budget += shard->budget;
+        spxCacheUnlock(shard);
+    }
 }
 
+#endif /* SPXI_CACHE */
+
 /* Basic Image Allocation and Deallocation Implementation */
 
 Img2D spxImageCreate(int width, int height, int channels)
 {
-    size_t size;
-    Img2D image;
-    image.width = width;
-    image.height = height;
-    image.channels = channels;
-    size = width * height * channels;
-    image.pixbuf = (uint8_t*)malloc(size);
-    memset(image.pixbuf, SPXI_PADDING, size);
+    Img2D image = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    const size_t size = spxImageBytes(width, height, channels, 1);
+    if (!size) {
+        fprintf(stderr, "spximg cannot create image of %dx%d with %d channels\n",
+            width, height, channels
+        );
+        return image;
+    }
+
+    image.pixbuf = spxPixbufAlloc(size);
+    if (image.pixbuf) {
+        image.width = width;
+        image.height = height;
+        image.channels = channels;
+        memset(image.pixbuf, SPXI_PADDING, size);
+    }
     return image;
 }
 
 Img2D spxImageCopy(const Img2D img)
 {
-    Img2D image;
-    size_t size = img.width * img.height * img.channels;
-    
-    image.width = img.width;
-    image.height = img.height;
-    image.channels = img.channels;
-    image.pixbuf = (uint8_t*)malloc(size);
-    memcpy(image.pixbuf, img.pixbuf, size);
-    
-    return image;
+#ifdef SPXI_SHARED
+    if (spxPixbufOwned(img)) {
+        spxAtomicAdd(&spxPixbufBuffer(img.pixbuf)->refs, 1);
+        return img;
+    }
+#endif /* SPXI_SHARED */
+    return spxImagePack(img);
+}
+
+/* make sure no other image shares the pixels before writing to them,
+ * images with a stride write into the buffer they were made from */
+uint8_t* spxImageWritable(Img2D* image)
+{
+#ifdef SPXI_SHARED
+    SpxBuffer* buffer;
+    if (spxPixbufOwned(*image) && spxAtomicAdd(&spxPixbufBuffer(image->pixbuf)->refs, 0) > 1) {
+        Img2D own = spxImagePack(*image);
+        if (!own.pixbuf) {
+            return NULL;
+        }
+
+        buffer = spxPixbufBuffer(image->pixbuf);
+        if (!spxAtomicAdd(&buffer->refs, -1)) {
+            SPXI_FREE(buffer);
+        }
+        *image = own;
+    }
+#endif /* SPXI_SHARED */
+    return image->pixbuf;
 }
 
 void spxImageFree(Img2D* image)
 {
     if (image->pixbuf) {
-        free(image->pixbuf);
+#ifdef SPXI_SHARED
+        SpxBuffer* buffer = spxPixbufBuffer(image->pixbuf);
+        if (!spxAtomicAdd(&buffer->refs, -1)) {
+            SPXI_FREE(buffer);
+        }
+#else
+        SPXI_FREE(image->pixbuf);
+#endif /* SPXI_SHARED */
         image->pixbuf = NULL;
+        image->palette = NULL;
         image->width = 0;
         image->height = 0;
         image->channels = 0;
+        image->depth = 0;
+        image->layout = 0;
     }
 }
 
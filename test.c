@@ -0,0 +1,1445 @@
+/*
+
+Copyright (c) 2023 Eugenio Arteaga A.
+
+Permission is hereby granted, free of charge, to any
+person obtaining a copy of this software and associated
+documentation files (the "Software"), to deal in the
+Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice
+shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+/******************
+***** spxtest *****
+*******************
+
+Tests for spximg.h. Small images made up of gradients and noise go
+through the codecs and operations first and are checked against what
+they should come out as.
+
+The large image tests then write a PGM of more than 4 GB
+and an 8-bit BMP of more than 2 GB as sparse files, with pixels only
+in a few bands of rows, so they take little disk space. The PGM is
+mapped and used in place through a strided window, which is cropped,
+saved, loaded back and compared without reading the whole file.
+Both files are refused under a pixel limit just below their size, and
+loaded whole without limits when there is enough free memory,
+otherwise those checks are skipped. -s leaves them out.
+
+****************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+#define SPXI_APPLICATION
+#define SPXI_JPEG_STRIP_PIXELS (1UL << 14)
+#define SPXI_CACHE
+#include <spximg.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef TEST_PNM_WIDTH
+#define TEST_PNM_WIDTH 70000
+#endif /* TEST_PNM_WIDTH */
+
+#ifndef TEST_PNM_HEIGHT
+#define TEST_PNM_HEIGHT 62000
+#endif /* TEST_PNM_HEIGHT */
+
+#ifndef TEST_BMP_WIDTH
+#define TEST_BMP_WIDTH 48000
+#endif /* TEST_BMP_WIDTH */
+
+#ifndef TEST_BMP_HEIGHT
+#define TEST_BMP_HEIGHT 48000
+#endif /* TEST_BMP_HEIGHT */
+
+#define TEST_TILE_WIDTH 256
+#define TEST_TILE_HEIGHT 192
+#define TEST_PATH_SIZE 512
+#define TEST_BMP_HEADER (14 + 40 + 1024)
+
+typedef struct TestProgress {
+    int calls;
+    int rows;
+    int total;
+    int order;
+    int cancel;
+} TestProgress;
+
+typedef struct TestFile {
+    char path[TEST_PATH_SIZE];
+    size_t header;
+    size_t bytes;
+    int width;
+    int height;
+    int bottomup;
+    int bands[2][2];
+} TestFile;
+
+static uint32_t testSeed = 1;
+static int testCount = 0;
+static int testFailures = 0;
+static int testForce = 0;
+
+/* Checks and Expected Pixels */
+
+static void testCheck(const int ok, const char* name)
+{
+    ++testCount;
+    testFailures += !ok;
+    fprintf(stdout, "%-6s%s\n", ok ? "ok" : "FAIL", name);
+}
+
+static void testSkip(const char* name, const char* reason)
+{
+    fprintf(stdout, "%-6s%s (%s)\n", "skip", name, reason);
+}
+
+static uint8_t testPattern(const size_t x, const size_t y)
+{
+    return (uint8_t)((x >> 2) + (y >> 1) + ((x ^ y) & 7));
+}
+
+static int testRandom(void)
+{
+    testSeed = testSeed * 1103515245UL + 12345UL;
+    return (int)((testSeed >> 16) & 0x7FFF);
+}
+
+static void testPath(char* path, const char* dir, const char* name, const char* ext)
+{
+    sprintf(path, "%.400s/spxtest_%d_%.32s.%s", dir, (int)getpid(), name, ext);
+}
+
+/* gradients running a different way in each channel with some noise
+ * over them, alpha included */
+static Img2D testImage(const int width, const int height, const int channels)
+{
+    Img2D img = spxImageCreate(width, height, channels);
+    uint8_t* px = img.pixbuf;
+    int x, y, c;
+
+    for (y = 0; px && y < height; ++y) {
+        for (x = 0; x < width; ++x) {
+            for (c = 0; c < channels; ++c) {
+                const int gx = x * 255 / width, gy = y * 255 / height;
+                const int v = c & 1 ? (gx + 255 - gy) / 2 : c ? gy : gx;
+                *px++ = (uint8_t)((v * 7 >> 3) + (testRandom() & 31));
+            }
+        }
+    }
+    return img;
+}
+
+/* whether two 8-bit interleaved images hold the same samples */
+static int testSame(const Img2D a, const Img2D b)
+{
+    const size_t size = (size_t)a.width * a.channels;
+    const size_t sa = a.stride ? a.stride : size, sb = b.stride ? b.stride : size;
+    int y;
+    if (!a.pixbuf || !b.pixbuf || a.width != b.width || a.height != b.height ||
+        a.channels != b.channels) {
+        return 0;
+    }
+
+    for (y = 0; y < a.height; ++y) {
+        if (memcmp(a.pixbuf + (size_t)y * sa, b.pixbuf + (size_t)y * sb, size)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* whether two images of the same shape are within a PSNR of each other */
+static int testClose(const Img2D a, const Img2D b, const double psnr)
+{
+    SpxImageCompare cmp;
+    return a.pixbuf && b.pixbuf && a.channels == b.channels &&
+        !spxImageCompare(a, b, &cmp) && cmp.psnr[SPXI_COMPARE_ALL] >= psnr;
+}
+
+/* rows outside the written bands are holes of the sparse file */
+static uint8_t testExpected(const TestFile* file, const size_t x, const size_t y)
+{
+    int i;
+    for (i = 0; i < 2; ++i) {
+        if ((int)y >= file->bands[i][0] && (int)y < file->bands[i][1]) {
+            return testPattern(x, y);
+        }
+    }
+    return 0;
+}
+
+/* whether a gray or indexed image holds the file at x, y */
+static int testRegion(const TestFile* file, const Img2D img, const int x, const int y)
+{
+    const size_t stride = img.stride ? img.stride : (size_t)img.width;
+    int i, j;
+    if (!img.pixbuf || img.channels != 1) {
+        return 0;
+    }
+
+    for (j = 0; j < img.height; ++j) {
+        const uint8_t* row = img.pixbuf + (size_t)j * stride;
+        for (i = 0; i < img.width; ++i) {
+            if (row[i] != testExpected(file, (size_t)x + i, (size_t)y + j)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* mean squared error of two gray images, -1 when their sizes differ */
+static double testMse(const Img2D a, const Img2D b)
+{
+    const size_t sa = a.stride ? a.stride : (size_t)a.width;
+    const size_t sb = b.stride ? b.stride : (size_t)b.width;
+    double sum = 0.0;
+    int i, j;
+    if (!a.pixbuf || !b.pixbuf || a.channels != 1 || b.channels != 1 ||
+        a.width != b.width || a.height != b.height) {
+        return -1.0;
+    }
+
+    for (j = 0; j < a.height; ++j) {
+        const uint8_t* ra = a.pixbuf + (size_t)j * sa, *rb = b.pixbuf + (size_t)j * sb;
+        for (i = 0; i < a.width; ++i) {
+            const double d = (double)ra[i] - (double)rb[i];
+            sum += d * d;
+        }
+    }
+    return sum / ((double)a.width * a.height);
+}
+
+static size_t testMemory(void)
+{
+#if defined _SC_AVPHYS_PAGES
+    const long pages = sysconf(_SC_AVPHYS_PAGES);
+#elif defined _SC_PHYS_PAGES
+    const long pages = sysconf(_SC_PHYS_PAGES);
+#else
+    const long pages = 0;
+#endif /* _SC_AVPHYS_PAGES */
+    const long size = sysconf(_SC_PAGESIZE);
+    return pages > 0 && size > 0 ? (size_t)pages * (size_t)size : 0;
+}
+
+static int testFits(const size_t bytes)
+{
+    return testForce || testMemory() >= bytes + bytes / 4;
+}
+
+/* Sparse Files */
+
+static int testWriteAt(const int fd, const void* data, size_t size, off_t offset)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    while (size) {
+        const ssize_t n = pwrite(fd, p, size, offset);
+        if (n <= 0) {
+            return EXIT_FAILURE;
+        }
+        p += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void testPut16(uint8_t* p, const unsigned v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void testPut32(uint8_t* p, const unsigned long v)
+{
+    testPut16(p, (unsigned)(v & 0xFFFF));
+    testPut16(p + 2, (unsigned)(v >> 16));
+}
+
+/* a binary PGM, or an 8-bit gray palette BMP, of the size of the file
+ * with only its bands of rows written */
+static int testWriteFile(TestFile* file, const int bmp)
+{
+    uint8_t header[TEST_BMP_HEADER], *row;
+    size_t stride = (size_t)file->width;
+    int fd, i, x, y, ret = EXIT_SUCCESS;
+
+    if (bmp) {
+        memset(header, 0, sizeof(header));
+        header[0] = 'B';
+        header[1] = 'M';
+        file->header = TEST_BMP_HEADER;
+        stride = ((size_t)file->width + 3) & ~(size_t)3;
+        file->bytes = file->header + stride * file->height;
+        testPut32(header + 2, (unsigned long)(file->bytes & 0xFFFFFFFFUL));
+        testPut32(header + 10, TEST_BMP_HEADER);
+        testPut32(header + 14, 40);
+        testPut32(header + 18, (unsigned long)file->width);
+        testPut32(header + 22, (unsigned long)file->height);
+        testPut16(header + 26, 1);
+        testPut16(header + 28, 8);
+        testPut32(header + 46, 256);
+        for (i = 0; i < 256; ++i) {
+            memset(header + 54 + i * 4, i, 3);
+        }
+    } else {
+        sprintf((char*)header, "P5\n%d %d\n255\n", file->width, file->height);
+        file->header = strlen((const char*)header);
+        file->bytes = file->header + stride * file->height;
+    }
+
+    fd = open(file->path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    row = (uint8_t*)malloc(stride);
+    if (fd < 0 || !row || ftruncate(fd, (off_t)file->bytes) ||
+        testWriteAt(fd, header, file->header, 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (row) {
+        memset(row, 0, stride);
+    }
+    for (i = 0; i < 2 && !ret; ++i) {
+        for (y = file->bands[i][0]; y < file->bands[i][1] && !ret; ++y) {
+            const size_t stored = file->bottomup ? (size_t)(file->height - 1 - y) : (size_t)y;
+            for (x = 0; x < file->width; ++x) {
+                row[x] = testPattern((size_t)x, (size_t)y);
+            }
+            ret = testWriteAt(fd, row, stride, (off_t)(file->header + stored * stride));
+        }
+    }
+
+    free(row);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ret;
+}
+
+/* Small Image Tests */
+
+/* DCT-domain transforms and crops of a JPEG of whole MCUs against the
+ * same operations on its decoded pixels, which only differ by rounding */
+static void testTransformJpeg(const char* dir)
+{
+    static const char* names[8] = {
+        "none", "flip x", "flip y", "rotate 180",
+        "transpose", "rotate 90", "rotate 270", "transverse"
+    };
+    static const int crop[4] = {16, 16, 32, 16};
+    char src[TEST_PATH_SIZE], dst[TEST_PATH_SIZE], label[128];
+    Img2D img = testImage(64, 48, 3), decoded, expect, back;
+    int t;
+
+    testPath(src, dir, "transform", "jpg");
+    testPath(dst, dir, "transformed", "jpg");
+    decoded = spxImageSave(img, src) ? img : spxImageLoad(src);
+    testCheck(decoded.pixbuf && decoded.pixbuf != img.pixbuf, "save JPEG to transform");
+    if (!decoded.pixbuf || decoded.pixbuf == img.pixbuf) {
+        spxImageFree(&img);
+        return;
+    }
+
+    for (t = SPXI_TRANSFORM_FLIP_X; t <= SPXI_TRANSFORM_TRANSVERSE; ++t) {
+        sprintf(label, "JPEG %s in the DCT domain", names[t]);
+        back = spxImageTransformJpeg(src, dst, t, NULL, 0) ? img : spxImageLoad(dst);
+        expect = spxImageTransform(decoded, t);
+        testCheck(back.pixbuf != img.pixbuf && testClose(expect, back, 40.0), label);
+        if (back.pixbuf != img.pixbuf) {
+            spxImageFree(&back);
+        }
+        spxImageFree(&expect);
+    }
+
+    back = spxImageTransformJpeg(src, dst, SPXI_TRANSFORM_NONE, crop, 0) ?
+        img : spxImageLoad(dst);
+    expect = spxImageCrop(decoded, crop[0], crop[1], crop[2], crop[3]);
+    testCheck(back.pixbuf != img.pixbuf && testClose(expect, back, 40.0),
+        "JPEG crop in the DCT domain"
+    );
+    if (back.pixbuf != img.pixbuf) {
+        spxImageFree(&back);
+    }
+    spxImageFree(&expect);
+
+    spxImageFree(&decoded);
+    spxImageFree(&img);
+    remove(src);
+    remove(dst);
+    testCheck(spxImageTransformJpeg(dst, src, SPXI_TRANSFORM_FLIP_X, NULL, 0) != 0,
+        "JPEG transform of a missing file fails"
+    );
+}
+
+/* whether a small file holds the bytes of a string anywhere */
+static int testContains(const char* path, const char* str)
+{
+    const size_t len = strlen(str);
+    uint8_t data[1 << 16];
+    FILE* file = fopen(path, "rb");
+    size_t i, size = file ? fread(data, 1, sizeof(data), file) : 0;
+    if (file) {
+        fclose(file);
+    }
+
+    for (i = 0; i + len <= size; ++i) {
+        if (!memcmp(data + i, str, len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* JPEG encoded and decoded in strips on several threads against the
+ * same file decoded serially and the image encoded serially, the strips
+ * only add restart markers so all of them decode to the same pixels */
+static void testStripsJpeg(const char* dir)
+{
+#ifdef SPXI_THREADS
+    char path[TEST_PATH_SIZE], serial[TEST_PATH_SIZE], label[128];
+    Img2D img, strips, back, ref;
+    int channels;
+
+    testPath(path, dir, "strips", "jpg");
+    testPath(serial, dir, "serial", "jpg");
+    for (channels = 1; channels <= 3; channels += 2) {
+        img = testImage(256, 160, channels);
+        spxImageSetThreads(4);
+        sprintf(label, "JPEG of %d channels saved in strips", channels);
+        testCheck(!spxImageSave(img, path) && testContains(path, SPXI_JPEG_STRIP_COMMENT),
+            label
+        );
+        strips = spxImageLoad(path);
+
+        spxImageSetThreads(1);
+        back = spxImageLoad(path);
+        sprintf(label, "JPEG of %d channels decoded in strips", channels);
+        testCheck(testSame(strips, back) && testClose(img, strips, 30.0), label);
+
+        sprintf(label, "JPEG of %d channels saved serially", channels);
+        testCheck(!spxImageSave(img, serial) && !testContains(serial, SPXI_JPEG_STRIP_COMMENT),
+            label
+        );
+        ref = spxImageLoad(serial);
+        sprintf(label, "JPEG of %d channels the same in strips", channels);
+        testCheck(testSame(strips, ref), label);
+
+        spxImageFree(&ref);
+        spxImageFree(&back);
+        spxImageFree(&strips);
+        spxImageFree(&img);
+    }
+
+    spxImageSetThreads(0);
+    remove(path);
+    remove(serial);
+#else
+    (void)dir;
+    testSkip("JPEG in strips", "needs SPXI_THREADS");
+#endif /* SPXI_THREADS */
+}
+
+/* hits, misses and evictions of the cache of decoded images, entries
+ * are kept while held and after, until the budget pushes them out */
+static void testCache(const char* dir)
+{
+    char a[TEST_PATH_SIZE], b[TEST_PATH_SIZE];
+    SpxImageCacheStats st, st0;
+    Img2D img = testImage(64, 48, 3), other = testImage(48, 32, 3), x, y, gray, back;
+    int ok;
+
+    testPath(a, dir, "cache_a", "png");
+    testPath(b, dir, "cache_b", "png");
+    ok = !spxImageSave(img, a) && !spxImageSave(other, b);
+    testCheck(ok, "save images to cache");
+    if (!ok) {
+        spxImageFree(&img);
+        spxImageFree(&other);
+        return;
+    }
+
+    spxImageCacheStatsGet(&st0);
+    x = spxImageCacheLoad(a, 0);
+    y = spxImageCacheLoad(a, 0);
+    spxImageCacheStatsGet(&st);
+    testCheck(testSame(img, x) && y.pixbuf == x.pixbuf &&
+        st.misses == st0.misses + 1 && st.hits == st0.hits + 1 &&
+        st.entries == st0.entries + 1, "cache miss then hit"
+    );
+
+    gray = spxImageCacheLoad(a, 1);
+    back = spxImageReshape(img, 1);
+    spxImageCacheStatsGet(&st);
+    testCheck(testSame(back, gray) && gray.pixbuf != x.pixbuf &&
+        st.misses == st0.misses + 2 && st.entries == st0.entries + 2,
+        "cache keys by channels"
+    );
+    spxImageFree(&back);
+    spxImageCacheRelease(&gray);
+    spxImageCacheRelease(&y);
+
+    /* a budget of 0 drops all but the entry still held */
+    y = spxImageCacheLoad(b, 0);
+    spxImageCacheRelease(&y);
+    spxImageCacheBudget(0);
+    spxImageCacheStatsGet(&st);
+    testCheck(!y.pixbuf && testSame(img, x) && st.entries == 1 && st.budget == 0 &&
+        st.evictions == st0.evictions + 2, "cache evicts what is not held"
+    );
+
+    spxImageCacheRelease(&x);
+    spxImageCacheStatsGet(&st);
+    testCheck(!st.entries && !st.bytes && st.evictions == st0.evictions + 3,
+        "cache evicts once released"
+    );
+
+    /* rewritten files are keyed apart from what was cached before */
+    spxImageCacheBudget(SPXI_CACHE_BUDGET);
+    x = spxImageCacheLoad(a, 0);
+    ok = !spxImageSave(other, a);
+    y = spxImageCacheLoad(a, 0);
+    spxImageCacheStatsGet(&st);
+    testCheck(ok && testSame(img, x) && testSame(other, y) &&
+        st.misses == st0.misses + 5 && st.entries == 2, "cache reloads rewritten file"
+    );
+    spxImageCacheRelease(&x);
+    spxImageCacheRelease(&y);
+    spxImageCacheStatsGet(&st);
+    testCheck(st.entries == 2 && st.budget == (size_t)SPXI_CACHE_BUDGET / SPXI_CACHE_SHARDS *
+        SPXI_CACHE_SHARDS, "cache keeps released entries under budget"
+    );
+
+    spxImageCacheBudget(0);
+    spxImageCacheBudget(SPXI_CACHE_BUDGET);
+    spxImageFree(&img);
+    spxImageFree(&other);
+    remove(a);
+    remove(b);
+}
+
+static uint8_t* testReadFile(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    uint8_t* data = NULL;
+    long n;
+
+    *size = 0;
+    if (!file) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    n = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = n > 0 ? (uint8_t*)malloc((size_t)n) : NULL;
+    if (data && fread(data, 1, (size_t)n, file) != (size_t)n) {
+        free(data);
+        data = NULL;
+    }
+    *size = data ? (size_t)n : 0;
+    fclose(file);
+    return data;
+}
+
+/* push a file to the decoder in two pieces split at every byte, and a
+ * byte at a time, each must decode to what loading it from memory does */
+static void testPushDecoder(const char* dir)
+{
+    static const char* exts[4] = {"png", "jpg", "ppm", "bmp"};
+    char label[128];
+    TestFile bmp;
+    Img2D img = testImage(24, 20, 3), expect, back;
+    SpxImageDecoder* decoder;
+    uint8_t* data;
+    size_t i, k, size;
+    int e, ok;
+
+    for (e = 0; e < 4; ++e) {
+        /* BMP is only loaded, it is written the way the large one is */
+        memset(&bmp, 0, sizeof(bmp));
+        testPath(bmp.path, dir, "push", exts[e]);
+        bmp.width = 21;
+        bmp.height = 13;
+        bmp.bottomup = 1;
+        bmp.bands[0][1] = bmp.height;
+        ok = e == 3 ? !testWriteFile(&bmp, 1) : !spxImageSave(img, bmp.path);
+        data = ok ? testReadFile(bmp.path, &size) : NULL;
+        remove(bmp.path);
+        expect = data ? spxImageLoadMemory(data, size, 0) : img;
+        ok = data && expect.pixbuf != img.pixbuf && expect.pixbuf;
+        for (k = 0; ok && k <= size; ++k) {
+            decoder = spxImageDecoderOpen(0);
+            ok = decoder && spxImageDecoderPush(decoder, data, k) >= 0 &&
+                spxImageDecoderPush(decoder, data + k, size - k) >= 0;
+            back = spxImageDecoderFinish(decoder);
+            ok = ok && testSame(expect, back);
+            spxImageDecoderClose(decoder);
+            spxImageFree(&back);
+        }
+        sprintf(label, "push %s split at every byte", exts[e]);
+        testCheck(ok, label);
+
+        decoder = ok ? spxImageDecoderOpen(0) : NULL;
+        for (i = 0; decoder && i < size && ok; ++i) {
+            ok = spxImageDecoderPush(decoder, data + i, 1) >= 0;
+        }
+        back = spxImageDecoderFinish(decoder);
+        sprintf(label, "push %s a byte at a time", exts[e]);
+        testCheck(ok && testSame(expect, back), label);
+        spxImageDecoderClose(decoder);
+        spxImageFree(&back);
+
+        decoder = ok ? spxImageDecoderOpen(0) : NULL;
+        ok = decoder && spxImageDecoderPush(decoder, data, size - 1) >= 0;
+        back = spxImageDecoderFinish(decoder);
+        sprintf(label, "push %s cut short fails", exts[e]);
+        testCheck(ok && !back.pixbuf && spxImageLastError() == SPXI_ERROR_DECODE, label);
+        spxImageDecoderClose(decoder);
+        spxImageFree(&back);
+
+        if (expect.pixbuf != img.pixbuf) {
+            spxImageFree(&expect);
+        }
+        free(data);
+    }
+
+    spxImageFree(&img);
+}
+
+/* counts calls and checks rows only grow, cancels past cancel rows */
+static int testProgress(void* user, int rows, int total)
+{
+    TestProgress* progress = (TestProgress*)user;
+    progress->order &= rows > progress->rows && rows <= total;
+    progress->calls++;
+    progress->rows = rows;
+    progress->total = total;
+    return progress->cancel && rows >= progress->cancel;
+}
+
+static int testExists(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file) {
+        fclose(file);
+    }
+    return file != NULL;
+}
+
+/* saves and loads cancelled by the progress callback fail, leave no
+ * file behind and report the cancel, those let through count every row.
+ * JPEG is saved in strips on threads as well as serially */
+static void testCancel(const char* dir)
+{
+    static const char* exts[3] = {"png", "jpg", "ppm"};
+    char path[TEST_PATH_SIZE], label[128];
+    Img2D img = testImage(128, 200, 3), back;
+    TestProgress progress;
+    int e, t, ok;
+
+    for (t = 1; t <= 4; t += 3) {
+        spxImageSetThreads(t);
+        for (e = 0; e < 3; ++e) {
+            testPath(path, dir, "cancel", exts[e]);
+            memset(&progress, 0, sizeof(progress));
+            progress.order = 1;
+            progress.cancel = SPXI_PROGRESS_ROWS;
+            spxImageSetProgress(&testProgress, &progress);
+            ok = spxImageSave(img, path) && !testExists(path) &&
+                spxImageLastError() == SPXI_ERROR_CANCEL && progress.calls &&
+                progress.rows < progress.total;
+            sprintf(label, "cancel %s save on %d thread%s", exts[e], t, t > 1 ? "s" : "");
+            testCheck(ok, label);
+
+            memset(&progress, 0, sizeof(progress));
+            progress.order = 1;
+            ok = !spxImageSave(img, path) && progress.order && progress.calls > 1 &&
+                progress.rows == progress.total && progress.total >= img.height;
+            sprintf(label, "progress of %s save on %d thread%s", exts[e], t, t > 1 ? "s" : "");
+            testCheck(ok, label);
+
+            memset(&progress, 0, sizeof(progress));
+            progress.order = 1;
+            back = spxImageLoad(path);
+            ok = back.pixbuf && progress.order && progress.rows == progress.total;
+            spxImageFree(&back);
+
+            memset(&progress, 0, sizeof(progress));
+            progress.cancel = SPXI_PROGRESS_ROWS;
+            back = spxImageLoad(path);
+            ok = ok && !back.pixbuf && spxImageLastError() == SPXI_ERROR_CANCEL;
+            sprintf(label, "progress and cancel of %s load on %d thread%s", exts[e], t,
+                t > 1 ? "s" : ""
+            );
+            testCheck(ok, label);
+            spxImageFree(&back);
+            spxImageSetProgress(NULL, NULL);
+            remove(path);
+        }
+    }
+
+    spxImageSetThreads(0);
+    spxImageFree(&img);
+}
+
+static int testWriteData(const char* path, const uint8_t* data, const size_t size)
+{
+    FILE* file = fopen(path, "wb");
+    int ret = !file || fwrite(data, 1, size, file) != size;
+    if (file) {
+        ret |= fclose(file) != 0;
+    }
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* a file with metadata added after the signature, a tEXt chunk, a
+ * comment marker or a comment line */
+static int testWriteTagged(const char* path, const uint8_t* data, const size_t size,
+    const int format)
+{
+    static const char text[] = "Comment\0spxtest";
+    uint8_t tag[64];
+    uint8_t* tagged = (uint8_t*)malloc(size + sizeof(tag));
+    size_t pos = 2, len = 0;
+    int ret;
+
+    if (!tagged || size < 33) {
+        free(tagged);
+        return EXIT_FAILURE;
+    }
+
+    if (format == SPXI_FORMAT_PNG) {
+        const unsigned long n = sizeof(text) - 1;
+        uLong crc;
+        pos = 33;
+        tag[0] = tag[1] = tag[2] = 0;
+        tag[3] = (uint8_t)n;
+        memcpy(tag + 4, "tEXt", 4);
+        memcpy(tag + 8, text, n);
+        crc = crc32(0, tag + 4, (uInt)(n + 4));
+        tag[n + 8] = (uint8_t)(crc >> 24);
+        tag[n + 9] = (uint8_t)(crc >> 16);
+        tag[n + 10] = (uint8_t)(crc >> 8);
+        tag[n + 11] = (uint8_t)crc;
+        len = n + 12;
+    } else if (format == SPXI_FORMAT_JPEG) {
+        memcpy(tag, "\377\376\0\11spxtest", 4 + 7);
+        len = 4 + 7;
+    } else {
+        memcpy(tag, "\n# spxtest\n", 11);
+        len = 11;
+    }
+
+    memcpy(tagged, data, pos);
+    memcpy(tagged + pos, tag, len);
+    memcpy(tagged + pos + len, data + pos, size - pos);
+    ret = testWriteData(path, tagged, size + len);
+    free(tagged);
+    return ret;
+}
+
+/* plain copies keep the bytes, stripped ones drop the metadata and
+ * still load to the same pixels, in place as well */
+static void testCopyFile(const char* dir)
+{
+    static const char* exts[3] = {"png", "jpg", "ppm"};
+    static const int formats[3] = {SPXI_FORMAT_PNG, SPXI_FORMAT_JPEG, SPXI_FORMAT_PNM};
+    char src[TEST_PATH_SIZE], dst[TEST_PATH_SIZE], label[128];
+    Img2D img = testImage(40, 30, 3), expect, back;
+    uint8_t* data, *copy;
+    size_t size, copysize;
+    int e, ok;
+
+    for (e = 0; e < 3; ++e) {
+        testPath(src, dir, "copy_src", exts[e]);
+        testPath(dst, dir, "copy_dst", exts[e]);
+        data = spxImageSave(img, src) ? NULL : testReadFile(src, &size);
+        expect = spxImageLoad(src);
+        ok = data && expect.pixbuf && !testWriteTagged(src, data, size, formats[e]);
+        free(data);
+        data = ok ? testReadFile(src, &size) : NULL;
+
+        copy = data && !spxImageCopyFile(src, dst, 0) ? testReadFile(dst, &copysize) : NULL;
+        sprintf(label, "copy %s keeps its bytes", exts[e]);
+        testCheck(copy && copysize == size && !memcmp(copy, data, size) &&
+            testContains(dst, "spxtest"), label
+        );
+        free(copy);
+
+        back = data && !spxImageCopyFile(src, dst, SPXI_COPY_STRIP) ? spxImageLoad(dst) : img;
+        sprintf(label, "copy %s stripped of metadata", exts[e]);
+        testCheck(back.pixbuf != img.pixbuf && testSame(expect, back) &&
+            !testContains(dst, "spxtest"), label
+        );
+        if (back.pixbuf != img.pixbuf) {
+            spxImageFree(&back);
+        }
+
+        back = data && !spxImageCopyFile(src, src, SPXI_COPY_STRIP) ? spxImageLoad(src) : img;
+        sprintf(label, "copy %s stripped in place", exts[e]);
+        testCheck(back.pixbuf != img.pixbuf && testSame(expect, back) &&
+            !testContains(src, "spxtest"), label
+        );
+        if (back.pixbuf != img.pixbuf) {
+            spxImageFree(&back);
+        }
+
+        free(data);
+        spxImageFree(&expect);
+        remove(src);
+        remove(dst);
+    }
+
+    testPath(src, dir, "copy_src", "png");
+    testPath(dst, dir, "copy_dst", "jpg");
+    testCheck(!spxImageSave(img, src) && spxImageCopyFile(src, dst, 0) && !testExists(dst),
+        "copy to another format fails"
+    );
+    remove(src);
+    spxImageFree(&img);
+}
+
+static size_t testFileSize(const char* path)
+{
+    size_t size;
+    uint8_t* data = testReadFile(path, &size);
+    free(data);
+    return size;
+}
+
+/* the quality spxImageSaveJpegTarget picks fits the budget and the next
+ * one up does not, for budgets of what a few qualities come out as */
+static void testTargetJpeg(const char* dir)
+{
+    static const int sizes[2][2] = {{40, 24}, {192, 528}};
+    static const int qualities[3] = {30, 75, 95};
+    char path[TEST_PATH_SIZE], label[128];
+    Img2D img;
+    size_t bytes;
+    int i, k, t, q;
+
+    testPath(path, dir, "target", "jpg");
+    for (i = 0; i < 2; ++i) {
+        img = testImage(sizes[i][0], sizes[i][1], 3);
+        for (t = 1; t <= 4; t += 3) {
+            for (k = 0; k < 3; ++k) {
+                /* sizes to match are of serial files, without restart markers */
+                spxImageSetThreads(1);
+                bytes = spxImageSaveJpeg(img, path, qualities[k]) ? 0 : testFileSize(path);
+                remove(path);
+                spxImageSetThreads(t);
+                q = bytes ? spxImageSaveJpegTarget(img, path, bytes) : 0;
+                spxImageSetThreads(1);
+                sprintf(label, "JPEG of %dx%d fits %lu bytes on %d thread%s",
+                    img.width, img.height, (unsigned long)bytes, t, t > 1 ? "s" : ""
+                );
+                testCheck(q >= qualities[k] && testFileSize(path) <= bytes &&
+                    (q == 100 || (!spxImageSaveJpeg(img, path, q + 1) &&
+                    testFileSize(path) > bytes)), label
+                );
+                remove(path);
+            }
+
+            spxImageSetThreads(t);
+            sprintf(label, "JPEG of %dx%d in 64 bytes fails on %d thread%s",
+                img.width, img.height, t, t > 1 ? "s" : ""
+            );
+            testCheck(!spxImageSaveJpegTarget(img, path, 64) && !testExists(path), label);
+        }
+        spxImageFree(&img);
+    }
+    spxImageSetThreads(0);
+}
+
+/* a PNG with every row under the given filters, libpng picks one of
+ * them for each row when there are several */
+static int testWritePng(const char* path, const Img2D img, const int filters,
+    const int interlace)
+{
+    static const int types[4] = {
+        PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGBA
+    };
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    FILE* volatile file = NULL;
+    int y;
+
+    if (!info || setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        if (file) {
+            fclose(file);
+        }
+        return EXIT_FAILURE;
+    }
+
+    file = fopen(path, "wb");
+    if (!file) {
+        png_error(png, "open");
+    }
+
+    png_init_io(png, file);
+    png_set_IHDR(png, info, img.width, img.height, 8, types[img.channels - 1],
+        interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT
+    );
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, filters);
+    png_write_info(png, info);
+    for (y = interlace ? png_set_interlace_handling(png) : 1; y > 0; --y) {
+        int j;
+        for (j = 0; j < img.height; ++j) {
+            png_write_row(png, img.pixbuf + (size_t)j * img.width * img.channels);
+        }
+    }
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    return fclose(file) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* decode with libpng alone, through its simplified API */
+static Img2D testReadPng(const char* path, const int channels)
+{
+    static const png_uint_32 formats[4] = {
+        PNG_FORMAT_GRAY, PNG_FORMAT_GA, PNG_FORMAT_RGB, PNG_FORMAT_RGBA
+    };
+    Img2D img = {NULL, 0, 0, 0, NULL, 0, 0, 0};
+    png_image image;
+
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&image, path)) {
+        return img;
+    }
+
+    image.format = formats[channels - 1];
+    img = spxImageCreate((int)image.width, (int)image.height, channels);
+    if (!img.pixbuf || !png_image_finish_read(&image, NULL, img.pixbuf, 0, NULL)) {
+        spxImageFree(&img);
+    }
+    png_image_free(&image);
+    return img;
+}
+
+/* files of each filter and number of channels, the direct decoder and
+ * its SSE2 unfiltering against libpng and the pixels that were written,
+ * a large one taking several batches of rows and interlaced ones that
+ * fall back to libpng */
+static void testPngFilters(const char* dir)
+{
+    static const char* names[6] = {"none", "sub", "up", "avg", "paeth", "mixed"};
+    static const int filters[6] = {
+        PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+        PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS
+    };
+    char path[TEST_PATH_SIZE], label[128];
+    Img2D img, back, ref;
+    int c, f, i, ok;
+
+    testPath(path, dir, "filters", "png");
+    for (i = 0; i < 3; ++i) {
+        for (f = 0; f < 6; ++f) {
+            ok = 1;
+            for (c = 1; c <= 4; ++c) {
+                img = i == 1 ? testImage(300, 300, c) : testImage(97, 61, c);
+                back = ref = img;
+                if (!testWritePng(path, img, filters[f], i == 2)) {
+                    back = spxImageLoad(path);
+                    ref = testReadPng(path, c);
+                }
+                ok &= back.pixbuf != img.pixbuf && testSame(img, back) && testSame(ref, back);
+                if (back.pixbuf != img.pixbuf) {
+                    spxImageFree(&back);
+                    spxImageFree(&ref);
+                }
+                spxImageFree(&img);
+            }
+            sprintf(label, "PNG %s%s of 1 to 4 channels%s", names[f],
+                i == 2 ? " interlaced" : "", i == 1 ? " in batches" : ""
+            );
+            testCheck(ok, label);
+        }
+    }
+    remove(path);
+}
+
+/* whether the results of two comparisons agree to rounding */
+static int testAgree(const SpxImageCompare* a, const SpxImageCompare* b)
+{
+    int c;
+    if (a->channels != b->channels) {
+        return 0;
+    }
+
+    for (c = 0; c <= SPXI_COMPARE_ALL; ++c) {
+        if (c >= a->channels && c < SPXI_COMPARE_ALL) {
+            continue;
+        }
+        if (a->maxdiff[c] != b->maxdiff[c] || fabs(a->mse[c] - b->mse[c]) > 1e-9 ||
+            fabs(a->ssim[c] - b->ssim[c]) > 1e-9 || fabs(a->msssim[c] - b->msssim[c]) > 1e-9 ||
+            (a->psnr[c] != b->psnr[c] && fabs(a->psnr[c] - b->psnr[c]) > 1e-9)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* images against themselves and against a copy off by 4 in every
+ * sample, MSE 16 and PSNR 10 log10(255^2 / 16), in memory and as
+ * PNG and JPEG files read a row at a time */
+static void testCompare(const char* dir)
+{
+    const double psnr = 36.089603782119850; /* 10 log10(255^2 / 16) */
+    char apath[TEST_PATH_SIZE], bpath[TEST_PATH_SIZE];
+    SpxImageCompare cmp, files;
+    Img2D a = testImage(120, 90, 3), b = spxImageCopy(a), gray, mask, la, lb;
+    size_t i, size = (size_t)a.width * a.height * a.channels;
+    int ok;
+
+    for (i = 0; a.pixbuf && b.pixbuf && i < size; ++i) {
+        a.pixbuf[i] = (uint8_t)(a.pixbuf[i] < 4 ? 4 : a.pixbuf[i] > 251 ? 251 : a.pixbuf[i]);
+        b.pixbuf[i] = (uint8_t)(testRandom() & 1 ? a.pixbuf[i] + 4 : a.pixbuf[i] - 4);
+    }
+
+    ok = !spxImageCompare(a, a, &cmp);
+    testCheck(ok && cmp.channels == 3 && cmp.mse[SPXI_COMPARE_ALL] == 0.0 &&
+        cmp.psnr[SPXI_COMPARE_ALL] == HUGE_VAL && !cmp.maxdiff[SPXI_COMPARE_ALL] &&
+        fabs(cmp.ssim[SPXI_COMPARE_ALL] - 1.0) < 1e-9 &&
+        fabs(cmp.msssim[SPXI_COMPARE_ALL] - 1.0) < 1e-9, "compare identical images"
+    );
+
+    ok = !spxImageCompare(a, b, &cmp);
+    testCheck(ok && fabs(cmp.mse[0] - 16.0) < 1e-9 && fabs(cmp.mse[2] - 16.0) < 1e-9 &&
+        fabs(cmp.psnr[SPXI_COMPARE_ALL] - psnr) < 1e-9 && cmp.maxdiff[1] == 4 &&
+        cmp.ssim[SPXI_COMPARE_ALL] > 0.5 && cmp.ssim[SPXI_COMPARE_ALL] < 1.0 &&
+        cmp.msssim[SPXI_COMPARE_ALL] > cmp.ssim[SPXI_COMPARE_ALL] * 0.5 &&
+        cmp.msssim[SPXI_COMPARE_ALL] < 1.0, "compare images off by 4"
+    );
+
+    mask = spxImageDiffMask(a, b, 3);
+    gray = spxImageDiffMask(a, b, 4);
+    testCheck(mask.pixbuf && gray.pixbuf && mask.channels == 1 &&
+        mask.pixbuf[0] == 0xFF && !memchr(mask.pixbuf, 0, (size_t)a.width * a.height) &&
+        !gray.pixbuf[0] && !memchr(gray.pixbuf, 0xFF, (size_t)a.width * a.height),
+        "difference mask of images off by 4"
+    );
+    spxImageFree(&mask);
+    spxImageFree(&gray);
+
+    gray = spxImageReshape(a, 1);
+    ok = !spxImageCompare(a, gray, &cmp);
+    testCheck(ok && cmp.channels == 1 && cmp.psnr[SPXI_COMPARE_ALL] == HUGE_VAL,
+        "compare against gray of the same image"
+    );
+    spxImageFree(&gray);
+
+    testPath(apath, dir, "compare_a", "png");
+    testPath(bpath, dir, "compare_b", "png");
+    ok = !spxImageSave(a, apath) && !spxImageSave(b, bpath) &&
+        !spxImageCompare(a, b, &cmp) && !spxImageCompareFiles(apath, bpath, &files);
+    testCheck(ok && testAgree(&cmp, &files), "compare PNG files as images");
+    remove(apath);
+    remove(bpath);
+
+    testPath(apath, dir, "compare_a", "jpg");
+    testPath(bpath, dir, "compare_b", "jpg");
+    la = lb = a;
+    if (!spxImageSave(a, apath) && !spxImageSave(b, bpath)) {
+        la = spxImageLoad(apath);
+        lb = spxImageLoad(bpath);
+    }
+    ok = la.pixbuf != a.pixbuf && !spxImageCompare(la, lb, &cmp) &&
+        !spxImageCompareFiles(apath, bpath, &files);
+    testCheck(ok && testAgree(&cmp, &files), "compare JPEG files as images");
+    if (la.pixbuf != a.pixbuf) {
+        spxImageFree(&la);
+        spxImageFree(&lb);
+    }
+    remove(apath);
+    remove(bpath);
+
+    gray = spxImageCrop(a, 0, 0, 60, 90);
+    testCheck(spxImageCompare(a, gray, &cmp) != 0, "compare images of different sizes fails");
+    spxImageFree(&gray);
+    spxImageFree(&a);
+    spxImageFree(&b);
+}
+
+/* whether two analyses agree, sums to rounding */
+static int testSameAnalysis(const SpxImageAnalysis* a, const SpxImageAnalysis* b)
+{
+    int c;
+    if (a->channels != b->channels || a->opaque != b->opaque || a->gray != b->gray ||
+        a->channelsNeeded != b->channelsNeeded) {
+        return 0;
+    }
+
+    for (c = 0; c < a->channels; ++c) {
+        if (a->min[c] != b->min[c] || a->max[c] != b->max[c] ||
+            fabs(a->mean[c] - b->mean[c]) > 1e-9 || fabs(a->stddev[c] - b->stddev[c]) > 1e-6 ||
+            memcmp(a->histogram[c], b->histogram[c], sizeof(a->histogram[c]))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* histograms, extremes and moments counted here sample by sample */
+static int testCountedAnalysis(const Img2D img, const SpxImageAnalysis* a)
+{
+    const size_t pixels = (size_t)img.width * img.height;
+    SpxImageAnalysis ref;
+    size_t i;
+    int c;
+
+    memset(&ref, 0, sizeof(ref));
+    for (c = 0; c < img.channels; ++c) {
+        double sum = 0.0, squares = 0.0;
+        ref.min[c] = 255;
+        for (i = 0; i < pixels; ++i) {
+            const int v = img.pixbuf[i * img.channels + c];
+            ++ref.histogram[c][v];
+            ref.min[c] = v < ref.min[c] ? v : ref.min[c];
+            ref.max[c] = v > ref.max[c] ? v : ref.max[c];
+            sum += v;
+            squares += (double)v * v;
+        }
+        /* squared to check it, which needs no libm */
+        ref.mean[c] = sum / pixels;
+        ref.stddev[c] = fabs(a->stddev[c] * a->stddev[c] -
+            (squares / pixels - ref.mean[c] * ref.mean[c])) < 1e-6 ? a->stddev[c] : -1.0;
+    }
+
+    ref.channels = a->channels;
+    ref.opaque = a->opaque;
+    ref.gray = a->gray;
+    ref.channelsNeeded = a->channelsNeeded;
+    return a->depth == 8 && testSameAnalysis(a, &ref);
+}
+
+/* statistics of known images, what they tell about gray and alpha, and
+ * the same numbers from planes, 16 bits, palettes, files and threads */
+static void testAnalyze(const char* dir)
+{
+    char path[TEST_PATH_SIZE];
+    SpxImageAnalysis a, b;
+    Img2D img = testImage(300, 250, 4), rgb = spxImageReshape(img, 3), tmp, tmp2;
+    int c, ok;
+
+    spxImageSetThreads(1);
+    ok = !spxImageAnalyze(img, &a);
+    spxImageSetThreads(4);
+    ok = ok && !spxImageAnalyze(img, &b);
+    spxImageSetThreads(0);
+    testCheck(ok && testCountedAnalysis(img, &a) && testSameAnalysis(&a, &b) &&
+        !a.gray && !a.opaque && a.channelsNeeded == 4, "analyze RGBA on 1 and 4 threads"
+    );
+
+    tmp = spxImageReshape(rgb, 4);
+    testCheck(!spxImageAnalyze(tmp, &a) && testCountedAnalysis(tmp, &a) &&
+        !a.gray && a.opaque && a.min[3] == 255 && a.histogram[3][255] == 300 * 250 &&
+        a.channelsNeeded == 3, "analyze opaque RGBA"
+    );
+    spxImageFree(&tmp);
+
+    tmp2 = spxImageReshape(img, 1);
+    tmp = spxImageReshape(tmp2, 4);
+    testCheck(!spxImageAnalyze(tmp, &a) && testCountedAnalysis(tmp, &a) &&
+        a.gray && a.opaque && a.channelsNeeded == 1 && !memcmp(a.histogram[0],
+        a.histogram[2], sizeof(a.histogram[0])), "analyze gray opaque RGBA"
+    );
+    spxImageFree(&tmp);
+
+    tmp = spxImageReshape(tmp2, 2);
+    for (c = 0; tmp.pixbuf && c < tmp.width * tmp.height; ++c) {
+        tmp.pixbuf[c * 2 + 1] = (uint8_t)(c & 1 ? 255 : 128);
+    }
+    testCheck(!spxImageAnalyze(tmp, &a) && testCountedAnalysis(tmp, &a) &&
+        a.gray && !a.opaque && a.channelsNeeded == 2 && a.min[1] == 128 &&
+        a.histogram[1][128] + a.histogram[1][255] == 300 * 250,
+        "analyze gray with alpha"
+    );
+    spxImageFree(&tmp);
+    spxImageFree(&tmp2);
+
+    ok = !spxImageAnalyze(img, &a);
+    tmp = spxImageLayout(img, SPXI_LAYOUT_PLANAR);
+    testCheck(ok && !spxImageAnalyze(tmp, &b) && testSameAnalysis(&a, &b),
+        "analyze planar RGBA"
+    );
+    spxImageFree(&tmp);
+
+    tmp = spxImageDepth(img, 16);
+    ok = ok && !spxImageAnalyze(tmp, &b) && b.depth == 16 && b.gray == a.gray &&
+        b.opaque == a.opaque && !memcmp(a.histogram, b.histogram, sizeof(a.histogram));
+    for (c = 0; ok && c < 4; ++c) {
+        ok = b.min[c] == a.min[c] * 257 && b.max[c] == a.max[c] * 257 &&
+            fabs(b.mean[c] - a.mean[c] * 257) < 1e-6;
+    }
+    testCheck(ok, "analyze 16-bit RGBA");
+    spxImageFree(&tmp);
+
+    tmp = spxImageQuantize(rgb, 16);
+    tmp2 = spxImageReshape(tmp, 4);
+    testCheck(tmp.palette && !spxImageAnalyze(tmp, &a) && !spxImageAnalyze(tmp2, &b) &&
+        testSameAnalysis(&a, &b) && a.channels == 4, "analyze palette as RGBA"
+    );
+    spxImageFree(&tmp);
+    spxImageFree(&tmp2);
+
+    testPath(path, dir, "analyze", "png");
+    testCheck(!spxImageSave(img, path) && !spxImageAnalyze(img, &a) &&
+        !spxImageAnalyzeFile(path, &b) && testSameAnalysis(&a, &b), "analyze PNG file"
+    );
+    remove(path);
+
+    spxImageFree(&rgb);
+    spxImageFree(&img);
+}
+
+/* Large Image Tests */
+
+/* save an image, load it back and compare both, JPEG by its error */
+static void testRoundTrip(const TestFile* file, const Img2D img, const int x, const int y,
+    const char* dir, const char* ext, const char* name)
+{
+    char path[TEST_PATH_SIZE], label[128];
+    Img2D back;
+    double mse;
+
+    sprintf(path, "%.400s/spxtest_%d.%s", dir, (int)getpid(), ext);
+    sprintf(label, "%s through %s", name, ext);
+    if (spxImageSave(img, path)) {
+        testCheck(0, label);
+        return;
+    }
+
+    back = spxImageLoad(path);
+    if (back.pixbuf && back.channels != img.channels) {
+        /* PNM stores gray as RGB, folding it back keeps the samples */
+        Img2D tmp = spxImageReshape(back, img.channels);
+        spxImageFree(&back);
+        back = tmp;
+    }
+
+    /* a PSNR over 30 dB for JPEG, the same samples otherwise */
+    mse = testMse(img, back);
+    if (!strcmp(ext, "jpg")) {
+        testCheck(mse >= 0.0 && mse < 255.0 * 255.0 / 1000.0, label);
+    } else {
+        testCheck(mse == 0.0 && testRegion(file, back, x, y), label);
+    }
+
+    spxImageFree(&back);
+    remove(path);
+}
+
+/* the mapped PGM as an image of rows inside the mapping, so it is
+ * cropped and saved without reading more of the file than it needs */
+static void testMapped(const TestFile* file, const char* dir)
+{
+    const int tw = TEST_TILE_WIDTH, th = TEST_TILE_HEIGHT;
+    const int x = file->width - tw, y = file->height - th;
+    const int edge = (int)((((size_t)1 << 32) - file->header) / file->width) - th / 2;
+    const size_t stride = (size_t)file->width;
+    Img2D mosaic = {NULL, 0, 0, 1, NULL, 0, 0, 0}, window, crop, across;
+    uint8_t* map;
+    int fd;
+
+    fd = open(file->path, O_RDONLY);
+    map = fd < 0 ? NULL : (uint8_t*)mmap(NULL, file->bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (!map || map == (uint8_t*)MAP_FAILED) {
+        testCheck(0, "map sparse PGM");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    mosaic.pixbuf = map + file->header;
+    mosaic.width = file->width;
+    mosaic.height = file->height;
+    mosaic.stride = stride;
+
+    window = mosaic;
+    window.pixbuf += (size_t)y * stride + x;
+    window.width = tw;
+    window.height = th;
+    testCheck(testRegion(file, window, x, y), "window past 4 GB reads in place");
+
+    crop = spxImageCrop(mosaic, x, y, tw, th);
+    testCheck(testRegion(file, crop, x, y), "crop of the far corner");
+    testCheck(testMse(window, crop) == 0.0, "compare window and crop");
+
+    across = spxImageCrop(mosaic, x - 3, edge, tw, th);
+    testCheck(testRegion(file, across, x - 3, edge), "crop across the 4 GB offset");
+
+    testRoundTrip(file, window, x, y, dir, "png", "strided window");
+    testRoundTrip(file, window, x, y, dir, "pgm", "strided window");
+    testRoundTrip(file, window, x, y, dir, "jpg", "strided window");
+    testRoundTrip(file, across, x - 3, edge, dir, "png", "crop across 4 GB");
+
+    spxImageFree(&crop);
+    spxImageFree(&across);
+    munmap(map, file->bytes);
+    close(fd);
+}
+
+/* refuse the file with a pixel limit just under its size, then load it
+ * whole without limits and check its far rows */
+static void testLoaded(const TestFile* file, const char* dir, const int flags,
+    const char* name)
+{
+    const int tw = TEST_TILE_WIDTH, th = TEST_TILE_HEIGHT;
+    const size_t pixels = (size_t)file->width * file->height;
+    SpxImageLimits limits = {0, 0, 0, 0};
+    char label[128];
+    Img2D img, crop;
+    int i;
+
+    limits.pixels = pixels - 1;
+    spxImageSetLimits(&limits);
+    img = spxImageLoadEx(file->path, flags);
+    sprintf(label, "%s refused by a pixel limit", name);
+    testCheck(!img.pixbuf && spxImageLastError() == SPXI_ERROR_LIMIT, label);
+    spxImageFree(&img);
+    spxImageSetLimits(NULL);
+    limits.pixels = 0;
+
+    sprintf(label, "%s loaded whole", name);
+    if (!testFits(pixels)) {
+        testSkip(label, "not enough free memory, -f forces it");
+        return;
+    }
+
+    spxImageSetLimits(&limits);
+    img = spxImageLoadEx(file->path, flags);
+    spxImageSetLimits(NULL);
+    testCheck(img.pixbuf && img.width == file->width && img.height == file->height &&
+        img.channels == 1, label
+    );
+
+    for (i = 0; i < 2 && img.pixbuf; ++i) {
+        const int y = file->bands[i][0], x = i ? 0 : file->width - tw;
+        crop = spxImageCrop(img, x, y, tw, th);
+        sprintf(label, "%s band %d", name, i);
+        testCheck(testRegion(file, crop, x, y), label);
+        if (!i && crop.pixbuf) {
+            /* indices of the gray palette are the samples themselves */
+            Img2D gray = crop.palette ? spxImageReshape(crop, 1) : spxImageCopy(crop);
+            sprintf(label, "%s crop", name);
+            testRoundTrip(file, gray, x, y, dir, "png", label);
+            spxImageFree(&gray);
+        }
+        spxImageFree(&crop);
+    }
+
+    spxImageFree(&img);
+}
+
+static int testUsage(const char* exe)
+{
+    fprintf(stdout, "%s usage:\n", exe);
+    fprintf(stdout, "-d <dir>\t: Directory for the sparse files (default .)\n");
+    fprintf(stdout, "-f\t\t: Load the files whole even without enough free memory\n");
+    fprintf(stdout, "-s\t\t: Skip the large image tests\n");
+    fprintf(stdout, "-h\t\t: Display usage and available commands\n");
+    return EXIT_SUCCESS;
+}
+
+int main(const int argc, const char** argv)
+{
+    const char* dir = ".";
+    TestFile pnm, bmp;
+    int i, small = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-h")) {
+            return testUsage(argv[0]);
+        } else if (!strcmp(argv[i], "-f")) {
+            testForce = 1;
+        } else if (!strcmp(argv[i], "-s")) {
+            small = 1;
+        } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            dir = argv[++i];
+        } else {
+            fprintf(stderr, "%s: unknown option %s\n", argv[0], argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    testTransformJpeg(dir);
+    testStripsJpeg(dir);
+    testCache(dir);
+    testPushDecoder(dir);
+    testCancel(dir);
+    testCopyFile(dir);
+    testTargetJpeg(dir);
+    testPngFilters(dir);
+    testCompare(dir);
+    testAnalyze(dir);
+
+    if (small || sizeof(size_t) < 8) {
+        testSkip("large images", small ? "-s" : "needs a 64-bit size_t");
+        fprintf(stdout, "%d checks, %d failed\n", testCount, testFailures);
+        return testFailures ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    memset(&pnm, 0, sizeof(pnm));
+    sprintf(pnm.path, "%.400s/spxtest_%d_large.pgm", dir, (int)getpid());
+    pnm.width = TEST_PNM_WIDTH;
+    pnm.height = TEST_PNM_HEIGHT;
+    pnm.bands[0][0] = pnm.height - TEST_TILE_HEIGHT;
+    pnm.bands[0][1] = pnm.height;
+    pnm.bands[1][0] = (int)(((size_t)1 << 32) / pnm.width) - TEST_TILE_HEIGHT;
+    pnm.bands[1][1] = pnm.bands[1][0] + 2 * TEST_TILE_HEIGHT;
+
+    memset(&bmp, 0, sizeof(bmp));
+    sprintf(bmp.path, "%.400s/spxtest_%d_large.bmp", dir, (int)getpid());
+    bmp.width = TEST_BMP_WIDTH;
+    bmp.height = TEST_BMP_HEIGHT;
+    bmp.bottomup = 1;
+    bmp.bands[0][0] = bmp.height - TEST_TILE_HEIGHT;
+    bmp.bands[0][1] = bmp.height;
+    bmp.bands[1][0] = 0;
+    bmp.bands[1][1] = TEST_TILE_HEIGHT;
+
+    testCheck(!testWriteFile(&pnm, 0), "write sparse PGM");
+    if (!testFailures) {
+        testMapped(&pnm, dir);
+        testLoaded(&pnm, dir, 0, "PGM");
+    }
+    remove(pnm.path);
+
+    if (!testWriteFile(&bmp, 1)) {
+        testCheck(1, "write sparse BMP");
+        testLoaded(&bmp, dir, SPXI_LOAD_INDEXED, "BMP");
+    } else {
+        testCheck(0, "write sparse BMP");
+    }
+    remove(bmp.path);
+
+    fprintf(stdout, "%d checks, %d failed\n", testCount, testFailures);
+    return testFailures ? EXIT_FAILURE : EXIT_SUCCESS;
+}